@@ -18,6 +18,8 @@
 
 #define HOSTNAME_LENGTH 100         // maximum host name length
 #define CLIENTNAME_LENGTH 100       // maximum client name length
+#define ROOMNAME_LENGTH 32          // maximum room name length
+#define DEFAULT_ROOM "lobby"        // the room every client enters when joining the server
 
 /* This is exchange messge structure for message queue - use by both client and server */
 struct exchg_msg {
@@ -29,6 +31,10 @@ struct exchg_msg {
     char content[CONTENT_LENGTH];   // message content - expected to be terminated by a '\0' char
                                     // CMD_CLIENT_JOIN - carry the username
                                     // CMD_CLIENT_SEND/CMD_SERVER_BROADCAST - carry the chat message
+                                    // CMD_CLIENT_ROOM_CREATE/CMD_CLIENT_ROOM_JOIN/CMD_SERVER_ROOM_OK - carry the room name
+                                    // CMD_CLIENT_SUBSCRIBE/CMD_CLIENT_UNSUBSCRIBE/CMD_SERVER_SUB_OK - carry the keyword
+                                    // CMD_CLIENT_WHISPER - the recipient's name, its length in private_data, then the message
+                                    // CMD_SERVER_WHISPER - carry the chat message
 };
 
 /* Command instructions */
@@ -39,11 +45,54 @@ struct exchg_msg {
 #define CMD_SERVER_BROADCAST    104 // a chat message broadcasted by the chat server
 #define CMD_SERVER_CLOSE        105 // the server closes
 #define CMD_SERVER_FAIL         106 // the server incurs failure
+#define CMD_CLIENT_ROOM_CREATE  107 // create a chat room and move into it
+#define CMD_CLIENT_ROOM_JOIN    108 // move into an existing chat room
+#define CMD_CLIENT_ROOM_LEAVE   109 // leave the current chat room, back to DEFAULT_ROOM
+#define CMD_SERVER_ROOM_OK      110 // the client is now in the chat room carried by the message
+#define CMD_CLIENT_RESUME       111 // join again after a disconnect, and get the messages missed (v2 only)
+#define CMD_CLIENT_RING_ATTACH  112 // receive through a shared memory ring from now on (v2 over the Unix socket only)
+#define CMD_SERVER_RING_OK      113 // the last message on the socket, the ring's memfd and eventfd come along
+#define CMD_CLIENT_RING_ACK     114 // the client made room in the ring the server waits for
+#define CMD_PEER_HELLO          115 // server to server: open a peer link, and the answer to it
+#define CMD_PEER_ROOM           116 // server to server: a room exists
+#define CMD_PEER_RELAY          117 // server to server: a message of a room, for the local clients there
+#define CMD_PEER_CLAIM          118 // server to server: may a client of mine take this name?
+#define CMD_PEER_CLAIM_REPLY    119 // server to server: the answer to CMD_PEER_CLAIM
+#define CMD_PEER_RELEASE        120 // server to server: the claim is decided, forget it
+#define CMD_SERVER_PING         121 // are you still there? answer with CMD_CLIENT_PONG (v2 only)
+#define CMD_CLIENT_PONG         122 // the answer to CMD_SERVER_PING
+#define CMD_CLIENT_SUBSCRIBE    123 // get only the broadcasts of the room with this keyword (or any other subscribed)
+#define CMD_CLIENT_UNSUBSCRIBE  124 // drop a keyword, all of them if none is given: every broadcast again
+#define CMD_SERVER_SUB_OK       125 // the keyword is (un)subscribed, carried by the message
+#define CMD_CLIENT_WHISPER      126 // a chat message for one client only, by name
+#define CMD_SERVER_WHISPER      127 // a chat message for this client only
+#define CMD_PEER_WHISPER        128 // server to server: a whisper for a client which is not here
+#define CMD_PEER_NOTICE         129 // server to server: a join, leave or kick notice of a room, ahead of the chat messages
+#define CMD_SERVER_ROSTER       130 // the members of the room, on entering it (v2 only)
+#define CMD_SERVER_PRESENCE     131 // the members which joined and left the room lately (v2 only)
+#define CMD_CLIENT_FILE_OFFER   132 // share a file in the room: make room for it on the server (v2 only)
+#define CMD_SERVER_FILE_OK      133 // the file offered may be uploaded with this id, or it is uploaded
+#define CMD_CLIENT_DATA_OPEN    134 // the first message of a data stream, which carries the bytes of files
+#define CMD_CLIENT_FILE_PUT     135 // data stream: the file offered follows, as raw bytes
+#define CMD_CLIENT_FILE_GET     136 // data stream: a piece of a file shared
+#define CMD_SERVER_FILE_DATA    137 // data stream: the piece of the file asked for
+#define CMD_PEER_WHISPER_REPLY  138 // server to server: the answer to CMD_PEER_WHISPER
 
 /* ERROR code - these are the error codes returned with COMMAND_FAILURE by my server */
 #define ERR_JOIN_DUP_NAME       200 // the new client has a duplicate name with another client
 #define ERR_JOIN_ROOM_FULL      201 // server room is full
 #define ERR_UNKNOWN_CMD         202 // unknown command
 #define ERR_OTHERS              203 // other errors
+#define ERR_ROOM_EXISTS         204 // a room with this name exists already
+#define ERR_ROOM_NOT_FOUND      205 // no room with this name
+#define ERR_ROOM_LIMIT          206 // the server cannot host any more rooms
+#define ERR_RATE_LIMITED        207 // the client sends faster than the server allows, the message is thrown away
+#define ERR_SUB_LIMIT           208 // too many keywords, or a keyword empty or too long
+#define ERR_SUB_NOT_FOUND       209 // the client has not subscribed to this keyword
+#define ERR_USER_NOT_FOUND      210 // no client with this name
+#define ERR_FILE_LIMIT          211 // the file is too large, or the server has no room for it
+#define ERR_FILE_NOT_FOUND      212 // no such file, or not (yet) complete
+#define ERR_STREAM_LIMIT        213 // the session has as many data streams open as it may
+#define ERR_FILE_RATE           214 // files are offered faster than the flood limits of the client allow
 
 #endif
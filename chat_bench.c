@@ -0,0 +1,352 @@
+#include "chat.h"
+#include "chat_conn.h"
+#include "chat_hist.h"
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+
+static char usage[] =
+"\n\
+/*****************************************************************/\n\
+/*    Load generator and latency benchmark of the chat server    */\n\
+/*                                                               */\n\
+/*    USAGE:  ./chat_bench     [options] [port]                  */\n\
+/*            -h: host of the server (127.0.0.1)                 */\n\
+/*            -n: # of simulated clients (100)                   */\n\
+/*            -s: # of the clients which send messages (all)     */\n\
+/*            -j: joins per second, 0 = as fast as possible (0)  */\n\
+/*            -r: messages per second of all senders (1000)      */\n\
+/*            -l: payload size in bytes (64)                     */\n\
+/*            -d: duration of the message phase in seconds (10)  */\n\
+/*            -t: # of receiver threads (# of cores)             */\n\
+/*            -u: connect to this local socket instead of TCP    */\n\
+/*            -S: receive through shared memory rings (with -u)  */\n\
+/*****************************************************************/\n\
+\n";
+
+/*
+ * Every message carries the time it was sent: "@<ns> <seq> xxxx...", the server prefixes
+ * it with "<name>: ". All clients run on the same host, they share the monotonic clock.
+ */
+#define STAMP_MARK '@'
+
+/*
+ * One simulated client
+ */
+struct bench_client {
+    struct chat_conn conn;
+    char name[CLIENTNAME_LENGTH];
+    int ring_watched;           // the eventfd of the ring is in the epoll set
+};
+
+/*
+ * A receiver thread waits for the broadcasts of its share of the clients
+ */
+struct receiver {
+    pthread_t thread;
+    int epfd;
+    struct histogram hist;      // the latency (us) of the timestamped messages received
+    atomic_ulong received;      // # of timestamped messages received
+    unsigned long others;       // # of other messages (joins, leaves, ...)
+    unsigned long errors;       // # of connections lost
+};
+
+struct bench_client *clients;
+struct receiver *receivers;
+int nclients = 100, nsenders = 0, nreceivers = 0;
+int join_rate = 0, msg_rate = 1000, payload_size = 64, duration = 10;
+char *local_path = NULL;
+int use_ring = 0;
+atomic_int stopping;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until(long long t)
+{
+    struct timespec ts;
+
+    ts.tv_sec = t / 1000000000LL;
+    ts.tv_nsec = t % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/*
+ * Take the latency out of a broadcast, if it is one of ours
+ * Return value: 0 - success, -1 - not a timestamped message
+ */
+static int parse_stamp(struct chat_frame *mbuf, long long *sent)
+{
+    const char *p = memchr(mbuf -> payload, ':', mbuf -> len);
+    char num[24];
+    size_t n = 0;
+
+    if (p == NULL || (size_t)(p - mbuf -> payload) + 3 > mbuf -> len || p[2] != STAMP_MARK)
+        return -1;
+    for (p += 3; p < mbuf -> payload + mbuf -> len && *p >= '0' && *p <= '9' && n < sizeof(num) - 1; p++)
+        num[n++] = *p;
+    num[n] = '\0';
+    *sent = atoll(num);
+    return 0;
+}
+
+void *receiver_fn(void *arg)
+{
+    struct receiver *r = arg;
+#define BENCH_MAX_EVENTS 256
+    struct epoll_event events[BENCH_MAX_EVENTS];
+    struct chat_frame mbuf;
+    long long sent;
+    int i, n, ret;
+
+    while (!atomic_load(&stopping)) {
+        n = epoll_wait(r -> epfd, events, BENCH_MAX_EVENTS, 100);
+        for (i = 0; i < n; i++) {
+            struct bench_client *c = events[i].data.ptr;
+
+            /* take whatever is there, from the socket or the ring */
+            while ((ret = recv_msg_nowait(&c -> conn, &mbuf)) == 1) {
+                if (mbuf.command == CMD_SERVER_BROADCAST && parse_stamp(&mbuf, &sent) == 0) {
+                    hist_record(&r -> hist, (now_ns() - sent) / 1000);
+                    atomic_fetch_add_explicit(&r -> received, 1, memory_order_relaxed);
+                } else {
+                    r -> others++;
+                }
+            }
+            if (c -> conn.ring != NULL && !c -> ring_watched) {
+                struct epoll_event ev;
+
+                ev.events = EPOLLIN;
+                ev.data.ptr = c;
+                epoll_ctl(r -> epfd, EPOLL_CTL_ADD, c -> conn.ring -> efd, &ev);
+                c -> ring_watched = 1;
+            }
+            if (ret == 0 || errno != EAGAIN) {
+                r -> errors++;
+                epoll_ctl(r -> epfd, EPOLL_CTL_DEL, c -> conn.sockfd, NULL);
+                if (c -> ring_watched)
+                    epoll_ctl(r -> epfd, EPOLL_CTL_DEL, c -> conn.ring -> efd, NULL);
+            }
+        }
+    }
+    return NULL;
+}
+
+static unsigned long total_received(void)
+{
+    unsigned long total = 0;
+    int i;
+
+    for (i = 0; i < nreceivers; i++)
+        total += atomic_load(&receivers[i].received);
+    return total;
+}
+
+int main(int argc, char **argv)
+{
+    char host[HOSTNAME_LENGTH] = "127.0.0.1";
+    int port = 50388, opt, i, joined, ret;
+    struct hostent *remote_host;
+    struct sockaddr_in server_addr;
+    struct sockaddr_un local_addr;
+    struct histogram hist;
+    unsigned long sent, expected, received;
+    long long start, t, interval;
+    char *payload;
+
+    while ((opt = getopt(argc, argv, "h:n:s:j:r:l:d:t:u:S")) != -1) {
+        switch (opt) {
+        case 'h':
+            strncpy(host, optarg, HOSTNAME_LENGTH - 1);
+            break;
+        case 'n':
+            nclients = atoi(optarg);
+            break;
+        case 's':
+            nsenders = atoi(optarg);
+            break;
+        case 'j':
+            join_rate = atoi(optarg);
+            break;
+        case 'r':
+            msg_rate = atoi(optarg);
+            break;
+        case 'l':
+            payload_size = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 't':
+            nreceivers = atoi(optarg);
+            break;
+        case 'u':
+            local_path = optarg;
+            break;
+        case 'S':
+            use_ring = 1;
+            break;
+        default:
+            printf("%s", usage);
+            exit(1);
+        }
+    }
+    if (optind < argc)
+        port = atoi(argv[optind]);
+    if (nclients < 1)
+        nclients = 1;
+    if (nsenders < 1 || nsenders > nclients)
+        nsenders = nclients;
+    if (nreceivers < 1)
+        nreceivers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (msg_rate < 1)
+        msg_rate = 1;
+    if (payload_size < 32)
+        payload_size = 32;      // room for the timestamp
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* every client costs one descriptor */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if (local_path != NULL) {
+        memset(&local_addr, 0, sizeof(local_addr));
+        local_addr.sun_family = AF_UNIX;
+        strncpy(local_addr.sun_path, local_path, sizeof(local_addr.sun_path) - 1);
+    } else {
+        if ((remote_host = gethostbyname(host)) == NULL) {
+            printf("cannot resolve the remote host name, %s\n", host);
+            exit(1);
+        }
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);
+        server_addr.sin_addr = *((struct in_addr *)remote_host -> h_addr);
+        memset(&(server_addr.sin_zero), '\0', 8);
+    }
+    if (use_ring && local_path == NULL) {
+        printf("shared memory rings need a local socket (-u)\n");
+        exit(1);
+    }
+
+    clients = (struct bench_client *)calloc(nclients, sizeof(struct bench_client));
+    receivers = (struct receiver *)calloc(nreceivers, sizeof(struct receiver));
+    for (i = 0; i < nreceivers; i++) {
+        if ((receivers[i].epfd = epoll_create1(0)) == -1) {
+            perror("epoll_create1");
+            exit(1);
+        }
+        pthread_create(&receivers[i].thread, NULL, receiver_fn, &receivers[i]);
+    }
+
+    /* join phase: the clients join one by one, at join_rate */
+    if (local_path != NULL)
+        printf("Joining %d clients to %s%s ...\n", nclients, local_path, use_ring ? " with rings" : "");
+    else
+        printf("Joining %d clients to %s:%d ...\n", nclients, host, port);
+    start = now_ns();
+    for (i = 0; i < nclients; i++) {
+        struct bench_client *c = &clients[i];
+        struct epoll_event ev;
+
+        if (join_rate > 0)
+            sleep_until(start + (long long)i * 1000000000LL / join_rate);
+        snprintf(c -> name, CLIENTNAME_LENGTH, "bench%d-%d", (int)getpid(), i);
+        if ((c -> conn.sockfd = socket(local_path ? AF_UNIX : AF_INET, SOCK_STREAM, 0)) == -1) {
+            perror("socket");
+            exit(1);
+        }
+        if (local_path != NULL)
+            ret = join_server(&c -> conn, (struct sockaddr *)&local_addr, sizeof(local_addr), c -> name);
+        else
+            ret = join_server(&c -> conn, (struct sockaddr *)&server_addr, sizeof(server_addr), c -> name);
+        if (ret == 0 && use_ring && attach_ring(&c -> conn, 0) != 0)
+            ret = -1;
+        if (ret != 0) {
+            if (ret == -1)
+                printf("client %d cannot join: %s\n", i, strerror(errno));
+            else
+                printf("client %d cannot join: error %d\n", i, ret);
+            exit(1);
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(receivers[i % nreceivers].epfd, EPOLL_CTL_ADD, c -> conn.sockfd, &ev);
+    }
+    joined = nclients;
+    t = now_ns() - start;
+    printf("%d clients joined in %.3f s, %.0f joins/s\n", joined, t / 1e9, joined / (t / 1e9));
+
+    /* wait for the welcome messages to settle */
+    sleep_until(now_ns() + 200000000LL);
+
+    /* message phase: the senders take turns, one message every interval */
+    payload = (char *)malloc(payload_size + 1);
+    interval = 1000000000LL / msg_rate;
+    printf("Sending %d msgs/s of %d bytes from %d client(s) for %d s ...\n", msg_rate, payload_size, nsenders, duration);
+    start = now_ns();
+    for (sent = 0; ; sent++) {
+        t = start + (long long)sent * interval;
+        if (t - start >= (long long)duration * 1000000000LL)
+            break;
+        sleep_until(t);
+
+        int n = snprintf(payload, payload_size + 1, "%c%lld %lu ", STAMP_MARK, now_ns(), sent);
+        memset(payload + n, 'x', payload_size - n);
+        payload[payload_size] = '\0';
+        if (send_msg_to_server(&clients[sent % nsenders].conn, payload, CMD_CLIENT_SEND) != 0) {
+            printf("client %lu cannot send\n", sent % nsenders);
+            break;
+        }
+    }
+    t = now_ns() - start;
+
+    /* every client, the sender included, receives every message */
+    expected = sent * joined;
+    start = now_ns();
+    while (total_received() < expected && now_ns() - start < 2000000000LL)
+        sleep_until(now_ns() + 10000000LL);
+    atomic_store(&stopping, 1);
+
+    memset(&hist, 0, sizeof(hist));
+    for (i = 0; i < nreceivers; i++) {
+        pthread_join(receivers[i].thread, NULL);
+        hist_merge(&hist, &receivers[i].hist);
+        if (receivers[i].errors > 0)
+            printf("receiver %d lost %lu connection(s)\n", i, receivers[i].errors);
+    }
+    received = total_received();
+
+    printf("\n");
+    printf("messages sent       %lu in %.3f s, %.0f msgs/s\n", sent, t / 1e9, sent / (t / 1e9));
+    printf("messages delivered  %lu of %lu (%.2f%%), %.0f msgs/s\n", received, expected,
+           expected ? 100.0 * received / expected : 0.0, received / (t / 1e9));
+    printf("fan-out latency     p50 %.3f ms  p99 %.3f ms  p99.9 %.3f ms  max %.3f ms\n",
+           hist_percentile(&hist, 50) / 1000.0, hist_percentile(&hist, 99) / 1000.0,
+           hist_percentile(&hist, 99.9) / 1000.0, hist_percentile(&hist, 100) / 1000.0);
+
+    /* leave politely */
+    for (i = 0; i < joined; i++) {
+        send_msg_to_server(&clients[i].conn, NULL, CMD_CLIENT_DEPART);
+        close(clients[i].conn.sockfd);
+        decoder_free(&clients[i].conn.decoder);
+    }
+    free(payload);
+    free(clients);
+    free(receivers);
+    return 0;
+}
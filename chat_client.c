@@ -1,8 +1,13 @@
 #include "chat.h"
+#include "chat_conn.h"
 #include <limits.h>
 #include <string.h>
 #include <curses.h>
 #include <sys/ioctl.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <assert.h>
 
 #define CHATROOM_DEBUG
@@ -26,88 +31,256 @@
     } while (0)
 
 
+#define INPUT_LENGTH 1024   // the longest line the user can type
+
+#define RECONNECT_TRIES 5   // the chat thread waits 1, 2, 4, ... seconds between them
+
 // global variables - access by main and slave threads
-int sockfd;         //the socket file descriptor
+struct chat_conn conn;  //the connection to the server
+pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;  // held by the chat thread while it swaps the socket
+
+// the members of the room, as CMD_SERVER_ROSTER and CMD_SERVER_PRESENCE tell - update by the chat thread, shown by WHO
+char (*roster)[CLIENTNAME_LENGTH];
+int roster_count, roster_cap;
+pthread_mutex_t roster_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// a file going up (SHARE) or down (FETCH)
+struct transfer {
+    struct transfer *next;      // offered, waiting for the server's answer
+    int upload;
+    uint64_t id;                // the id the server gave the file
+    int fd;
+    size_t size;                // upload: the size of the file
+    char name[PATH_MAX];        // upload: the name the room sees; download: the path written
+    WINDOW *win;                // where the outcome is shown
+};
+
+// the files offered by SHARE, in order - the server answers each with CMD_SERVER_FILE_OK or CMD_SERVER_FAIL
+struct transfer *shares, **shares_tail = &shares;
+pthread_mutex_t shares_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 /*
- * Send a message to server
- * Return value:  0 - success;
- *               -1 - error;
+ * Send a message unless the chat thread is reconnecting - see send_msg_to_server()
  */
-int send_msg_to_server(int sockfd, char *msg, int command)
+int send_msg(char *msg, int command)
 {
-    struct exchg_msg mbuf;
-    int msg_len = 0;
+    int ret;
     
-    memset(&mbuf, 0, sizeof(struct exchg_msg));
-    mbuf.instruction = htonl(command);
-    if (command == CMD_CLIENT_DEPART) {
-        mbuf.private_data = htonl(-1);
-    } else if ( (command == CMD_CLIENT_JOIN) ||
-                (command == CMD_CLIENT_SEND) ) {
-        memcpy(mbuf.content, msg, strlen(msg));
-        msg_len = strlen(msg) + 1;
-        msg_len = (msg_len < CONTENT_LENGTH) ? msg_len : CONTENT_LENGTH;
-        mbuf.content[msg_len-1] = '\0';
-        mbuf.private_data = htonl(msg_len);
+    pthread_mutex_lock(&conn_lock);
+    ret = (conn.sockfd == -1) ? -1 : send_msg_to_server(&conn, msg, command);
+    pthread_mutex_unlock(&conn_lock);
+    return ret;
+}
+
+/*
+ * The connection is lost: connect again and resume the session, the chat thread only
+ * Return value:  0 - success;
+ *               -1 - the server cannot be reached, or refuses;
+ */
+int reconnect(WINDOW *mywin)
+{
+    int i, ret, fd;
+
+    // the main thread may cancel us, but not while we hold the lock
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_mutex_lock(&conn_lock);
+    close(conn.sockfd);
+    conn.sockfd = -1;
+    pthread_mutex_unlock(&conn_lock);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+    for (i = 0; i < RECONNECT_TRIES; i++) {
+        DISPLAY(mywin, "******Connection lost, reconnecting in %d s ...******", 1 << i);
+        sleep(1 << i);
+
+        if ((fd = socket(conn.server_addr.ss_family, SOCK_STREAM, 0)) == -1)
+            continue;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        pthread_mutex_lock(&conn_lock);
+        conn.sockfd = fd;
+        ret = resume_server(&conn);
+        if (ret == 0 && conn.server_addr.ss_family == AF_UNIX)
+            attach_ring(&conn, 0);
+        if (ret != 0) {
+            close(fd);
+            conn.sockfd = -1;
+        }
+        pthread_mutex_unlock(&conn_lock);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+        if (ret == 0) {
+            DISPLAY(mywin, "******Reconnected******");
+            return 0;
+        }
+        if (ret == ERR_JOIN_DUP_NAME) {
+            DISPLAY(mywin, "reconnect failure - your name has been taken meanwhile");
+            return -1;
+        } else if (ret > 0) {
+            DISPLAY(mywin, "reconnect failure - error %d", ret);
+            return -1;
+        }
     }
-    
-    if (send(sockfd, &mbuf, sizeof(mbuf), 0) == -1) {
-        perror("Server socket sending error");
-        return -1;
+    return -1;
+}
+
+
+/*
+ * Put a name into the roster, or take it out - roster_lock held
+ */
+void roster_set(const char *name, size_t len, int present)
+{
+    int i;
+
+    if (len >= CLIENTNAME_LENGTH)
+        len = CLIENTNAME_LENGTH - 1;
+    for (i = 0; i < roster_count; i++)
+        if (strlen(roster[i]) == len && memcmp(roster[i], name, len) == 0)
+            break;
+    if (!present) {
+        if (i < roster_count)
+            memcpy(roster[i], roster[--roster_count], CLIENTNAME_LENGTH);
+        return;
     }
-    
-    return 0;
+    if (i < roster_count)
+        return;
+    if (roster_count == roster_cap) {
+        roster_cap = (roster_cap > 0) ? roster_cap * 2 : 64;
+        roster = realloc(roster, roster_cap * CLIENTNAME_LENGTH);
+    }
+    memcpy(roster[roster_count], name, len);
+    roster[roster_count++][len] = '\0';
 }
 
 /*
- * Join the chat server
+ * Apply CMD_SERVER_ROSTER or CMD_SERVER_PRESENCE to the roster, and show who joined and left
  * Return value:  0 - success;
- *               -1 - error;
+ *               -1 - a malformed message;
  */
-int join_server(int sockfd, struct sockaddr_in server_addr, char *user_name, WINDOW *screen)
+int roster_update(WINDOW *mywin, struct chat_frame *mbuf)
 {
-    struct exchg_msg mbuf;
-    int reply_instruction;
-    int error_code = 0;
+    const char *p = mbuf -> payload, *end = mbuf -> payload + mbuf -> len;
+    int list, nlists = (mbuf -> command == CMD_SERVER_ROSTER) ? 1 : 2, n, ret = 0;
+    uint64_t count, len, i;
 
-    // make a connection to the remote host
-    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(struct sockaddr)) == -1) {
-        DISPLAY(screen, "socket connect error (%s)", strerror(errno));
-        return -1;
-	}
-    
-    // send a JOIN message
-    if (send_msg_to_server(sockfd, user_name, CMD_CLIENT_JOIN) != 0) {
-        DISPLAY(screen, "socket send error (%s)", strerror(errno));
-        return -1;
+    // the main thread may cancel us, but not while we hold the lock
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_mutex_lock(&roster_lock);
+    if (mbuf -> command == CMD_SERVER_ROSTER)
+        roster_count = 0;
+    for (list = 0; list < nlists && ret == 0; list++) {
+        if ((n = varint_get(p, end - p, &count)) <= 0) {
+            ret = -1;
+            break;
+        }
+        p += n;
+        for (i = 0; i < count; i++) {
+            if ((n = varint_get(p, end - p, &len)) <= 0 || len > (uint64_t)(end - p - n)) {
+                ret = -1;
+                break;
+            }
+            p += n;
+            roster_set(p, len, list == 0);
+            if (mbuf -> command == CMD_SERVER_PRESENCE)
+                wprintw(mywin, "%s%.*s", (i > 0) ? ", " : "", (int)len, p);
+            p += len;
+        }
+        if (mbuf -> command == CMD_SERVER_PRESENCE && count > 0)
+            wprintw(mywin, (list == 0) ? " just join%s the chat room, welcome!\n" : " just leave%s the chat room, goodbye!\n",
+                    (count == 1) ? "s" : "");
     }
-    
-    // get the response from the server
-    if (recv(sockfd, &mbuf, sizeof(mbuf), 0) == -1) {
-        DISPLAY(screen, "socket receive error (%s)", strerror(errno));
-        return -1;
-	}
-
-    reply_instruction = ntohl(mbuf.instruction);
-    if (reply_instruction == CMD_SERVER_JOIN_OK) {
-        return 0;
-    } else if (reply_instruction == CMD_SERVER_FAIL) {
-        error_code = ntohl(mbuf.private_data);
-        if (error_code == ERR_JOIN_DUP_NAME)
-            DISPLAY(screen, "connection failure - your name has been used, pls change your name.");
-        else if (error_code == ERR_JOIN_ROOM_FULL)
-            DISPLAY(screen, "connection failure - the room is full");
-        else
-            DISPLAY(screen, "connection failure - unknown error");
+    pthread_mutex_unlock(&roster_lock);
+    wrefresh(mywin);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    return ret;
+}
+
+/*
+ * One upload (SHARE) or download (FETCH), on a data stream of its own - run by a transfer thread
+ * The chat goes on meanwhile, however large the file is.
+ */
+void *transfer_thread_fn(void *arg)
+{
+    struct transfer *t = (struct transfer *)arg;
+    size_t got = 0;
+    int sockfd, ret;
+
+    pthread_detach(pthread_self());
+    // the chat thread may be resuming the session, the stream needs its token
+    pthread_mutex_lock(&conn_lock);
+    sockfd = (conn.sockfd == -1) ? -1 : open_data_stream(&conn);
+    pthread_mutex_unlock(&conn_lock);
+
+    if (sockfd == -1)
+        ret = -1;
+    else if (t -> upload)
+        ret = put_file(sockfd, t -> id, t -> fd, t -> size);
+    else
+        ret = get_file(sockfd, t -> id, t -> fd, &got);
+
+    if (ret == 0 && t -> upload)
+        DISPLAY(t -> win, "******%s is shared******", t -> name);
+    else if (ret == 0)
+        DISPLAY(t -> win, "******%s: %zu bytes fetched******", t -> name, got);
+    else if (ret == ERR_FILE_NOT_FOUND)
+        DISPLAY(t -> win, "file failure - no such file, or not complete yet");
+    else if (ret == ERR_USER_NOT_FOUND)
+        DISPLAY(t -> win, "file failure - the session is over, join again");
+    else if (ret == ERR_FILE_RATE)
+        DISPLAY(t -> win, "file failure - too fast, wait a moment");
+    else if (ret == ERR_STREAM_LIMIT)
+        DISPLAY(t -> win, "file failure - too many transfers at once, try again when one is over");
+    else if (ret > 0)
+        DISPLAY(t -> win, "file failure - error %d", ret);
+    else
+        DISPLAY(t -> win, "file failure - %s", strerror(errno));
+
+    if (sockfd != -1)
+        close(sockfd);
+    close(t -> fd);
+    if (ret != 0 && !t -> upload)
+        unlink(t -> name);
+    free(t);
+    return NULL;
+}
+
+/*
+ * The server answered the oldest offer of SHARE: CMD_SERVER_FILE_OK starts its upload, CMD_SERVER_FAIL drops it
+ * Return value:  0 - success;
+ *               -1 - a malformed message, or no offer is waiting;
+ */
+int share_answer(WINDOW *mywin, struct chat_frame *mbuf)
+{
+    struct transfer *t;
+    pthread_t thread;
+    uint64_t id = 0;
+    int ret = 0;
+
+    // the main thread may cancel us, but not while we hold the lock
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_mutex_lock(&shares_lock);
+    if ((t = shares) != NULL && (shares = t -> next) == NULL)
+        shares_tail = &shares;
+    pthread_mutex_unlock(&shares_lock);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    if (t == NULL)
         return -1;
+    
+    if (mbuf -> command == CMD_SERVER_FAIL && mbuf -> private_data == ERR_FILE_RATE) {
+        DISPLAY(mywin, "share failure - too fast, %s is not shared", t -> name);
+    } else if (mbuf -> command == CMD_SERVER_FAIL) {
+        DISPLAY(mywin, "share failure - %s is too large, or the server has no room for it", t -> name);
+    } else if (varint_get(mbuf -> payload, mbuf -> len, &id) <= 0 || id == 0) {
+        ret = -1;
     } else {
-        DISPLAY(screen, "receive unknown reply");
-        return -1;
-	}
-
-    return 0;
+        t -> id = id;
+        if (pthread_create(&thread, NULL, transfer_thread_fn, (void *)t) == 0)
+            return 0;
+        DISPLAY(mywin, "share failure - cannot start the upload of %s", t -> name);
+    }
+    close(t -> fd);
+    free(t);
+    return ret;
 }
 
 /*
@@ -117,14 +290,16 @@ int join_server(int sockfd, struct sockaddr_in server_addr, char *user_name, WIN
 void *chat_thread_fn(void *arg)
 {
     WINDOW *mywin = (WINDOW *)arg;		
-    struct exchg_msg mbuf;					//message buffer
+    struct chat_frame mbuf;					//message buffer
     int instuction;
 
     //DEBUG_DISPLAY(mywin, "Listen thread started");
 
     // listen to broadcast message until user quits
     while (1) {
-        if (recv(sockfd, &mbuf, sizeof(mbuf), 0) <= 0) {
+        if (recv_msg_from_server(&conn, &mbuf) != 1) {
+            if (reconnect(mywin) == 0)
+                continue;
             DISPLAY(mywin, "recv error occurs, exit");
             endwin();
             exit(0);
@@ -132,10 +307,46 @@ void *chat_thread_fn(void *arg)
  
         //DEBUG_DISPLAY(mywin, "Listen thread: message received (%d)", ntohl(mbuf.instruction));
 
-        instuction = ntohl(mbuf.instruction);
+        instuction = mbuf.command;
         if (instuction == CMD_SERVER_BROADCAST) {
-            assert(ntohl(mbuf.private_data) <= CONTENT_LENGTH);
-            DISPLAY(mywin, "%s", mbuf.content);
+            DISPLAY(mywin, "%.*s", (int)mbuf.len, mbuf.payload);
+        } else if (instuction == CMD_SERVER_ROOM_OK) {
+            DISPLAY(mywin, "******You are in room %.*s******", (int)mbuf.len, mbuf.payload);
+        } else if (instuction == CMD_SERVER_ROSTER || instuction == CMD_SERVER_PRESENCE) {
+            if (roster_update(mywin, &mbuf) != 0)
+                DISPLAY(mywin, "Listen thread got a wrong roster");
+        } else if (instuction == CMD_SERVER_WHISPER) {
+            DISPLAY(mywin, "[whisper] %.*s", (int)mbuf.len, mbuf.payload);
+        } else if (instuction == CMD_SERVER_SUB_OK) {
+            if (mbuf.len > 0)
+                DISPLAY(mywin, "******Keyword %.*s done******", (int)mbuf.len, mbuf.payload);
+            else
+                DISPLAY(mywin, "******No keywords, you get every message******");
+        } else if (instuction == CMD_SERVER_FILE_OK || (instuction == CMD_SERVER_FAIL &&
+                   (mbuf.private_data == ERR_FILE_LIMIT || mbuf.private_data == ERR_FILE_RATE))) {
+            if (share_answer(mywin, &mbuf) != 0)
+                DISPLAY(mywin, "Listen thread got a wrong answer to SHARE");
+        } else if (instuction == CMD_SERVER_FAIL) {
+            if (mbuf.private_data == ERR_ROOM_EXISTS)
+                DISPLAY(mywin, "room failure - the room exists already, use ENTER");
+            else if (mbuf.private_data == ERR_ROOM_NOT_FOUND)
+                DISPLAY(mywin, "room failure - no such room, use CREATE");
+            else if (mbuf.private_data == ERR_ROOM_LIMIT)
+                DISPLAY(mywin, "room failure - the server cannot host more rooms");
+            else if (mbuf.private_data == ERR_JOIN_ROOM_FULL)
+                DISPLAY(mywin, "room failure - the room is full");
+            else if (mbuf.private_data == ERR_RATE_LIMITED)
+                DISPLAY(mywin, "failure - too fast, the message is not sent");
+            else if (mbuf.private_data == ERR_SUB_LIMIT)
+                DISPLAY(mywin, "keyword failure - too many keywords, or too long");
+            else if (mbuf.private_data == ERR_SUB_NOT_FOUND)
+                DISPLAY(mywin, "keyword failure - you have not subscribed to it");
+            else if (mbuf.private_data == ERR_USER_NOT_FOUND)
+                DISPLAY(mywin, "whisper failure - nobody has this name");
+            else if (mbuf.private_data == ERR_FILE_NOT_FOUND)
+                DISPLAY(mywin, "file failure - no such file, or not complete yet");
+            else
+                DISPLAY(mywin, "failure - error %d", mbuf.private_data);
         } else if (instuction == CMD_SERVER_CLOSE) {
             DISPLAY(mywin, "******Exit: the chat server closes.******");
             endwin();
@@ -160,20 +371,37 @@ int test_input_error(char *user_command, char *parameter)
 {
     int ret = 0;
  
-    // these commands have NO parameters: CLEAR EXIT DEPART
-    // these commands HAVE parameters: USER JOIN SEND
+    // these commands have NO parameters: CLEAR EXIT DEPART LEAVE WHO
+    // these commands HAVE parameters: USER JOIN SEND CREATE ENTER SUBSCRIBE WHISPER SHARE FETCH
+    // UNSUBSCRIBE may have one
     if (strcasecmp(user_command, "CLEAR") == 0) {
         ret = (parameter == NULL) ? 0 : -1;
     } else if (strcasecmp(user_command, "EXIT") == 0) {
         ret = (parameter == NULL) ? 0 : -1;
     } else if (strcasecmp(user_command, "DEPART") == 0) {
         ret = (parameter == NULL) ? 0 : -1;
+    } else if (strcasecmp(user_command, "LEAVE") == 0) {
+        ret = (parameter == NULL) ? 0 : -1;
+    } else if (strcasecmp(user_command, "WHO") == 0) {
+        ret = (parameter == NULL) ? 0 : -1;
+    } else if (strcasecmp(user_command, "CREATE") == 0) {
+        ret = (parameter == NULL) ? -1 : 0;
+    } else if (strcasecmp(user_command, "ENTER") == 0) {
+        ret = (parameter == NULL) ? -1 : 0;
     } else if (strcasecmp(user_command, "USER") == 0) {
         ret = (parameter == NULL) ? -1 : 0;
     } else if (strcasecmp(user_command, "JOIN") == 0) {
         ret = (parameter == NULL) ? -1 : 0;
     } else if (strcasecmp(user_command, "SEND") == 0) {
         ret = (parameter == NULL) ? -1 : 0;
+    } else if (strcasecmp(user_command, "SUBSCRIBE") == 0) {
+        ret = (parameter == NULL) ? -1 : 0;
+    } else if (strcasecmp(user_command, "WHISPER") == 0) {
+        ret = (parameter == NULL || strchr(parameter, ' ') == NULL) ? -1 : 0;
+    } else if (strcasecmp(user_command, "SHARE") == 0) {
+        ret = (parameter == NULL) ? -1 : 0;
+    } else if (strcasecmp(user_command, "FETCH") == 0) {
+        ret = (parameter == NULL) ? -1 : 0;
     }
     
     return ret;
@@ -184,8 +412,8 @@ int test_input_error(char *user_command, char *parameter)
  */
 int main(int argc, char *argv[])
 {
-    char MENU[] = "[CLEAR] [USER] [JOIN] [SEND] [DEPART] [EXIT]"; // menu title
-    char input_buffer[CONTENT_LENGTH * 2];      // input buffer
+    char MENU[] = "[CLEAR] [USER] [JOIN] [SEND] [WHISPER] [CREATE] [ENTER] [LEAVE] [SUBSCRIBE] [UNSUBSCRIBE] [WHO] [SHARE] [FETCH] [DEPART] [EXIT]"; // menu title
+    char input_buffer[INPUT_LENGTH + 1];        // input buffer
     char *line, *user_command, *parameter;      // temporary strings
     char user_name[CLIENTNAME_LENGTH];          // the client user_name
     char server_name[HOSTNAME_LENGTH];          // the name of the remote server
@@ -197,7 +425,10 @@ int main(int argc, char *argv[])
     pthread_t chat_thread;                      // chat thread
 
     int is_connected = 0;                       // the connection status 
-    int port;
+    int port, ret;
+	
+    // a data stream the server closes fails the upload, sendfile() has no MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
 	
     /**** initialize ncurses functions (no need to touch this part) ***/
     initscr();
@@ -245,7 +476,7 @@ int main(int argc, char *argv[])
     while (1) {	
         wprintw(cmd_window,"@=  ");         //get the user input
 
-        wgetnstr(cmd_window, input_buffer, CONTENT_LENGTH);
+        wgetnstr(cmd_window, input_buffer, INPUT_LENGTH);
         //DEBUG_DISPLAY(msg_window, "input_buffer %s", input_buffer);
 
         user_command = strtok(input_buffer, " ");   //get the user command
@@ -290,53 +521,78 @@ int main(int argc, char *argv[])
             } else {
                 struct hostent *remote_host;        // the remote host identity 
                 struct sockaddr_in server_addr;     // remote host internet address
+                struct sockaddr_un local_addr;      // or the local socket of a server on this host
                 char *input_server_name, *input_port;
 
                 /****** get the server info **************************/
                 input_server_name = strtok(parameter, " ");
                 //DEBUG_DISPLAY(msg_window, "input_server_name %s", input_server_name);
-                strcpy(server_name, input_server_name);
+                strncpy(server_name, input_server_name, HOSTNAME_LENGTH - 1);
                 
-                input_port = strtok(NULL, " ");
-               // DEBUG_DISPLAY(msg_window, "input_port %s", input_port);
-                if (input_port == NULL) {
-                    DISPLAY(cmd_window, "port number is missed");
-                    continue;
+                // JOIN /path/of/the/socket: the server runs here, messages come through shared memory
+                if (strchr(server_name, '/') != NULL) {
+                    memset(&local_addr, 0, sizeof(local_addr));
+                    local_addr.sun_family = AF_UNIX;
+                    strncpy(local_addr.sun_path, server_name, sizeof(local_addr.sun_path) - 1);
+                    if ((conn.sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+                        DISPLAY(cmd_window, "client socket creation error");
+                        goto END;
+                    }
+                    ret = join_server(&conn, (struct sockaddr *)&local_addr, sizeof(local_addr), user_name);
+                    if (ret == 0 && attach_ring(&conn, 0) != 0)
+                        ret = -1;
                 } else {
-                    port = atoi(input_port);
-                }
+                    input_port = strtok(NULL, " ");
+                   // DEBUG_DISPLAY(msg_window, "input_port %s", input_port);
+                    if (input_port == NULL) {
+                        DISPLAY(cmd_window, "port number is missed");
+                        continue;
+                    } else {
+                        port = atoi(input_port);
+                    }
                 
-                if ( (remote_host = gethostbyname(server_name)) == NULL) {  
-                    DISPLAY(cmd_window, "Join: cannot resolve the remote host name, %s", server_name);
-                    continue;
-                }
+                    if ( (remote_host = gethostbyname(server_name)) == NULL) {  
+                        DISPLAY(cmd_window, "Join: cannot resolve the remote host name, %s", server_name);
+                        continue;
+                    }
                 
-                if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-                    DISPLAY(cmd_window, "client socket creation error");
-                    goto END;
+                    if ((conn.sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+                        DISPLAY(cmd_window, "client socket creation error");
+                        goto END;
+                    }
+                
+                    // initialize the remote host internet address
+                    server_addr.sin_family = AF_INET;		
+                    server_addr.sin_port = htons(port);
+                    server_addr.sin_addr = *((struct in_addr *)remote_host->h_addr);
+                    memset(&(server_addr.sin_zero), '\0', 8);
+                    /*****************************************************/
+
+                    ret = join_server(&conn, (struct sockaddr *)&server_addr, sizeof(server_addr), user_name);
                 }
                 
-                // initialize the remote host internet address
-                server_addr.sin_family = AF_INET;		
-                server_addr.sin_port = htons(port);
-                server_addr.sin_addr = *((struct in_addr *)remote_host->h_addr);
-                memset(&(server_addr.sin_zero), '\0', 8);
-                /*****************************************************/
-
-                if (join_server(sockfd, server_addr, user_name, msg_window) == 0) {
+                if (ret == 0) {
                     is_connected = 1;
                     DISPLAY(cmd_window, "Successfully connected to chat server");
                 } else {
+                    if (ret == -1)
+                        DISPLAY(msg_window, "connection failure - %s", strerror(errno));
+                    else if (ret == ERR_JOIN_DUP_NAME)
+                        DISPLAY(msg_window, "connection failure - your name has been used, pls change your name.");
+                    else if (ret == ERR_JOIN_ROOM_FULL)
+                        DISPLAY(msg_window, "connection failure - the room is full");
+                    else
+                        DISPLAY(msg_window, "connection failure - unknown error");
                     is_connected = 0;
                     DISPLAY(cmd_window, "Fail to connect to server");
-                    close(sockfd);
+                    close(conn.sockfd);
                     continue;
                 }
 
                 // start the chat thread to receive broadcast message
                 if (pthread_create(&chat_thread, NULL, chat_thread_fn, (void *)msg_window) != 0) {
                     DISPLAY(cmd_window, "Fail to start the background thread");
-                    close(sockfd);
+                    close(conn.sockfd);
                     goto END;
                 }
             }
@@ -345,20 +601,140 @@ int main(int argc, char *argv[])
                 DISPLAY(cmd_window, "Not connected, join a server first");
                 continue;
         }
-            if (send_msg_to_server(sockfd, parameter, CMD_CLIENT_SEND) != 0) {
-                DISPLAY(cmd_window, "send message fails");
-                close(sockfd);
-                goto END;
+            if (send_msg(parameter, CMD_CLIENT_SEND) != 0) {
+                // the chat thread notices the broken connection and reconnects
+                DISPLAY(cmd_window, "send message fails, try again");
+            }
+        } else if (strcasecmp(user_command, "WHISPER") == 0) {  /* WHISPER <name> <message>: to one client only */
+            char *to = strtok(parameter, " "), *msg = strtok(NULL, "");
+            int sent;
+
+            if (!is_connected) {
+                DISPLAY(cmd_window, "Not connected, join a server first");
+                continue;
+            }
+            pthread_mutex_lock(&conn_lock);
+            sent = (conn.sockfd == -1) ? -1 : send_whisper(&conn, to, (msg != NULL) ? msg : "");
+            pthread_mutex_unlock(&conn_lock);
+            if (sent != 0)
+                DISPLAY(cmd_window, "send message fails, try again");
+            else
+                DISPLAY(msg_window, "[to %s] %s", to, (msg != NULL) ? msg : "");
+        } else if ((strcasecmp(user_command, "CREATE") == 0) ||
+                   (strcasecmp(user_command, "ENTER") == 0) ||
+                   (strcasecmp(user_command, "LEAVE") == 0)) {  /* client moves to another chat room */
+            int command = (strcasecmp(user_command, "CREATE") == 0) ? CMD_CLIENT_ROOM_CREATE :
+                          (strcasecmp(user_command, "ENTER") == 0) ? CMD_CLIENT_ROOM_JOIN : CMD_CLIENT_ROOM_LEAVE;
+
+            if (!is_connected) {
+                DISPLAY(cmd_window, "Not connected, join a server first");
+                continue;
+            }
+            if ((parameter != NULL) && (strlen(parameter) >= ROOMNAME_LENGTH)) {
+                DISPLAY(cmd_window, "The room name is too long");
+                continue;
+            }
+            if (send_msg(parameter, command) != 0) {
+                DISPLAY(cmd_window, "room change fails, try again");
+            }
+        } else if ((strcasecmp(user_command, "SUBSCRIBE") == 0) ||
+                   (strcasecmp(user_command, "UNSUBSCRIBE") == 0)) {  /* only the messages with a keyword, "word*" for a prefix */
+            int command = (strcasecmp(user_command, "SUBSCRIBE") == 0) ? CMD_CLIENT_SUBSCRIBE : CMD_CLIENT_UNSUBSCRIBE;
+
+            if (!is_connected) {
+                DISPLAY(cmd_window, "Not connected, join a server first");
+                continue;
+            }
+            if (send_msg(parameter, command) != 0) {
+                DISPLAY(cmd_window, "keyword change fails, try again");
+            }
+        } else if (strcasecmp(user_command, "WHO") == 0) {  /* the members of the room, as the server told them */
+            if (!is_connected) {
+                DISPLAY(cmd_window, "Not connected, join a server first");
+                continue;
+            }
+            pthread_mutex_lock(&roster_lock);
+            wprintw(msg_window, "******%d in the room:", roster_count);
+            for (i = 0; i < roster_count; i++)
+                wprintw(msg_window, "%s %s", (i > 0) ? "," : "", roster[i]);
+            pthread_mutex_unlock(&roster_lock);
+            DISPLAY(msg_window, "******");
+        } else if (strcasecmp(user_command, "SHARE") == 0) {  /* SHARE <path>: a file for the room, it goes up once the server makes room */
+            struct transfer *t;
+            struct stat st;
+            char *base = strrchr(parameter, '/');
+            int sent;
+
+            if (!is_connected) {
+                DISPLAY(cmd_window, "Not connected, join a server first");
+                continue;
+            }
+            t = (struct transfer *)calloc(1, sizeof(struct transfer));
+            if ((t -> fd = open(parameter, O_RDONLY)) == -1 || fstat(t -> fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+                DISPLAY(cmd_window, "Cannot share %s", parameter);
+                if (t -> fd != -1)
+                    close(t -> fd);
+                free(t);
+                continue;
+            }
+            t -> upload = 1;
+            t -> size = st.st_size;
+            t -> win = msg_window;
+            strncpy(t -> name, (base != NULL) ? base + 1 : parameter, FILE_NAME_MAX - 1);
+
+            // in line before the answer can come in
+            pthread_mutex_lock(&shares_lock);
+            pthread_mutex_lock(&conn_lock);
+            sent = (conn.sockfd == -1) ? -1 : offer_file(&conn, t -> name, t -> size);
+            pthread_mutex_unlock(&conn_lock);
+            if (sent == 0) {
+                *shares_tail = t;
+                shares_tail = &t -> next;
+            }
+            pthread_mutex_unlock(&shares_lock);
+            if (sent != 0) {
+                DISPLAY(cmd_window, "share fails, try again");
+                close(t -> fd);
+                free(t);
+            }
+        } else if (strcasecmp(user_command, "FETCH") == 0) {  /* FETCH <id> [path]: a file shared in the room, the id its notice tells */
+            char *id = strtok(parameter, " "), *path = strtok(NULL, " "), *end;
+            struct transfer *t;
+            pthread_t thread;
+
+            if (!is_connected) {
+                DISPLAY(cmd_window, "Not connected, join a server first");
+                continue;
+            }
+            t = (struct transfer *)calloc(1, sizeof(struct transfer));
+            t -> id = strtoull(id, &end, 16);
+            if (*end != '\0' || t -> id == 0) {
+                DISPLAY(cmd_window, "Incorrect input: the id of a file is a hex number");
+                free(t);
+                continue;
+            }
+            t -> win = msg_window;
+            strncpy(t -> name, (path != NULL) ? path : id, PATH_MAX - 1);
+            if ((t -> fd = open(t -> name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+                DISPLAY(cmd_window, "Cannot write %s", t -> name);
+                free(t);
+                continue;
+            }
+            if (pthread_create(&thread, NULL, transfer_thread_fn, (void *)t) != 0) {
+                DISPLAY(cmd_window, "Fail to start the download");
+                close(t -> fd);
+                free(t);
             }
         } else if (strcasecmp(user_command, "DEPART") == 0) { /* client departs from the chat server */
             if (is_connected) {
                 pthread_cancel(chat_thread); // terminate the chat_thread
                 pthread_join(chat_thread, NULL);
                 
-                if (send_msg_to_server(sockfd, NULL, CMD_CLIENT_DEPART) != 0) {
+                if (send_msg(NULL, CMD_CLIENT_DEPART) != 0) {
                     DISPLAY(cmd_window, "depart fails");
                 }
-                close(sockfd);
+                if (conn.sockfd != -1)
+                    close(conn.sockfd);
                 is_connected = 0;
                 
                 DISPLAY(msg_window, "You have left the chat room.");
@@ -371,10 +747,11 @@ int main(int argc, char *argv[])
                 pthread_cancel(chat_thread); // terminate the chat_thread
                 pthread_join(chat_thread, NULL);
                 
-                if (send_msg_to_server(sockfd, NULL, CMD_CLIENT_DEPART) != 0) {
+                if (send_msg(NULL, CMD_CLIENT_DEPART) != 0) {
                     DISPLAY(cmd_window, "depart fails");
                 }
-                close(sockfd);
+                if (conn.sockfd != -1)
+                    close(conn.sockfd);
                 is_connected = 0;
                 
                 DISPLAY(msg_window, "You have left the chat room.");
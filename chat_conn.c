@@ -0,0 +1,551 @@
+#include "chat.h"
+#include "chat_conn.h"
+#include <string.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+
+/*
+ * Send a message to server
+ * A chat message longer than the server accepts is truncated.
+ * Return value:  0 - success;
+ *               -1 - error;
+ */
+int send_msg_to_server(struct chat_conn *conn, char *msg, int command)
+{
+    size_t msg_len = 0, len;
+
+    if ( (command == CMD_CLIENT_JOIN) ||
+         (command == CMD_CLIENT_SEND) ||
+         (command == CMD_CLIENT_ROOM_CREATE) ||
+         (command == CMD_CLIENT_ROOM_JOIN) ||
+         (command == CMD_CLIENT_SUBSCRIBE) ||
+         (command == CMD_CLIENT_UNSUBSCRIBE && msg != NULL) ) {
+        msg_len = strlen(msg);
+        if ((command == CMD_CLIENT_SEND) && (msg_len > conn -> server_max_payload))
+            msg_len = conn -> server_max_payload;
+    }
+
+    char mbuf[proto_frame_size(PROTO_V2, msg_len)];
+    if (msg_len > 0)
+        len = proto_encode(mbuf, PROTO_V2, command, -1, msg, msg_len);
+    else
+        len = proto_encode(mbuf, PROTO_V2, command, -1, NULL, 0);
+
+    if (send(conn -> sockfd, mbuf, len, MSG_NOSIGNAL) != (ssize_t)len) {
+        perror("Server socket sending error");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Send a chat message to one client only, by name
+ * Return value:  0 - success;
+ *               -1 - error;
+ */
+int send_whisper(struct chat_conn *conn, const char *to, const char *msg)
+{
+    size_t to_len = strlen(to), msg_len = strlen(msg), len;
+
+    if (to_len + VARINT_MAX + msg_len > conn -> server_max_payload)
+        msg_len = (conn -> server_max_payload > to_len + VARINT_MAX) ? conn -> server_max_payload - to_len - VARINT_MAX : 0;
+
+    char mbuf[proto_relay_size(to_len, msg_len)];
+    len = proto_encode_relay(mbuf, CMD_CLIENT_WHISPER, to, msg, msg_len);
+    if (send(conn -> sockfd, mbuf, len, MSG_NOSIGNAL) != (ssize_t)len) {
+        perror("Server socket sending error");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * recv() which keeps the descriptors passed along, CMD_SERVER_RING_OK carries those of the ring
+ */
+static ssize_t sock_recv(struct chat_conn *conn, char *p, size_t len, int flags)
+{
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    ssize_t n;
+    int i, nfds, fds[2];
+
+    iov.iov_base = p;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if ((n = recvmsg(conn -> sockfd, &msg, flags | MSG_CMSG_CLOEXEC)) <= 0)
+        return n;
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm -> cmsg_level != SOL_SOCKET || cm -> cmsg_type != SCM_RIGHTS)
+            continue;
+        nfds = (cm -> cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cm), ((nfds < 2) ? nfds : 2) * sizeof(int));
+        for (i = 0; i < conn -> nring_fds; i++)
+            close(conn -> ring_fds[i]);
+        for (i = 0; i < nfds && i < 2; i++)
+            conn -> ring_fds[i] = fds[i];
+        conn -> nring_fds = i;
+    }
+    return n;
+}
+
+/* CMD_SERVER_RING_OK: the rest comes through the ring */
+static int ring_switch(struct chat_conn *conn)
+{
+    struct ring *r;
+
+    if (conn -> nring_fds != 2) {
+        errno = EPROTO;
+        return -1;
+    }
+    r = (struct ring *)malloc(sizeof(struct ring));
+    conn -> nring_fds = 0;
+    if (ring_map(r, conn -> ring_fds[0], conn -> ring_fds[1]) == -1) {
+        free(r);
+        return -1;
+    }
+    conn -> ring = r;
+    conn -> ring_used = 0;
+    return 0;
+}
+
+static void ring_detach(struct chat_conn *conn)
+{
+    int i;
+
+    if (conn -> ring != NULL) {
+        ring_close(conn -> ring);
+        free(conn -> ring);
+        conn -> ring = NULL;
+    }
+    for (i = 0; i < conn -> nring_fds; i++)
+        close(conn -> ring_fds[i]);
+    conn -> nring_fds = 0;
+}
+
+/*
+ * The next message out of the ring, decoded in place - its bytes are given back on the next call
+ * Nothing is left on the socket but the end of the connection.
+ */
+static int ring_next(struct chat_conn *conn, struct chat_frame *mbuf, int wait)
+{
+    struct frame_decoder d;
+    struct pollfd pfd[2];
+    const char *p;
+    size_t avail;
+    char c;
+    int ret;
+
+    if (ring_consume(conn -> ring, conn -> ring_used)) {
+        // the server waits for room
+        char ack[PROTO_V2_HEADER_MAX];
+        size_t len = proto_encode(ack, PROTO_V2, CMD_CLIENT_RING_ACK, -1, NULL, 0);
+
+        if (send(conn -> sockfd, ack, len, MSG_NOSIGNAL) != (ssize_t)len)
+            return -1;
+    }
+    conn -> ring_used = 0;
+
+    while (1) {
+        if ((avail = ring_peek(conn -> ring, &p)) > 0) {
+            decoder_init(&d, PROTO_V2, conn -> decoder.max_payload);
+            d.buf = (char *)p;
+            d.end = d.cap = avail;
+            if ((ret = decoder_next(&d, mbuf)) == 1) {
+                conn -> ring_used = d.start;
+                return 1;
+            }
+            if (ret == -1 || avail == conn -> ring -> size) {
+                errno = EPROTO;
+                return -1;
+            }
+        }
+        if (!ring_sleep(conn -> ring))
+            continue;
+
+        // the ring is empty, has the server gone?
+        ret = recv(conn -> sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (ret == 0 || (ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+            return ret;
+        if (ret == 1) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (!wait) {
+            errno = EAGAIN;
+            return -1;
+        }
+        pfd[0].fd = conn -> ring -> efd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = conn -> sockfd;
+        pfd[1].events = POLLIN;
+        if (poll(pfd, 2, -1) == -1 && errno != EINTR)
+            return -1;
+        if (pfd[0].revents & POLLIN)
+            ring_woken(conn -> ring);
+    }
+}
+
+/*
+ * Take the next message from the socket or the ring, waiting for it or not
+ * Return value: see recv_msg_from_server(), -1 with errno EAGAIN: nothing yet
+ */
+static int conn_next(struct chat_conn *conn, struct chat_frame *mbuf, int wait)
+{
+    char *p;
+    size_t room;
+    ssize_t n;
+    int ret;
+
+    if (conn -> ring != NULL) {
+        if ((ret = ring_next(conn, mbuf, wait)) != 1)
+            return ret;
+    } else {
+        while ((ret = decoder_next(&conn -> decoder, mbuf)) == 0) {
+            p = decoder_space(&conn -> decoder, &room);
+            n = sock_recv(conn, p, room, wait ? 0 : MSG_DONTWAIT);
+            if (n <= 0)
+                return (int)n;
+            decoder_commit(&conn -> decoder, n);
+        }
+        if (ret < 0) {
+            errno = EPROTO;
+            return ret;
+        }
+        if (mbuf -> command == CMD_SERVER_RING_OK) {
+            if (ring_switch(conn) != 0)
+                return -1;
+            return conn_next(conn, mbuf, wait);
+        }
+    }
+
+    if (mbuf -> command == CMD_SERVER_PING) {
+        // the server checks that we are still there, the caller need not know
+        if (send_msg_to_server(conn, NULL, CMD_CLIENT_PONG) != 0)
+            return -1;
+        return conn_next(conn, mbuf, wait);
+    } else if (mbuf -> command == CMD_SERVER_BROADCAST && mbuf -> seq > 0) {
+        conn -> last_seq = mbuf -> seq;
+    } else if (mbuf -> command == CMD_SERVER_ROOM_OK) {
+        // the numbers of the new room start over for us
+        n = (mbuf -> len < ROOMNAME_LENGTH) ? mbuf -> len : ROOMNAME_LENGTH - 1;
+        memcpy(conn -> room, mbuf -> payload, n);
+        conn -> room[n] = '\0';
+        conn -> last_seq = 0;
+    }
+    return 1;
+}
+
+/*
+ * Receive the next message from server, however it is split up on the wire
+ * The connection keeps track of the room and the last message, for resume_server().
+ * The switch to a ring (CMD_SERVER_RING_OK) and the heartbeat (CMD_SERVER_PING) are taken care of,
+ * the caller does not see them.
+ * Return value:  1 - success;
+ *                0 - the server closed the connection;
+ *               -1 - error;
+ */
+int recv_msg_from_server(struct chat_conn *conn, struct chat_frame *mbuf)
+{
+    return conn_next(conn, mbuf, 1);
+}
+
+/*
+ * Like recv_msg_from_server(), but return at once if no message is there
+ * Wait for conn -> sockfd, and also for conn -> ring -> efd once the ring is attached.
+ * Return value:  1 - success;
+ *                0 - the server closed the connection;
+ *               -1 - error, EAGAIN: no message yet;
+ */
+int recv_msg_nowait(struct chat_conn *conn, struct chat_frame *mbuf)
+{
+    return conn_next(conn, mbuf, 0);
+}
+
+/*
+ * Connect, send the first message and wait for CMD_SERVER_JOIN_OK
+ * Return value: see join_server()
+ */
+static int handshake(struct chat_conn *conn, char *mbuf, size_t len)
+{
+    struct chat_frame reply;
+    int ret, on = 1;
+
+    // the server speaks protocol v2 with us, it may prefix our messages with a name
+    decoder_free(&conn -> decoder);
+    decoder_init(&conn -> decoder, PROTO_V2, DEFAULT_MAX_PAYLOAD + CLIENTNAME_LENGTH + CONTENT_LENGTH);
+    conn -> server_max_payload = CONTENT_LENGTH - 1;
+    // a new connection starts on the socket
+    ring_detach(conn);
+
+    // every message goes out at once, chat messages are small and far apart
+    if (conn -> server_addr.ss_family == AF_INET)
+        setsockopt(conn -> sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    // make a connection to the remote host
+    if (connect(conn -> sockfd, (struct sockaddr *)&conn -> server_addr, conn -> addr_len) == -1)
+        return -1;
+
+    if (send(conn -> sockfd, mbuf, len, MSG_NOSIGNAL) != (ssize_t)len)
+        return -1;
+
+    // get the response from the server
+    if ((ret = recv_msg_from_server(conn, &reply)) != 1) {
+        if (ret == 0)
+            errno = ECONNRESET;
+        return -1;
+    }
+
+    if (reply.command == CMD_SERVER_JOIN_OK) {
+        // the server tells how long our messages may be, and so are the broadcasts
+        conn -> server_max_payload = (reply.private_data > 0) ? reply.private_data : CONTENT_LENGTH - 1;
+        conn -> decoder.max_payload = conn -> server_max_payload + CLIENTNAME_LENGTH + CONTENT_LENGTH;
+        conn -> token = reply.token;
+        return 0;
+    } else if (reply.command == CMD_SERVER_FAIL) {
+        return (reply.private_data > 0) ? reply.private_data : ERR_OTHERS;
+    }
+
+    errno = EPROTO;
+    return -1;
+}
+
+/*
+ * Join the chat server, conn -> sockfd is a new socket of the family of server_addr
+ * (AF_INET, or AF_UNIX for the local socket of a server on the same host)
+ * Return value:  0 - success;
+ *               -1 - error, see errno;
+ *               >0 - the server refuses, the error code of CMD_SERVER_FAIL
+ */
+int join_server(struct chat_conn *conn, const struct sockaddr *server_addr, socklen_t addr_len, char *user_name)
+{
+    size_t len = strlen(user_name);
+    char mbuf[proto_frame_size(PROTO_V2, len)];
+
+    memcpy(&conn -> server_addr, server_addr, addr_len);
+    conn -> addr_len = addr_len;
+    strncpy(conn -> name, user_name, CLIENTNAME_LENGTH - 1);
+    strcpy(conn -> room, DEFAULT_ROOM);
+    conn -> last_seq = 0;
+    conn -> token = 0;
+
+    // send a JOIN message
+    return handshake(conn, mbuf, proto_encode(mbuf, PROTO_V2, CMD_CLIENT_JOIN, -1, user_name, len));
+}
+
+/*
+ * Join the chat server again after the connection was lost, conn -> sockfd is a new socket
+ * The server puts us back into our room and sends what we missed, as far as it still can.
+ * Return value: see join_server()
+ */
+int resume_server(struct chat_conn *conn)
+{
+    size_t name_len = strlen(conn -> name), room_len = strlen(conn -> room);
+    char payload[3 * VARINT_MAX + name_len + room_len];
+    char mbuf[proto_frame_size(PROTO_V2, sizeof(payload))];
+    size_t n;
+
+    n = varint_put(payload, conn -> token);
+    n += varint_put(payload + n, conn -> last_seq);
+    n += varint_put(payload + n, name_len);
+    memcpy(payload + n, conn -> name, name_len);
+    memcpy(payload + n + name_len, conn -> room, room_len);
+    n += name_len + room_len;
+
+    return handshake(conn, mbuf, proto_encode(mbuf, PROTO_V2, CMD_CLIENT_RESUME, -1, payload, n));
+}
+
+/*
+ * Ask the server to send everything through a shared memory ring of (at least) size bytes, 0: its default
+ * The server needs the connection to be a Unix socket. The answer comes in with the messages:
+ * recv_msg_from_server() switches over quietly, or returns CMD_SERVER_FAIL.
+ * Return value:  0 - success;
+ *               -1 - error;
+ */
+int attach_ring(struct chat_conn *conn, size_t size)
+{
+    char payload[VARINT_MAX], mbuf[PROTO_V2_HEADER_MAX + VARINT_MAX];
+    size_t len;
+
+    len = proto_encode(mbuf, PROTO_V2, CMD_CLIENT_RING_ATTACH, -1, payload, varint_put(payload, size));
+    if (send(conn -> sockfd, mbuf, len, MSG_NOSIGNAL) != (ssize_t)len)
+        return -1;
+    return 0;
+}
+
+/*
+ * Offer a file of size bytes to the room, before uploading it
+ * The answer comes in with the messages: CMD_SERVER_FILE_OK with the id to upload it with, see
+ * put_file(), or CMD_SERVER_FAIL.
+ * Return value:  0 - success;
+ *               -1 - error;
+ */
+int offer_file(struct chat_conn *conn, const char *name, size_t size)
+{
+    size_t name_len = strnlen(name, FILE_NAME_MAX - 1), len;
+    char payload[VARINT_MAX + name_len];
+    char mbuf[proto_frame_size(PROTO_V2, sizeof(payload))];
+    int n;
+
+    n = varint_put(payload, size);
+    memcpy(payload + n, name, name_len);
+    len = proto_encode(mbuf, PROTO_V2, CMD_CLIENT_FILE_OFFER, -1, payload, n + name_len);
+    if (send(conn -> sockfd, mbuf, len, MSG_NOSIGNAL) != (ssize_t)len)
+        return -1;
+    return 0;
+}
+
+/*
+ * Open a data stream for the session of conn: a new connection to the same server which carries
+ * the bytes of files, so a transfer holds up no chat message - see put_file() and get_file()
+ * The server checks the name and token with the first request.
+ * Return value: the socket of the stream, -1 on error
+ */
+int open_data_stream(struct chat_conn *conn)
+{
+    size_t name_len = strlen(conn -> name), len;
+    char payload[VARINT_MAX + name_len];
+    char mbuf[proto_frame_size(PROTO_V2, sizeof(payload))];
+    int sockfd, n, on = 1;
+
+    if ((sockfd = socket(conn -> server_addr.ss_family, SOCK_STREAM, 0)) == -1)
+        return -1;
+    if (connect(sockfd, (struct sockaddr *)&conn -> server_addr, conn -> addr_len) == -1)
+        goto fail;
+    // the requests are small and wait for their answers
+    if (conn -> server_addr.ss_family == AF_INET)
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    n = varint_put(payload, conn -> token);
+    memcpy(payload + n, conn -> name, name_len);
+    len = proto_encode(mbuf, PROTO_V2, CMD_CLIENT_DATA_OPEN, -1, payload, n + name_len);
+    if (send(sockfd, mbuf, len, MSG_NOSIGNAL) != (ssize_t)len)
+        goto fail;
+    return sockfd;
+
+fail:
+    close(sockfd);
+    return -1;
+}
+
+/* the next answer on a data stream, however long it takes */
+static int data_next(int sockfd, struct frame_decoder *d, struct chat_frame *f)
+{
+    char *p;
+    size_t room;
+    ssize_t n;
+    int ret;
+
+    while ((ret = decoder_next(d, f)) == 0) {
+        p = decoder_space(d, &room);
+        if ((n = recv(sockfd, p, room, 0)) == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = ECONNRESET;
+            return -1;
+        }
+        decoder_commit(d, n);
+    }
+    if (ret < 0) {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Upload the file offered as id over a data stream: size bytes of fd, from its start
+ * The bytes go from the file to the socket with sendfile(), the server splices them into its spool.
+ * Return value:  0 - success, the server has the file complete;
+ *               -1 - error, see errno;
+ *               >0 - the server refuses, the error code of CMD_SERVER_FAIL
+ */
+int put_file(int sockfd, uint64_t id, int fd, size_t size)
+{
+    char payload[VARINT_MAX], mbuf[PROTO_V2_HEADER_MAX + VARINT_MAX];
+    struct frame_decoder d;
+    struct chat_frame reply;
+    off_t off = 0;
+    ssize_t n;
+    size_t len;
+    int ret;
+
+    len = proto_encode(mbuf, PROTO_V2, CMD_CLIENT_FILE_PUT, -1, payload, varint_put(payload, id));
+    if (send(sockfd, mbuf, len, MSG_NOSIGNAL) != (ssize_t)len)
+        return -1;
+    while ((size_t)off < size) {
+        if ((n = sendfile(sockfd, fd, &off, size - off)) == -1 && errno == EINTR)
+            continue;
+        if (n == 0) {
+            errno = EIO;    // the file is shorter than offered
+            return -1;
+        }
+        if (n == -1)
+            break;          // the server may have stopped the upload, its answer tells why
+    }
+
+    decoder_init(&d, PROTO_V2, 2 * VARINT_MAX);
+    ret = data_next(sockfd, &d, &reply);
+    decoder_free(&d);
+    if (ret != 0)
+        return -1;
+    if (reply.command == CMD_SERVER_FAIL)
+        return (reply.private_data > 0) ? reply.private_data : ERR_OTHERS;
+    return (reply.command == CMD_SERVER_FILE_OK && (size_t)off == size) ? 0 : ERR_OTHERS;
+}
+
+/*
+ * Download the file id over a data stream into fd, FILE_GET_MAX bytes at a time
+ * Return value:  0 - success, *got bytes are written;
+ *               -1 - error, see errno;
+ *               >0 - the server refuses, the error code of CMD_SERVER_FAIL
+ */
+int get_file(int sockfd, uint64_t id, int fd, size_t *got)
+{
+    char payload[3 * VARINT_MAX], mbuf[PROTO_V2_HEADER_MAX + 3 * VARINT_MAX];
+    struct frame_decoder d;
+    struct chat_frame piece;
+    const char *p;
+    ssize_t n;
+    size_t len, left;
+    int k, ret = 0;
+
+    *got = 0;
+    decoder_init(&d, PROTO_V2, FILE_GET_MAX);
+    do {
+        k = varint_put(payload, id);
+        k += varint_put(payload + k, *got);
+        k += varint_put(payload + k, FILE_GET_MAX);
+        len = proto_encode(mbuf, PROTO_V2, CMD_CLIENT_FILE_GET, -1, payload, k);
+        if (send(sockfd, mbuf, len, MSG_NOSIGNAL) != (ssize_t)len || data_next(sockfd, &d, &piece) != 0) {
+            ret = -1;
+            break;
+        }
+        if (piece.command != CMD_SERVER_FILE_DATA) {
+            ret = (piece.command == CMD_SERVER_FAIL && piece.private_data > 0) ? piece.private_data : ERR_OTHERS;
+            break;
+        }
+        for (p = piece.payload, left = piece.len; left > 0; p += n, left -= n) {
+            if ((n = write(fd, p, left)) == -1) {
+                if (errno == EINTR) {
+                    n = 0;
+                    continue;
+                }
+                ret = -1;
+                break;
+            }
+        }
+        *got += piece.len - left;
+    } while (ret == 0 && piece.len == FILE_GET_MAX);
+    decoder_free(&d);
+    return ret;
+}
@@ -0,0 +1,44 @@
+#ifndef _CHAT_CONN_H_
+#define _CHAT_CONN_H_
+
+#include "chat_proto.h"
+#include "chat_ring.h"
+
+/*
+ * The client side of one connection to the chat server - use by chat_client and chat_bench
+ * The client always speaks protocol v2.
+ * Over a Unix socket, it may have the server write into a shared memory ring instead, see chat_ring.h.
+ * Files go over data streams of their own, next to the connection.
+ */
+struct chat_conn {
+    int sockfd;                     // the socket file descriptor
+    struct frame_decoder decoder;   // reassembles the messages from the server
+    size_t server_max_payload;      // the longest message the server accepts, told by CMD_SERVER_JOIN_OK
+
+    struct ring *ring;              // attached: the messages from the server are read from here
+    size_t ring_used;               // the bytes of the last message taken out of the ring, given back on the next call
+    int ring_fds[2], nring_fds;     // the memfd and eventfd come with CMD_SERVER_RING_OK, before it is decoded
+
+    /* what it takes to resume the session after the connection is lost */
+    struct sockaddr_storage server_addr;
+    socklen_t addr_len;
+    char name[CLIENTNAME_LENGTH];
+    uint64_t token;                 // told by CMD_SERVER_JOIN_OK
+    uint64_t last_seq;              // the last message received in the room
+    char room[ROOMNAME_LENGTH];     // the room the client is in
+};
+
+int send_msg_to_server(struct chat_conn *conn, char *msg, int command);
+int send_whisper(struct chat_conn *conn, const char *to, const char *msg);
+int recv_msg_from_server(struct chat_conn *conn, struct chat_frame *mbuf);
+int recv_msg_nowait(struct chat_conn *conn, struct chat_frame *mbuf);
+int join_server(struct chat_conn *conn, const struct sockaddr *server_addr, socklen_t addr_len, char *user_name);
+int resume_server(struct chat_conn *conn);
+int attach_ring(struct chat_conn *conn, size_t size);
+
+int offer_file(struct chat_conn *conn, const char *name, size_t size);
+int open_data_stream(struct chat_conn *conn);
+int put_file(int sockfd, uint64_t id, int fd, size_t size);
+int get_file(int sockfd, uint64_t id, int fd, size_t *got);
+
+#endif
@@ -0,0 +1,72 @@
+#include "chat_hist.h"
+#include <stddef.h>
+
+static int hist_index(unsigned long long v)
+{
+	int shift;
+
+	if (v < (2 << HIST_SUB_BITS))
+		return v;
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return (shift << HIST_SUB_BITS) + (v >> shift);
+}
+
+/* the largest value counted in bucket i */
+static unsigned long long hist_value(int i)
+{
+	int shift;
+
+	if (i < (2 << HIST_SUB_BITS))
+		return i;
+	shift = (i >> HIST_SUB_BITS) - 1;
+	return ((unsigned long long)((i & ((1 << HIST_SUB_BITS) - 1)) + (1 << HIST_SUB_BITS) + 1) << shift) - 1;
+}
+
+void hist_record(struct histogram *h, unsigned long long v)
+{
+	unsigned long long max = atomic_load_explicit(&h -> max, memory_order_relaxed);
+	int i = hist_index(v);
+
+	atomic_fetch_add_explicit(&h -> count[(i < HIST_SIZE) ? i : HIST_SIZE - 1], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h -> total, 1, memory_order_relaxed);
+	while (v > max && !atomic_compare_exchange_weak_explicit(&h -> max, &max, v,
+				memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+/*
+ * Add the counts of from to into
+ */
+void hist_merge(struct histogram *into, struct histogram *from)
+{
+	unsigned long long max = atomic_load_explicit(&from -> max, memory_order_relaxed);
+	int i;
+
+	for (i = 0; i < HIST_SIZE; i++)
+		atomic_fetch_add_explicit(&into -> count[i], atomic_load_explicit(&from -> count[i], memory_order_relaxed),
+				memory_order_relaxed);
+	atomic_fetch_add_explicit(&into -> total, atomic_load_explicit(&from -> total, memory_order_relaxed),
+			memory_order_relaxed);
+	if (max > atomic_load_explicit(&into -> max, memory_order_relaxed))
+		atomic_store_explicit(&into -> max, max, memory_order_relaxed);
+}
+
+/*
+ * The value below which p percent of the recorded values are, 0 if nothing is recorded
+ */
+unsigned long long hist_percentile(struct histogram *h, double p)
+{
+	unsigned long total = atomic_load_explicit(&h -> total, memory_order_relaxed);
+	unsigned long long max = atomic_load_explicit(&h -> max, memory_order_relaxed);
+	unsigned long want = (unsigned long)(total * p / 100.0), seen = 0;
+	int i;
+
+	if (total == 0)
+		return 0;
+	for (i = 0; i < HIST_SIZE; i++) {
+		seen += atomic_load_explicit(&h -> count[i], memory_order_relaxed);
+		if (seen > want)
+			return (hist_value(i) < max) ? hist_value(i) : max;
+	}
+	return max;
+}
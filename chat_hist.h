@@ -0,0 +1,27 @@
+#ifndef _CHAT_HIST_H_
+#define _CHAT_HIST_H_
+
+#include <stdatomic.h>
+
+/*
+ * Latency histogram, HDR style - use by both server and chat_bench
+ * Values below 64 have a bucket each, above there are 32 buckets per power of 2,
+ * so a percentile is off by at most ~3%. Values up to 2^40 are told apart.
+ *
+ * Any thread may record and read at any time: the counters are atomic, the
+ * reader sees a consistent enough picture for monitoring.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SIZE ((40 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct histogram {
+    atomic_ulong count[HIST_SIZE];
+    atomic_ulong total;
+    atomic_ullong max;
+};
+
+void hist_record(struct histogram *h, unsigned long long v);
+void hist_merge(struct histogram *into, struct histogram *from);
+unsigned long long hist_percentile(struct histogram *h, double p);
+
+#endif
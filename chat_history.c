@@ -0,0 +1,277 @@
+#include "chat_history.h"
+#include "chat_proto.h"
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define REC_SIZE(len) ((sizeof(struct history_rec) + (len) + 7) & ~(size_t)7)
+
+static struct history_segment *segment_map(const char *path, int create)
+{
+	struct history_segment *seg;
+	struct stat st;
+	int fd;
+
+	fd = open(path, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0600);
+	if (fd == -1)
+		return NULL;
+	if (create && ftruncate(fd, HISTORY_SEGMENT_SIZE) == -1) {
+		close(fd);
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct history_rec)) {
+		close(fd);
+		return NULL;
+	}
+
+	seg = (struct history_segment *)calloc(1, sizeof(struct history_segment));
+	seg -> size = st.st_size;
+	/* a new segment is faulted in now, the broadcast thread should not wait for the page cache */
+	seg -> base = mmap(NULL, seg -> size, PROT_READ | PROT_WRITE, MAP_SHARED | (create ? MAP_POPULATE : 0), fd, 0);
+	close(fd);
+	if (seg -> base == MAP_FAILED) {
+		free(seg);
+		return NULL;
+	}
+	strncpy(seg -> path, path, PATH_MAX - 1);
+	atomic_init(&seg -> refcnt, 1);
+	return seg;
+}
+
+static void segment_index(struct history_segment *seg, const struct history_rec *rec, size_t off)
+{
+	if (seg -> nrecs++ % HISTORY_INDEX_EVERY != 0)
+		return;
+	if (seg -> nindex == seg -> index_cap) {
+		seg -> index_cap = seg -> index_cap ? seg -> index_cap * 2 : 64;
+		seg -> index = (struct history_index *)realloc(seg -> index, sizeof(struct history_index) * seg -> index_cap);
+	}
+	seg -> index[seg -> nindex].seq = rec -> seq;
+	seg -> index[seg -> nindex].stamp = rec -> stamp;
+	seg -> index[seg -> nindex].off = off;
+	seg -> nindex++;
+}
+
+/*
+ * Walk the records of a segment found on disk: rebuild its index and find its end
+ * A record which does not look right (the server died while writing it) ends the segment.
+ */
+static void segment_scan(struct history_segment *seg)
+{
+	const struct history_rec *rec;
+	uint64_t seq = 0;
+	size_t off = 0;
+
+	while (off + sizeof(struct history_rec) <= seg -> size) {
+		rec = (const struct history_rec *)(seg -> base + off);
+		if (rec -> len == 0 || rec -> payload_off > rec -> len || off + REC_SIZE(rec -> len) > seg -> size ||
+				rec -> seq <= seq)
+			break;
+		if (seq == 0)
+			seg -> first_seq = rec -> seq;
+		seq = seg -> last_seq = rec -> seq;
+		segment_index(seg, rec, off);
+		off += REC_SIZE(rec -> len);
+	}
+	seg -> used = off;
+}
+
+void history_segment_get(struct history_segment *seg)
+{
+	atomic_fetch_add_explicit(&seg -> refcnt, 1, memory_order_relaxed);
+}
+
+void history_segment_put(struct history_segment *seg)
+{
+	if (atomic_fetch_sub_explicit(&seg -> refcnt, 1, memory_order_acq_rel) == 1) {
+		munmap(seg -> base, seg -> size);
+		free(seg -> index);
+		free(seg);
+	}
+}
+
+static void history_link(struct history *h, struct history_segment *seg)
+{
+	struct history_segment *old;
+
+	if (h -> newest != NULL)
+		h -> newest -> next = seg;
+	else
+		h -> oldest = seg;
+	h -> newest = seg;
+	h -> nsegments++;
+
+	/* retention: the oldest segment goes, frames being sent keep it mapped a little longer */
+	while (h -> nsegments > HISTORY_MAX_SEGMENTS) {
+		old = h -> oldest;
+		h -> oldest = old -> next;
+		h -> nsegments--;
+		unlink(old -> path);
+		history_segment_put(old);
+	}
+}
+
+static int name_cmp(const struct dirent **a, const struct dirent **b)
+{
+	return strcmp((*a) -> d_name, (*b) -> d_name);
+}
+
+static int is_segment(const struct dirent *d)
+{
+	size_t len = strlen(d -> d_name);
+
+	return len > 4 && strcmp(d -> d_name + len - 4, ".log") == 0;
+}
+
+/*
+ * Open the history of a room under root, with the segments left by an earlier run
+ * Return value:  0 - success;
+ *               -1 - error, see errno;
+ */
+int history_open(struct history *h, const char *root, const char *room)
+{
+	struct history_segment *seg;
+	struct dirent **names;
+	char path[PATH_MAX];
+	int i, n, len;
+
+	memset(h, 0, sizeof(struct history));
+	h -> next_seq = 1;
+
+	/* room names come from the clients, they never make it into a path as they are */
+	len = snprintf(h -> dir, PATH_MAX, "%s/", root);
+	for (; *room && len < PATH_MAX - 3; room++)
+		len += sprintf(h -> dir + len, "%02x", (unsigned char)*room);
+	if (mkdir(root, 0700) == -1 && errno != EEXIST)
+		return -1;
+	if (mkdir(h -> dir, 0700) == -1 && errno != EEXIST)
+		return -1;
+
+	/* segment names are zero padded, in name order they are oldest first */
+	if ((n = scandir(h -> dir, &names, is_segment, name_cmp)) == -1)
+		return -1;
+	for (i = 0; i < n; i++) {
+		len = snprintf(path, PATH_MAX, "%s/%s", h -> dir, names[i] -> d_name);
+		free(names[i]);
+		/* a path cut short would be some other file */
+		if (len >= PATH_MAX || (seg = segment_map(path, 0)) == NULL)
+			continue;
+		segment_scan(seg);
+		if (seg -> used == 0 || (h -> newest != NULL && seg -> first_seq < h -> next_seq)) {
+			/* empty, or overlapping what we have - of no use */
+			unlink(path);
+			history_segment_put(seg);
+			continue;
+		}
+		history_link(h, seg);
+		h -> next_seq = seg -> last_seq + 1;
+	}
+	free(names);
+	return 0;
+}
+
+/*
+ * Unmap the history, the files stay
+ */
+void history_close(struct history *h)
+{
+	struct history_segment *seg;
+
+	while ((seg = h -> oldest) != NULL) {
+		h -> oldest = seg -> next;
+		history_segment_put(seg);
+	}
+	h -> newest = NULL;
+	h -> nsegments = 0;
+}
+
+/*
+ * Append one message, encoded as a v2 CMD_SERVER_BROADCAST frame
+ * seq is larger than that of any message stored before.
+ * Return value: the record, it stays valid as long as a reference to *seg is held;
+ *               NULL - the message cannot be stored
+ */
+const struct history_rec *history_append(struct history *h, uint64_t seq, int64_t stamp, const char *msg, size_t len,
+		struct history_segment **seg)
+{
+	size_t frame_len, size = REC_SIZE(proto_broadcast_size(PROTO_V2, len));
+	struct history_segment *s = h -> newest;
+	struct history_rec *rec;
+	char path[PATH_MAX];
+
+	if (size > HISTORY_SEGMENT_SIZE)
+		return NULL;
+	if (s == NULL || s -> used + size > s -> size) {
+		if (snprintf(path, PATH_MAX, "%s/%020llu.log", h -> dir, (unsigned long long)seq) >= PATH_MAX)
+			return NULL;
+		if ((s = segment_map(path, 1)) == NULL)
+			return NULL;
+		s -> first_seq = seq;
+		history_link(h, s);
+	}
+
+	rec = (struct history_rec *)(s -> base + s -> used);
+	rec -> seq = seq;
+	rec -> stamp = stamp;
+	frame_len = proto_encode_broadcast(rec -> frame, PROTO_V2, seq, msg, len);
+	rec -> payload_off = frame_len - len;
+	/* the length goes last: a record cut short by a crash reads as the end of the log */
+	atomic_thread_fence(memory_order_release);
+	rec -> len = frame_len;
+
+	segment_index(s, rec, s -> used);
+	s -> used += REC_SIZE(frame_len);
+	s -> last_seq = seq;
+	h -> next_seq = seq + 1;
+	*seg = s;
+	return rec;
+}
+
+/*
+ * Call fn for every message from from_seq on (or the oldest one kept), oldest first
+ * The sparse index finds the first record, the rest is read in place.
+ * fn returns non-zero to stop.
+ * Return value: the # of messages passed to fn
+ */
+int history_replay(struct history *h, uint64_t from_seq,
+		int (*fn)(struct history_segment *, const struct history_rec *, void *), void *arg)
+{
+	struct history_segment *seg, *s;
+	const struct history_rec *rec;
+	int lo, hi, mid, count = 0;
+	size_t off = 0;
+
+	/* the last segment starting at or before from_seq */
+	for (seg = h -> oldest, s = h -> oldest; s != NULL; s = s -> next)
+		if (s -> first_seq <= from_seq)
+			seg = s;
+	if (seg == NULL)
+		return 0;
+
+	/* the last index entry at or before from_seq */
+	lo = 0;
+	hi = seg -> nindex - 1;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (seg -> index[mid].seq <= from_seq) {
+			off = seg -> index[mid].off;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	for (; seg != NULL; seg = seg -> next, off = 0) {
+		for (; off < seg -> used; off += REC_SIZE(rec -> len)) {
+			rec = (const struct history_rec *)(seg -> base + off);
+			if (rec -> seq < from_seq)
+				continue;
+			count++;
+			if (fn(seg, rec, arg) != 0)
+				return count;
+		}
+	}
+	return count;
+}
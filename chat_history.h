@@ -0,0 +1,78 @@
+#ifndef _CHAT_HISTORY_H_
+#define _CHAT_HISTORY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+
+/*
+ * Message history of a room - append-only log files, written and read through mmap
+ *
+ * The history of a room lives in <dir>/<room name in hex>/, one file per segment, named after
+ * the sequence number of its first message. A segment is a fixed size file mapped as a whole;
+ * records are appended until the next one does not fit, then a new segment starts. Only the
+ * newest HISTORY_MAX_SEGMENTS segments are kept.
+ *
+ *   +----------------------+------------------------------+---------+
+ *   | struct history_rec   | the message, a v2 BROADCAST  | padding |
+ *   |                      | frame ready for the wire     | to 8    |
+ *   +----------------------+------------------------------+---------+
+ *
+ * A record is never changed once written, so the frames can be sent from the mapping
+ * directly while the log grows. The file past the last record reads as zeroes.
+ *
+ * Every HISTORY_INDEX_EVERY records, the segment notes (seq, time, offset) in a sparse
+ * index kept in memory, and rebuilt from the records when the server restarts.
+ *
+ * The history of a room is not locked: its owner serializes all calls. Segments are
+ * reference counted, they stay mapped while a frame points into them.
+ */
+#define HISTORY_SEGMENT_SIZE (4 * 1024 * 1024)
+#define HISTORY_MAX_SEGMENTS 16
+#define HISTORY_INDEX_EVERY 32
+#define DEFAULT_HISTORY_REPLAY 20   // # of messages a joining client gets
+
+struct history_rec {
+    uint32_t len;               // # of bytes of the frame, 0: the end of the segment
+    uint32_t payload_off;       // where the message text starts within the frame
+    uint64_t seq;               // the sequence number of the message in its room, increasing
+    int64_t stamp;              // when it was broadcast (ms, wall clock)
+    char frame[];
+};
+
+struct history_index {
+    uint64_t seq;
+    int64_t stamp;
+    size_t off;
+};
+
+struct history_segment {
+    struct history_segment *next;   // the next newer segment
+    atomic_int refcnt;              // the history itself + every frame pointing into the segment
+    char path[PATH_MAX];
+    char *base;                     // the mapping
+    size_t size, used;
+    uint64_t first_seq, last_seq;   // the first and the last record of the segment
+    struct history_index *index;
+    int nindex, index_cap;
+    int nrecs;
+};
+
+struct history {
+    char dir[PATH_MAX];
+    struct history_segment *oldest, *newest;
+    int nsegments;
+    uint64_t next_seq;              // after the last message stored
+};
+
+int history_open(struct history *h, const char *root, const char *room);
+void history_close(struct history *h);
+const struct history_rec *history_append(struct history *h, uint64_t seq, int64_t stamp, const char *msg, size_t len,
+        struct history_segment **seg);
+int history_replay(struct history *h, uint64_t from_seq,
+        int (*fn)(struct history_segment *, const struct history_rec *, void *), void *arg);
+void history_segment_get(struct history_segment *seg);
+void history_segment_put(struct history_segment *seg);
+
+#endif
@@ -0,0 +1,152 @@
+#include "chat_match.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* a pattern ending in a state - those of the states down its fail links end there too */
+struct match_out {
+	int next;                   // the next output of the same state, -1: none
+	int len;
+	int flags;
+	int owner;
+};
+
+struct matcher {
+	int nclasses;
+	unsigned char cls[256];     // byte -> column of the table, 0: a byte no pattern has
+	int32_t *go;                // go[state * nclasses + class]: the next state, 0 is the root
+	int32_t *out;               // out[state]: the first output of the state, -1: none
+	int32_t *dict;              // dict[state]: the nearest state down the fail links with an output, 0: none
+	struct match_out *outs;
+};
+
+static inline unsigned char fold(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static inline int is_word(unsigned char c)
+{
+	return (c >= '0' && c <= '9') || (fold(c) >= 'a' && fold(c) <= 'z') || c == '_' || c >= 0x80;
+}
+
+/*
+ * Compile n patterns into one automaton
+ * Return value: the matcher, NULL if n is 0 or out of memory
+ */
+struct matcher *matcher_build(const struct match_pattern *p, int n)
+{
+	struct matcher *m;
+	int32_t *fail = NULL, *queue = NULL, *t;
+	size_t maxstates = 1, j;
+	int i, c, nc, s, u, nstates = 1, head = 0, tail = 0;
+
+	if (n == 0 || (m = (struct matcher *)calloc(1, sizeof(struct matcher))) == NULL)
+		return NULL;
+
+	/* one column per byte some pattern has, both cases of a letter share theirs */
+	m -> nclasses = 1;
+	for (i = 0; i < n; i++) {
+		maxstates += p[i].len;
+		for (j = 0; j < p[i].len; j++) {
+			c = fold(p[i].text[j]);
+			if (m -> cls[c] != 0)
+				continue;
+			m -> cls[c] = m -> nclasses++;
+			if (c >= 'a' && c <= 'z')
+				m -> cls[c - ('a' - 'A')] = m -> cls[c];
+		}
+	}
+	nc = m -> nclasses;
+
+	m -> go = (int32_t *)calloc(maxstates * nc, sizeof(int32_t));
+	m -> out = (int32_t *)malloc(maxstates * sizeof(int32_t));
+	m -> dict = (int32_t *)calloc(maxstates, sizeof(int32_t));
+	m -> outs = (struct match_out *)malloc(n * sizeof(struct match_out));
+	fail = (int32_t *)calloc(maxstates, sizeof(int32_t));
+	queue = (int32_t *)malloc(maxstates * sizeof(int32_t));
+	if (m -> go == NULL || m -> out == NULL || m -> dict == NULL || m -> outs == NULL || fail == NULL || queue == NULL) {
+		matcher_free(m);
+		m = NULL;
+		goto out;
+	}
+	memset(m -> out, -1, maxstates * sizeof(int32_t));
+
+	/* the trie of the patterns */
+	for (i = 0; i < n; i++) {
+		for (s = 0, j = 0; j < p[i].len; j++) {
+			t = &m -> go[s * nc + m -> cls[(unsigned char)p[i].text[j]]];
+			if (*t == 0)
+				*t = nstates++;
+			s = *t;
+		}
+		m -> outs[i].next = m -> out[s];
+		m -> outs[i].len = p[i].len;
+		m -> outs[i].flags = p[i].flags;
+		m -> outs[i].owner = p[i].owner;
+		m -> out[s] = i;
+	}
+
+	/* breadth first: the fail link of a state is complete before the states below it need it,
+	 * and a missing edge becomes the edge of the fail state - the trie turns into a DFA */
+	for (c = 0; c < nc; c++)
+		if ((s = m -> go[c]) != 0)
+			queue[tail++] = s;
+	while (head < tail) {
+		u = queue[head++];
+		m -> dict[u] = (m -> out[fail[u]] != -1) ? fail[u] : m -> dict[fail[u]];
+		for (c = 0; c < nc; c++) {
+			t = &m -> go[u * nc + c];
+			if (*t != 0) {
+				fail[*t] = m -> go[fail[u] * nc + c];
+				queue[tail++] = *t;
+			} else {
+				*t = m -> go[fail[u] * nc + c];
+			}
+		}
+	}
+
+out:
+	free(fail);
+	free(queue);
+	return m;
+}
+
+void matcher_free(struct matcher *m)
+{
+	if (m == NULL)
+		return;
+	free(m -> go);
+	free(m -> out);
+	free(m -> dict);
+	free(m -> outs);
+	free(m);
+}
+
+/*
+ * Scan a message once: masks[owner] |= bit for the owner of every pattern in it
+ */
+void matcher_scan(const struct matcher *m, const char *text, size_t len, uint64_t *masks, uint64_t bit)
+{
+	const unsigned char *s = (const unsigned char *)text;
+	const struct match_out *o;
+	size_t i, start;
+	int32_t state = 0, t, k;
+
+	for (i = 0; i < len; i++) {
+		state = m -> go[state * m -> nclasses + m -> cls[s[i]]];
+		for (t = (m -> out[state] != -1) ? state : m -> dict[state]; t != 0; t = m -> dict[t]) {
+			for (k = m -> out[t]; k != -1; k = o -> next) {
+				o = &m -> outs[k];
+				if (masks[o -> owner] & bit)
+					continue;
+				/* a word: a boundary in front, and one behind unless the word may go on */
+				start = i + 1 - o -> len;
+				if (start > 0 && is_word(s[start - 1]) && is_word(s[start]))
+					continue;
+				if (!(o -> flags & MATCH_PREFIX) && i + 1 < len && is_word(s[i]) && is_word(s[i + 1]))
+					continue;
+				masks[o -> owner] |= bit;
+			}
+		}
+	}
+}
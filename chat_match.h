@@ -0,0 +1,34 @@
+#ifndef _CHAT_MATCH_H_
+#define _CHAT_MATCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Multi-pattern matcher for the keyword subscriptions of a room - use by the server
+ *
+ * All patterns of all subscribers of a room are compiled into one Aho-Corasick automaton, a
+ * DFA: every byte of a message is one table lookup, however many patterns there are, and a
+ * message is scanned once for all of them. The bytes no pattern contains share one column of
+ * the table, so it stays small (# of states x # of distinct pattern bytes).
+ *
+ * Matching ignores the case of ASCII letters. A pattern matches as a word: it starts at a word
+ * boundary and, unless it is a MATCH_PREFIX pattern, ends at one. Letters, digits, '_' and
+ * all non-ASCII bytes make up words.
+ */
+#define MATCH_PREFIX 1              // the word may go on: "deploy" matches "deployment" too
+
+struct match_pattern {
+    const char *text;
+    size_t len;                     // > 0
+    int flags;                      // MATCH_PREFIX
+    int owner;                      // the index of the subscriber, into the masks of matcher_scan()
+};
+
+struct matcher;
+
+struct matcher *matcher_build(const struct match_pattern *p, int n);
+void matcher_free(struct matcher *m);
+void matcher_scan(const struct matcher *m, const char *text, size_t len, uint64_t *masks, uint64_t bit);
+
+#endif
@@ -0,0 +1,205 @@
+#include "chat_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define POOL_LARGE POOL_CLASSES     // the class of a block from malloc
+#define POOL_CACHE_MAX (2 * POOL_BATCH)
+
+/* in front of every block, keeps what follows aligned for any type */
+struct pool_hdr {
+	uint32_t cls;
+	uint32_t pad;
+	size_t size;                // POOL_LARGE only: the # of bytes asked for
+};
+
+/* a free block, linked through its first bytes - the header is written again when it is handed out */
+struct pool_free {
+	struct pool_free *next;
+};
+
+struct pool_list {
+	struct pool_free *head;
+	int count;
+};
+
+struct pool_depot {
+	pthread_mutex_t lock;
+	struct pool_list free;
+};
+
+static struct pool_depot depots[POOL_CLASSES] = {
+	[0 ... POOL_CLASSES - 1] = { PTHREAD_MUTEX_INITIALIZER, { NULL, 0 } }
+};
+static atomic_size_t slab_bytes, large_bytes;
+
+static __thread struct pool_list cache[POOL_CLASSES];
+static __thread int cache_registered;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static inline size_t block_size(int cls)
+{
+	return sizeof(struct pool_hdr) + ((size_t)POOL_MIN_SIZE << cls);
+}
+
+static inline int size_class(size_t size)
+{
+	if (size <= POOL_MIN_SIZE)
+		return 0;
+	return 64 - __builtin_clzll(size - 1) - POOL_MIN_SHIFT;
+}
+
+/* move up to n blocks from the head of one list to another */
+static void list_move(struct pool_list *to, struct pool_list *from, int n)
+{
+	struct pool_free *b;
+
+	while (n-- > 0 && (b = from -> head) != NULL) {
+		from -> head = b -> next;
+		from -> count--;
+		b -> next = to -> head;
+		to -> head = b;
+		to -> count++;
+	}
+}
+
+/* a thread going away hands its cache back, its blocks are not lost to the others */
+static void cache_flush(void *arg)
+{
+	struct pool_list *c = arg;
+	int i;
+
+	for (i = 0; i < POOL_CLASSES; i++) {
+		pthread_mutex_lock(&depots[i].lock);
+		list_move(&depots[i].free, &c[i], c[i].count);
+		pthread_mutex_unlock(&depots[i].lock);
+	}
+}
+
+static void cache_key_init(void)
+{
+	pthread_key_create(&cache_key, cache_flush);
+}
+
+/* the first use of the cache by a thread: have it flushed when the thread exits */
+static void cache_register(void)
+{
+	pthread_once(&cache_once, cache_key_init);
+	pthread_setspecific(cache_key, cache);
+	cache_registered = 1;
+}
+
+/* fill the cache of the class from the depot, or from a new slab */
+static void cache_refill(int cls)
+{
+	struct pool_depot *d = &depots[cls];
+	size_t size = block_size(cls), n;
+	char *slab;
+
+	if (!cache_registered)
+		cache_register();
+	pthread_mutex_lock(&d -> lock);
+	list_move(&cache[cls], &d -> free, POOL_BATCH);
+	pthread_mutex_unlock(&d -> lock);
+	if (cache[cls].head != NULL)
+		return;
+
+	/* slabs are never given back: what was needed once is likely needed again */
+	n = POOL_SLAB_SIZE / size;
+	if ((slab = (char *)malloc(n * size)) == NULL)
+		return;
+	atomic_fetch_add_explicit(&slab_bytes, n * size, memory_order_relaxed);
+	while (n-- > 0) {
+		struct pool_free *b = (struct pool_free *)(slab + n * size);
+
+		b -> next = cache[cls].head;
+		cache[cls].head = b;
+		cache[cls].count++;
+	}
+}
+
+/*
+ * Allocate size bytes, like malloc()
+ * Return value: the block, NULL if out of memory
+ */
+void *pool_alloc(size_t size)
+{
+	struct pool_hdr *h;
+	struct pool_free *b;
+	int cls;
+
+	if (size > POOL_MAX_SIZE) {
+		if ((h = (struct pool_hdr *)malloc(sizeof(struct pool_hdr) + size)) == NULL)
+			return NULL;
+		h -> cls = POOL_LARGE;
+		h -> size = size;
+		atomic_fetch_add_explicit(&large_bytes, size, memory_order_relaxed);
+		return h + 1;
+	}
+
+	cls = size_class(size);
+	if (cache[cls].head == NULL) {
+		cache_refill(cls);
+		if (cache[cls].head == NULL)
+			return NULL;
+	}
+	b = cache[cls].head;
+	cache[cls].head = b -> next;
+	cache[cls].count--;
+	h = (struct pool_hdr *)b;
+	h -> cls = cls;
+	return h + 1;
+}
+
+void *pool_calloc(size_t size)
+{
+	void *p = pool_alloc(size);
+
+	if (p != NULL)
+		memset(p, 0, size);
+	return p;
+}
+
+/*
+ * Give back a block of pool_alloc(), NULL is fine
+ */
+void pool_free(void *p)
+{
+	struct pool_hdr *h;
+	struct pool_free *b;
+	int cls;
+
+	if (p == NULL)
+		return;
+	h = (struct pool_hdr *)p - 1;
+	cls = h -> cls;
+	if (cls == POOL_LARGE) {
+		atomic_fetch_sub_explicit(&large_bytes, h -> size, memory_order_relaxed);
+		free(h);
+		return;
+	}
+
+	if (!cache_registered)
+		cache_register();
+	b = (struct pool_free *)h;
+	b -> next = cache[cls].head;
+	cache[cls].head = b;
+	/* a thread freeing more than it allocates (a broadcaster, say) passes the surplus on */
+	if (++cache[cls].count > POOL_CACHE_MAX) {
+		pthread_mutex_lock(&depots[cls].lock);
+		list_move(&depots[cls].free, &cache[cls], POOL_BATCH);
+		pthread_mutex_unlock(&depots[cls].lock);
+	}
+}
+
+/*
+ * The memory held: by the slabs, whether in use or not, and by the large blocks in use
+ */
+void pool_usage(size_t *slabs, size_t *large)
+{
+	*slabs = atomic_load_explicit(&slab_bytes, memory_order_relaxed);
+	*large = atomic_load_explicit(&large_bytes, memory_order_relaxed);
+}
@@ -0,0 +1,32 @@
+#ifndef _CHAT_POOL_H_
+#define _CHAT_POOL_H_
+
+#include <stddef.h>
+
+/*
+ * Pooled allocator for the objects the server makes and frees per message and per session:
+ * frames, outbound queue entries, chat messages, client sessions
+ *
+ * Blocks come in POOL_CLASSES size classes, POOL_MIN_SIZE bytes and doubling. A class is
+ * carved out of slabs of POOL_SLAB_SIZE bytes, and freed blocks go back to their class - never
+ * to malloc - so the server's footprint stays at its high water mark instead of growing with
+ * fragmentation while clients come and go.
+ *
+ * Every thread keeps a cache of free blocks per class and serves itself without a lock; it
+ * trades POOL_BATCH blocks at a time with the depot of the class, which is shared and locked.
+ * A block freed by another thread than the one allocating it simply joins that thread's cache.
+ * Requests above POOL_MAX_SIZE go to malloc.
+ */
+#define POOL_MIN_SHIFT 5
+#define POOL_MIN_SIZE (1 << POOL_MIN_SHIFT)                         // 32 bytes
+#define POOL_CLASSES 10
+#define POOL_MAX_SIZE (POOL_MIN_SIZE << (POOL_CLASSES - 1))         // 16K
+#define POOL_SLAB_SIZE (64 * 1024)
+#define POOL_BATCH 32               // # of blocks moved between a thread cache and the depot at a time
+
+void *pool_alloc(size_t size);
+void *pool_calloc(size_t size);
+void pool_free(void *p);
+void pool_usage(size_t *slab_bytes, size_t *large_bytes);
+
+#endif
@@ -0,0 +1,300 @@
+#include "chat_proto.h"
+#include <string.h>
+#include <stddef.h>
+
+#define DECODER_MIN_ROOM 256    // receive at least this many bytes at once
+
+/*
+ * Encode an unsigned integer as varint
+ * Return value: the # of bytes written (at most VARINT_MAX)
+ */
+int varint_put(char *out, uint64_t v)
+{
+	int n = 0;
+
+	while (v >= 0x80) {
+		out[n++] = (char)(v | 0x80);
+		v >>= 7;
+	}
+	out[n++] = (char)v;
+	return n;
+}
+
+/*
+ * Decode a varint
+ * Return value: >0 - the # of bytes consumed;
+ *                0 - incomplete, more bytes are needed;
+ *               -1 - malformed (longer than VARINT_MAX bytes);
+ */
+int varint_get(const char *p, size_t len, uint64_t *v)
+{
+	uint64_t result = 0;
+	size_t i;
+
+	for (i = 0; i < len && i < VARINT_MAX; i++) {
+		result |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+		if ((p[i] & 0x80) == 0) {
+			*v = result;
+			return i + 1;
+		}
+	}
+	return (i == VARINT_MAX) ? -1 : 0;
+}
+
+/*
+ * The # of bytes a message with a payload of len bytes takes on the wire
+ */
+size_t proto_frame_size(int version, size_t len)
+{
+	if (version == PROTO_V1)
+		return sizeof(struct exchg_msg);
+	return 2 + (len < 0x80 ? 1 : len < 0x4000 ? 2 : len < 0x200000 ? 3 : len < 0x10000000 ? 4 : 5) + len;
+}
+
+/*
+ * Encode one message into out, which has room for proto_frame_size() bytes
+ * payload == NULL: v2 sends private_data as varint payload (if not negative), v1 puts it in private_data
+ * A v1 message carries at most CONTENT_LENGTH-1 bytes, longer payloads are truncated.
+ * Return value: the # of bytes written
+ */
+size_t proto_encode(char *out, int version, int command, int private_data, const char *payload, size_t len)
+{
+	char num[5];
+	size_t n = 0;
+
+	if (version == PROTO_V1) {
+		struct exchg_msg *mbuf = (struct exchg_msg *)out;
+		int msg_len;
+
+		memset(mbuf, 0, sizeof(struct exchg_msg));
+		mbuf -> instruction = htonl(command);
+		if (payload != NULL) {
+			msg_len = len + 1;
+			msg_len = (msg_len < CONTENT_LENGTH) ? msg_len : CONTENT_LENGTH;
+			memcpy(mbuf -> content, payload, msg_len - 1);
+			mbuf -> private_data = htonl(msg_len);
+		}
+		else mbuf -> private_data = htonl(private_data);
+		return sizeof(struct exchg_msg);
+	}
+
+	if (payload == NULL) {
+		len = (private_data >= 0) ? varint_put(num, private_data) : 0;
+		payload = num;
+	}
+	out[n++] = (char)PROTO_V2_MAGIC;
+	out[n++] = (char)command;
+	n += varint_put(out + n, len);
+	memcpy(out + n, payload, len);
+	return n + len;
+}
+
+/*
+ * The # of bytes a CMD_SERVER_BROADCAST with a message of len bytes takes on the wire, at most
+ */
+size_t proto_broadcast_size(int version, size_t len)
+{
+	return proto_frame_size(version, len + VARINT_MAX);
+}
+
+/*
+ * Encode a CMD_SERVER_BROADCAST into out, which has room for proto_broadcast_size() bytes
+ * v2 puts the sequence number in front of the message, v1 has no room for it.
+ * Return value: the # of bytes written
+ */
+size_t proto_encode_broadcast(char *out, int version, uint64_t seq, const char *msg, size_t len)
+{
+	size_t n;
+
+	if (version == PROTO_V1)
+		return proto_encode(out, version, CMD_SERVER_BROADCAST, -1, msg, len);
+
+	n = proto_broadcast_header(out, seq, len);
+	memcpy(out + n, msg, len);
+	return n + len;
+}
+
+/*
+ * Encode the v2 header of a CMD_SERVER_BROADCAST of len bytes into out, at most
+ * PROTO_BROADCAST_HEADROOM bytes; the message is to follow right behind.
+ * Return value: the # of bytes written
+ */
+size_t proto_broadcast_header(char *out, uint64_t seq, size_t len)
+{
+	char num[VARINT_MAX];
+	size_t n = 0;
+	int k;
+
+	k = varint_put(num, seq);
+	out[n++] = (char)PROTO_V2_MAGIC;
+	out[n++] = (char)CMD_SERVER_BROADCAST;
+	n += varint_put(out + n, k + len);
+	memcpy(out + n, num, k);
+	return n + k;
+}
+
+/*
+ * The # of bytes a CMD_PEER_RELAY of a message of len bytes takes on the wire, at most
+ * The same for CMD_CLIENT_WHISPER, with the name of the recipient instead of the room's.
+ */
+size_t proto_relay_size(size_t room_len, size_t len)
+{
+	return proto_frame_size(PROTO_V2, VARINT_MAX + room_len + len);
+}
+
+/*
+ * Encode a CMD_PEER_RELAY into out, which has room for proto_relay_size() bytes
+ * command may be CMD_PEER_NOTICE, or CMD_CLIENT_WHISPER with the recipient's name for room.
+ * Return value: the # of bytes written
+ */
+size_t proto_encode_relay(char *out, int command, const char *room, const char *msg, size_t len)
+{
+	char num[VARINT_MAX];
+	size_t n = 0, room_len = strlen(room);
+	int k;
+
+	k = varint_put(num, room_len);
+	out[n++] = (char)PROTO_V2_MAGIC;
+	out[n++] = (char)command;
+	n += varint_put(out + n, k + room_len + len);
+	memcpy(out + n, num, k);
+	n += k;
+	memcpy(out + n, room, room_len);
+	n += room_len;
+	memcpy(out + n, msg, len);
+	return n + len;
+}
+
+void decoder_init(struct frame_decoder *d, int version, size_t max_payload)
+{
+	memset(d, 0, sizeof(struct frame_decoder));
+	d -> version = version;
+	d -> max_payload = max_payload;
+}
+
+void decoder_free(struct frame_decoder *d)
+{
+	free(d -> buf);
+	d -> buf = NULL;
+	d -> start = d -> end = d -> cap = 0;
+}
+
+/*
+ * Get room to receive more bytes into, at the end of what is buffered
+ * The buffer grows up to the largest frame allowed, so a frame always fits.
+ */
+char *decoder_space(struct frame_decoder *d, size_t *room)
+{
+	size_t max_frame = PROTO_V2_HEADER_MAX + d -> max_payload;
+
+	if (max_frame < sizeof(struct exchg_msg))
+		max_frame = sizeof(struct exchg_msg);
+
+	/* move the partial frame to the front */
+	if (d -> start > 0 && (d -> start == d -> end || d -> cap - d -> end < DECODER_MIN_ROOM)) {
+		memmove(d -> buf, d -> buf + d -> start, d -> end - d -> start);
+		d -> end -= d -> start;
+		d -> start = 0;
+	}
+	if (d -> cap - d -> end < DECODER_MIN_ROOM && d -> cap < max_frame) {
+		size_t cap = (d -> cap == 0) ? DECODER_MIN_ROOM : d -> cap * 2;
+		if (cap > max_frame)
+			cap = max_frame;
+		d -> buf = (char *)realloc(d -> buf, cap);
+		d -> cap = cap;
+	}
+	*room = d -> cap - d -> end;
+	return d -> buf + d -> end;
+}
+
+/*
+ * n bytes were received into the room given by decoder_space()
+ */
+void decoder_commit(struct frame_decoder *d, size_t n)
+{
+	d -> end += n;
+}
+
+/*
+ * Take up to max of the bytes received beyond the last frame out of the decoder as they are:
+ * a raw stream which follows a frame, like the file after CMD_CLIENT_FILE_PUT
+ * Return value: the # of bytes at *p, valid until the next decoder call
+ */
+size_t decoder_take(struct frame_decoder *d, size_t max, const char **p)
+{
+	size_t n = d -> end - d -> start;
+
+	if (n > max)
+		n = max;
+	*p = d -> buf + d -> start;
+	d -> start += n;
+	return n;
+}
+
+/*
+ * Take the next complete frame out of the decoder
+ * Return value:  1 - a frame is decoded into f;
+ *                0 - no complete frame yet;
+ *               -1 - protocol error, the stream cannot be decoded any more;
+ */
+int decoder_next(struct frame_decoder *d, struct chat_frame *f)
+{
+	const char *p = d -> buf + d -> start;
+	size_t avail = d -> end - d -> start;
+	uint64_t len, v;
+	int n, k;
+
+	if (avail == 0)
+		return 0;
+	if (d -> version == 0)
+		d -> version = ((unsigned char)p[0] == PROTO_V2_MAGIC) ? PROTO_V2 : PROTO_V1;
+	f -> version = d -> version;
+	f -> seq = 0;
+	f -> token = 0;
+
+	if (d -> version == PROTO_V1) {
+		struct exchg_msg mbuf;
+
+		if (avail < sizeof(struct exchg_msg))
+			return 0;
+		memcpy(&mbuf, p, sizeof(struct exchg_msg));
+		f -> command = ntohl(mbuf.instruction);
+		f -> private_data = ntohl(mbuf.private_data);
+		f -> payload = p + offsetof(struct exchg_msg, content);
+		f -> len = strnlen(f -> payload, CONTENT_LENGTH);
+		d -> start += sizeof(struct exchg_msg);
+		return 1;
+	}
+
+	if ((unsigned char)p[0] != PROTO_V2_MAGIC)
+		return -1;
+	if (avail < 3)
+		return 0;
+	n = varint_get(p + 2, avail - 2, &len);
+	if (n == 0)
+		return 0;
+	if (n < 0 || len > d -> max_payload)
+		return -1;
+	if (avail < 2 + n + len)
+		return 0;
+
+	f -> command = (unsigned char)p[1];
+	f -> private_data = -1;
+	f -> payload = p + 2 + n;
+	f -> len = len;
+	if ((f -> command == CMD_SERVER_FAIL || f -> command == CMD_SERVER_JOIN_OK || f -> command == CMD_SERVER_RING_OK) && len > 0) {
+		if ((k = varint_get(f -> payload, len, &v)) <= 0)
+			return -1;
+		f -> private_data = v;
+		if (f -> command == CMD_SERVER_JOIN_OK && k < len && varint_get(f -> payload + k, len - k, &f -> token) <= 0)
+			return -1;
+	}
+	if (f -> command == CMD_SERVER_BROADCAST) {
+		if ((k = varint_get(f -> payload, len, &f -> seq)) <= 0)
+			return -1;
+		f -> payload += k;
+		f -> len -= k;
+	}
+	d -> start += 2 + n + len;
+	return 1;
+}
@@ -0,0 +1,114 @@
+#ifndef _CHAT_PROTO_H_
+#define _CHAT_PROTO_H_
+
+#include "chat.h"
+#include <stdint.h>
+
+/*
+ * Wire protocol versions - use by both client and server
+ *
+ * v1 (legacy): every message is a fixed size struct exchg_msg in network byte order
+ *
+ * v2: variable size frames
+ *   +-------+---------+-------------------+---------------------+
+ *   | magic | command | payload length    | payload             |
+ *   | 0xC2  | 1 byte  | varint, 1-5 bytes | 0 .. max_payload    |
+ *   +-------+---------+-------------------+---------------------+
+ *   varint: 7 bits per byte, least significant group first, the high bit tells that another byte follows
+ *   payload: CMD_CLIENT_JOIN - the username
+ *            CMD_CLIENT_SEND - the chat message, not terminated by '\0'
+ *            CMD_SERVER_BROADCAST - varint, the sequence number of the message in its room (0: none),
+ *                                   then the chat message
+ *            CMD_SERVER_JOIN_OK - varint, the largest payload the server accepts, then varint, the
+ *                                 session token
+ *            CMD_SERVER_FAIL - varint, the error code
+ *            CMD_CLIENT_RESUME - varint, the session token; varint, the last sequence number seen;
+ *                                varint, the length of the username; the username; the room name
+ *            CMD_CLIENT_RING_ATTACH - varint, the size of the ring wanted (0: the default)
+ *            CMD_SERVER_RING_OK - varint, the size of the ring, see chat_ring.h
+ *            CMD_PEER_HELLO - varint, the node id of the server
+ *            CMD_PEER_ROOM - the room name
+ *            CMD_PEER_RELAY - varint, the length of the room name; the room name; the chat message
+ *            CMD_PEER_NOTICE - the same as CMD_PEER_RELAY
+ *            CMD_PEER_CLAIM - varint, the claim id; the username
+ *            CMD_PEER_CLAIM_REPLY - varint, the claim id; varint, 1 - granted, 0 - denied
+ *            CMD_PEER_RELEASE - varint, the claim id
+ *            CMD_SERVER_PING/CMD_CLIENT_PONG - none; peer servers ping each other the same way
+ *            CMD_CLIENT_WHISPER - varint, the length of the recipient's name; the name; the chat message
+ *            CMD_SERVER_WHISPER - the chat message, "<sender>: <message>"
+ *            CMD_PEER_WHISPER - varint, the whisper id; varint, the length of the recipient's name; the name;
+ *                               "<sender>: <message>"
+ *            CMD_PEER_WHISPER_REPLY - varint, the whisper id; varint, 1 - delivered, 0 - no such client
+ *            CMD_CLIENT_SUBSCRIBE/CMD_CLIENT_UNSUBSCRIBE/CMD_SERVER_SUB_OK - the keyword
+ *            CMD_SERVER_ROSTER - varint, the # of names; each name: varint, its length; the name
+ *            CMD_SERVER_PRESENCE - the names joined, then the names left, both the same as CMD_SERVER_ROSTER
+ *            CMD_CLIENT_FILE_OFFER - varint, the size of the file; the file name
+ *            CMD_SERVER_FILE_OK - varint, the file id; varint, the size; on the chat connection, the file name
+ *            CMD_CLIENT_DATA_OPEN - varint, the session token of the chat connection; the username
+ *            CMD_CLIENT_FILE_PUT - varint, the file id; the frame is followed by the file, size bytes
+ *            CMD_CLIENT_FILE_GET - varint, the file id; varint, the offset; varint, the # of bytes (at most
+ *                                  FILE_GET_MAX, 0: that many)
+ *            CMD_SERVER_FILE_DATA - the bytes of the file, fewer than asked for at its end
+ *
+ * The server tells the versions apart by the first byte a client sends: a v1 message starts with the
+ * high byte of the instruction (0), a v2 frame with the magic byte. A connection keeps its version.
+ */
+#define PROTO_V1 1
+#define PROTO_V2 2
+#define PROTO_V2_MAGIC 0xC2
+#define PROTO_V2_HEADER_MAX 7               // magic + command + the longest varint
+#define DEFAULT_MAX_PAYLOAD 4096            // the default limit of a v2 payload
+#define FILE_NAME_MAX 256                   // the longest name of a file shared, see chat_spool.h
+#define FILE_GET_MAX (1 << 20)              // the largest piece of a file one CMD_CLIENT_FILE_GET gets
+
+/*
+ * One decoded message, whatever the version
+ */
+struct chat_frame {
+    int version;
+    int command;
+    int private_data;       // CMD_SERVER_FAIL: the error code, CMD_SERVER_JOIN_OK (v2): the server's max. payload
+                            // v1 CMD_CLIENT_WHISPER: the length of the recipient's name, the message follows it
+                            // CMD_SERVER_RING_OK: the size of the ring
+                            // v1 only: CMD_CLIENT_SEND/CMD_SERVER_BROADCAST - the length of the message
+    uint64_t seq;           // v2 CMD_SERVER_BROADCAST: the sequence number in the room, 0 if none
+    uint64_t token;         // v2 CMD_SERVER_JOIN_OK: the session token, to resume the session after a disconnect
+    const char *payload;    // points into the decoder buffer, valid until the next decoder call
+    size_t len;
+};
+
+/*
+ * Incremental decoder: bytes are received into the decoder as they come, complete
+ * frames are taken out one by one, whatever the segmentation on the wire
+ */
+struct frame_decoder {
+    char *buf;
+    size_t start;           // the first byte not decoded yet
+    size_t end;             // the end of the received bytes
+    size_t cap;
+    size_t max_payload;     // a v2 frame announcing a longer payload is a protocol error
+    int version;            // 0 until the first byte tells, then PROTO_V1 or PROTO_V2
+};
+
+#define VARINT_MAX 10        // the longest varint, for 64 bits
+#define PROTO_BROADCAST_HEADROOM (2 + 2 * VARINT_MAX)  // the longest v2 header of a CMD_SERVER_BROADCAST
+
+int varint_put(char *out, uint64_t v);
+int varint_get(const char *p, size_t len, uint64_t *v);
+
+size_t proto_frame_size(int version, size_t len);
+size_t proto_encode(char *out, int version, int command, int private_data, const char *payload, size_t len);
+size_t proto_broadcast_size(int version, size_t len);
+size_t proto_encode_broadcast(char *out, int version, uint64_t seq, const char *msg, size_t len);
+size_t proto_broadcast_header(char *out, uint64_t seq, size_t len);
+size_t proto_relay_size(size_t room_len, size_t len);
+size_t proto_encode_relay(char *out, int command, const char *room, const char *msg, size_t len);
+
+void decoder_init(struct frame_decoder *d, int version, size_t max_payload);
+void decoder_free(struct frame_decoder *d);
+char *decoder_space(struct frame_decoder *d, size_t *room);
+void decoder_commit(struct frame_decoder *d, size_t n);
+size_t decoder_take(struct frame_decoder *d, size_t max, const char **p);
+int decoder_next(struct frame_decoder *d, struct chat_frame *f);
+
+#endif
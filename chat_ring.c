@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include "chat_ring.h"
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+/*
+ * Create a ring of (at least) size bytes, the producer's side
+ * Return value:  0 - success;
+ *               -1 - error, see errno;
+ */
+int ring_create(struct ring *r, size_t size)
+{
+	size_t n = RING_MIN_SIZE;
+
+	while (n < size && n < RING_MAX_SIZE)
+		n <<= 1;
+	memset(r, 0, sizeof(struct ring));
+	r -> memfd = r -> efd = -1;
+	r -> size = n;
+	r -> map_size = RING_HDR_SIZE + n;
+
+	if ((r -> memfd = memfd_create("chat-ring", MFD_CLOEXEC)) == -1)
+		return -1;
+	if (ftruncate(r -> memfd, r -> map_size) == -1)
+		goto fail;
+	r -> hdr = mmap(NULL, r -> map_size, PROT_READ | PROT_WRITE, MAP_SHARED, r -> memfd, 0);
+	if (r -> hdr == MAP_FAILED) {
+		r -> hdr = NULL;
+		goto fail;
+	}
+	r -> data = (char *)r -> hdr + RING_HDR_SIZE;
+	r -> hdr -> magic = RING_MAGIC;
+	r -> hdr -> size = n;
+	if ((r -> efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+		goto fail;
+	return 0;
+
+fail:
+	ring_close(r);
+	return -1;
+}
+
+/*
+ * Map a ring passed on by the producer, the consumer's side: the data follows twice
+ * The ring takes over both descriptors, also when it fails.
+ * Return value:  0 - success;
+ *               -1 - error, see errno;
+ */
+int ring_map(struct ring *r, int memfd, int efd)
+{
+	struct ring_hdr *hdr;
+	struct stat st;
+	char *base;
+	size_t size;
+	uint32_t magic;
+
+	memset(r, 0, sizeof(struct ring));
+	r -> memfd = memfd;
+	r -> efd = efd;
+
+	/* look at the header first, nothing in it is trusted before it is checked */
+	hdr = mmap(NULL, RING_HDR_SIZE, PROT_READ, MAP_SHARED, memfd, 0);
+	if (hdr == MAP_FAILED)
+		goto fail;
+	magic = hdr -> magic;
+	size = hdr -> size;
+	munmap(hdr, RING_HDR_SIZE);
+	if (magic != RING_MAGIC || size < RING_MIN_SIZE || size > RING_MAX_SIZE || (size & (size - 1)) != 0 ||
+			fstat(memfd, &st) == -1 || (size_t)st.st_size < RING_HDR_SIZE + size) {
+		errno = EPROTO;
+		goto fail;
+	}
+
+	/* reserve the whole range, then put the file over it: the header and data, then the data again */
+	r -> map_size = RING_HDR_SIZE + 2 * size;
+	base = mmap(NULL, r -> map_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		goto fail;
+	if (mmap(base, RING_HDR_SIZE + size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memfd, 0) == MAP_FAILED ||
+			mmap(base + RING_HDR_SIZE + size, size, PROT_READ, MAP_SHARED | MAP_FIXED, memfd, RING_HDR_SIZE) == MAP_FAILED) {
+		munmap(base, r -> map_size);
+		goto fail;
+	}
+	r -> hdr = (struct ring_hdr *)base;
+	r -> data = base + RING_HDR_SIZE;
+	r -> size = size;
+
+	/* the mapping keeps the memory, the descriptor is of no more use */
+	close(memfd);
+	r -> memfd = -1;
+	return 0;
+
+fail:
+	r -> hdr = NULL;
+	ring_close(r);
+	return -1;
+}
+
+void ring_close(struct ring *r)
+{
+	if (r -> hdr != NULL)
+		munmap(r -> hdr, r -> map_size);
+	if (r -> memfd != -1)
+		close(r -> memfd);
+	if (r -> efd != -1)
+		close(r -> efd);
+	r -> hdr = NULL;
+	r -> memfd = r -> efd = -1;
+}
+
+/*
+ * Copy as much of the iovecs into the ring as fits, and wake up the consumer if it sleeps
+ * Return value: the # of bytes written, 0 if the ring is full - then the consumer sends
+ *               CMD_CLIENT_RING_ACK when it has made room
+ */
+size_t ring_writev(struct ring *r, const struct iovec *iov, int cnt)
+{
+	struct ring_hdr *hdr = r -> hdr;
+	uint64_t tail = atomic_load_explicit(&hdr -> tail, memory_order_relaxed);
+	uint64_t head = atomic_load_explicit(&hdr -> head, memory_order_acquire);
+	size_t room = r -> size - (tail - head), written = 0, n, off, first;
+	int i;
+
+	if (tail - head > r -> size)
+		return 0;       // the consumer broke the ring, it only stalls itself
+	if (room == 0) {
+		/* announce the wait, then look once more: the consumer may have read in between */
+		atomic_store_explicit(&hdr -> producer_waiting, 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		head = atomic_load_explicit(&hdr -> head, memory_order_acquire);
+		if ((room = r -> size - (tail - head)) == 0)
+			return 0;
+		atomic_store_explicit(&hdr -> producer_waiting, 0, memory_order_relaxed);
+	}
+
+	for (i = 0; i < cnt && room > 0; i++) {
+		n = (iov[i].iov_len < room) ? iov[i].iov_len : room;
+		off = (tail + written) & (r -> size - 1);
+		first = (n < r -> size - off) ? n : r -> size - off;
+		memcpy(r -> data + off, iov[i].iov_base, first);
+		memcpy(r -> data, (char *)iov[i].iov_base + first, n - first);
+		written += n;
+		room -= n;
+	}
+	atomic_store_explicit(&hdr -> tail, tail + written, memory_order_release);
+
+	/* the store of tail and the load of consumer_waiting must not be reordered */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&hdr -> consumer_waiting, memory_order_relaxed) &&
+			atomic_exchange(&hdr -> consumer_waiting, 0)) {
+		uint64_t one = 1;
+
+		/* EAGAIN: the counter is full, the consumer is awake for sure */
+		while (write(r -> efd, &one, sizeof(one)) == -1 && errno == EINTR)
+			;
+	}
+	return written;
+}
+
+/*
+ * Where the unread bytes start, in one piece however the ring wraps - the consumer
+ * Return value: the # of bytes ready to read
+ */
+size_t ring_peek(struct ring *r, const char **p)
+{
+	uint64_t head = atomic_load_explicit(&r -> hdr -> head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&r -> hdr -> tail, memory_order_acquire);
+
+	if (tail - head > r -> size)
+		return 0;       // the producer broke the ring
+	*p = r -> data + (head & (r -> size - 1));
+	return tail - head;
+}
+
+/*
+ * n bytes are read, the producer may have them back
+ * Return value: 1 - the producer waits for room, send CMD_CLIENT_RING_ACK; 0 - no need
+ */
+int ring_consume(struct ring *r, size_t n)
+{
+	struct ring_hdr *hdr = r -> hdr;
+
+	if (n == 0)
+		return 0;
+	atomic_store_explicit(&hdr -> head, atomic_load_explicit(&hdr -> head, memory_order_relaxed) + n,
+			memory_order_release);
+	atomic_thread_fence(memory_order_seq_cst);
+	return atomic_load_explicit(&hdr -> producer_waiting, memory_order_relaxed) &&
+			atomic_exchange(&hdr -> producer_waiting, 0);
+}
+
+/*
+ * The consumer found the ring empty and is about to wait for the eventfd
+ * Return value: 1 - go ahead and wait; 0 - something came in meanwhile, read it
+ */
+int ring_sleep(struct ring *r)
+{
+	struct ring_hdr *hdr = r -> hdr;
+
+	atomic_store_explicit(&hdr -> consumer_waiting, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&hdr -> tail, memory_order_relaxed) != atomic_load_explicit(&hdr -> head, memory_order_relaxed)) {
+		atomic_store_explicit(&hdr -> consumer_waiting, 0, memory_order_relaxed);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * The eventfd fired, reset it
+ */
+void ring_woken(struct ring *r)
+{
+	uint64_t v;
+
+	while (read(r -> efd, &v, sizeof(v)) == -1 && errno == EINTR)
+		;
+}
@@ -0,0 +1,67 @@
+#ifndef _CHAT_RING_H_
+#define _CHAT_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+/*
+ * Shared memory transport for clients on the same host - use by both client and server
+ *
+ * A client connected over the Unix socket may ask for CMD_CLIENT_RING_ATTACH. The server then
+ * creates a ring in a memfd and passes it, with an eventfd, along with CMD_SERVER_RING_OK
+ * (SCM_RIGHTS). From that message on, everything the server has for the client goes into the
+ * ring instead of the socket: the same v2 frames as on the wire, as a stream of bytes. The
+ * client still sends its own messages over the socket.
+ *
+ *   +--------------------------+----------------------------------------+
+ *   | struct ring_hdr          | data: size bytes, a power of 2         |
+ *   | RING_HDR_SIZE bytes      |                                        |
+ *   +--------------------------+----------------------------------------+
+ *
+ * The server (the producer) owns tail, the client (the consumer) owns head; head <= tail, both
+ * only grow. Nobody takes a lock, and nobody makes a system call while the other side keeps up:
+ * - the producer writes the eventfd only when the consumer said it is going to sleep
+ * - when the ring is full, the producer says it waits, and the consumer answers with
+ *   CMD_CLIENT_RING_ACK on the socket once it has made room.
+ * The consumer maps the data twice in a row, so any frame reads as one piece in place.
+ */
+#define RING_MAGIC 0x31524843           // "CHR1"
+#define RING_HDR_SIZE 4096
+#define DEFAULT_RING_SIZE (1 << 20)
+#define RING_MIN_SIZE (64 * 1024)
+#define RING_MAX_SIZE (64 << 20)
+
+struct ring_hdr {
+    uint32_t magic;
+    uint32_t pad;
+    uint64_t size;                                          // the # of data bytes
+
+    _Atomic uint64_t head __attribute__((aligned(64)));    // the next byte to read - update by the consumer
+    atomic_int consumer_waiting;                            // the consumer sleeps on the eventfd
+
+    _Atomic uint64_t tail __attribute__((aligned(64)));    // the next byte to write - update by the producer
+    atomic_int producer_waiting;                            // the producer waits for CMD_CLIENT_RING_ACK
+};
+
+struct ring {
+    struct ring_hdr *hdr;
+    char *data;
+    size_t size, map_size;
+    int memfd;                  // the server closes it once passed on
+    int efd;                    // the eventfd waking up the consumer
+};
+
+int ring_create(struct ring *r, size_t size);
+int ring_map(struct ring *r, int memfd, int efd);
+void ring_close(struct ring *r);
+
+size_t ring_writev(struct ring *r, const struct iovec *iov, int cnt);
+
+size_t ring_peek(struct ring *r, const char **p);
+int ring_consume(struct ring *r, size_t n);
+int ring_sleep(struct ring *r);
+void ring_woken(struct ring *r);
+
+#endif
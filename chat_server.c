@@ -1,17 +1,63 @@
 #include "chat.h"
 #include "chat_server.h"
+#include "chat_pool.h"
 #include <string.h>
 #include <signal.h>
 #include <assert.h> 
 #include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <linux/errqueue.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/random.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+#include <stdarg.h>
 
 static char banner[] =
 "\n\n\
 /*****************************************************************/\n\
 /*    Client/Server Application - Mutli-thread Chat Server       */\n\
 /*                                                               */\n\
-/*    USAGE:  ./chat_server    [port]                            */\n\
+/*    USAGE:  ./chat_server    [options] [port]                  */\n\
+/*            -t: # of event loop threads (default: # of cores)  */\n\
+/*            -p: slow client policy, drop|coalesce|disconnect   */\n\
+/*            -B: max. bytes queued for one client (64K)         */\n\
+/*            -T: max. lag of one client in ms (5000)            */\n\
+/*            -q: size of the message buffer of the room (1024)  */\n\
+/*            -m: max. message size of protocol v2 (4096)        */\n\
+/*            -r: max. # of chat rooms (1024)                    */\n\
+/*            -c: max. # of clients in one room (65536)          */\n\
+/*            -a: # of acceptor threads, >1 uses SO_REUSEPORT    */\n\
+/*            -H: max. time in ms for a new client to join (5000)*/\n\
+/*            -A: path of the admin Unix socket (none)           */\n\
+/*            -D: directory of the message history (none)        */\n\
+/*            -R: # of messages replayed on entering a room (20) */\n\
+/*            -K: # of messages kept for resuming clients (1024) */\n\
+/*            -b: max. bytes a room broadcasts as one batch (32K)*/\n\
+/*            -w: max. time in us a batch waits to fill (0)      */\n\
+/*            -f: # of fan-out workers for large rooms (0)       */\n\
+/*            -Z: min. bytes of a MSG_ZEROCOPY write (0 = off)   */\n\
+/*            -U: path of a Unix socket for local clients (none) */\n\
+/*            -F: host:port of a peer server, repeatable (none)  */\n\
+/*            -P: ms of silence before a ping (30000, 0 = off)   */\n\
+/*            -I: ms a client may idle in a room (0 = forever)   */\n\
+/*            -L: msgs/s of one client[,burst] (0 = no limit)    */\n\
+/*            -Y: bytes/s of one client[,burst] (0 = no limit)   */\n\
+/*            -O: over the limit, throttle|reject (throttle)     */\n\
+/*            -W: ms to gather joins and leaves of a room (50)   */\n\
+/*            -s: directory of the shared files (/tmp)           */\n\
+/*            -X: max. bytes of one shared file (64M)            */\n\
 /*            Press <Ctrl + C> to terminate the server           */\n\
+/*            kill -USR1 prints the lagging clients and metrics  */\n\
 /*****************************************************************/\n\
 \n\n";
 
@@ -35,36 +81,286 @@ static char banner[] =
 
 void server_init(void);
 void server_run(void);
+void *acceptor_fn(void *);
+struct chat_client *client_new(int fd, struct sockaddr_in *addr, int local, int peer_addr);
 void *broadcast_thread_fn(void *);
-void *client_thread_fn(void *);
-int send_msg_to_server(int sockfd, char *msg, int command, int privateData);
+void *event_loop_fn(void *);
+int client_read(struct chat_client *);
+int client_dispatch(struct chat_client *);
+int client_join(struct chat_client *, struct chat_frame *);
+void client_depart(struct chat_client *);
+void client_put(struct chat_client *);
+struct chat_room *room_lookup(const char *name);
+int room_create(const char *name, struct chat_room **room);
+void room_foreach(void (*fn)(struct chat_room *, void *), void *arg);
+int room_add_client(struct chat_room *, struct chat_client *, struct frame *reply, long long since);
+int lobby_reserve(struct chat_client *);
+void lobby_release(struct chat_client *);
+void room_remove_client(struct chat_room *, struct chat_client *);
+void client_change_room(struct chat_client *, struct chat_frame *);
+void client_subscribe(struct chat_client *, struct chat_frame *);
+void client_whisper(struct chat_client *, struct chat_frame *);
+int client_subs_free(struct chat_client *);
+int client_ring_attach(struct chat_client *, struct chat_frame *);
+void client_file_offer(struct chat_client *, struct chat_frame *);
+int data_request(struct chat_client *, struct chat_frame *);
+int data_recv(struct chat_client *);
+int data_flush(struct chat_client *);
+void data_close(struct chat_client *);
+int data_notice(struct chat_client *);
+int client_admit(struct chat_client *, int command, const char *room_name, uint64_t last_seq);
+int name_index_insert(struct chat_client *, int takeover);
+void name_index_remove(struct chat_client *);
+int name_index_deliver(const char *name, const char *msg, size_t len);
+int name_index_session(const char *name, uint64_t token, struct chat_client **session);
+int name_index_kick(const char *name);
+int name_index_grant(const char *name, uint64_t node, uint64_t claim);
+int fed_link(struct chat_client *, uint64_t node);
+void fed_unlink(struct chat_client *);
+int fed_claim(struct chat_client *, int command, const char *room_name, uint64_t last_seq);
+void fed_claim_cancel(struct chat_client *);
+void fed_claims_done(struct event_loop *);
+int fed_peer_read(struct chat_client *, struct chat_frame *);
+void fed_relay(struct frame **f, int n);
+void fed_room(const char *name);
+int fed_whisper(struct chat_client *, const char *name, const char *msg, size_t len);
+void fed_whisper_cancel(struct chat_client *);
+void *peer_thread_fn(void *);
+void chatmsg_queue_init(struct chatmsg_queue *, size_t);
+void chatmsg_put(struct chatmsg_queue *, struct frame *msg);
+int chatmsg_put_nowait(struct chatmsg_queue *, struct frame *msg);
+void chatmsg_put_lane(struct chatmsg_queue *, int lane, struct frame *msg);
+struct frame *chatmsg_get(struct chatmsg_queue *, long long *stamp, long long until);
+void chatmsg_wakeup(struct chatmsg_queue *);
+void chatmsg_wake_at(struct chatmsg_queue *, long long when);
+struct frame *frame_new(int version, int command, int privateData, const char *payload, size_t len);
+struct frame *frame_broadcast(int version, uint64_t seq, const char *msg, size_t len);
+struct frame *frame_message(size_t len);
+struct frame *frame_relay(int command, const char *room, const char *msg, size_t len);
+void frame_seal(struct frame *, uint64_t seq);
+struct frame *frame_map(struct history_segment *seg, const struct history_rec *rec);
+void frame_put(struct frame *);
+void client_enqueue(struct chat_client *, struct frame *);
+void client_enqueue_batch(struct chat_client *, struct frame **, int n);
+void client_enqueue_urgent(struct chat_client *, struct frame *);
+void client_zc_reap(struct chat_client *);
+void fanout_init(int nworkers);
+void fanout_stop(void);
+void *fanout_worker_fn(void *);
+void fanout_broadcast(struct chat_room *, struct frame *f[][BATCH_MAX], int n, const uint64_t *masks);
+void client_replay(struct chat_client *, struct frame *);
+int client_flush(struct chat_client *);
+void *stats_thread_fn(void *);
+void *admin_thread_fn(void *);
+struct thread_stats *stats_self(void);
+void stats_register(const char *fmt, ...);
+void write_stats(FILE *out, int json);
+void write_clients(FILE *out, int json, int all);
+int send_all(int sockfd, void *buf, size_t len);
+int set_nonblocking(int fd);
 void shutdown_handler(int);
 
-#define BACKLOG 10
 #define MYPORT 50388
 
 struct chat_server  chatserver;
 int port = MYPORT;
-int sockfd;  // listen on sock_fd
-struct sockaddr_in their_addr; // client's address information
-socklen_t sin_size;
 
-struct chatmsg_queue *msgQ = &chatserver.room.chatmsgQ;
+/* wall clock, for what outlives the server */
+static long long now_wall_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* add to a counter of the own thread_stats, nobody else writes it */
+static inline void stat_add(atomic_ulong *counter, unsigned long n)
+{
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/* rate[,burst] of -L and -Y, the burst is one second's worth by default */
+static void parse_rate(const char *arg, struct rate_limit *l)
+{
+    char *end;
 
-sem_t *buf_full = &chatserver.room.chatmsgQ.buffer_full;
-sem_t *buf_empty = &chatserver.room.chatmsgQ.buffer_empty;
-sem_t *mq_lock = &chatserver.room.chatmsgQ.mq_lock;
-sem_t *cq_lock = &chatserver.room.clientQ.cq_lock;
+    l -> rate = strtol(arg, &end, 10);
+    l -> burst = (*end == ',') ? strtol(end + 1, NULL, 10) : l -> rate;
+    if (l -> rate < 0)
+        l -> rate = 0;
+    if (l -> burst < 1)
+        l -> burst = 1;
+}
 
 /*
  * The main server process
  */
 int main(int argc, char **argv)
 {
+    int opt;
+    char *p;
+
     printf("%s\n", banner);
     
-    if (argc > 1) {
-        port = atoi(argv[1]);
+    chatserver.nloops = sysconf(_SC_NPROCESSORS_ONLN);
+    chatserver.slow_policy = SLOW_DROP_OLDEST;
+    chatserver.max_lag_bytes = DEFAULT_MAX_LAG_BYTES;
+    chatserver.max_lag_ms = DEFAULT_MAX_LAG_MS;
+    chatserver.queue_msgs = DEFAULT_QUEUE_MSG;
+    chatserver.max_payload = DEFAULT_MAX_PAYLOAD;
+    chatserver.max_rooms = DEFAULT_MAX_ROOMS;
+    chatserver.room_capacity = DEFAULT_ROOM_CLIENT;
+    chatserver.nacceptors = 1;
+    chatserver.handshake_ms = DEFAULT_HANDSHAKE_MS;
+    chatserver.heartbeat_ms = DEFAULT_HEARTBEAT_MS;
+    chatserver.history_replay = DEFAULT_HISTORY_REPLAY;
+    chatserver.retain_msgs = DEFAULT_RETAIN_MSGS;
+    chatserver.batch_bytes = DEFAULT_BATCH_BYTES;
+    chatserver.batch_us = DEFAULT_BATCH_US;
+    chatserver.presence_ms = DEFAULT_PRESENCE_MS;
+    chatserver.spool.dir = "/tmp";
+    chatserver.spool.file_max = DEFAULT_FILE_MAX;
+    while ((opt = getopt(argc, argv, "t:p:B:T:q:m:r:c:a:H:A:D:R:K:b:w:f:Z:U:F:P:I:L:Y:O:W:s:X:")) != -1) {
+        switch (opt) {
+        case 't':
+            chatserver.nloops = atoi(optarg);
+            break;
+        case 'p':
+            if (strcmp(optarg, "drop") == 0)
+                chatserver.slow_policy = SLOW_DROP_OLDEST;
+            else if (strcmp(optarg, "coalesce") == 0)
+                chatserver.slow_policy = SLOW_COALESCE;
+            else if (strcmp(optarg, "disconnect") == 0)
+                chatserver.slow_policy = SLOW_DISCONNECT;
+            else {
+                printf("unknown slow client policy %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'B':
+            chatserver.max_lag_bytes = atol(optarg);
+            break;
+        case 'T':
+            chatserver.max_lag_ms = atoi(optarg);
+            break;
+        case 'q':
+            chatserver.queue_msgs = atol(optarg);
+            break;
+        case 'm':
+            chatserver.max_payload = atol(optarg);
+            break;
+        case 'r':
+            chatserver.max_rooms = atoi(optarg);
+            break;
+        case 'c':
+            chatserver.room_capacity = atoi(optarg);
+            break;
+        case 'a':
+            chatserver.nacceptors = atoi(optarg);
+            break;
+        case 'H':
+            chatserver.handshake_ms = atoi(optarg);
+            break;
+        case 'A':
+            chatserver.admin_path = optarg;
+            break;
+        case 'D':
+            chatserver.history_dir = optarg;
+            break;
+        case 'R':
+            chatserver.history_replay = atoi(optarg);
+            break;
+        case 'K':
+            chatserver.retain_msgs = atol(optarg);
+            break;
+        case 'b':
+            chatserver.batch_bytes = atol(optarg);
+            break;
+        case 'w':
+            chatserver.batch_us = atoi(optarg);
+            break;
+        case 'f':
+            chatserver.fanout.nworkers = atoi(optarg);
+            break;
+        case 'Z':
+            chatserver.zc_threshold = atol(optarg);
+            if (chatserver.zc_threshold > 0 && chatserver.zc_threshold < ZEROCOPY_SUGGESTED)
+                printf("zero-copy writes under %d bytes are likely slower than copying\n", ZEROCOPY_SUGGESTED);
+            break;
+        case 'U':
+            chatserver.local_path = optarg;
+            break;
+        case 'F':
+            if ((p = strrchr(optarg, ':')) == NULL) {
+                printf("a peer server is given as host:port, not %s\n", optarg);
+                exit(1);
+            }
+            *p = '\0';
+            chatserver.fed.addrs = (struct peer_addr *)realloc(chatserver.fed.addrs,
+                    (chatserver.fed.naddrs + 1) * sizeof(struct peer_addr));
+            chatserver.fed.addrs[chatserver.fed.naddrs].host = optarg;
+            chatserver.fed.addrs[chatserver.fed.naddrs].port = p + 1;
+            chatserver.fed.addrs[chatserver.fed.naddrs].node = 0;
+            chatserver.fed.addrs[chatserver.fed.naddrs].busy = 0;
+            chatserver.fed.naddrs++;
+            break;
+        case 'P':
+            chatserver.heartbeat_ms = atoi(optarg);
+            break;
+        case 'I':
+            chatserver.idle_ms = atoi(optarg);
+            break;
+        case 'L':
+            parse_rate(optarg, &chatserver.msg_limit);
+            break;
+        case 'Y':
+            parse_rate(optarg, &chatserver.byte_limit);
+            break;
+        case 'O':
+            if (strcmp(optarg, "throttle") == 0)
+                chatserver.flood_policy = FLOOD_THROTTLE;
+            else if (strcmp(optarg, "reject") == 0)
+                chatserver.flood_policy = FLOOD_REJECT;
+            else {
+                printf("unknown flood policy %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'W':
+            chatserver.presence_ms = atoi(optarg);
+            break;
+        case 's':
+            chatserver.spool.dir = optarg;
+            break;
+        case 'X':
+            chatserver.spool.file_max = atol(optarg);
+            break;
+        default:
+            exit(1);
+        }
+    }
+    if (chatserver.nloops < 1)
+        chatserver.nloops = 1;
+    if (chatserver.nacceptors < 1)
+        chatserver.nacceptors = 1;
+    if (chatserver.fanout.nworkers < 0)
+        chatserver.fanout.nworkers = 0;
+    if (chatserver.heartbeat_ms < 0)
+        chatserver.heartbeat_ms = 0;
+    if (chatserver.idle_ms < 0)
+        chatserver.idle_ms = 0;
+
+    if (optind < argc) {
+        port = atoi(argv[optind]);
     } else {
         port = MYPORT;
     }
@@ -74,6 +370,8 @@ int main(int argc, char **argv)
     // Register "Control + C" signal handler
     signal(SIGINT, shutdown_handler);
     signal(SIGTERM, shutdown_handler);
+    // A client may vanish while we are writing to it, let send() report EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
 
 	// Initilize the server
     server_init();
@@ -92,20 +390,33 @@ void server_init(void)
 {
     // Initilize all related data structures
     // 1. semaphores, mutex, pointers, etc.
-    // 2. create the broadcast_thread
+    // 2. create the lobby with its broadcast_thread, and the event loops
 
-	int i = 0; 
-	while (i < MAX_QUEUE_MSG){
-		msgQ->slots[i] = (char *)malloc(sizeof(char) * CONTENT_LENGTH);
-		//memset(msgQ->slots[i], '\0', CONTENT_LENGTH);//or memset(msgQ->slots[i], 0, sizeof(char) * CONTENT_LENGTH);
-		i++;
+	int i;
+
+	for (i = 0; i < ROOM_HASH_SIZE; i++) {
+		pthread_mutex_init(&chatserver.rooms.buckets[i].lock, NULL);
+		chatserver.rooms.buckets[i].head = NULL;
 	}
+	atomic_init(&chatserver.rooms.count, 0);
+	for (i = 0; i < NAME_LOCK_STRIPES; i++)
+		pthread_mutex_init(&chatserver.names.locks[i], NULL);
+	pthread_mutex_init(&chatserver.metrics.lock, NULL);
+	chatserver.metrics.threads = NULL;
+	chatserver.metrics.start = now_ms();
 
-	memset(&chatserver.room.clientQ, 0, sizeof(struct client_queue));
+	/* the node id tells the servers of a federation apart, and decides their ties */
+	pthread_mutex_init(&chatserver.fed.lock, NULL);
+	atomic_init(&chatserver.fed.npeers, 0);
+	while (chatserver.fed.node == 0)
+		if (getrandom(&chatserver.fed.node, sizeof(chatserver.fed.node), 0) != sizeof(chatserver.fed.node))
+			chatserver.fed.node = ((uint64_t)now_ns() << 16) ^ getpid();
 
-	if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-		perror("socket");
-		exit(1);
+	/* every client costs one descriptor, allow as many as the hard limit does */
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
 	}
 
 	/* Prepare the socket address structure of the server */    
@@ -114,344 +425,4791 @@ void server_init(void)
 	chatserver.address.sin_addr.s_addr = htonl(INADDR_ANY); // automatically fill with my IP address
 	memset(&(chatserver.address.sin_zero), '\0', 8); // zero the rest of the struct
 	
-	if (bind(sockfd, (struct sockaddr *)&chatserver.address, sizeof(struct sockaddr)) == -1) {
-		perror("bind");
-		exit(1);
+	/* one listening socket per acceptor, they share the port with SO_REUSEPORT */
+	chatserver.acceptors = (struct acceptor *)calloc(chatserver.nacceptors + 1, sizeof(struct acceptor));
+	for (i = 0; i < chatserver.nacceptors; i++) {
+		int fd, on = 1;
+
+		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+			perror("socket");
+			exit(1);
+		}
+		/* a restarted server gets its port back at once, its clients are waiting to resume */
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (chatserver.nacceptors > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+			perror("setsockopt SO_REUSEPORT");
+			exit(1);
+		}
+		if (bind(fd, (struct sockaddr *)&chatserver.address, sizeof(struct sockaddr)) == -1) {
+			perror("bind");
+			exit(1);
+		}
+		if (listen(fd, BACKLOG) == -1) {
+			perror("listen");
+			exit(1);
+		}
+		chatserver.acceptors[i].listenfd = fd;
 	}
 
 	printf("Chat server is up and listening at port %d\n", port);
 
-	/* initialize all synchronization structures */
-	sem_init(buf_full, 0, MAX_QUEUE_MSG);		//initially, has 20 slots in chatmsgQ
-	sem_init(buf_empty, 0, 0);					//initially, no items in chatmsgQ
-	sem_init(mq_lock, 0, 1);					//work as mutex lock - initially is free
-	sem_init(cq_lock, 0, 1);
+	/* clients on the same host may skip TCP, and attach a shared memory ring */
+	if (chatserver.local_path != NULL) {
+		struct sockaddr_un addr;
+		int fd;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(chatserver.local_path) >= sizeof(addr.sun_path)) {
+			printf("the local socket path is too long\n");
+			exit(1);
+		}
+		strcpy(addr.sun_path, chatserver.local_path);
+		unlink(chatserver.local_path);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+				bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+				listen(fd, BACKLOG) == -1) {
+			perror("local socket");
+			exit(1);
+		}
+		chatserver.acceptors[chatserver.nacceptors].listenfd = fd;
+		chatserver.acceptors[chatserver.nacceptors].local = 1;
+		printf("Local clients connect at %s\n", chatserver.local_path);
+	}
+
+	/* only the main thread handles SIGINT/SIGTERM, so no worker is interrupted while holding a lock */
+	sigset_t mask, oldmask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+
+	/* SIGUSR1 stays blocked everywhere, the stats thread picks it up with sigwait() */
+	pthread_t stats_thread;
+	pthread_create(&stats_thread, NULL, stats_thread_fn, NULL);
+	pthread_detach(stats_thread);
+
+	/* the shared files, with the thread closing those dropped */
+	spool_init(&chatserver.spool, chatserver.spool.dir, chatserver.spool.file_max, DEFAULT_SPOOL_BYTES);
+
+	/* the admin socket answers queries of the metrics at any time, only the owner may connect */
+	if (chatserver.admin_path != NULL) {
+		struct sockaddr_un addr;
+		int fd;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(chatserver.admin_path) >= sizeof(addr.sun_path)) {
+			printf("the admin socket path is too long\n");
+			exit(1);
+		}
+		strcpy(addr.sun_path, chatserver.admin_path);
+		unlink(chatserver.admin_path);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+				bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+				listen(fd, 8) == -1) {
+			perror("admin socket");
+			exit(1);
+		}
+		chmod(chatserver.admin_path, S_IRUSR | S_IWUSR);
+
+		pthread_t admin_thread;
+		pthread_create(&admin_thread, NULL, admin_thread_fn, (void *)(intptr_t)fd);
+		pthread_detach(admin_thread);
+		printf("Admin socket at %s\n", chatserver.admin_path);
+	}
+
+	/* the fan-out pool, before any room can use it */
+	fanout_init(chatserver.fanout.nworkers);
+
+	/* create the lobby, and its broadcast_thread */
+	if (room_create(DEFAULT_ROOM, &chatserver.lobby) != 0) {
+		printf("cannot create the room %s\n", DEFAULT_ROOM);
+		exit(1);
+	}
+
+	/* create the event loops */
+	chatserver.loops = (struct event_loop *)malloc(sizeof(struct event_loop) * chatserver.nloops);
+	for (i = 0; i < chatserver.nloops; i++) {
+		if ((chatserver.loops[i].epfd = epoll_create1(0)) == -1) {
+			perror("epoll_create1");
+			exit(1);
+		}
+		pthread_mutex_init(&chatserver.loops[i].timer_lock, NULL);
+		chatserver.loops[i].now = now_ms();
+		wheel_init(&chatserver.loops[i].timers, chatserver.loops[i].now);
+		chatserver.loops[i].sleep_until = LLONG_MAX;
+		chatserver.loops[i].claims_done = NULL;
+		chatserver.loops[i].lingering = NULL;
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if ((chatserver.loops[i].wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+				epoll_ctl(chatserver.loops[i].epfd, EPOLL_CTL_ADD, chatserver.loops[i].wakefd, &ev) == -1) {
+			perror("eventfd");
+			exit(1);
+		}
+		pthread_create(&(chatserver.loops[i].loop_thread), NULL, event_loop_fn, (void *)(&chatserver.loops[i]));
+	}
+	printf("%d event loop thread(s) serving clients\n", chatserver.nloops);
+	if (chatserver.heartbeat_ms > 0)
+		printf("Silent clients are pinged after %d ms\n", chatserver.heartbeat_ms);
+	if (chatserver.msg_limit.rate > 0)
+		printf("A client may send %ld msgs/s, %ld at once - %s beyond\n", chatserver.msg_limit.rate, chatserver.msg_limit.burst,
+				chatserver.flood_policy == FLOOD_REJECT ? "rejected" : "throttled");
+	if (chatserver.byte_limit.rate > 0)
+		printf("A client may send %ld bytes/s, %ld at once - %s beyond\n", chatserver.byte_limit.rate, chatserver.byte_limit.burst,
+				chatserver.flood_policy == FLOOD_REJECT ? "rejected" : "throttled");
+
+	/* the main thread is the first acceptor, see server_run() */
+	for (i = 1; i < chatserver.nacceptors; i++)
+		pthread_create(&(chatserver.acceptors[i].thread), NULL, acceptor_fn, (void *)(&chatserver.acceptors[i]));
+	if (chatserver.nacceptors > 1)
+		printf("%d acceptor thread(s) share the port\n", chatserver.nacceptors);
+	if (chatserver.local_path != NULL)
+		pthread_create(&(chatserver.acceptors[chatserver.nacceptors].thread), NULL, acceptor_fn,
+				(void *)(&chatserver.acceptors[chatserver.nacceptors]));
 
-	/* create broadcast_thread */
-	pthread_create(&(chatserver.room.broadcast_thread), NULL, (void *)(*broadcast_thread_fn), (void *)(msgQ));
+	/* the links to the peer servers are opened, and opened again, in the background */
+	if (chatserver.fed.naddrs > 0) {
+		pthread_t peer_thread;
+		pthread_create(&peer_thread, NULL, peer_thread_fn, NULL);
+		pthread_detach(peer_thread);
+	}
+	printf("Node id %016llx, %d peer server(s) to link with\n", (unsigned long long)chatserver.fed.node, chatserver.fed.naddrs);
 
+	sigaddset(&oldmask, SIGUSR1);
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
 } 
 
-int send_msg_to_server(int sockfd, char *msg, int command, int privateData)
+int set_nonblocking(int fd)
 {
-    struct exchg_msg sbuf;
-    int msg_len = 0;
+	int flags = fcntl(fd, F_GETFL, 0);
 
-	memset(&sbuf, 0, sizeof(struct exchg_msg));
-	sbuf.instruction = htonl(command); 
-	if (command == CMD_SERVER_BROADCAST) {          
-		memcpy(sbuf.content, msg, strlen(msg));
-		msg_len = strlen(msg) + 1;
-        msg_len = (msg_len < CONTENT_LENGTH) ? msg_len : CONTENT_LENGTH;
-        sbuf.content[msg_len-1] = '\0';	
-        sbuf.private_data = htonl(msg_len);
-    }
-	else sbuf.private_data = htonl(privateData);
+	if (flags == -1)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * Write the whole buffer to a (non-blocking) socket, waiting for it to become writable when the
+ * send buffer is full
+ * Return value:  0 - success;
+ *               -1 - error;
+ */
+int send_all(int sockfd, void *buf, size_t len)
+{
+	char *p = buf;
+	struct pollfd pfd;
+	ssize_t n;
 
+	while (len > 0) {
+		n = send(sockfd, p, len, MSG_NOSIGNAL);
+		if (n >= 0) {
+			p += n;
+			len -= n;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			pfd.fd = sockfd;
+			pfd.events = POLLOUT;
+			if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+				return -1;
+		} else if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return 0;
+}
 
-    if (send(sockfd, &sbuf, sizeof(sbuf), 0) == -1) {
-        perror("Server socket sending error");
-        return -1;
-    }
+/*
+ * Format a message for the bounded buffer right into its frame, see frame_message()
+ */
+static struct frame *frame_printf(const char *fmt, ...)
+{
+	struct frame *f;
+	va_list ap;
+	int len;
 
-    return 0;
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	f = frame_message(len);
+	/* one more byte for the '\0' of vsnprintf(), the headroom is followed by len + 1 bytes */
+	va_start(ap, fmt);
+	vsnprintf(f -> data + PROTO_BROADCAST_HEADROOM, len + 1, fmt, ap);
+	va_end(ap);
+	return f;
+}
+
+static long futex(atomic_int *uaddr, int op, int val)
+{
+	return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+/* FUTEX_WAIT until the monotonic clock reaches until (ns) */
+static long futex_wait_until(atomic_int *uaddr, int val, long long until)
+{
+	struct timespec ts;
+	long long left = until - now_ns();
+
+	if (left <= 0)
+		return 0;
+	ts.tv_sec = left / 1000000000LL;
+	ts.tv_nsec = left % 1000000000LL;
+	return syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
 }
+
 /*
- * Run the chat server 
+ * Initialize the bounded buffer with (at least) the given # of slots
  */
-void server_run(void)
+void chatmsg_queue_init(struct chatmsg_queue *q, size_t size)
 {
+	size_t n = 2, i;
 
+	while (n < size)
+		n <<= 1;
+	q -> slots = (struct chatmsg_slot *)malloc(sizeof(struct chatmsg_slot) * n);
+	for (i = 0; i < n; i++)
+		atomic_init(&q -> slots[i].seq, i);
+	q -> mask = n - 1;
+	atomic_init(&q -> head, 0);
+	atomic_init(&q -> tail, 0);
+	atomic_init(&q -> not_empty, 0);
+	atomic_init(&q -> consumer_waiting, 0);
+	atomic_init(&q -> not_full, 0);
+	atomic_init(&q -> producers_waiting, 0);
+	for (i = 0; i < LANE_CHAT; i++) {
+		pthread_mutex_init(&q -> lanes[i].lock, NULL);
+		q -> lanes[i].head = q -> lanes[i].tail = NULL;
+		atomic_init(&q -> lanes[i].count, 0);
+	}
+	q -> turn = 0;
+	atomic_init(&q -> wake_at, 0);
+}
 
-    while (1) {
-        // Listen for new connections
-        // 1. if it is a CMD_CLIENT_JOIN, try to create a new client_thread
-        //  1.1) check whether the room is full or not
-        //  1.2) check whether the username has been used or not
-        // 2. otherwise, return ERR_UNKNOWN_CMD
+/* claim a slot and publish the message, -1 if the buffer is full */
+static int chatmsg_try_put(struct chatmsg_queue *q, struct frame *msg, long long stamp)
+{
+	struct chatmsg_slot *slot;
+	size_t pos = atomic_load_explicit(&q -> tail, memory_order_relaxed);
+	intptr_t dif;
 
-		int new_fd;	//new connection on new_fd
-		struct exchg_msg mbuf;	//mbuf for received msg
-		int instruction, msg_len;		
-		char clientName [CLIENTNAME_LENGTH];//clientName for every distinguish thread
-		
-		if (listen(sockfd, BACKLOG) == -1) {
-			perror("listen");
-			exit(1);
+	while (1) {
+		slot = &q -> slots[pos & q -> mask];
+		dif = (intptr_t)atomic_load_explicit(&slot -> seq, memory_order_acquire) - (intptr_t)pos;
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q -> tail, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (dif < 0) {
+			return -1;
+		} else {
+			pos = atomic_load_explicit(&q -> tail, memory_order_relaxed);
 		}
+	}
+	slot -> msg = msg;
+	slot -> stamp = stamp;
+	atomic_store_explicit(&slot -> seq, pos + 1, memory_order_release);
+	return 0;
+}
 
-		sin_size = sizeof(struct sockaddr_in);
-		if ((new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size)) == -1) {
-			perror("accept");
-			exit(1);
-		}
+/* take the oldest message, NULL if the buffer is empty - consumer only */
+static struct frame *chatmsg_try_get(struct chatmsg_queue *q, long long *stamp)
+{
+	size_t pos = atomic_load_explicit(&q -> head, memory_order_relaxed);
+	struct chatmsg_slot *slot = &q -> slots[pos & q -> mask];
+	struct frame *msg;
+
+	if (atomic_load_explicit(&slot -> seq, memory_order_acquire) != pos + 1)
+		return NULL;
+	msg = slot -> msg;
+	if (stamp != NULL)
+		*stamp = slot -> stamp;
+	atomic_store_explicit(&slot -> seq, pos + q -> mask + 1, memory_order_release);
+	atomic_store_explicit(&q -> head, pos + 1, memory_order_relaxed);
+	/* the message no longer takes up the share of its sender */
+	if (msg -> sender != NULL) {
+		atomic_fetch_sub_explicit(&msg -> sender -> inflight, 1, memory_order_relaxed);
+		client_put(msg -> sender);
+		msg -> sender = NULL;
+	}
+	return msg;
+}
+
+/* take the oldest message of a priority lane, NULL if it is empty - consumer only */
+static struct frame *lane_try_get(struct msg_lane *l, long long *stamp)
+{
+	struct frame *msg;
+
+	if (atomic_load(&l -> count) == 0)
+		return NULL;
+	pthread_mutex_lock(&l -> lock);
+	if ((msg = l -> head) != NULL) {
+		if ((l -> head = msg -> lane_next) == NULL)
+			l -> tail = NULL;
+		atomic_fetch_sub(&l -> count, 1);
+	}
+	pthread_mutex_unlock(&l -> lock);
+	if (msg != NULL && stamp != NULL)
+		*stamp = msg -> stamp;
+	return msg;
+}
+
+/* take the next message by priority, NULL if all lanes are empty - consumer only, see LANE_CONTROL */
+static struct frame *chatmsg_try_next(struct chatmsg_queue *q, long long *stamp)
+{
+	struct frame *msg;
+
+	if ((msg = lane_try_get(&q -> lanes[LANE_CONTROL], stamp)) != NULL)
+		return msg;
+	if (q -> turn < LANE_PRESENCE_WEIGHT) {
+		if ((msg = lane_try_get(&q -> lanes[LANE_PRESENCE], stamp)) == NULL)
+			msg = chatmsg_try_get(q, stamp);
+	} else {
+		if ((msg = chatmsg_try_get(q, stamp)) == NULL)
+			msg = lane_try_get(&q -> lanes[LANE_PRESENCE], stamp);
+	}
+	if (msg != NULL)
+		q -> turn = (q -> turn + 1) % (LANE_PRESENCE_WEIGHT + LANE_CHAT_WEIGHT);
+	return msg;
+}
+
+/* a message was published: wake the consumer, if it sleeps on an empty buffer */
+static void chatmsg_wake_consumer(struct chatmsg_queue *q)
+{
+	/* the store of the message and the load of consumer_waiting must not be reordered */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&q -> consumer_waiting, memory_order_relaxed)) {
+		atomic_fetch_add(&q -> not_empty, 1);
+		futex(&q -> not_empty, FUTEX_WAKE_PRIVATE, 1);
+	}
+}
 
-		/* communicate with the client using new_fd */
+/*
+ * Put one message into the bounded buffer, wait if the buffer is full
+ * The buffer owns the message from now on, a frame of frame_message()
+ */
+void chatmsg_put(struct chatmsg_queue *q, struct frame *msg)
+{
+	long long stamp = now_ns();
+	int v;
 
-		/* receive msg from client */			
-		memset(&mbuf, 0, sizeof(struct exchg_msg));
-		if (recv(new_fd, &mbuf, CONTENT_LENGTH-1, 0) == -1) {
-		    perror("recv error occurs, exit");
-		    exit(1);
+	while (chatmsg_try_put(q, msg, stamp) != 0) {
+		/* full: sleep until the consumer frees a slot */
+		v = atomic_load(&q -> not_full);
+		atomic_fetch_add(&q -> producers_waiting, 1);
+		if (chatmsg_try_put(q, msg, stamp) == 0) {
+			atomic_fetch_sub(&q -> producers_waiting, 1);
+			break;
 		}
+		futex(&q -> not_full, FUTEX_WAIT_PRIVATE, v);
+		atomic_fetch_sub(&q -> producers_waiting, 1);
+		pthread_testcancel();	// futex() is no cancellation point
+	}
 
-		/* handle byte endian */
-		instruction = ntohl(mbuf.instruction);
-		msg_len = ntohl(mbuf.private_data);
+	chatmsg_wake_consumer(q);
+}
 
-		if (instruction == CMD_CLIENT_JOIN){
-			assert(msg_len <= CLIENTNAME_LENGTH);
-			strcpy(clientName, mbuf.content);
+/*
+ * Put one message into the bounded buffer, unless it is full - never waits
+ * Return value:  0 - the buffer owns the message from now on;
+ *               -1 - the buffer is full, the message is still the caller's
+ */
+int chatmsg_put_nowait(struct chatmsg_queue *q, struct frame *msg)
+{
+	if (chatmsg_try_put(q, msg, now_ns()) != 0)
+		return -1;
+	chatmsg_wake_consumer(q);
+	return 0;
+}
 
-			/* check room ********************************/
-			sem_wait(cq_lock);
-			if (chatserver.room.clientQ.count >= MAX_ROOM_CLIENT) {
-				sem_post(cq_lock);//release lock
-				if (send_msg_to_server(new_fd, NULL, CMD_SERVER_FAIL, ERR_JOIN_ROOM_FULL) != 0) exit(1);
-				close(new_fd); 
-				continue;	//Join unsuccessfully, so have to listen for another join request
-			}
-			sem_post(cq_lock);
+/*
+ * Put one message into a priority lane of the buffer, LANE_CONTROL or LANE_PRESENCE
+ * The lanes are not bounded, this never waits. The buffer owns the message from now on.
+ */
+void chatmsg_put_lane(struct chatmsg_queue *q, int lane, struct frame *msg)
+{
+	struct msg_lane *l = &q -> lanes[lane];
 
-			/* check usename */
-			int checkName = 1;
-			sem_wait(cq_lock);
-			struct chat_client *p = chatserver.room.clientQ.head;				
-			while (p != NULL){
-				if (strcmp(p -> client_name , clientName) == 0){checkName = 0; break;}
-				p = p -> next;
-			}
-			sem_post(cq_lock);//release lock
-			if (checkName == 0) {
-				if (send_msg_to_server(new_fd, NULL, CMD_SERVER_FAIL, ERR_JOIN_DUP_NAME) != 0) exit(1);
-				close(new_fd); 
-				continue;	//Join unsuccessfully, so have to listen for another join request
-			}
-		 	/* checking finished***************************/
+	msg -> stamp = now_ns();
+	msg -> lane = lane;
+	msg -> lane_next = NULL;
+	pthread_mutex_lock(&l -> lock);
+	if (l -> tail != NULL)
+		l -> tail -> lane_next = msg;
+	else
+		l -> head = msg;
+	l -> tail = msg;
+	atomic_fetch_add(&l -> count, 1);
+	pthread_mutex_unlock(&l -> lock);
 
-			/* collect client info */
-			struct chat_client *newClient;
-			newClient = (struct chat_client *)malloc(sizeof(struct chat_client));
-			memset(newClient, 0, sizeof(struct chat_client));
-			newClient -> socketfd = new_fd;
-			newClient -> address = their_addr;
-			strcpy(newClient -> client_name, clientName);				
-			pthread_create(&(newClient -> client_thread), NULL, (void *)(*client_thread_fn), (void *)(newClient));
+	chatmsg_wake_consumer(q);
+}
+
+/*
+ * Take the next message out of the buffer by priority, wait if the buffer is empty - consumer only
+ * The caller owns the message and puts it, stamp tells when it was put.
+ * until: 0 - wait as long as it takes; -1 - do not wait; else the time (ns, monotonic clock)
+ * to give up. NULL is returned if nothing comes in time, or by the time of chatmsg_wake_at().
+ */
+struct frame *chatmsg_get(struct chatmsg_queue *q, long long *stamp, long long until)
+{
+	struct frame *msg;
+	long long wake;
+	int v;
 
+	while ((msg = chatmsg_try_next(q, stamp)) == NULL) {
+		/* the consumer's own deadline may come first, see chatmsg_wake_at() */
+		wake = atomic_load(&q -> wake_at);
+		if (wake != 0 && until >= 0 && (until == 0 || wake < until))
+			until = wake;
+		if (until < 0 || (until != 0 && now_ns() >= until))
+			return NULL;
+		/* empty: announce that we sleep, then look once more before really sleeping */
+		v = atomic_load(&q -> not_empty);
+		atomic_store(&q -> consumer_waiting, 1);
+		if ((msg = chatmsg_try_next(q, stamp)) != NULL) {
+			atomic_store(&q -> consumer_waiting, 0);
+			break;
 		}
-		//otherwise, return ERR_UNKNOWN_CMD
-		else {
-			if (send_msg_to_server(new_fd, NULL, CMD_SERVER_FAIL, ERR_UNKNOWN_CMD) != 0) exit(1);
-			close(new_fd); 
-			continue;	//Join unsuccessfully, so have to listen for another join request
+		if (until == 0 && atomic_load(&q -> wake_at) != 0) {
+			atomic_store(&q -> consumer_waiting, 0);
+			continue;
 		}
+		if (until != 0)
+			futex_wait_until(&q -> not_empty, v, until);
+		else
+			futex(&q -> not_empty, FUTEX_WAIT_PRIVATE, v);
+		atomic_store(&q -> consumer_waiting, 0);
+		pthread_testcancel();	// futex() is no cancellation point
 	}
-}
 
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&q -> producers_waiting, memory_order_relaxed) > 0) {
+		atomic_fetch_add(&q -> not_full, 1);
+		futex(&q -> not_full, FUTEX_WAKE_PRIVATE, INT_MAX);
+	}
+	return msg;
+}
 
-void *client_thread_fn(void *arg)
+/*
+ * Wake up everybody sleeping on the bounded buffer, so that cancelled threads notice it
+ */
+void chatmsg_wakeup(struct chatmsg_queue *q)
 {
-    // Put one message into the bounded buffer "$client_name$ just joins, welcome!"
+	atomic_fetch_add(&q -> not_empty, 1);
+	futex(&q -> not_empty, FUTEX_WAKE_PRIVATE, INT_MAX);
+	atomic_fetch_add(&q -> not_full, 1);
+	futex(&q -> not_full, FUTEX_WAKE_PRIVATE, INT_MAX);
+}
 
-    struct chat_client *clientInfo;
-	clientInfo = arg;
+/*
+ * Have the consumer return from chatmsg_get() by the given time (ns, monotonic clock), even if
+ * nothing comes; the consumer sets it back to 0 once it has done what was due
+ */
+void chatmsg_wake_at(struct chatmsg_queue *q, long long when)
+{
+	atomic_store(&q -> wake_at, when);
 
-	/* Insert the client into clientQ */
-	sem_wait(cq_lock);
-	if (chatserver.room.clientQ.tail != NULL){				
-		chatserver.room.clientQ.tail -> next = clientInfo;
-		clientInfo -> prev = chatserver.room.clientQ.tail;
-		chatserver.room.clientQ.tail = clientInfo;}
-	else{
-		chatserver.room.clientQ.head = clientInfo;
-		chatserver.room.clientQ.tail = clientInfo;
-		chatserver.room.clientQ.head -> next = NULL;
-		chatserver.room.clientQ.tail -> prev = NULL;
+	/* the store of wake_at and the load of consumer_waiting must not be reordered */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&q -> consumer_waiting, memory_order_relaxed)) {
+		atomic_fetch_add(&q -> not_empty, 1);
+		futex(&q -> not_empty, FUTEX_WAKE_PRIVATE, 1);
 	}
-	chatserver.room.clientQ.count ++;
-	sem_post(cq_lock);	// release lock
+}
 
-	/* enable cancallation and set the thread cancellation state to asynchronous */
-	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-	
-	struct exchg_msg mbuf;	//mbuf for received msg
-	char content[CONTENT_LENGTH]; //content for storing outgoing msg string
-	int instruction, msg_len;		
-	int new_fd = clientInfo -> socketfd;	
-
-
-	/* send CMD_SERVER_JOIN_OK back to client */
-	if (send_msg_to_server(new_fd, NULL, CMD_SERVER_JOIN_OK, -1) != 0) exit(1);
-
-	/* send welcome message to client */
-	memset(&content, '\0', sizeof(content));
-	strcat(content, clientInfo -> client_name);	
-	strcat(content, " just joins the chat room, welcome!");
-	sem_wait(buf_full);			//wait for space
-	sem_wait(mq_lock);			//now has space, wait for lock
-	strcpy(msgQ->slots[msgQ->tail], content);	//put item in msgQ.slots
-	msgQ->tail = (msgQ->tail + 1) % MAX_QUEUE_MSG;
-	sem_post(mq_lock);				//release lock
-	sem_post(buf_empty);			//indicate one more item in msgQ
-
-	printf("A new client enters [%s %s:%d]\n",clientInfo -> client_name, inet_ntoa(clientInfo -> address.sin_addr), clientInfo -> address.sin_port);
-	//sem_wait(cq_lock);	
-	//printf("[debug]Clients in chatroom : %d.\n", chatserver.room.clientQ.count);
-	//sem_post(cq_lock);
+/*
+ * Encode one outgoing message in the given protocol version
+ * The caller holds the only reference.
+ */
+struct frame *frame_new(int version, int command, int privateData, const char *payload, size_t len)
+{
+	struct frame *f;
 
-    while (1) {
-        // Wait for incomming messages from this client
-        // 1. if it is CMD_CLIENT_SEND, put the message to the bounded buffer
-        // 2. if it is CMD_CLIENT_DEPART: 
-        //  2.1) send a message "$client_name$ leaves, goodbye!" to all other clients
-        //  2.2) free/destroy the resources allocated to this client
-        //  2.3) terminate this thread
-		
-		/* receive msg from client */			
-		memset(&mbuf, 0, sizeof(struct exchg_msg));
-		if (recv(new_fd, &mbuf, CONTENT_LENGTH-1, 0) == -1) {
-		    perror("recv error occurs, exit");
-		    exit(1);
-		}
-
-		/* handle byte endian */
-		instruction = ntohl(mbuf.instruction);
-		msg_len = ntohl(mbuf.private_data);
-		if (instruction == CMD_CLIENT_SEND) {
-			assert(msg_len <= CLIENTNAME_LENGTH);
-
-			memset(&content, '\0', sizeof(content));				
-			strcat(content, clientInfo -> client_name);	
-			strcat(content, ": ");		
-			strcat(content, mbuf.content);
-			sem_wait(buf_full);			//wait for space
-			sem_wait(mq_lock);			//now has space, wait for lock
-			strcpy(msgQ->slots[msgQ->tail], content);	//put item in msgQ.slots
-			msgQ->tail = (msgQ->tail + 1) % MAX_QUEUE_MSG;
-			sem_post(mq_lock);				//release lock
-			sem_post(buf_empty);			//indicate one more item in msgQ
-
-		}
-		else if (instruction == CMD_CLIENT_DEPART) 
-		{	close(new_fd); 
-
-			/* send "Goodbye" msg to every clients */
-			memset(&content, '\0', sizeof(content));				
-			strcat(content, clientInfo -> client_name);	
-			strcat(content, " just leaves the chat room, goodbye!");
-			sem_wait(buf_full);			//wait for space
-			sem_wait(mq_lock);			//now has space, wait for lock
-			strcpy(msgQ->slots[msgQ->tail], content);	//put item in msgQ.slots
-			msgQ->tail = (msgQ->tail + 1) % MAX_QUEUE_MSG;
-			sem_post(mq_lock);				//release lock
-			sem_post(buf_empty);			//indicate one more item in msgQ
-
-			/* remove the client from clientQ, be sure to delete the correct one! */
-			sem_wait(cq_lock);
-			chatserver.room.clientQ.count --;
-			// pay attention to the special cases,such as deleting the head or tail of the list
-			if ((clientInfo -> prev != NULL)&&(clientInfo -> next != NULL)){	
-				clientInfo -> next -> prev = clientInfo -> prev;
-				clientInfo -> prev -> next = clientInfo -> next;
-			}
-			else if ((clientInfo -> next == NULL)&&(clientInfo -> prev != NULL))
-				{clientInfo -> prev -> next = NULL;	chatserver.room.clientQ.tail = clientInfo -> prev;}
-			else if ((clientInfo -> prev == NULL)&&(clientInfo -> next != NULL))
-				{clientInfo -> next -> prev = NULL;	chatserver.room.clientQ.head = clientInfo -> next;}
-			else {chatserver.room.clientQ.head = NULL;	chatserver.room.clientQ.tail = NULL;}
-			sem_post(cq_lock);//release lock
+	f = (struct frame *)pool_alloc(sizeof(struct frame) + proto_frame_size(version, len));
+	atomic_init(&f -> refcnt, 1);
+	f -> stamp = 0;
+	f -> relayed = 0;
+	f -> sender = NULL;
+	f -> lane = LANE_CHAT;
+	f -> seq = 0;
+	f -> buf = f -> data;
+	f -> seg = NULL;
+	f -> len = proto_encode(f -> data, version, command, privateData, payload, len);
+	return f;
+}
 
-			printf("A client departs [%s %s:%d]\n", clientInfo -> client_name, inet_ntoa(clientInfo-> address.sin_addr), clientInfo-> address.sin_port);
-			//sem_wait(cq_lock);
-			//printf("[debug]Clients in chatroom : %d.\n", chatserver.room.clientQ.count);
-			//sem_post(cq_lock);
+/*
+ * Encode one CMD_SERVER_BROADCAST, a v2 client sees its sequence number (0: none)
+ * The caller holds the only reference.
+ */
+struct frame *frame_broadcast(int version, uint64_t seq, const char *msg, size_t len)
+{
+	struct frame *f;
 
-			pthread_detach(pthread_self());	/* instruct system to automatically remove my thread resource after termination */
-			free(clientInfo);		//'newClient' points to the same area 
-			pthread_exit(0); 	
+	f = (struct frame *)pool_alloc(sizeof(struct frame) + proto_broadcast_size(version, len));
+	atomic_init(&f -> refcnt, 1);
+	f -> stamp = 0;
+	f -> relayed = 0;
+	f -> sender = NULL;
+	f -> lane = LANE_CHAT;
+	f -> seq = seq;
+	f -> buf = f -> data;
+	f -> seg = NULL;
+	f -> len = proto_encode_broadcast(f -> data, version, seq, msg, len);
+	return f;
+}
 
-		}
-   }
-} 
+/*
+ * A chat message of len bytes on its way to the room's buffer, still to be written into
+ * data + PROTO_BROADCAST_HEADROOM (there is room for a '\0' behind)
+ * The space in front is for frame_seal(), the message becomes a v2 broadcast where it is.
+ * The caller holds the only reference.
+ */
+struct frame *frame_message(size_t len)
+{
+	struct frame *f;
 
+	f = (struct frame *)pool_alloc(sizeof(struct frame) + PROTO_BROADCAST_HEADROOM + len + 1);
+	atomic_init(&f -> refcnt, 1);
+	f -> stamp = 0;
+	f -> relayed = 0;
+	f -> sender = NULL;
+	f -> lane = LANE_CHAT;
+	f -> seq = 0;
+	f -> buf = f -> data + PROTO_BROADCAST_HEADROOM;
+	f -> seg = NULL;
+	f -> len = len;
+	return f;
+}
 
-void *broadcast_thread_fn(void *arg)
+/*
+ * Encode a CMD_PEER_RELAY of a message of the room, for the peer servers
+ * The caller holds the only reference.
+ */
+struct frame *frame_relay(int command, const char *room, const char *msg, size_t len)
 {
-	/* enable cancallation and set the thread cancellation state to asynchronous */
-	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+	struct frame *f;
 
-    while (1) {
-        // Broadcast the messages in the bounded buffer to all clients, one by one
-		
-		char content[CONTENT_LENGTH]; //content to store outgoing msg string
-		memset(&content, '\0', sizeof(content));
+	f = (struct frame *)pool_alloc(sizeof(struct frame) + proto_relay_size(strlen(room), len));
+	atomic_init(&f -> refcnt, 1);
+	f -> stamp = 0;
+	f -> relayed = 0;
+	f -> sender = NULL;
+	f -> lane = LANE_CHAT;
+	f -> seq = 0;
+	f -> buf = f -> data;
+	f -> seg = NULL;
+	f -> len = proto_encode_relay(f -> data, command, room, msg, len);
+	return f;
+}
+
+/*
+ * Turn a message of frame_message() into its v2 CMD_SERVER_BROADCAST: the header goes right
+ * in front of the text, nothing is copied
+ */
+void frame_seal(struct frame *f, uint64_t seq)
+{
+	char hdr[PROTO_BROADCAST_HEADROOM];
+	size_t n = proto_broadcast_header(hdr, seq, f -> len);
 
-		sem_wait(buf_empty);
-		sem_wait(mq_lock);
-		strcpy(content, msgQ->slots[msgQ->head]);
+	memcpy(f -> data + PROTO_BROADCAST_HEADROOM - n, hdr, n);
+	f -> buf = f -> data + PROTO_BROADCAST_HEADROOM - n;
+	f -> len += n;
+	f -> seq = seq;
+}
 
-		sem_wait(cq_lock);
-		struct chat_client *p = chatserver.room.clientQ.head;
-		while (p != NULL){	
-			if (send_msg_to_server(p -> socketfd, content, CMD_SERVER_BROADCAST, -1) != 0) exit(1);
-			p = p -> next;
+/*
+ * A frame sending a v2 history record right out of its mapped segment, nothing is copied
+ * The caller holds the only reference.
+ */
+struct frame *frame_map(struct history_segment *seg, const struct history_rec *rec)
+{
+	struct frame *f;
+
+	f = (struct frame *)pool_alloc(sizeof(struct frame));
+	atomic_init(&f -> refcnt, 1);
+	f -> stamp = 0;
+	f -> relayed = 0;
+	f -> sender = NULL;
+	f -> lane = LANE_CHAT;
+	f -> seq = rec -> seq;
+	f -> buf = rec -> frame;
+	f -> len = rec -> len;
+	f -> seg = seg;
+	history_segment_get(seg);
+	return f;
+}
+
+/*
+ * Drop one reference to a frame, the last one frees it
+ */
+void frame_put(struct frame *f)
+{
+	if (atomic_fetch_sub_explicit(&f -> refcnt, 1, memory_order_acq_rel) == 1) {
+		if (f -> seg != NULL)
+			history_segment_put(f -> seg);
+		pool_free(f);
+	}
+}
+
+static void out_msg_free(struct out_msg *m)
+{
+	frame_put(m -> frame);
+	pool_free(m);
+}
+
+/* let the event loop of the client wait for EPOLLOUT, or stop waiting - out_lock held */
+static void client_arm(struct chat_client *clientInfo, int armed)
+{
+	struct epoll_event ev;
+
+	if (clientInfo -> out_armed == armed)
+		return;
+	clientInfo -> out_armed = armed;
+	/* a full ring is no matter of the socket, the client sends CMD_CLIENT_RING_ACK */
+	if (clientInfo -> ring != NULL)
+		return;
+	/* a throttled client is not read, see client_hold() */
+	ev.events = (clientInfo -> held != NULL ? 0 : EPOLLIN | EPOLLRDHUP) | (armed ? EPOLLOUT : 0);
+	ev.data.ptr = clientInfo;
+	epoll_ctl(clientInfo -> loop -> epfd, EPOLL_CTL_MOD, clientInfo -> socketfd, &ev);
+}
+
+/*
+ * Attaching a ring: write CMD_SERVER_RING_OK, the descriptors of the ring on its first byte - out_lock held
+ * Once it is all on the socket the client maps the ring, and the outbound queue goes there.
+ * Return value:  1 - attached;
+ *                0 - the socket is full, EPOLLOUT continues;
+ *               -1 - error;
+ */
+static int client_ring_handoff(struct chat_client *clientInfo)
+{
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	struct frame *f = clientInfo -> ring_ok;
+	struct ring *r = clientInfo -> ring_next;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	ssize_t n;
+
+	while (clientInfo -> ring_ok_off < f -> len) {
+		iov.iov_base = (char *)f -> buf + clientInfo -> ring_ok_off;
+		iov.iov_len = f -> len - clientInfo -> ring_ok_off;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		if (clientInfo -> ring_ok_off == 0) {
+			/* SCM_RIGHTS rides on the first byte, the rest of the frame follows like any data */
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			cm = CMSG_FIRSTHDR(&msg);
+			cm -> cmsg_level = SOL_SOCKET;
+			cm -> cmsg_type = SCM_RIGHTS;
+			cm -> cmsg_len = CMSG_LEN(2 * sizeof(int));
+			memcpy(CMSG_DATA(cm), (int []){ r -> memfd, r -> efd }, 2 * sizeof(int));
+		}
+		if ((n = sendmsg(clientInfo -> socketfd, &msg, MSG_NOSIGNAL)) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			return -1;
 		}
-		sem_post(cq_lock);
+		clientInfo -> ring_ok_off += n;
+	}
 
-		msgQ->head = (msgQ->head + 1) % MAX_QUEUE_MSG;
-		sem_post(mq_lock);		
-		sem_post(buf_full);
-    }
+	/* the client has its own mapping now */
+	close(r -> memfd);
+	r -> memfd = -1;
+	frame_put(f);
+	clientInfo -> ring_ok = NULL;
+	clientInfo -> ring_next = NULL;
+	client_arm(clientInfo, 0);
+	clientInfo -> ring = r;
+	return 1;
 }
 
+/*
+ * Write as much of the outbound queue as the socket (or the ring) takes - out_lock held
+ * Return value:  0 - success (the queue may not be empty);
+ *               -1 - error;
+ */
+static int client_write(struct chat_client *clientInfo)
+{
+#define OUT_IOV_MAX BATCH_MAX
+	struct iovec iov[OUT_IOV_MAX];
+	struct thread_stats *st = stats_self();
+	struct msghdr msg;
+	struct out_msg *m;
+	long long now = 0;
+	size_t total;
+	int cnt, max, zc, ret;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	while (1) {
+		/* attaching a ring: a message begun on the socket is finished there, CMD_SERVER_RING_OK follows */
+		if (clientInfo -> ring_ok != NULL && (clientInfo -> out_head == NULL || clientInfo -> out_head -> off == 0) &&
+				(ret = client_ring_handoff(clientInfo)) != 1)
+			return ret;
+		if (clientInfo -> out_head == NULL)
+			break;
+		total = 0;
+		max = (clientInfo -> ring_ok != NULL) ? 1 : OUT_IOV_MAX;
+		for (cnt = 0, m = clientInfo -> out_head; m != NULL && cnt < max; m = m -> next, cnt++) {
+			iov[cnt].iov_base = (char *)m -> frame -> buf + m -> off;
+			iov[cnt].iov_len = m -> frame -> len - m -> off;
+			total += iov[cnt].iov_len;
+		}
+		msg.msg_iovlen = cnt;
+
+		if (clientInfo -> ring != NULL) {
+			/* the same bytes into shared memory, no system call while the client keeps up */
+			zc = 0;
+			if ((n = ring_writev(clientInfo -> ring, iov, cnt)) == 0)
+				return 0;
+		} else {
+			/* small writes are copied, pinning the pages would cost more */
+			zc = clientInfo -> zerocopy && total >= chatserver.zc_threshold;
+			n = sendmsg(clientInfo -> socketfd, &msg, MSG_NOSIGNAL | (zc ? MSG_ZEROCOPY : 0));
+			if (n == -1 && zc && errno == ENOBUFS) {
+				/* out of memory for pinned pages (optmem), copy this time */
+				zc = 0;
+				n = sendmsg(clientInfo -> socketfd, &msg, MSG_NOSIGNAL);
+			}
+		}
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (zc) {
+			/* every message the send touched waits for the kernel to let go of it */
+			size_t left = n;
+			for (m = clientInfo -> out_head; m != NULL && left > 0; m = m -> next) {
+				m -> zc = 1;
+				m -> zc_tag = clientInfo -> zc_next;
+				left -= (left < (size_t)(m -> frame -> len - m -> off)) ? left : (size_t)(m -> frame -> len - m -> off);
+			}
+			clientInfo -> zc_next++;
+			stat_add(&st -> zc_sends, 1);
+		}
+		clientInfo -> out_bytes -= n;
+		stat_add(&st -> bytes_out, n);
+		while (n > 0) {
+			m = clientInfo -> out_head;
+			if (n < m -> frame -> len - m -> off) {
+				m -> off += n;
+				break;
+			}
+			n -= m -> frame -> len - m -> off;
+			clientInfo -> out_head = m -> next;
+			if (clientInfo -> out_head == NULL)
+				clientInfo -> out_tail = NULL;
+			clientInfo -> sent_msgs++;
+			stat_add(&st -> msgs_out, 1);
+			if (m -> frame -> stamp != 0 && !m -> replayed) {
+				if (now == 0)
+					now = now_ns();
+				hist_record(&st -> latency, (now - m -> frame -> stamp) / 1000);
+			}
+			if (m -> zc) {
+				m -> next = NULL;
+				if (clientInfo -> zc_tail != NULL)
+					clientInfo -> zc_tail -> next = m;
+				else
+					clientInfo -> zc_head = m;
+				clientInfo -> zc_tail = m;
+			} else {
+				out_msg_free(m);
+			}
+		}
+	}
+	return 0;
+}
 
 /*
- * Signal handler (when "Ctrl + C" is pressed)
+ * Take the zero-copy notifications off the error queue of a socket, and free what the kernel is done with
+ * lock guards the zc list, NULL if no other thread sees it.
+ * Return value: # of notifications saying the kernel copied after all
  */
-void shutdown_handler(int signum)
+static int zc_reap(int fd, struct out_msg **head, struct out_msg **tail, pthread_mutex_t *lock)
 {
-    // Implement server shutdown here
-    // 1. send CMD_SERVER_CLOSE message to all clients
-    // 2. terminates all threads: broadcast_thread, client_thread(s)
-    // 3. free/destroy all dynamically allocated resources: memory, mutex, semaphore, whatever.
-	
-	
-	printf("Kill by SIGKILL (kill -2)\n");
-	printf("Shutdown server .....\n");
-	/* terminate broadcast_thread */
-	pthread_cancel(chatserver.room.broadcast_thread);
-	pthread_join(chatserver.room.broadcast_thread, NULL);
-
-	/* send CMD_SERVER_CLOSE message to all clients, terminate all client_thread & free clientQ */
-	sem_wait(cq_lock);
-	struct chat_client *p = chatserver.room.clientQ.head;		
-	while (p != NULL){	
-		if (send_msg_to_server(p -> socketfd, NULL, CMD_SERVER_CLOSE, -1) != 0) exit(1);
-		pthread_cancel(p -> client_thread);
-		pthread_join(p -> client_thread, NULL);
-		close(p -> socketfd);	//close all new_fd
-		if (p -> next != NULL){
-			p = p -> next;
-			free(p -> prev);
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+	struct sock_extended_err *err;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct out_msg *m;
+	int copied = 0;
+
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1)
+			return copied;		// EAGAIN: all taken
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!((cm -> cmsg_level == SOL_IP && cm -> cmsg_type == IP_RECVERR) ||
+					(cm -> cmsg_level == SOL_IPV6 && cm -> cmsg_type == IPV6_RECVERR)))
+				continue;
+			err = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (err -> ee_errno != 0 || err -> ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			/* sends ee_info..ee_data are done, TCP completes them in order */
+			if (lock != NULL)
+				pthread_mutex_lock(lock);
+			while ((m = *head) != NULL && (int32_t)(m -> zc_tag - err -> ee_data) <= 0) {
+				*head = m -> next;
+				if (*head == NULL)
+					*tail = NULL;
+				out_msg_free(m);
+			}
+			if (lock != NULL)
+				pthread_mutex_unlock(lock);
+			if (err -> ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				copied++;
 		}
-		else{free(p); break;}
 	}
-	sem_post(cq_lock);	//release lock
-	
-	/* free msgQ */
-	int i = 0; 
-	while (i < MAX_QUEUE_MSG){
-		free(msgQ -> slots[i]);
-		i++;
+}
+
+/*
+ * Take the zero-copy notifications of a client, and free what the kernel is done with
+ */
+void client_zc_reap(struct chat_client *clientInfo)
+{
+	int copied = zc_reap(clientInfo -> socketfd, &clientInfo -> zc_head, &clientInfo -> zc_tail, &clientInfo -> out_lock);
+
+	if (copied > 0) {
+		/* no gain on this route, stop pinning pages for nothing */
+		pthread_mutex_lock(&clientInfo -> out_lock);
+		clientInfo -> zerocopy = 0;
+		pthread_mutex_unlock(&clientInfo -> out_lock);
+		stat_add(&stats_self() -> zc_copied, copied);
 	}
+}
 
-	/* destroy mutex, semaphore */
-	sem_destroy(buf_full);	//release semaphore resources
-	sem_destroy(buf_empty);
-	sem_destroy(mq_lock);
-	sem_destroy(cq_lock);
+/*
+ * Look after the sockets of departed clients still waiting for zero-copy notifications - on the loop thread
+ * Return value: whether some are left
+ */
+static int loop_linger(struct event_loop *loop)
+{
+	struct zc_linger *l, **pp = &loop -> lingering;
+	struct sockaddr sa;
+
+	while ((l = *pp) != NULL) {
+		zc_reap(l -> fd, &l -> zc_head, &l -> zc_tail, NULL);
+		if (l -> zc_head == NULL) {
+			close(l -> fd);
+			*pp = l -> next;
+			free(l);
+			continue;
+		}
+		if (!l -> reset && loop -> now >= l -> deadline) {
+			/* AF_UNSPEC resets the connection: the kernel purges its send queue, the socket stays to tell us */
+			printf("A departed client does not take its messages, reset the connection\n");
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_family = AF_UNSPEC;
+			connect(l -> fd, &sa, sizeof(sa));
+			l -> reset = 1;
+		}
+		pp = &l -> next;
+	}
+	return loop -> lingering != NULL;
+}
+
+/*
+ * The client lags behind, apply the slow consumer policy - out_lock held
+ * Messages which are partially written are never touched, the client would see a broken message;
+ * neither are the urgent ones.
+ */
+static void client_lagging(struct chat_client *clientInfo)
+{
+	struct out_msg *m, **pp, *notice;
+	char content[CONTENT_LENGTH];
+	unsigned long skipped = 0;
+
+	if (clientInfo -> lag_events++ == 0)
+		printf("A client lags behind [%s %s:%d] %lu bytes queued\n", clientInfo -> client_name,
+				inet_ntoa(clientInfo -> address.sin_addr), clientInfo -> address.sin_port, (unsigned long)clientInfo -> out_bytes);
+
+	switch (chatserver.slow_policy) {
+	case SLOW_DISCONNECT:
+		/* the event loop sees the hang up and removes the client */
+		clientInfo -> dead = 1;
+		shutdown(clientInfo -> socketfd, SHUT_RDWR);
+		stat_add(&stats_self() -> disconnects, 1);
+		return;
+
+	case SLOW_DROP_OLDEST:
+		/* drop from the head until the lag is acceptable, always keep the newest message */
+		pp = &clientInfo -> out_head;
+		while ((m = *pp) != NULL && m -> next != NULL &&
+				(clientInfo -> out_bytes > chatserver.max_lag_bytes ||
+				 now_ms() - m -> stamp > chatserver.max_lag_ms)) {
+			if (m -> off > 0 || m -> urgent || m -> frame -> lane != LANE_CHAT) {
+				pp = &m -> next;
+				continue;
+			}
+			*pp = m -> next;
+			clientInfo -> out_bytes -= m -> frame -> len;
+			clientInfo -> dropped_msgs++;
+			stat_add(&stats_self() -> drops, 1);
+			out_msg_free(m);
+		}
+		break;
+
+	case SLOW_COALESCE:
+		/* replace everything not started yet by one notice */
+		pp = &clientInfo -> out_head;
+		while ((m = *pp) != NULL) {
+			if (m -> off > 0 || m -> urgent || m -> frame -> lane != LANE_CHAT) {
+				pp = &m -> next;
+				continue;
+			}
+			*pp = m -> next;
+			clientInfo -> out_bytes -= m -> frame -> len;
+			if (m -> skipped > 0) {
+				skipped += m -> skipped;
+			} else {
+				skipped++;
+				clientInfo -> dropped_msgs++;
+				stat_add(&stats_self() -> drops, 1);
+			}
+			out_msg_free(m);
+		}
+		/* only notices, urgent or begun messages lag: nothing was skipped, nothing to tell */
+		if (skipped == 0)
+			break;
+		snprintf(content, sizeof(content), "*** %lu messages skipped, you are too slow ***", skipped);
+		notice = (struct out_msg *)pool_alloc(sizeof(struct out_msg));
+		notice -> next = NULL;
+		notice -> frame = frame_broadcast(clientInfo -> version, 0, content, strlen(content));
+		notice -> off = 0;
+		notice -> skipped = skipped;
+		notice -> replayed = 0;
+		notice -> urgent = 0;
+		notice -> zc = 0;
+		notice -> stamp = now_ms();
+		*pp = notice;
+		clientInfo -> out_bytes += notice -> frame -> len;
+		break;
+	}
+
+	/* the head may have changed, find the tail again */
+	for (m = clientInfo -> out_head; m != NULL && m -> next != NULL; m = m -> next)
+		;
+	clientInfo -> out_tail = m;
+}
+
+#define QUEUE_REPLAYED  1   // sent again, not counted in the fan-out latency
+#define QUEUE_URGENT    2   // ahead of all but the messages begun already, and the urgent ones before
+
+/* see client_enqueue() */
+static void client_queue_frames(struct chat_client *clientInfo, struct frame **f, int n, int flags)
+{
+	struct out_msg *m, **pp;
+	long long now = now_ms();
+	int i;
+
+	pthread_mutex_lock(&clientInfo -> out_lock);
+	if (clientInfo -> dead) {
+		pthread_mutex_unlock(&clientInfo -> out_lock);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		m = (struct out_msg *)pool_alloc(sizeof(struct out_msg));
+		m -> next = NULL;
+		m -> frame = f[i];
+		m -> off = 0;
+		m -> skipped = 0;
+		m -> stamp = now;
+		m -> replayed = (flags & QUEUE_REPLAYED) != 0;
+		m -> urgent = (flags & QUEUE_URGENT) != 0;
+		m -> zc = 0;
+		atomic_fetch_add_explicit(&f[i] -> refcnt, 1, memory_order_relaxed);
+
+		if (m -> urgent) {
+			for (pp = &clientInfo -> out_head; *pp != NULL && ((*pp) -> off > 0 || (*pp) -> urgent); pp = &(*pp) -> next)
+				;
+			m -> next = *pp;
+			*pp = m;
+			if (m -> next == NULL)
+				clientInfo -> out_tail = m;
+		} else {
+			if (clientInfo -> out_tail != NULL)
+				clientInfo -> out_tail -> next = m;
+			else
+				clientInfo -> out_head = m;
+			clientInfo -> out_tail = m;
+		}
+		clientInfo -> out_bytes += f[i] -> len;
+	}
+
+	if (!clientInfo -> out_armed) {
+		/* nothing was pending, most likely the socket takes it all */
+		if (client_write(clientInfo) != 0) {
+			/* the event loop notices the broken connection by itself */
+			pthread_mutex_unlock(&clientInfo -> out_lock);
+			return;
+		}
+	}
+	if (clientInfo -> out_head != NULL) {
+		if (clientInfo -> state == CLIENT_PEER) {
+			/* a peer server loses no message to the slow client policy, one far behind is linked again */
+			if (clientInfo -> out_bytes > PEER_MAX_QUEUE) {
+				printf("A peer server lags behind, drop the link [%016llx]\n", (unsigned long long)clientInfo -> node);
+				clientInfo -> dead = 1;
+				shutdown(clientInfo -> socketfd, SHUT_RDWR);
+			}
+		} else if (clientInfo -> out_bytes > chatserver.max_lag_bytes ||
+				now_ms() - clientInfo -> out_head -> stamp > chatserver.max_lag_ms)
+			client_lagging(clientInfo);
+		if (clientInfo -> out_bytes > clientInfo -> out_peak)
+			clientInfo -> out_peak = clientInfo -> out_bytes;
+	}
+	if (clientInfo -> out_head != NULL || clientInfo -> ring_ok != NULL)
+		client_arm(clientInfo, !clientInfo -> dead);
+	pthread_mutex_unlock(&clientInfo -> out_lock);
+}
+
+/*
+ * Queue one message for a client and write it out right away if the client keeps up
+ * The queue takes its own reference to the frame, the caller keeps its one.
+ * Never blocks: a client which cannot keep up is handled by the slow consumer policy.
+ */
+void client_enqueue(struct chat_client *clientInfo, struct frame *f)
+{
+	client_queue_frames(clientInfo, &f, 1, 0);
+}
+
+/*
+ * Queue several messages for a client at once, like client_enqueue()
+ * A client keeping up gets them all with one writev().
+ */
+void client_enqueue_batch(struct chat_client *clientInfo, struct frame **f, int n)
+{
+	client_queue_frames(clientInfo, f, n, 0);
+}
+
+/*
+ * Queue a message which was broadcast before (history, resume), like client_enqueue()
+ */
+void client_replay(struct chat_client *clientInfo, struct frame *f)
+{
+	client_queue_frames(clientInfo, &f, 1, QUEUE_REPLAYED);
+}
+
+/*
+ * Queue a message ahead of what waits for the client, like client_enqueue()
+ * Only a message begun already goes first, the client would see it broken otherwise.
+ */
+void client_enqueue_urgent(struct chat_client *clientInfo, struct frame *f)
+{
+	client_queue_frames(clientInfo, &f, 1, QUEUE_URGENT);
+}
+
+/*
+ * Queue one control message (no text) for a client, in its protocol version, like client_enqueue()
+ * A connection dropped right after gets it as far as its socket takes it at once, the loop never waits.
+ */
+static void client_notify(struct chat_client *clientInfo, int command, int privateData)
+{
+	struct frame *f = frame_new(clientInfo -> version, command, privateData, NULL, 0);
+
+	client_enqueue(clientInfo, f);
+	frame_put(f);
+}
+
+/*
+ * The socket of a client is writable again, continue with its outbound queue
+ * Return value:  0 - success;
+ *               -1 - error;
+ */
+int client_flush(struct chat_client *clientInfo)
+{
+	int ret;
+
+	pthread_mutex_lock(&clientInfo -> out_lock);
+	ret = client_write(clientInfo);
+	if (ret == 0 && clientInfo -> out_head == NULL && clientInfo -> ring_ok == NULL)
+		client_arm(clientInfo, 0);
+	pthread_mutex_unlock(&clientInfo -> out_lock);
+	return ret;
+}
+
+/*
+ * Fan-out pool: the workers write the shards of the broadcasts of large rooms
+ */
+void fanout_init(int nworkers)
+{
+	struct fanout_pool *pool = &chatserver.fanout;
+	int i;
+
+	pool -> nworkers = nworkers;
+	atomic_init(&pool -> work, 0);
+	atomic_init(&pool -> stopping, 0);
+	if (nworkers == 0)
+		return;
+	pool -> workers = (struct fanout_worker *)aligned_alloc(CACHE_LINE, sizeof(struct fanout_worker) * nworkers);
+	for (i = 0; i < nworkers; i++) {
+		pthread_mutex_init(&pool -> workers[i].lock, NULL);
+		pool -> workers[i].head = pool -> workers[i].count = 0;
+		pthread_create(&pool -> workers[i].thread, NULL, fanout_worker_fn, (void *)&pool -> workers[i]);
+	}
+	printf("%d fan-out worker(s) share the broadcasts of rooms over %d clients\n", nworkers, FANOUT_SHARD_SIZE);
+}
+
+void fanout_stop(void)
+{
+	struct fanout_pool *pool = &chatserver.fanout;
+	int i;
+
+	atomic_store(&pool -> stopping, 1);
+	atomic_fetch_add(&pool -> work, 1);
+	futex(&pool -> work, FUTEX_WAKE_PRIVATE, INT_MAX);
+	for (i = 0; i < pool -> nworkers; i++)
+		pthread_join(pool -> workers[i].thread, NULL);
+}
+
+/* take a shard: from the head of the own deque (self, if any), else from the tail of another one */
+static int fanout_take(struct fanout_worker *self, struct fanout_task *t)
+{
+	struct fanout_pool *pool = &chatserver.fanout;
+	struct fanout_worker *w;
+	int i, start;
+
+	if (self != NULL) {
+		pthread_mutex_lock(&self -> lock);
+		if (self -> count > 0) {
+			*t = self -> tasks[self -> head];
+			self -> head = (self -> head + 1) % FANOUT_QUEUE_SIZE;
+			self -> count--;
+			pthread_mutex_unlock(&self -> lock);
+			return 1;
+		}
+		pthread_mutex_unlock(&self -> lock);
+	}
+
+	/* start with the next worker, so the thieves do not all go for the same deque */
+	start = (self != NULL) ? (int)(self - pool -> workers) + 1 : 0;
+	for (i = 0; i < pool -> nworkers; i++) {
+		w = &pool -> workers[(start + i) % pool -> nworkers];
+		if (w == self || w -> count == 0)	// a racy peek, the lock decides
+			continue;
+		pthread_mutex_lock(&w -> lock);
+		if (w -> count > 0) {
+			w -> count--;
+			*t = w -> tasks[(w -> head + w -> count) % FANOUT_QUEUE_SIZE];
+			pthread_mutex_unlock(&w -> lock);
+			return 1;
+		}
+		pthread_mutex_unlock(&w -> lock);
+	}
+	return 0;
+}
+
+/*
+ * Queue a batch of its room for a client - cq_lock held
+ * A subscriber gets only the messages with its keywords in them, as masks tell.
+ */
+static void client_deliver(struct chat_client *clientInfo, struct frame **f, int n, const uint64_t *masks)
+{
+	struct frame *mine[BATCH_MAX];
+	uint64_t m;
+	int k = 0;
+
+	if (clientInfo -> subs == NULL || masks == NULL) {
+		client_enqueue_batch(clientInfo, f, n);
+		return;
+	}
+	for (m = masks[clientInfo -> sub_slot]; m != 0; m &= m - 1)
+		mine[k++] = f[__builtin_ctzll(m)];
+	if (k > 0)
+		client_enqueue_batch(clientInfo, mine, k);
+}
+
+/* queue the batch on every client of a shard */
+static void fanout_run(struct fanout_task *t)
+{
+	struct fanout_job *job = t -> job;
+	struct chat_client *p = t -> first;
+	int i;
+
+	for (i = 0; i < t -> count; i++, p = p -> next)
+		client_deliver(p, job -> frames[p -> version], job -> n, job -> masks);
+	if (atomic_fetch_sub_explicit(&job -> pending, 1, memory_order_acq_rel) == 1) {
+		atomic_store(&job -> done, 1);
+		futex(&job -> done, FUTEX_WAKE_PRIVATE, 1);
+	}
+}
+
+void *fanout_worker_fn(void *arg)
+{
+	struct fanout_worker *self = arg;
+	struct fanout_pool *pool = &chatserver.fanout;
+	struct fanout_task t;
+	int v;
+
+	stats_register("fanout %d", (int)(self - pool -> workers));
+	while (!atomic_load(&pool -> stopping)) {
+		/* read the futex word first, shards dealt out after this wake us up */
+		v = atomic_load(&pool -> work);
+		while (fanout_take(self, &t))
+			fanout_run(&t);
+		futex(&pool -> work, FUTEX_WAIT_PRIVATE, v);
+	}
+	return NULL;
+}
+
+/*
+ * Write a batch to all clients of a large room with the help of the fan-out pool - cq_lock held
+ * Returns when every client has the batch queued: the clients cannot leave meanwhile,
+ * and the next batch of the room cannot overtake this one.
+ */
+void fanout_broadcast(struct chat_room *room, struct frame *f[][BATCH_MAX], int n, const uint64_t *masks)
+{
+	struct fanout_pool *pool = &chatserver.fanout;
+	struct fanout_worker *w;
+	struct fanout_task t;
+	struct fanout_job job;
+	struct chat_client *p = room -> clientQ.head;
+	int v, shard = 0;
+
+	for (v = PROTO_V1; v <= PROTO_V2; v++)
+		job.frames[v] = f[v];
+	job.n = n;
+	job.masks = masks;
+	atomic_init(&job.pending, 1);	// the dealing itself, so the job cannot finish early
+	atomic_init(&job.done, 0);
+
+	while (p != NULL) {
+		t.first = p;
+		t.job = &job;
+		for (t.count = 0; p != NULL && t.count < FANOUT_SHARD_SIZE; t.count++)
+			p = p -> next;
+
+		atomic_fetch_add_explicit(&job.pending, 1, memory_order_relaxed);
+		w = &pool -> workers[shard++ % pool -> nworkers];
+		pthread_mutex_lock(&w -> lock);
+		if (w -> count < FANOUT_QUEUE_SIZE) {
+			w -> tasks[(w -> head + w -> count) % FANOUT_QUEUE_SIZE] = t;
+			w -> count++;
+			pthread_mutex_unlock(&w -> lock);
+		} else {
+			pthread_mutex_unlock(&w -> lock);
+			fanout_run(&t);		// the deque is full, do it ourselves
+		}
+	}
+	atomic_fetch_add(&pool -> work, 1);
+	futex(&pool -> work, FUTEX_WAKE_PRIVATE, pool -> nworkers);
+
+	/* help out instead of waiting idle, then wait for the shards the workers are still writing */
+	if (atomic_fetch_sub_explicit(&job.pending, 1, memory_order_acq_rel) == 1)
+		return;
+	while (atomic_load(&job.pending) > 0 && fanout_take(NULL, &t))
+		fanout_run(&t);
+	while (atomic_load(&job.done) == 0)
+		futex(&job.done, FUTEX_WAIT_PRIVATE, 0);
+}
+
+/*
+ * Metrics: every thread counts in a thread_stats block of its own, without any lock
+ */
+static __thread struct thread_stats *self_stats;
+
+/*
+ * Give the calling thread a thread_stats block, named after what it does
+ */
+void stats_register(const char *fmt, ...)
+{
+	struct thread_stats *st;
+	va_list ap;
+
+	st = (struct thread_stats *)aligned_alloc(CACHE_LINE, sizeof(struct thread_stats));
+	memset(st, 0, sizeof(struct thread_stats));
+	va_start(ap, fmt);
+	vsnprintf(st -> name, sizeof(st -> name), fmt, ap);
+	va_end(ap);
+
+	pthread_mutex_lock(&chatserver.metrics.lock);
+	st -> next = chatserver.metrics.threads;
+	chatserver.metrics.threads = st;
+	pthread_mutex_unlock(&chatserver.metrics.lock);
+	self_stats = st;
+}
+
+/*
+ * The thread_stats block of the calling thread
+ */
+struct thread_stats *stats_self(void)
+{
+	if (self_stats == NULL)
+		stats_register("thread");
+	return self_stats;
+}
+
+/*
+ * Take the cq_lock of a room, counting the time spent waiting for it
+ */
+static void cq_lock(struct chat_room *room)
+{
+	struct thread_stats *st;
+	long long t;
+
+	if (sem_trywait(&room -> clientQ.cq_lock) == 0)
+		return;
+	t = now_ns();
+	sem_wait(&room -> clientQ.cq_lock);
+	st = stats_self();
+	stat_add(&st -> cq_waits, 1);
+	stat_add(&st -> cq_wait_ns, now_ns() - t);
+}
+
+static void json_string(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(out, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(out, "\\u%04x", (unsigned char)*s);
+		else
+			fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+#define STATS_COUNTERS(_c) \
+	_c(msgs_in) _c(bytes_in) _c(msgs_out) _c(bytes_out) _c(broadcasts) \
+	_c(drops) _c(disconnects) _c(timeouts) _c(limited) _c(cq_waits) _c(cq_wait_ns) _c(zc_sends) _c(zc_copied)
+
+static void write_thread(FILE *out, int json, struct thread_stats *st, const char *name)
+{
+	if (json) {
+		fprintf(out, "{\"name\":");
+		json_string(out, name);
+#define _c(x) fprintf(out, ",\"" #x "\":%lu", atomic_load_explicit(&st -> x, memory_order_relaxed));
+		STATS_COUNTERS(_c)
+#undef _c
+		fprintf(out, "}");
+	} else {
+		fprintf(out, "%-24.24s", name);
+#define _c(x) fprintf(out, " %12lu", atomic_load_explicit(&st -> x, memory_order_relaxed));
+		STATS_COUNTERS(_c)
+#undef _c
+		fprintf(out, "\n");
+	}
+}
+
+struct queue_stats {
+	FILE *out;
+	int json;
+	int rooms;
+	unsigned long clients, queued;
+};
+
+static void write_room(struct chat_room *room, void *arg)
+{
+	struct queue_stats *qs = arg;
+	size_t depth = atomic_load_explicit(&room -> chatmsgQ.tail, memory_order_relaxed) -
+			atomic_load_explicit(&room -> chatmsgQ.head, memory_order_relaxed);
+
+	if (qs -> json) {
+		fprintf(qs -> out, "%s{\"name\":", qs -> rooms > 0 ? "," : "");
+		json_string(qs -> out, room -> name);
+		fprintf(qs -> out, ",\"clients\":%d,\"queued\":%zu}", room -> clientQ.count, depth);
+	} else {
+		fprintf(qs -> out, "%-24.24s %12d %12zu\n", room -> name, room -> clientQ.count, depth);
+	}
+	qs -> rooms++;
+	qs -> clients += room -> clientQ.count;
+	qs -> queued += depth;
+}
+
+/*
+ * Write the counters of every thread and their sum, the fan-out latency and the depth of the room buffers
+ */
+void write_stats(FILE *out, int json)
+{
+	struct thread_stats *sum, *st;
+	struct queue_stats qs = { out, json, 0, 0, 0 };
+	double pct[] = { 50, 90, 99, 99.9, 100 };
+	const char *pct_name[] = { "p50", "p90", "p99", "p99.9", "max" };
+	size_t slab_bytes, large_bytes;
+	int i;
+
+	sum = (struct thread_stats *)calloc(1, sizeof(struct thread_stats));
+	pool_usage(&slab_bytes, &large_bytes);
+	pthread_mutex_lock(&chatserver.metrics.lock);
+	st = chatserver.metrics.threads;
+	pthread_mutex_unlock(&chatserver.metrics.lock);
+
+	/* blocks are only ever pushed at the head, the list can be walked without the lock */
+	if (json)
+		fprintf(out, "{\"uptime_ms\":%lld,\"threads\":[", now_ms() - chatserver.metrics.start);
+	else
+		fprintf(out, "%-24s %12s %12s %12s %12s %12s %12s %12s %12s %12s %12s %12s %12s %12s\n", "thread", "msgs_in", "bytes_in",
+				"msgs_out", "bytes_out", "broadcasts", "drops", "disconnects", "timeouts", "limited", "cq_waits", "cq_wait_ns", "zc_sends", "zc_copied");
+	for (i = 0; st != NULL; st = st -> next, i++) {
+		if (json && i > 0)
+			fprintf(out, ",");
+		write_thread(out, json, st, st -> name);
+#define _c(x) stat_add(&sum -> x, atomic_load_explicit(&st -> x, memory_order_relaxed));
+		STATS_COUNTERS(_c)
+#undef _c
+		hist_merge(&sum -> latency, &st -> latency);
+	}
+	if (json) {
+		fprintf(out, "],\"total\":");
+		write_thread(out, json, sum, "total");
+		fprintf(out, ",\"latency_us\":{\"count\":%lu", atomic_load(&sum -> latency.total));
+		for (i = 0; i < 5; i++)
+			fprintf(out, ",\"%s\":%llu", pct_name[i], hist_percentile(&sum -> latency, pct[i]));
+		fprintf(out, "},\"rooms\":[");
+		room_foreach(write_room, &qs);
+		fprintf(out, "],\"clients\":%lu,\"queued\":%lu,\"pool_slab_bytes\":%zu,\"pool_large_bytes\":%zu,\"peers\":%d}\n",
+				qs.clients, qs.queued, slab_bytes, large_bytes, atomic_load(&chatserver.fed.npeers));
+	} else {
+		write_thread(out, json, sum, "total");
+		fprintf(out, "\nfan-out latency (us, room buffer to socket) count %lu", atomic_load(&sum -> latency.total));
+		for (i = 0; i < 5; i++)
+			fprintf(out, " %s %llu", pct_name[i], hist_percentile(&sum -> latency, pct[i]));
+		fprintf(out, "\n\n%-24s %12s %12s\n", "room", "clients", "queued");
+		room_foreach(write_room, &qs);
+		fprintf(out, "%d rooms, %lu clients, %lu messages queued, up %lld s\n", qs.rooms, qs.clients, qs.queued,
+				(now_ms() - chatserver.metrics.start) / 1000);
+		fprintf(out, "memory pools: %zu KB in slabs, %zu KB in large blocks\n", slab_bytes / 1024, large_bytes / 1024);
+		fprintf(out, "node %016llx, %d peer server(s) linked\n", (unsigned long long)chatserver.fed.node,
+				atomic_load(&chatserver.fed.npeers));
+	}
+	free(sum);
+}
+
+/*
+ * Write the slow consumer statistics of the clients
+ */
+struct lag_stats {
+	FILE *out;
+	int json;
+	int all;	// every client, or only those which lag or ever lagged behind
+	unsigned long total, lagged, dropped;
+};
+
+static void write_room_clients(struct chat_room *room, void *arg)
+{
+	struct lag_stats *st = arg;
+	struct chat_client *p;
+	long long now = now_ms(), lag;
+
+	cq_lock(room);
+	for (p = room -> clientQ.head; p != NULL; p = p -> next) {
+		pthread_mutex_lock(&p -> out_lock);
+		st -> total++;
+		st -> dropped += p -> dropped_msgs;
+		lag = (p -> out_head != NULL) ? now - p -> out_head -> stamp : 0;
+		if (p -> lag_events > 0 || p -> out_bytes > 0)
+			st -> lagged++;
+		if (!st -> all && p -> lag_events == 0 && p -> out_bytes == 0) {
+			pthread_mutex_unlock(&p -> out_lock);
+			continue;
+		}
+		if (st -> json) {
+			fprintf(st -> out, "%s{\"name\":", st -> total > 1 ? "," : "");
+			json_string(st -> out, p -> client_name);
+			fprintf(st -> out, ",\"room\":");
+			json_string(st -> out, room -> name);
+			fprintf(st -> out, ",\"address\":\"%s:%d\",\"queued\":%lu,\"peak\":%lu,\"lag_ms\":%lld,"
+					"\"sent\":%lu,\"dropped\":%lu,\"lags\":%lu}",
+					inet_ntoa(p -> address.sin_addr), p -> address.sin_port,
+					(unsigned long)p -> out_bytes, (unsigned long)p -> out_peak, lag,
+					p -> sent_msgs, p -> dropped_msgs, p -> lag_events);
+		} else {
+			fprintf(st -> out, "%-20.20s %-12.12s %15s:%-5d %10lu %10lu %8lld %10lu %10lu %6lu\n", p -> client_name, room -> name,
+					inet_ntoa(p -> address.sin_addr), p -> address.sin_port,
+					(unsigned long)p -> out_bytes, (unsigned long)p -> out_peak, lag,
+					p -> sent_msgs, p -> dropped_msgs, p -> lag_events);
+		}
+		pthread_mutex_unlock(&p -> out_lock);
+	}
+	sem_post(&room -> clientQ.cq_lock);
+}
+
+void write_clients(FILE *out, int json, int all)
+{
+	struct lag_stats st;
+
+	memset(&st, 0, sizeof(st));
+	st.out = out;
+	st.json = json;
+	st.all = all;
+	if (json) {
+		fprintf(out, "{\"clients\":[");
+		room_foreach(write_room_clients, &st);
+		fprintf(out, "],\"total\":%lu,\"lagged\":%lu,\"dropped\":%lu}\n", st.total, st.lagged, st.dropped);
+	} else {
+		fprintf(out, "%-20s %-12s %-21s %10s %10s %8s %10s %10s %6s\n", "client", "room", "address",
+				"queued", "peak", "lag_ms", "sent", "dropped", "lags");
+		room_foreach(write_room_clients, &st);
+		fprintf(out, "%lu clients in %d rooms, %lu lagging or lagged, %lu messages dropped\n",
+				st.total, atomic_load(&chatserver.rooms.count), st.lagged, st.dropped);
+	}
+}
+
+/*
+ * Print the lagging clients and the metrics upon SIGUSR1
+ */
+void *stats_thread_fn(void *arg)
+{
+	sigset_t mask;
+	int sig;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	while (sigwait(&mask, &sig) == 0) {
+		write_clients(stdout, 0, 0);
+		printf("\n");
+		write_stats(stdout, 0);
+		fflush(stdout);
+	}
+	return NULL;
+}
+
+/*
+ * Answer the queries on the admin socket, one command line per connection:
+ *   stats [json]     - the counters of all threads, fan-out latency, room buffers
+ *   clients [json]   - the outbound queue of every client
+ *   kick <name>      - disconnect a client
+ */
+void *admin_thread_fn(void *arg)
+{
+	int fd = (int)(intptr_t)arg, conn;
+	struct timeval tv = {1, 0};
+	char cmd[128], *word, *format, *save;
+	size_t len;
+	ssize_t n;
+	FILE *out;
+
+	while (1) {
+		if ((conn = accept(fd, NULL, NULL)) == -1) {
+			if (errno != EINTR)
+				perror("admin accept");
+			continue;
+		}
+		setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		for (len = 0; len < sizeof(cmd) - 1; len += n) {
+			n = recv(conn, cmd + len, sizeof(cmd) - 1 - len, 0);
+			if (n <= 0 || memchr(cmd + len, '\n', n) != NULL) {
+				len += (n > 0) ? n : 0;
+				break;
+			}
+		}
+		cmd[len] = '\0';
+		if ((out = fdopen(conn, "w")) == NULL) {
+			close(conn);
+			continue;
+		}
+
+		word = strtok_r(cmd, " \t\r\n", &save);
+		format = (word != NULL) ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+		if (word != NULL && strcmp(word, "stats") == 0)
+			write_stats(out, format != NULL && strcmp(format, "json") == 0);
+		else if (word != NULL && strcmp(word, "clients") == 0)
+			write_clients(out, format != NULL && strcmp(format, "json") == 0, 1);
+		else if (word != NULL && strcmp(word, "kick") == 0 && format != NULL)
+			fprintf(out, name_index_kick(format) ? "%s is kicked out\n" : "no client %s here\n", format);
+		else
+			fprintf(out, "commands: stats [json], clients [json], kick <name>\n");
+		fclose(out);
+	}
+	return NULL;
+}
+
+/*
+ * Run the chat server 
+ */
+void server_run(void)
+{
+	acceptor_fn(&chatserver.acceptors[0]);
+}
+
+/*
+ * Put the next deadline of a client on the wheel of its loop, on the loop's own thread
+ * It replaces the one armed before, if any.
+ */
+static void client_timer_arm(struct chat_client *clientInfo, long long expires)
+{
+	struct event_loop *loop = clientInfo -> loop;
+
+	pthread_mutex_lock(&loop -> timer_lock);
+	timer_add(&loop -> timers, &clientInfo -> timer, expires);
+	pthread_mutex_unlock(&loop -> timer_lock);
+}
+
+static void client_timer_stop(struct chat_client *clientInfo)
+{
+	struct event_loop *loop = clientInfo -> loop;
+
+	pthread_mutex_lock(&loop -> timer_lock);
+	timer_del(&loop -> timers, &clientInfo -> timer);
+	pthread_mutex_unlock(&loop -> timer_lock);
+}
+
+/*
+ * Start the heartbeat of a client which joined, or of a peer link
+ */
+static void client_heartbeat_start(struct chat_client *clientInfo)
+{
+	long long now = now_ms(), next = LLONG_MAX;
+
+	clientInfo -> last_rx = clientInfo -> last_active = now;
+	clientInfo -> ping_at = 0;
+	if (chatserver.heartbeat_ms > 0 && clientInfo -> version == PROTO_V2)
+		next = now + chatserver.heartbeat_ms;
+	if (chatserver.idle_ms > 0 && clientInfo -> state == CLIENT_JOINED && now + chatserver.idle_ms < next)
+		next = now + chatserver.idle_ms;
+	if (next != LLONG_MAX)
+		client_timer_arm(clientInfo, next);
+	else
+		client_timer_stop(clientInfo);
+}
+
+/*
+ * Move a token bucket on to now
+ * Return value: the # of ms until it holds cost, 0 if it does now
+ */
+static long long bucket_wait(struct token_bucket *b, const struct rate_limit *l, long long cost, long long now)
+{
+	long long full = (long long)l -> burst * 1000;
+
+	if (l -> rate == 0)
+		return 0;
+	b -> tokens += (now - b -> stamp) * l -> rate;
+	b -> stamp = now;
+	if (b -> tokens > full)
+		b -> tokens = full;
+	/* more than a burst waits for a full bucket, and empties it */
+	cost = (cost * 1000 < full) ? cost * 1000 : full;
+	if (b -> tokens >= cost)
+		return 0;
+	return (cost - b -> tokens + l -> rate - 1) / l -> rate;
+}
+
+static void bucket_take(struct token_bucket *b, const struct rate_limit *l, long long cost)
+{
+	long long full = (long long)l -> burst * 1000;
+
+	if (l -> rate > 0)
+		b -> tokens -= (cost * 1000 < full) ? cost * 1000 : full;
+}
+
+/* whether the messages of the sender in the buffer q leave no room for another one, its fair share is used up */
+static int flood_share_full(struct chatmsg_queue *q, struct chat_client *sender)
+{
+	size_t used = atomic_load_explicit(&q -> tail, memory_order_relaxed) - atomic_load_explicit(&q -> head, memory_order_relaxed);
+	size_t free_slots = (used < q -> mask + 1) ? q -> mask + 1 - used : 0;
+
+	return (size_t)atomic_load_explicit(&sender -> inflight, memory_order_relaxed) >= free_slots;
+}
+
+/*
+ * Whether the rates of a client allow a chat message of len bytes now - on its event loop
+ * The tokens are taken if so.
+ * Return value: 0 - they do; else the # of ms to wait
+ */
+static long long flood_rate_wait(struct chat_client *clientInfo, size_t len, long long now)
+{
+	long long wait, w;
+
+	wait = bucket_wait(&clientInfo -> msg_bucket, &chatserver.msg_limit, 1, now);
+	if ((w = bucket_wait(&clientInfo -> byte_bucket, &chatserver.byte_limit, len, now)) > wait)
+		wait = w;
+	if (wait > 0)
+		return wait;
+	bucket_take(&clientInfo -> msg_bucket, &chatserver.msg_limit, 1);
+	bucket_take(&clientInfo -> byte_bucket, &chatserver.byte_limit, len);
+	return 0;
+}
+
+/*
+ * Whether a chat message of len bytes may go into the buffer of the client's room now, see FLOOD_THROTTLE
+ * The tokens are taken if so.
+ * Return value: 0 - it may; else the # of ms to wait, and *rated tells whether for the rates
+ *               (else for the share of the buffer)
+ */
+static long long flood_wait(struct chat_client *clientInfo, size_t len, long long now, int *rated)
+{
+	long long wait;
+
+	*rated = 0;
+	if (flood_share_full(&clientInfo -> room -> chatmsgQ, clientInfo))
+		return FLOOD_RETRY_MS;	// the broadcast thread takes a batch soon, try again then
+
+	if ((wait = flood_rate_wait(clientInfo, len, now)) > 0)
+		*rated = 1;
+	return wait;
+}
+
+/*
+ * Put a chat message of a sender into the buffer q, it counts against the sender's share
+ */
+static void chatmsg_post(struct chatmsg_queue *q, struct chat_client *sender, struct frame *f)
+{
+	atomic_fetch_add_explicit(&sender -> refcnt, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&sender -> inflight, 1, memory_order_relaxed);
+	f -> sender = sender;
+	chatmsg_put(q, f);
+}
+
+/*
+ * Put a chat message of a client into the buffer of its room
+ */
+static void client_post(struct chat_client *clientInfo, struct frame *f)
+{
+	chatmsg_post(&clientInfo -> room -> chatmsgQ, clientInfo, f);
+}
+
+/*
+ * Hold a chat message over the flood limits, and stop reading the client until it may go
+ * Its timer tries again at until (ms), see client_timeout().
+ */
+static void client_hold(struct chat_client *clientInfo, struct frame *f, long long until)
+{
+	struct event_loop *loop = clientInfo -> loop;
+	struct epoll_event ev;
+
+	pthread_mutex_lock(&clientInfo -> out_lock);
+	clientInfo -> held = f;
+	clientInfo -> held_until = until;
+	ev.events = (clientInfo -> out_armed && clientInfo -> ring == NULL) ? EPOLLOUT : 0;
+	ev.data.ptr = clientInfo;
+	epoll_ctl(loop -> epfd, EPOLL_CTL_MOD, clientInfo -> socketfd, &ev);
+	pthread_mutex_unlock(&clientInfo -> out_lock);
+
+	/* only ever earlier: the heartbeat is checked then as well */
+	pthread_mutex_lock(&loop -> timer_lock);
+	if (clientInfo -> timer.pprev == NULL || until < clientInfo -> timer.expires)
+		timer_add(&loop -> timers, &clientInfo -> timer, until);
+	pthread_mutex_unlock(&loop -> timer_lock);
+}
+
+/*
+ * Try to send on the message held for a client, and read the client again if it went
+ * Return value:  0 - sent, or still held;
+ *               -1 - the client departs or breaks the protocol;
+ */
+static int client_release(struct chat_client *clientInfo, long long now)
+{
+	struct epoll_event ev;
+	long long wait;
+	int rated;
+
+	if (clientInfo -> state == CLIENT_PEER) {
+		/* a relay of a peer server, the room buffer was full */
+		if (chatmsg_put_nowait(&clientInfo -> held_room -> chatmsgQ, clientInfo -> held) != 0) {
+			clientInfo -> held_until = now + FLOOD_RETRY_MS;
+			return 0;
+		}
+	} else {
+		if ((wait = flood_wait(clientInfo, clientInfo -> held -> len, now, &rated)) > 0) {
+			clientInfo -> held_until = now + wait;
+			return 0;
+		}
+		client_post(clientInfo, clientInfo -> held);
+	}
+
+	pthread_mutex_lock(&clientInfo -> out_lock);
+	clientInfo -> held = NULL;
+	ev.events = EPOLLIN | EPOLLRDHUP | ((clientInfo -> out_armed && clientInfo -> ring == NULL) ? EPOLLOUT : 0);
+	ev.data.ptr = clientInfo;
+	epoll_ctl(clientInfo -> loop -> epfd, EPOLL_CTL_MOD, clientInfo -> socketfd, &ev);
+	pthread_mutex_unlock(&clientInfo -> out_lock);
+
+	/* it was not read meanwhile, its silence meant nothing */
+	clientInfo -> last_rx = now;
+	return client_dispatch(clientInfo);
+}
+
+/*
+ * The timer of a client fired, on its event loop
+ * A connection which has not joined yet is dropped. Otherwise the timer is only re-armed when it
+ * fires, not on every message: a client silent for heartbeat_ms gets CMD_SERVER_PING, and is
+ * dropped when it is still silent as long again - a half-open connection never answers. A client
+ * which sends nothing but CMD_CLIENT_PONG for idle_ms is dropped as well. A v1 client cannot
+ * answer a ping, only the idle limit holds for it. A throttled client gets its held message
+ * tried again.
+ */
+static void client_timeout(struct chat_client *clientInfo, long long now)
+{
+	long long next = LLONG_MAX, due;
+	struct frame *f;
+
+	if (clientInfo -> state == CLIENT_HANDSHAKE || clientInfo -> state == CLIENT_CLAIMING) {
+		printf("A client does not join in time, drop the connection [%s:%d]\n", inet_ntoa(clientInfo -> address.sin_addr), clientInfo -> address.sin_port);
+		stat_add(&stats_self() -> timeouts, 1);
+		client_depart(clientInfo);
+		return;
+	}
+
+	if (clientInfo -> state == CLIENT_DATA) {
+		if (now >= (due = clientInfo -> last_active + DATA_IDLE_MS)) {
+			printf("A data stream is idle too long, drop it [%s %s:%d]\n", clientInfo -> client_name,
+					inet_ntoa(clientInfo -> address.sin_addr), clientInfo -> address.sin_port);
+			stat_add(&stats_self() -> timeouts, 1);
+			client_depart(clientInfo);
+			return;
+		}
+		/* the notice of an upload waits for the share of the uploader */
+		if (clientInfo -> notice != NULL && data_notice(clientInfo) != 0)
+			due = now + FLOOD_RETRY_MS;
+		client_timer_arm(clientInfo, due);
+		return;
+	}
+
+	if (clientInfo -> held != NULL) {
+		if (client_release(clientInfo, now) != 0) {
+			client_depart(clientInfo);
+			return;
+		}
+		/* still held, or held again by what followed */
+		if (clientInfo -> held != NULL)
+			next = clientInfo -> held_until;
+	}
+
+	if (chatserver.idle_ms > 0 && clientInfo -> state == CLIENT_JOINED) {
+		if (now >= (due = clientInfo -> last_active + chatserver.idle_ms)) {
+			printf("A client is idle too long, drop the connection [%s %s:%d]\n", clientInfo -> client_name,
+					inet_ntoa(clientInfo -> address.sin_addr), clientInfo -> address.sin_port);
+			f = frame_new(clientInfo -> version, CMD_SERVER_CLOSE, 0, NULL, 0);
+			client_enqueue_urgent(clientInfo, f);
+			frame_put(f);
+			stat_add(&stats_self() -> timeouts, 1);
+			client_depart(clientInfo);
+			return;
+		}
+		if (due < next)
+			next = due;
+	}
+
+	/* a throttled client is not read, nothing is known of its silence */
+	if (chatserver.heartbeat_ms > 0 && clientInfo -> version == PROTO_V2 && clientInfo -> held == NULL) {
+		if (clientInfo -> ping_at > clientInfo -> last_rx) {
+			/* pinged, and nothing came back since */
+			if (now >= (due = clientInfo -> ping_at + chatserver.heartbeat_ms)) {
+				if (clientInfo -> state == CLIENT_PEER)
+					printf("A peer server does not answer, drop the link [%016llx]\n", (unsigned long long)clientInfo -> node);
+				else
+					printf("A client does not answer, drop the connection [%s %s:%d]\n", clientInfo -> client_name,
+							inet_ntoa(clientInfo -> address.sin_addr), clientInfo -> address.sin_port);
+				stat_add(&stats_self() -> timeouts, 1);
+				client_depart(clientInfo);
+				return;
+			}
+		} else if (now >= (due = clientInfo -> last_rx + chatserver.heartbeat_ms)) {
+			f = frame_new(PROTO_V2, CMD_SERVER_PING, -1, NULL, 0);
+			client_enqueue(clientInfo, f);
+			frame_put(f);
+			clientInfo -> ping_at = now;
+			due = now + chatserver.heartbeat_ms;
+		}
+		if (due < next)
+			next = due;
+	}
+
+	if (next != LLONG_MAX)
+		client_timer_arm(clientInfo, next);
+}
+
+/*
+ * Run the timers of a loop which fell due
+ * Return value: the # of ms until the next one, -1 if none is armed
+ */
+static int loop_timers(struct event_loop *loop)
+{
+	struct timer *t, *next;
+	long long now = now_ms();
+	int timeout;
+
+	pthread_mutex_lock(&loop -> timer_lock);
+	t = wheel_advance(&loop -> timers, now);
+	pthread_mutex_unlock(&loop -> timer_lock);
+
+	/* only this loop removes its clients, the others on the list stay valid */
+	for (; t != NULL; t = next) {
+		next = t -> next;
+		client_timeout((struct chat_client *)((char *)t - offsetof(struct chat_client, timer)), now);
+	}
+
+	pthread_mutex_lock(&loop -> timer_lock);
+	timeout = wheel_timeout(&loop -> timers, now);
+	loop -> sleep_until = (timeout == -1) ? LLONG_MAX : now + timeout;
+	pthread_mutex_unlock(&loop -> timer_lock);
+	return timeout;
+}
+
+/*
+ * Accept new connections and hand each over to an event loop
+ * Nothing is received here: the event loop runs the JOIN handshake, so a silent
+ * connection delays no one and is dropped when its handshake deadline passes.
+ */
+void *acceptor_fn(void *arg)
+{
+	struct acceptor *acceptor = arg;
+
+	if (acceptor -> local)
+		stats_register("acceptor local");
+	else
+		stats_register("acceptor %d", (int)(acceptor - chatserver.acceptors));
+
+    while (1) {
+        // Accept new connections
+        // 1. the new connection waits for its CMD_CLIENT_JOIN in an event loop, see client_join()
+        //  1.1) check whether the room is full or not
+        //  1.2) check whether the username has been used or not
+        // 2. otherwise, return ERR_UNKNOWN_CMD
+
+		int new_fd, on = 1;	//new connection on new_fd
+		struct sockaddr_in their_addr; // client's address information, 0.0.0.0:0 for a local one
+		socklen_t sin_size = sizeof(struct sockaddr_in);
+		
+		memset(&their_addr, 0, sizeof(their_addr));
+
+		if ((new_fd = accept(acceptor -> listenfd, (struct sockaddr *)&their_addr, &sin_size)) == -1) {
+			if (errno != EINTR)
+				perror("accept");
+			if (errno == EMFILE || errno == ENFILE)
+				usleep(10000);	// out of descriptors, give the departures a chance
+			continue;
+		}
+		/* batches are written whole, waiting for more (Nagle) only adds latency */
+		if (!acceptor -> local)
+			setsockopt(new_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		client_new(new_fd, &their_addr, acceptor -> local, -1);
+	}
+	return NULL;
+}
+
+/*
+ * Hand a new connection over to an event loop, which waits for its first message
+ * peer_addr: the index of the peer server in chatserver.fed.addrs the connection goes to, else -1
+ * Return value: the new session, NULL on error - the socket is closed then
+ */
+struct chat_client *client_new(int fd, struct sockaddr_in *addr, int local, int peer_addr)
+{
+	struct chat_client *newClient;
+	struct event_loop *loop;
+	long long deadline;
+	uint64_t one = 1;
+	int on = 1, wake = 0;
+
+	set_nonblocking(fd);
+
+	/* collect client info, the name follows with CMD_CLIENT_JOIN */
+	newClient = (struct chat_client *)pool_calloc(sizeof(struct chat_client));
+	newClient -> socketfd = fd;
+	newClient -> address = *addr;
+	newClient -> state = CLIENT_HANDSHAKE;
+	newClient -> local = local;
+	newClient -> peer_slot = -1;
+	newClient -> peer_addr = peer_addr;
+	atomic_init(&newClient -> refcnt, 1);
+	if (chatserver.zc_threshold > 0 && !local && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0)
+		newClient -> zerocopy = 1;
+	/* the first byte tells the protocol version, a JOIN frame is short */
+	decoder_init(&newClient -> decoder, 0, CLIENTNAME_LENGTH);
+	pthread_mutex_init(&newClient -> out_lock, NULL);
+
+	loop = &chatserver.loops[atomic_fetch_add(&chatserver.next_loop, 1) % chatserver.nloops];
+	newClient -> loop = loop;
+	deadline = now_ms() + chatserver.handshake_ms;
+
+	/* arm the handshake deadline before the loop can see it, and wake the loop if it sleeps past it */
+	pthread_mutex_lock(&loop -> timer_lock);
+	timer_add(&loop -> timers, &newClient -> timer, deadline);
+	if (deadline < loop -> sleep_until) {
+		loop -> sleep_until = deadline;
+		wake = 1;
+	}
+	pthread_mutex_unlock(&loop -> timer_lock);
+	if (wake)
+		while (write(loop -> wakefd, &one, sizeof(one)) == -1 && errno == EINTR)
+			;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = newClient;
+	if (epoll_ctl(loop -> epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		perror("epoll_ctl");
+		pthread_mutex_lock(&loop -> timer_lock);
+		timer_del(&loop -> timers, &newClient -> timer);
+		pthread_mutex_unlock(&loop -> timer_lock);
+		close(fd);
+		pthread_mutex_destroy(&newClient -> out_lock);
+		decoder_free(&newClient -> decoder);
+		pool_free(newClient);
+		return NULL;
+	}
+	return newClient;
+}
+
+/*
+ * Queue CMD_SERVER_JOIN_OK: a v2 client learns the largest message we accept and its session token
+ */
+static void send_join_ok(struct chat_client *clientInfo)
+{
+	char payload[2 * VARINT_MAX];
+	struct frame *f;
+	int n;
+
+	if (clientInfo -> version != PROTO_V2) {
+		client_notify(clientInfo, CMD_SERVER_JOIN_OK, -1);
+		return;
+	}
+
+	n = varint_put(payload, chatserver.max_payload);
+	n += varint_put(payload + n, clientInfo -> token);
+	f = frame_new(PROTO_V2, CMD_SERVER_JOIN_OK, -1, payload, n);
+	client_enqueue(clientInfo, f);
+	frame_put(f);
+}
+
+/*
+ * Take the fields of CMD_CLIENT_RESUME apart: token, last seq, name, room
+ * Return value:  0 - success;
+ *               -1 - malformed;
+ */
+static int parse_resume(struct chat_frame *mbuf, uint64_t *token, uint64_t *last_seq, char *room)
+{
+	const char *p = mbuf -> payload, *end = mbuf -> payload + mbuf -> len;
+	uint64_t name_len;
+	size_t len;
+	int n;
+
+	if ((n = varint_get(p, end - p, token)) <= 0)
+		return -1;
+	p += n;
+	if ((n = varint_get(p, end - p, last_seq)) <= 0)
+		return -1;
+	p += n;
+	if ((n = varint_get(p, end - p, &name_len)) <= 0 || name_len > (uint64_t)(end - p - n))
+		return -1;
+	p += n;
+
+	/* the name goes where client_join() expects a JOIN payload */
+	mbuf -> payload = p;
+	mbuf -> len = name_len;
+	p += name_len;
+
+	len = ((size_t)(end - p) < ROOMNAME_LENGTH) ? (size_t)(end - p) : ROOMNAME_LENGTH - 1;
+	memcpy(room, p, len);
+	room[len] = '\0';
+	return 0;
+}
+
+/*
+ * CMD_PEER_HELLO: the connection is a link to a peer server - the first message of a link opened
+ * by the peer, or the answer to the one we sent on ours
+ * Return value:  0 - success;
+ *               -1 - no link, the connection is to be dropped;
+ */
+static int peer_hello(struct chat_client *clientInfo, struct chat_frame *mbuf)
+{
+	char payload[VARINT_MAX];
+	struct frame *f;
+	uint64_t node;
+
+	if (varint_get(mbuf -> payload, mbuf -> len, &node) <= 0 || node == 0 || node == chatserver.fed.node)
+		return -1;
+	if (clientInfo -> peer_addr < 0) {
+		clientInfo -> initiator = node;
+		f = frame_new(PROTO_V2, CMD_PEER_HELLO, -1, payload, varint_put(payload, chatserver.fed.node));
+		client_enqueue(clientInfo, f);
+		frame_put(f);
+	} else {
+		clientInfo -> initiator = chatserver.fed.node;
+	}
+
+	if (fed_link(clientInfo, node) != 0) {
+		printf("Another link to the peer server is kept, drop this one [%016llx]\n", (unsigned long long)node);
+		return -1;
+	}
+	client_heartbeat_start(clientInfo);
+	/* a relayed message carries the name of the client and of the room along */
+	clientInfo -> decoder.max_payload = chatserver.max_payload + CLIENTNAME_LENGTH + ROOMNAME_LENGTH + 2 * VARINT_MAX;
+	printf("A peer server links up [%016llx %s:%d]\n", (unsigned long long)node,
+			inet_ntoa(clientInfo -> address.sin_addr), clientInfo -> address.sin_port);
+	return 0;
+}
+
+/*
+ * Handle CMD_CLIENT_DATA_OPEN: the new connection becomes a data stream of the client whose name
+ * and session token it carries, see chat_spool.h
+ * Return value:  0 - success;
+ *               -1 - no such session, the connection is to be dropped;
+ */
+static int data_open(struct chat_client *clientInfo, struct chat_frame *mbuf)
+{
+	uint64_t token;
+	size_t len;
+	int n, err;
+
+	if ((n = varint_get(mbuf -> payload, mbuf -> len, &token)) <= 0 ||
+			(len = mbuf -> len - n) == 0 || len >= CLIENTNAME_LENGTH) {
+		client_notify(clientInfo, CMD_SERVER_FAIL, ERR_UNKNOWN_CMD);
+		return -1;
+	}
+	memcpy(clientInfo -> client_name, mbuf -> payload + n, len);
+	clientInfo -> client_name[len] = '\0';
+	if ((err = name_index_session(clientInfo -> client_name, token, &clientInfo -> session)) != 0) {
+		client_notify(clientInfo, CMD_SERVER_FAIL, err);
+		return -1;
+	}
+
+	/* no heartbeat: the stream is as alive as the transfers on it, one idle too long is dropped */
+	clientInfo -> state = CLIENT_DATA;
+	clientInfo -> last_active = clientInfo -> loop -> now;
+	client_timer_arm(clientInfo, clientInfo -> last_active + DATA_IDLE_MS);
+	clientInfo -> decoder.max_payload = 3 * VARINT_MAX;
+	printf("A data stream opens [%s %s:%d]\n", clientInfo -> client_name,
+			inet_ntoa(clientInfo -> address.sin_addr), clientInfo -> address.sin_port);
+	return 0;
+}
+
+/*
+ * Handle the first message of a new connection, on its event loop
+ * The client enters the lobby if it is a CMD_CLIENT_JOIN with a free name and the lobby is not full.
+ * A v2 client coming back with CMD_CLIENT_RESUME gets its room again and the messages it missed;
+ * the session it left behind, if the server still keeps it, is taken over.
+ * With peer servers, the name is claimed from them first: the client is CLIENT_CLAIMING when
+ * this returns, and client_admit() lets it in once they all granted it.
+ * A CMD_CLIENT_DATA_OPEN makes the connection a data stream of a client instead, see data_open().
+ * Return value:  0 - success;
+ *               -1 - the join fails, the connection is to be dropped;
+ */
+int client_join(struct chat_client *clientInfo, struct chat_frame *mbuf)
+{
+	char room_name[ROOMNAME_LENGTH] = "";
+	uint64_t token = 0, last_seq = 0;
+	size_t len;
+
+	clientInfo -> version = mbuf -> version;
+	if (mbuf -> command == CMD_PEER_HELLO && mbuf -> version == PROTO_V2)
+		return peer_hello(clientInfo, mbuf);
+	if (clientInfo -> peer_addr >= 0)
+		return -1;	// a link we opened, the peer does not answer as one
+	if (mbuf -> command == CMD_CLIENT_DATA_OPEN && mbuf -> version == PROTO_V2)
+		return data_open(clientInfo, mbuf);
+	if (mbuf -> command == CMD_CLIENT_RESUME && mbuf -> version == PROTO_V2) {
+		if (parse_resume(mbuf, &token, &last_seq, room_name) != 0) {
+			client_notify(clientInfo, CMD_SERVER_FAIL, ERR_UNKNOWN_CMD);
+			return -1;
+		}
+	} else if (mbuf -> command != CMD_CLIENT_JOIN) {
+		client_notify(clientInfo, CMD_SERVER_FAIL, ERR_UNKNOWN_CMD);
+		return -1;
+	}
+
+	len = (mbuf -> len < CLIENTNAME_LENGTH) ? mbuf -> len : CLIENTNAME_LENGTH - 1;
+	memcpy(clientInfo -> client_name, mbuf -> payload, len);
+	clientInfo -> client_name[len] = '\0';
+
+	/* check room - and hold a place in the lobby until client_admit() */
+	if (lobby_reserve(clientInfo) != 0) {
+		client_notify(clientInfo, CMD_SERVER_FAIL, ERR_JOIN_ROOM_FULL);
+		return -1;
+	}
+
+	/* check usename - and reserve it, in one step */
+	clientInfo -> token = token;
+	if (name_index_insert(clientInfo, mbuf -> command == CMD_CLIENT_RESUME) != 0) {
+		lobby_release(clientInfo);
+		client_notify(clientInfo, CMD_SERVER_FAIL, ERR_JOIN_DUP_NAME);
+		return -1;
+	}
+	/* the peer servers have their say on the name */
+	if (fed_claim(clientInfo, mbuf -> command, room_name, last_seq) != 0)
+		return 0;
+ 	/* checking finished***************************/
+
+	return client_admit(clientInfo, mbuf -> command, room_name, last_seq);
+}
+
+/*
+ * Let a client in whose name is reserved, on its event loop: CMD_SERVER_JOIN_OK, and into its room
+ * command, room_name and last_seq are those of its CMD_CLIENT_JOIN or CMD_CLIENT_RESUME.
+ * Return value:  0 - success;
+ *               -1 - the join fails, the connection is to be dropped;
+ */
+int client_admit(struct chat_client *clientInfo, int command, const char *room_name, uint64_t last_seq)
+{
+	struct chat_room *room = chatserver.lobby;
+	long long since = 0;
+	struct frame *reply = NULL;
+
+	/* a fresh token for every connection, the old one is used up */
+	if (clientInfo -> version == PROTO_V2 && getrandom(&clientInfo -> token, sizeof(clientInfo -> token), 0) != sizeof(clientInfo -> token))
+		clientInfo -> token = ((uint64_t)now_ns() << 16) ^ (uintptr_t)clientInfo;
+
+	/* queue CMD_SERVER_JOIN_OK for the client, before any broadcast can reach it */
+	send_join_ok(clientInfo);
+
+	/* from now on, the client may send messages as long as the server accepts */
+	clientInfo -> state = CLIENT_JOINED;
+	client_heartbeat_start(clientInfo);
+	clientInfo -> decoder.max_payload = chatserver.max_payload;
+
+	/* a resumed client goes back to its room, if it is still there - else it starts over in the lobby */
+	if (command == CMD_CLIENT_RESUME) {
+		struct chat_room *r = room_lookup(room_name);
+
+		if (r != NULL && r != chatserver.lobby) {
+			reply = frame_new(PROTO_V2, CMD_SERVER_ROOM_OK, -1, r -> name, strlen(r -> name));
+			if (room_add_client(r, clientInfo, reply, last_seq) == 0)
+				room = r;
+			frame_put(reply);
+			reply = NULL;
+		} else if (r == chatserver.lobby) {
+			since = last_seq;
+		}
+		if (r != room) {
+			/* tell where the client is now */
+			reply = frame_new(PROTO_V2, CMD_SERVER_ROOM_OK, -1, room -> name, strlen(room -> name));
+		}
+	}
+
+	/* Insert the client into the lobby, and say welcome */
+	if (clientInfo -> room == NULL) {
+		if (reply != NULL) {
+			client_enqueue(clientInfo, reply);
+			frame_put(reply);
+		}
+		room_add_client(chatserver.lobby, clientInfo, NULL, since);
+	}
+	/* back in another room, the place held in the lobby is free again */
+	lobby_release(clientInfo);
+
+	printf("A %s client enters [%s %s:%d]\n", command == CMD_CLIENT_RESUME ? "resumed" : "new",
+			clientInfo -> client_name, inet_ntoa(clientInfo -> address.sin_addr), clientInfo -> address.sin_port);
+	return 0;
+}
+
+
+/*
+ * The event loop: wait for incoming messages of all clients owned by this loop
+ */
+void *event_loop_fn(void *arg)
+{
+	struct event_loop *loop = arg;
+#define LOOP_MAX_EVENTS 256
+	struct epoll_event events[LOOP_MAX_EVENTS];
+	int i, n, timeout;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	stats_register("loop %d", (int)(loop - chatserver.loops));
+
+    while (1) {
+        // Wait for incomming messages from the clients of this loop
+        // 1. if it is CMD_CLIENT_SEND, put the message to the bounded buffer
+        // 2. if the socket becomes writable, send out what is queued for the client
+        // 3. if it is CMD_CLIENT_DEPART or the connection is gone:
+        //  2.1) send a message "$client_name$ leaves, goodbye!" to all other clients
+        //  2.2) free/destroy the resources allocated to this client
+
+		/* wake up in time for the next deadline: handshake, heartbeat or idle */
+		timeout = loop_timers(loop);
+		/* and in time to look after the sockets of departed clients, see client_close() */
+		if (loop -> lingering != NULL && loop_linger(loop) && (timeout == -1 || timeout > ZC_LINGER_POLL_MS))
+			timeout = ZC_LINGER_POLL_MS;
+		n = epoll_wait(loop -> epfd, events, LOOP_MAX_EVENTS, timeout);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(1);
+		}
+		loop -> now = now_ms();
+
+		for (i = 0; i < n; i++) {
+			struct chat_client *clientInfo = events[i].data.ptr;
+
+			/* the peer servers decided on the names of some of our joining clients, or a new connection has an earlier deadline */
+			if (clientInfo == NULL) {
+				uint64_t v;
+
+				while (read(loop -> wakefd, &v, sizeof(v)) == -1 && errno == EINTR)
+					;
+				fed_claims_done(loop);
+				continue;
+			}
+			if (events[i].events & EPOLLOUT) {
+				if ((clientInfo -> state == CLIENT_DATA ? data_flush(clientInfo) : client_flush(clientInfo)) != 0) {
+					client_depart(clientInfo);
+					continue;
+				}
+			}
+			/* a zero-copy notification is no error, the socket is fine */
+			if ((events[i].events & EPOLLERR) && chatserver.zc_threshold > 0)
+				client_zc_reap(clientInfo);
+			/* a throttled client is not read before its time, unless it is gone */
+			if (clientInfo -> held != NULL && !(events[i].events & EPOLLHUP))
+				continue;
+			if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				if (client_read(clientInfo) != 0)
+					client_depart(clientInfo);
+			}
+		}
+	}
+}
+
+/*
+ * Receive the pending messages of one client, with at most LOOP_READ_BUDGET reads
+ * Return value:  0 - no more data for now;
+ *               -1 - the client departs or the connection is gone;
+ */
+int client_read(struct chat_client *clientInfo)
+{
+	int budget;
+	size_t room;
+	ssize_t n;
+	char *p;
+
+	for (budget = 0; budget < LOOP_READ_BUDGET; budget++) {
+		/* an upload goes by the slice, the stream is read again in the next round */
+		if (clientInfo -> upload != NULL)
+			return data_recv(clientInfo);
+		p = decoder_space(&clientInfo -> decoder, &room);
+		n = recv(clientInfo -> socketfd, p, room, 0);
+		if (n == 0)
+			return -1;
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		decoder_commit(&clientInfo -> decoder, n);
+		clientInfo -> last_rx = clientInfo -> loop -> now;
+		stat_add(&stats_self() -> bytes_in, n);
+		if (client_dispatch(clientInfo) != 0)
+			return -1;
+		/* the rest waits in the socket until the name is granted, or the held message goes, or the reply of a data stream */
+		if (clientInfo -> state == CLIENT_CLAIMING || clientInfo -> held != NULL || clientInfo -> dl_head_len > 0)
+			return 0;
+	}
+	return 0;
+}
+
+/*
+ * Handle the complete messages in the decoder of a client
+ * While the name of a joining client is claimed from the peer servers, what follows the join
+ * stays in the decoder; so does what follows a chat message held by flood control, or on a peer
+ * link a relay held for a full room buffer, and on a data stream what follows a request until
+ * its reply is out, or a CMD_CLIENT_FILE_PUT: the file.
+ * Return value:  0 - success;
+ *               -1 - the client departs or breaks the protocol;
+ */
+int client_dispatch(struct chat_client *clientInfo)
+{
+	struct chat_frame mbuf;	//mbuf for received msg
+	long long wait;
+	int ret = 0, rated;
+
+	/* messages may arrive in pieces or several at once, the decoder sorts it out */
+	while (clientInfo -> state != CLIENT_CLAIMING && clientInfo -> held == NULL &&
+			clientInfo -> upload == NULL && clientInfo -> dl_head_len == 0 &&
+			(ret = decoder_next(&clientInfo -> decoder, &mbuf)) == 1) {
+		if (clientInfo -> state == CLIENT_HANDSHAKE) {
+			if (client_join(clientInfo, &mbuf) != 0)
+				return -1;
+		}
+		else if (clientInfo -> state == CLIENT_PEER) {
+			if (fed_peer_read(clientInfo, &mbuf) != 0)
+				return -1;
+		}
+		else if (clientInfo -> state == CLIENT_DATA) {
+			if (data_request(clientInfo, &mbuf) != 0)
+				return -1;
+		}
+		else if (mbuf.command == CMD_CLIENT_PONG) {
+			/* alive, which the receipt says already - but not active */
+		}
+		else if (mbuf.command == CMD_CLIENT_SEND) {
+			clientInfo -> last_active = clientInfo -> loop -> now;
+			stat_add(&stats_self() -> msgs_in, 1);
+			/* "<name>: <message>" is put together in the frame which will go out */
+			size_t name_len = strlen(clientInfo -> client_name), len = strnlen(mbuf.payload, mbuf.len);
+			struct frame *f = frame_message(name_len + 2 + len);
+			char *text = f -> data + PROTO_BROADCAST_HEADROOM;
+
+			memcpy(text, clientInfo -> client_name, name_len);
+			memcpy(text + name_len, ": ", 2);
+			memcpy(text + name_len + 2, mbuf.payload, len);
+
+			/* flood control: the message goes now, waits - and the client with it - or is thrown away */
+			if ((wait = flood_wait(clientInfo, f -> len, clientInfo -> loop -> now, &rated)) == 0) {
+				client_post(clientInfo, f);
+			} else if (rated && chatserver.flood_policy == FLOOD_REJECT) {
+				stat_add(&stats_self() -> limited, 1);
+				frame_put(f);
+				f = frame_new(clientInfo -> version, CMD_SERVER_FAIL, ERR_RATE_LIMITED, NULL, 0);
+				client_enqueue(clientInfo, f);
+				frame_put(f);
+			} else {
+				stat_add(&stats_self() -> limited, 1);
+				client_hold(clientInfo, f, clientInfo -> loop -> now + wait);
+			}
+		}
+		else if (mbuf.command == CMD_CLIENT_ROOM_CREATE ||
+				 mbuf.command == CMD_CLIENT_ROOM_JOIN ||
+				 mbuf.command == CMD_CLIENT_ROOM_LEAVE) {
+			clientInfo -> last_active = clientInfo -> loop -> now;
+			client_change_room(clientInfo, &mbuf);
+		}
+		else if (mbuf.command == CMD_CLIENT_SUBSCRIBE ||
+				 mbuf.command == CMD_CLIENT_UNSUBSCRIBE) {
+			client_subscribe(clientInfo, &mbuf);
+		}
+		else if (mbuf.command == CMD_CLIENT_WHISPER) {
+			clientInfo -> last_active = clientInfo -> loop -> now;
+			client_whisper(clientInfo, &mbuf);
+		}
+		else if (mbuf.command == CMD_CLIENT_FILE_OFFER && clientInfo -> version == PROTO_V2) {
+			clientInfo -> last_active = clientInfo -> loop -> now;
+			client_file_offer(clientInfo, &mbuf);
+		}
+		else if (mbuf.command == CMD_CLIENT_RING_ATTACH) {
+			if (client_ring_attach(clientInfo, &mbuf) != 0)
+				return -1;
+		}
+		else if (mbuf.command == CMD_CLIENT_RING_ACK) {
+			/* there is room in the ring again */
+			if (client_flush(clientInfo) != 0)
+				return -1;
+		}
+		else if (mbuf.command == CMD_CLIENT_DEPART) {
+			return -1;
+		}
+	}
+	if (ret == -1) {
+		if (clientInfo -> state == CLIENT_HANDSHAKE)
+			printf("A new connection breaks the protocol, drop it [%s:%d]\n", inet_ntoa(clientInfo -> address.sin_addr), clientInfo -> address.sin_port);
+		else if (clientInfo -> state == CLIENT_PEER)
+			printf("A peer server breaks the protocol [%016llx]\n", (unsigned long long)clientInfo -> node);
+		else if (clientInfo -> state == CLIENT_DATA)
+			printf("A data stream breaks the protocol [%s]\n", clientInfo -> client_name);
+		else
+			printf("A client breaks the protocol [%s]\n", clientInfo -> client_name);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Close the socket of a departing client, and drop what is still queued for it - on its loop thread
+ * The kernel may still send from the frames of zero-copy sends, pooled or mapped: until it says
+ * it is done, the frames stay, and so does the socket, on the lingering list of the event loop.
+ */
+static void client_close(struct chat_client *clientInfo)
+{
+	struct zc_linger *l;
+	struct out_msg *m;
+
+	while ((m = clientInfo -> out_head) != NULL) {
+		clientInfo -> out_head = m -> next;
+		out_msg_free(m);
+	}
+	clientInfo -> out_tail = NULL;
+	if (clientInfo -> zc_head != NULL)
+		client_zc_reap(clientInfo);
+	if (clientInfo -> zc_head == NULL) {
+		close(clientInfo -> socketfd);
+		return;
+	}
+
+	/* what the socket has goes out, then the FIN */
+	shutdown(clientInfo -> socketfd, SHUT_WR);
+	l = (struct zc_linger *)malloc(sizeof(struct zc_linger));
+	l -> fd = clientInfo -> socketfd;
+	l -> zc_head = clientInfo -> zc_head;
+	l -> zc_tail = clientInfo -> zc_tail;
+	l -> deadline = clientInfo -> loop -> now + ZC_LINGER_MS;
+	l -> reset = 0;
+	l -> next = clientInfo -> loop -> lingering;
+	clientInfo -> loop -> lingering = l;
+	clientInfo -> zc_head = clientInfo -> zc_tail = NULL;
+}
+
+/*
+ * Remove a client from the server: its event loop stops watching it, the others are told it leaves
+ */
+void client_depart(struct chat_client *clientInfo)
+{
+	int kicked;
+
+	epoll_ctl(clientInfo -> loop -> epfd, EPOLL_CTL_DEL, clientInfo -> socketfd, NULL);
+	
+	/* a connection which never joined is in no room, and nobody knows its name - unless the peers are asked for it */
+	if (clientInfo -> state == CLIENT_HANDSHAKE || clientInfo -> state == CLIENT_CLAIMING) {
+		if (clientInfo -> claim != NULL)
+			fed_claim_cancel(clientInfo);
+		if (clientInfo -> state == CLIENT_CLAIMING)
+			name_index_remove(clientInfo);
+		if (clientInfo -> peer_addr >= 0)
+			fed_unlink(clientInfo);
+		lobby_release(clientInfo);
+		client_timer_stop(clientInfo);
+		client_close(clientInfo);
+		pthread_mutex_destroy(&clientInfo -> out_lock);
+		decoder_free(&clientInfo -> decoder);
+		client_put(clientInfo);
+		return;
+	}
+
+	/* a data stream is in no room either, only its transfers are to be ended */
+	if (clientInfo -> state == CLIENT_DATA) {
+		client_timer_stop(clientInfo);
+		data_close(clientInfo);
+		if (clientInfo -> notice != NULL)
+			frame_put(clientInfo -> notice);
+		atomic_fetch_sub(&clientInfo -> session -> nstreams, 1);
+		client_put(clientInfo -> session);
+		client_close(clientInfo);
+		pthread_mutex_destroy(&clientInfo -> out_lock);
+		decoder_free(&clientInfo -> decoder);
+		printf("A data stream closes [%s %s:%d]\n", clientInfo -> client_name,
+				inet_ntoa(clientInfo -> address.sin_addr), clientInfo -> address.sin_port);
+		client_put(clientInfo);
+		return;
+	}
+
+	client_timer_stop(clientInfo);
+	if (clientInfo -> held != NULL)
+		frame_put(clientInfo -> held);
+
+	/* remove the client from its room, the "Goodbye" msg goes to every client there */
+	if (clientInfo -> state == CLIENT_PEER) {
+		fed_unlink(clientInfo);
+	} else {
+		/* only this thread moves the client between rooms, see name_index_kick() */
+		pthread_mutex_lock(&clientInfo -> out_lock);
+		kicked = clientInfo -> kicked;
+		pthread_mutex_unlock(&clientInfo -> out_lock);
+		if (kicked)
+			chatmsg_put_lane(&clientInfo -> room -> chatmsgQ, LANE_CONTROL,
+					frame_printf("%s is removed from the chat server", clientInfo -> client_name));
+		room_remove_client(clientInfo -> room, clientInfo);
+		name_index_remove(clientInfo);
+		client_subs_free(clientInfo);
+		if (atomic_load(&clientInfo -> whispers) > 0)
+			fed_whisper_cancel(clientInfo);
+	}
+
+	/* the broadcast thread cannot see the client any more, safe to close */
+	client_close(clientInfo);
+	pthread_mutex_destroy(&clientInfo -> out_lock);
+	decoder_free(&clientInfo -> decoder);
+	if (clientInfo -> ring != NULL) {
+		ring_close(clientInfo -> ring);
+		free(clientInfo -> ring);
+	}
+	if (clientInfo -> ring_next != NULL) {
+		/* gone before CMD_SERVER_RING_OK was all out */
+		ring_close(clientInfo -> ring_next);
+		free(clientInfo -> ring_next);
+		frame_put(clientInfo -> ring_ok);
+	}
+
+	if (clientInfo -> state == CLIENT_PEER)
+		printf("A peer link is down [%016llx %s:%d]\n", (unsigned long long)clientInfo -> node,
+				inet_ntoa(clientInfo-> address.sin_addr), clientInfo-> address.sin_port);
+	else
+		printf("A client departs [%s %s:%d]\n", clientInfo -> client_name, inet_ntoa(clientInfo-> address.sin_addr), clientInfo-> address.sin_port);
+		
+	/* its messages still in the buffer of a room keep the memory */
+	client_put(clientInfo);
+}
+
+/*
+ * Drop a reference to a client session, the last one frees it
+ */
+void client_put(struct chat_client *clientInfo)
+{
+	if (atomic_fetch_sub_explicit(&clientInfo -> refcnt, 1, memory_order_acq_rel) == 1)
+		pool_free(clientInfo);
+}
+
+/*
+ * Drop all keywords of a client - cq_lock of its room held, or the client is in no room
+ * Return value: the # of keywords dropped
+ */
+int client_subs_free(struct chat_client *clientInfo)
+{
+	struct subscription *s;
+	int n = clientInfo -> nsubs;
+
+	while ((s = clientInfo -> subs) != NULL) {
+		clientInfo -> subs = s -> next;
+		pool_free(s);
+	}
+	clientInfo -> nsubs = 0;
+	return n;
+}
+
+/*
+ * Handle CMD_CLIENT_ROOM_CREATE/JOIN/LEAVE: move the client into another room
+ * The client gets CMD_SERVER_ROOM_OK with the name of its new room, or CMD_SERVER_FAIL.
+ */
+void client_change_room(struct chat_client *clientInfo, struct chat_frame *mbuf)
+{
+	char name[ROOMNAME_LENGTH];
+	struct chat_room *room = NULL, *old = clientInfo -> room;
+	struct frame *reply;
+	size_t len;
+	int err = 0;
+
+	len = strnlen(mbuf -> payload, mbuf -> len);
+	len = (len < ROOMNAME_LENGTH) ? len : ROOMNAME_LENGTH - 1;
+	memcpy(name, mbuf -> payload, len);
+	name[len] = '\0';
+
+	if (mbuf -> command == CMD_CLIENT_ROOM_LEAVE)
+		room = chatserver.lobby;
+	else if (len == 0)
+		err = ERR_ROOM_NOT_FOUND;
+	else if (mbuf -> command == CMD_CLIENT_ROOM_CREATE) {
+		if ((err = room_create(name, &room)) == 0)
+			fed_room(name);	// the peer servers have it too
+	}
+	else if ((room = room_lookup(name)) == NULL)
+		err = ERR_ROOM_NOT_FOUND;
+
+	if (err == 0 && room != old) {
+		/* leave first, a client is never listed in two rooms */
+		room_remove_client(old, clientInfo);
+		reply = frame_new(clientInfo -> version, CMD_SERVER_ROOM_OK, -1, room -> name, strlen(room -> name));
+		err = room_add_client(room, clientInfo, reply, 0);
+		frame_put(reply);
+		if (err != 0)
+			room_add_client(old, clientInfo, NULL, -1);	// the room is full, go back
+	} else if (err == 0) {
+		reply = frame_new(clientInfo -> version, CMD_SERVER_ROOM_OK, -1, room -> name, strlen(room -> name));
+		client_enqueue(clientInfo, reply);
+		frame_put(reply);
+	}
+
+	if (err != 0) {
+		reply = frame_new(clientInfo -> version, CMD_SERVER_FAIL, err, NULL, 0);
+		client_enqueue(clientInfo, reply);
+		frame_put(reply);
+	}
+}
+
+/*
+ * Handle CMD_CLIENT_SUBSCRIBE/UNSUBSCRIBE: change the keywords the broadcasts to the client are filtered by
+ * A keyword ending in '*' is a prefix, an unsubscription without one drops them all.
+ * The client gets CMD_SERVER_SUB_OK with the keyword, or CMD_SERVER_FAIL.
+ */
+void client_subscribe(struct chat_client *clientInfo, struct chat_frame *mbuf)
+{
+	struct chat_room *room = clientInfo -> room;
+	const char *text = mbuf -> payload;
+	struct subscription *s, **pp;
+	struct frame *reply;
+	size_t len;
+	int flags = 0, err = 0;
+
+	len = strnlen(mbuf -> payload, mbuf -> len);
+	if (len > 0 && text[len - 1] == '*') {
+		flags = MATCH_PREFIX;
+		len--;
+	}
+
+	/* the broadcast thread compiles the keywords under cq_lock, before its next batch */
+	cq_lock(room);
+	for (pp = &clientInfo -> subs; *pp != NULL; pp = &(*pp) -> next)
+		if ((*pp) -> len == len && (*pp) -> flags == flags && strncasecmp((*pp) -> text, text, len) == 0)
+			break;
+	if (mbuf -> command == CMD_CLIENT_SUBSCRIBE) {
+		if (*pp != NULL)
+			;	// subscribed already
+		else if (len == 0 || len > SUB_KEYWORD_MAX || clientInfo -> nsubs >= MAX_SUBSCRIPTIONS)
+			err = ERR_SUB_LIMIT;
+		else if ((s = (struct subscription *)pool_alloc(sizeof(struct subscription) + len)) == NULL)
+			err = ERR_OTHERS;
+		else {
+			s -> next = NULL;
+			s -> flags = flags;
+			s -> len = len;
+			memcpy(s -> text, text, len);
+			*pp = s;
+			clientInfo -> nsubs++;
+			room -> subs_changed = 1;
+		}
+	} else if (len == 0 && flags == 0) {
+		if (client_subs_free(clientInfo) > 0)
+			room -> subs_changed = 1;
+	} else if (*pp == NULL) {
+		err = ERR_SUB_NOT_FOUND;
+	} else {
+		s = *pp;
+		*pp = s -> next;
+		pool_free(s);
+		clientInfo -> nsubs--;
+		room -> subs_changed = 1;
+	}
+	sem_post(&room -> clientQ.cq_lock);
+
+	if (err == 0)
+		reply = frame_new(clientInfo -> version, CMD_SERVER_SUB_OK, -1, mbuf -> payload, strnlen(mbuf -> payload, mbuf -> len));
+	else
+		reply = frame_new(clientInfo -> version, CMD_SERVER_FAIL, err, NULL, 0);
+	client_enqueue(clientInfo, reply);
+	frame_put(reply);
+}
+
+/*
+ * Handle CMD_CLIENT_WHISPER: a chat message for one client, written straight onto its outbound queue
+ * Neither the buffer of a room nor its broadcast thread see it, and the whispers of a client are
+ * queued in the order it sent them. They take tokens like its other chat messages, but one over
+ * the rates is always answered with ERR_RATE_LIMITED: there is no buffer to wait for.
+ * A name no client here has goes to the peer servers, the one with the client delivers it; the
+ * sender gets ERR_USER_NOT_FOUND when none of them has it, or there are none to ask.
+ */
+void client_whisper(struct chat_client *clientInfo, struct chat_frame *mbuf)
+{
+	const char *p = mbuf -> payload, *end = mbuf -> payload + mbuf -> len;
+	size_t name_len = strlen(clientInfo -> client_name), len;
+	long long now = clientInfo -> loop -> now;
+	char name[CLIENTNAME_LENGTH], *text;
+	struct frame *reply;
+	uint64_t v = 0;
+	int n = 0, err = 0;
+
+	/* v1 tells the length of the name in private_data, v2 in front of it */
+	if (clientInfo -> version == PROTO_V1)
+		v = (mbuf -> private_data > 0) ? mbuf -> private_data : 0;
+	else if ((n = varint_get(p, end - p, &v)) <= 0)
+		n = 0;
+	if (v == 0 || v >= CLIENTNAME_LENGTH || v > (uint64_t)(end - p - n)) {
+		err = ERR_USER_NOT_FOUND;
+		goto out;
+	}
+	memcpy(name, p + n, v);
+	name[v] = '\0';
+	p += n + v;
+	len = end - p;
+
+	if (bucket_wait(&clientInfo -> msg_bucket, &chatserver.msg_limit, 1, now) > 0 ||
+			bucket_wait(&clientInfo -> byte_bucket, &chatserver.byte_limit, name_len + 2 + len, now) > 0) {
+		stat_add(&stats_self() -> limited, 1);
+		err = ERR_RATE_LIMITED;
+		goto out;
+	}
+	bucket_take(&clientInfo -> msg_bucket, &chatserver.msg_limit, 1);
+	bucket_take(&clientInfo -> byte_bucket, &chatserver.byte_limit, name_len + 2 + len);
+	stat_add(&stats_self() -> msgs_in, 1);
+
+	/* "<name>: <message>", like in the room */
+	text = (char *)pool_alloc(name_len + 2 + len);
+	memcpy(text, clientInfo -> client_name, name_len);
+	memcpy(text + name_len, ": ", 2);
+	memcpy(text + name_len + 2, p, len);
+	if (!name_index_deliver(name, text, name_len + 2 + len) && !fed_whisper(clientInfo, name, text, name_len + 2 + len))
+		err = ERR_USER_NOT_FOUND;
+	pool_free(text);
+
+out:
+	if (err != 0) {
+		reply = frame_new(clientInfo -> version, CMD_SERVER_FAIL, err, NULL, 0);
+		client_enqueue(clientInfo, reply);
+		frame_put(reply);
+	}
+} 
+
+
+/*
+ * Handle CMD_CLIENT_RING_ATTACH: from now on the client reads its messages from a shared memory ring
+ * CMD_SERVER_RING_OK is the last message on the socket, the descriptors of the ring come along.
+ * A message begun on the socket is finished there first, the ones not begun yet go into the ring;
+ * client_write() sends CMD_SERVER_RING_OK and switches over as the socket takes it.
+ * Return value:  0 - success, or the client is told CMD_SERVER_FAIL;
+ *               -1 - error;
+ */
+int client_ring_attach(struct chat_client *clientInfo, struct chat_frame *mbuf)
+{
+	char payload[VARINT_MAX];
+	struct frame *reply;
+	struct ring *r;
+	uint64_t size = 0;
+	int ret, err = 0;
+
+	/* descriptors only pass through a Unix socket; only this thread starts an attach, see client_ring_handoff() */
+	if (!clientInfo -> local || clientInfo -> version != PROTO_V2 || clientInfo -> ring != NULL || clientInfo -> ring_ok != NULL ||
+			(mbuf -> len > 0 && varint_get(mbuf -> payload, mbuf -> len, &size) <= 0))
+		err = ERR_UNKNOWN_CMD;
+	r = (struct ring *)malloc(sizeof(struct ring));
+	if (err == 0 && ring_create(r, (size > 0) ? size : DEFAULT_RING_SIZE) == -1) {
+		perror("ring_create");
+		err = ERR_OTHERS;
+	}
+	if (err != 0) {
+		free(r);
+		reply = frame_new(clientInfo -> version, CMD_SERVER_FAIL, err, NULL, 0);
+		client_enqueue(clientInfo, reply);
+		frame_put(reply);
+		return 0;
+	}
+
+	pthread_mutex_lock(&clientInfo -> out_lock);
+	clientInfo -> ring_next = r;
+	clientInfo -> ring_ok = frame_new(PROTO_V2, CMD_SERVER_RING_OK, -1, payload, varint_put(payload, r -> size));
+	clientInfo -> ring_ok_off = 0;
+	ret = client_write(clientInfo);
+	if (ret == 0 && (clientInfo -> out_head != NULL || clientInfo -> ring_ok != NULL))
+		client_arm(clientInfo, 1);
+	pthread_mutex_unlock(&clientInfo -> out_lock);
+	return ret;
+}
+
+/* the chat message telling the room of a file, a long name cut short - like snprintf() */
+static int file_notice(char *buf, size_t size, const struct spool_file *file)
+{
+	int long_name = strlen(file -> name) > FILE_NOTICE_NAME;
+
+	return snprintf(buf, size, "%s: shares %.*s%s (%zu bytes): FETCH %016llx", file -> owner, FILE_NOTICE_NAME,
+			file -> name, long_name ? "..." : "", file -> size, (unsigned long long)file -> id);
+}
+
+/*
+ * Handle CMD_CLIENT_FILE_OFFER: make room in the spool for a file the client is about to share in its room
+ * CMD_SERVER_FILE_OK tells the id to upload it with, over a data stream - see chat_spool.h.
+ * The chat message which tells the room of the file is charged to the rates of the client now, an
+ * offer over them is refused.
+ */
+void client_file_offer(struct chat_client *clientInfo, struct chat_frame *mbuf)
+{
+	char payload[2 * VARINT_MAX + FILE_NAME_MAX];
+	struct spool_file *file = NULL;
+	struct frame *reply;
+	uint64_t size;
+	size_t len = 0;
+	int n;
+
+	if ((n = varint_get(mbuf -> payload, mbuf -> len, &size)) > 0 && (len = mbuf -> len - n) > 0 && len < FILE_NAME_MAX)
+		file = spool_create(&chatserver.spool, mbuf -> payload + n, len, size, clientInfo -> client_name, clientInfo -> room -> name);
+	if (file == NULL) {
+		reply = frame_new(PROTO_V2, CMD_SERVER_FAIL, ERR_FILE_LIMIT, NULL, 0);
+	} else if (flood_rate_wait(clientInfo, file_notice(NULL, 0, file), clientInfo -> loop -> now) > 0) {
+		stat_add(&stats_self() -> limited, 1);
+		spool_remove(&chatserver.spool, file);
+		spool_put(file);
+		reply = frame_new(PROTO_V2, CMD_SERVER_FAIL, ERR_FILE_RATE, NULL, 0);
+	} else {
+		len = strlen(file -> name);
+		n = varint_put(payload, file -> id);
+		n += varint_put(payload + n, file -> size);
+		memcpy(payload + n, file -> name, len);
+		reply = frame_new(PROTO_V2, CMD_SERVER_FILE_OK, -1, payload, n + len);
+		spool_put(file);
+	}
+	client_enqueue(clientInfo, reply);
+	frame_put(reply);
+}
+
+/* a data stream is read or written, never both: the next request waits until the reply is out */
+static void data_arm(struct chat_client *clientInfo, int sending)
+{
+	struct epoll_event ev;
+
+	if (clientInfo -> out_armed == sending)
+		return;
+	clientInfo -> out_armed = sending;
+	ev.events = sending ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = clientInfo;
+	epoll_ctl(clientInfo -> loop -> epfd, EPOLL_CTL_MOD, clientInfo -> socketfd, &ev);
+}
+
+/*
+ * Go on with the reply of a data stream: the frame, then the bytes of the file with sendfile()
+ * At most FILE_SLICE bytes of the file go per call, a large piece takes several rounds of the loop.
+ * Return value:  0 - success (the reply may not be out yet);
+ *               -1 - error;
+ */
+static int data_send(struct chat_client *clientInfo)
+{
+	size_t slice = FILE_SLICE;
+	ssize_t n;
+
+	while (clientInfo -> dl_head_off < clientInfo -> dl_head_len) {
+		n = send(clientInfo -> socketfd, clientInfo -> dl_head + clientInfo -> dl_head_off,
+				clientInfo -> dl_head_len - clientInfo -> dl_head_off, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				goto wait;
+			return -1;
+		}
+		clientInfo -> dl_head_off += n;
+	}
+	while (clientInfo -> dl_left > 0 && slice > 0) {
+		n = spool_send(clientInfo -> download, clientInfo -> socketfd, &clientInfo -> dl_off,
+				(clientInfo -> dl_left < slice) ? clientInfo -> dl_left : slice);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				goto wait;
+			return -1;
+		}
+		if (n == 0)
+			return -1;	// the spool file is shorter than it says, the frame cannot be completed
+		clientInfo -> dl_left -= n;
+		clientInfo -> last_active = clientInfo -> loop -> now;
+		slice -= n;
+		stat_add(&stats_self() -> bytes_out, n);
+	}
+	/* the slice is used up, the other clients of the loop have their turn */
+	if (clientInfo -> dl_left > 0)
+		goto wait;
+
+	if (clientInfo -> download != NULL) {
+		spool_put(clientInfo -> download);
+		clientInfo -> download = NULL;
+	}
+	clientInfo -> dl_head_len = clientInfo -> dl_head_off = 0;
+	data_arm(clientInfo, 0);
+	return 0;
+
+wait:
+	data_arm(clientInfo, 1);
+	return 0;
+}
+
+/*
+ * Reply on a data stream: a frame of command with the payload, followed by n bytes of the file from off
+ * The reply takes over the caller's reference to the file, if any.
+ * Return value:  0 - success (the reply may not be out yet);
+ *               -1 - error;
+ */
+static int data_reply(struct chat_client *clientInfo, int command, const char *payload, size_t len,
+		struct spool_file *file, off_t off, size_t n)
+{
+	char *h = clientInfo -> dl_head;
+	int k = 0;
+
+	h[k++] = (char)PROTO_V2_MAGIC;
+	h[k++] = (char)command;
+	k += varint_put(h + k, len + n);
+	if (len > 0)
+		memcpy(h + k, payload, len);
+	clientInfo -> dl_head_len = k + len;
+	clientInfo -> dl_head_off = 0;
+	clientInfo -> download = file;
+	clientInfo -> dl_off = off;
+	clientInfo -> dl_left = n;
+	return data_send(clientInfo);
+}
+
+/*
+ * The reply of a data stream is (partly) out, or it is writable again
+ * Return value:  0 - success;
+ *               -1 - error;
+ */
+int data_flush(struct chat_client *clientInfo)
+{
+	if (data_send(clientInfo) != 0)
+		return -1;
+	/* the requests which came along with the one answered are next */
+	return (clientInfo -> dl_head_len == 0) ? client_dispatch(clientInfo) : 0;
+}
+
+/*
+ * Put the notice of an upload into the buffer of the room, as a chat message of the uploader
+ * Return value: 0 - it is in; 1 - the uploader's share of the buffer is used up, try again soon
+ */
+int data_notice(struct chat_client *clientInfo)
+{
+	struct chatmsg_queue *q = &clientInfo -> notice_room -> chatmsgQ;
+
+	if (flood_share_full(q, clientInfo -> session))
+		return 1;
+	chatmsg_post(q, clientInfo -> session, clientInfo -> notice);
+	clientInfo -> notice = NULL;
+	return 0;
+}
+
+/*
+ * The upload is complete: the uploader is told on the data stream, the room it was offered in
+ * by a chat message - of this server only, the peer servers have no copy to serve
+ */
+static int data_done(struct chat_client *clientInfo)
+{
+	struct spool_file *file = clientInfo -> upload;
+	char payload[2 * VARINT_MAX];
+	struct chat_room *room;
+	struct frame *f;
+	int n;
+
+	spool_finish(&chatserver.spool, file);
+	close(clientInfo -> pipefd[0]);
+	close(clientInfo -> pipefd[1]);
+	clientInfo -> upload = NULL;
+	printf("A file is shared [%s %s, %zu bytes]\n", file -> owner, file -> name, file -> size);
+
+	/* the rates were charged by the offer, the share of the buffer is taken now - or soon */
+	if ((room = room_lookup(file -> room)) != NULL) {
+		n = file_notice(NULL, 0, file);
+		f = frame_message(n);
+		file_notice(f -> data + PROTO_BROADCAST_HEADROOM, n + 1, file);
+		f -> relayed = 1;
+		clientInfo -> notice = f;
+		clientInfo -> notice_room = room;
+		if (data_notice(clientInfo) != 0)
+			client_timer_arm(clientInfo, clientInfo -> loop -> now + FLOOD_RETRY_MS);
+	}
+
+	n = varint_put(payload, file -> id);
+	n += varint_put(payload + n, file -> size);
+	spool_put(file);
+	return data_reply(clientInfo, CMD_SERVER_FILE_OK, payload, n, NULL, 0, 0);
+}
+
+/*
+ * Handle a request on a data stream
+ * Return value:  0 - success, or the client is told CMD_SERVER_FAIL;
+ *               -1 - the stream is to be dropped;
+ */
+int data_request(struct chat_client *clientInfo, struct chat_frame *mbuf)
+{
+	const char *p = mbuf -> payload, *end = mbuf -> payload + mbuf -> len;
+	char payload[VARINT_MAX];
+	struct spool_file *file;
+	uint64_t v[3] = { 0, 0, 0 };
+	size_t n;
+	int i, k;
+
+	if (mbuf -> command == CMD_CLIENT_DEPART)
+		return -1;
+	clientInfo -> last_active = clientInfo -> loop -> now;
+	if (mbuf -> command != CMD_CLIENT_FILE_PUT && mbuf -> command != CMD_CLIENT_FILE_GET)
+		return data_reply(clientInfo, CMD_SERVER_FAIL, payload, varint_put(payload, ERR_UNKNOWN_CMD), NULL, 0, 0);
+
+	/* PUT: the id; GET: the id, the offset and the length */
+	for (i = 0; i < (mbuf -> command == CMD_CLIENT_FILE_PUT ? 1 : 3); i++) {
+		if ((k = varint_get(p, end - p, &v[i])) <= 0)
+			return -1;
+		p += k;
+	}
+
+	if (mbuf -> command == CMD_CLIENT_FILE_PUT) {
+		/* the file follows the request, the stream is of no use any more if it is refused */
+		if (clientInfo -> notice != NULL) {
+			/* the room has not been told of the last one yet */
+			data_reply(clientInfo, CMD_SERVER_FAIL, payload, varint_put(payload, ERR_FILE_RATE), NULL, 0, 0);
+			return -1;
+		}
+		if ((file = spool_begin(&chatserver.spool, v[0], clientInfo -> client_name)) == NULL) {
+			data_reply(clientInfo, CMD_SERVER_FAIL, payload, varint_put(payload, ERR_FILE_NOT_FOUND), NULL, 0, 0);
+			return -1;
+		}
+		if (pipe(clientInfo -> pipefd) == -1) {
+			perror("pipe");
+			spool_remove(&chatserver.spool, file);
+			spool_put(file);
+			data_reply(clientInfo, CMD_SERVER_FAIL, payload, varint_put(payload, ERR_OTHERS), NULL, 0, 0);
+			return -1;
+		}
+		set_nonblocking(clientInfo -> pipefd[0]);
+		set_nonblocking(clientInfo -> pipefd[1]);
+		clientInfo -> upload = file;
+		/* the first bytes of the file may have come along with the request */
+		if ((n = decoder_take(&clientInfo -> decoder, file -> size, &p)) > 0 && spool_write(file, p, n) != 0)
+			return -1;
+		return (file -> received == file -> size) ? data_done(clientInfo) : 0;
+	}
+
+	if ((file = spool_get(&chatserver.spool, v[0])) == NULL)
+		return data_reply(clientInfo, CMD_SERVER_FAIL, payload, varint_put(payload, ERR_FILE_NOT_FOUND), NULL, 0, 0);
+	if (v[2] == 0 || v[2] > FILE_GET_MAX)
+		v[2] = FILE_GET_MAX;
+	/* past the end of the file, the piece is short or empty */
+	n = (v[1] < file -> size) ? file -> size - v[1] : 0;
+	if (n > v[2])
+		n = v[2];
+	if (n == 0) {
+		spool_put(file);
+		file = NULL;
+	}
+	return data_reply(clientInfo, CMD_SERVER_FILE_DATA, NULL, 0, file, v[1], n);
+}
+
+/*
+ * Receive the next slice of an upload, see spool_recv()
+ * Return value:  0 - success;
+ *               -1 - the upload is cut short, or fails;
+ */
+int data_recv(struct chat_client *clientInfo)
+{
+	ssize_t n;
+
+	n = spool_recv(clientInfo -> upload, clientInfo -> socketfd, clientInfo -> pipefd, FILE_SLICE);
+	if (n == 0)
+		return -1;
+	if (n == -1)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	clientInfo -> last_active = clientInfo -> loop -> now;
+	stat_add(&stats_self() -> bytes_in, n);
+	if (clientInfo -> upload -> received == clientInfo -> upload -> size)
+		return data_done(clientInfo);
+	return 0;
+}
+
+/*
+ * End the transfers of a data stream which goes away: an upload cut short is thrown away
+ */
+void data_close(struct chat_client *clientInfo)
+{
+	struct spool_file *file = clientInfo -> upload;
+
+	if (file != NULL) {
+		printf("An upload is cut short [%s %s, %zu of %zu bytes]\n", file -> owner, file -> name, file -> received, file -> size);
+		spool_remove(&chatserver.spool, file);
+		spool_put(file);
+		close(clientInfo -> pipefd[0]);
+		close(clientInfo -> pipefd[1]);
+		clientInfo -> upload = NULL;
+	}
+	if (clientInfo -> download != NULL) {
+		spool_put(clientInfo -> download);
+		clientInfo -> download = NULL;
+	}
+}
+
+/* FNV-1a */
+static unsigned int str_hash(const char *name)
+{
+	unsigned int h = 2166136261u;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h;
+}
+
+/* a name granted to a peer server whose claim is not decided yet - fed.lock held */
+static int name_leased(const char *name)
+{
+	struct name_lease *l, **pp = &chatserver.fed.leases;
+	long long now = now_ms();
+
+	while ((l = *pp) != NULL) {
+		/* a lease outlives no handshake, the claim it was granted to is decided by then */
+		if (l -> expires <= now) {
+			*pp = l -> next;
+			pool_free(l);
+			continue;
+		}
+		if (strcmp(l -> name, name) == 0)
+			return 1;
+		pp = &l -> next;
+	}
+	return 0;
+}
+
+/*
+ * Add a client to the name index, unless its name is taken - here, or leased to a peer server
+ * With takeover, a session holding the name and the token of the client is replaced: the server
+ * may not have noticed yet that the connection of a resuming client is gone. The old session
+ * is cut off and leaves its room without a word.
+ * Return value:  0 - success;
+ *               -1 - another client has the name;
+ */
+int name_index_insert(struct chat_client *clientInfo, int takeover)
+{
+	unsigned int h = str_hash(clientInfo -> client_name) % NAME_HASH_SIZE;
+	pthread_mutex_t *lock = &chatserver.names.locks[h % NAME_LOCK_STRIPES];
+	struct chat_client *p, **pp;
+	int leased;
+
+	pthread_mutex_lock(lock);
+	if (atomic_load(&chatserver.fed.npeers) > 0) {
+		pthread_mutex_lock(&chatserver.fed.lock);
+		leased = name_leased(clientInfo -> client_name);
+		pthread_mutex_unlock(&chatserver.fed.lock);
+		if (leased) {
+			pthread_mutex_unlock(lock);
+			return -1;
+		}
+	}
+	for (pp = &chatserver.names.buckets[h]; (p = *pp) != NULL; pp = &p -> name_next) {
+		if (strcmp(p -> client_name, clientInfo -> client_name) != 0)
+			continue;
+		if (!takeover || p -> state != CLIENT_JOINED || p -> token == 0 || p -> token != clientInfo -> token) {
+			pthread_mutex_unlock(lock);
+			return -1;
+		}
+
+		/* p is freed only after it left the index, which takes this lock */
+		*pp = p -> name_next;
+		pthread_mutex_lock(&p -> out_lock);
+		p -> dead = 1;
+		p -> quiet = 1;
+		shutdown(p -> socketfd, SHUT_RDWR);	// its event loop sees the hang up and removes it
+		pthread_mutex_unlock(&p -> out_lock);
+		clientInfo -> quiet = 1;
+		break;
+	}
+	clientInfo -> name_next = chatserver.names.buckets[h];
+	chatserver.names.buckets[h] = clientInfo;
+	pthread_mutex_unlock(lock);
+	return 0;
+}
+
+/*
+ * Remove a client from the name index, its name is free again
+ */
+void name_index_remove(struct chat_client *clientInfo)
+{
+	unsigned int h = str_hash(clientInfo -> client_name) % NAME_HASH_SIZE;
+	pthread_mutex_t *lock = &chatserver.names.locks[h % NAME_LOCK_STRIPES];
+	struct chat_client **pp;
+
+	pthread_mutex_lock(lock);
+	for (pp = &chatserver.names.buckets[h]; *pp != NULL; pp = &(*pp) -> name_next) {
+		if (*pp == clientInfo) {
+			*pp = clientInfo -> name_next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(lock);
+}
+
+/*
+ * Queue a CMD_SERVER_WHISPER for the client with the name, if it is here and in a room
+ * Return value: 1 - queued; 0 - no such client
+ */
+int name_index_deliver(const char *name, const char *msg, size_t len)
+{
+	unsigned int h = str_hash(name) % NAME_HASH_SIZE;
+	pthread_mutex_t *lock = &chatserver.names.locks[h % NAME_LOCK_STRIPES];
+	struct chat_client *p;
+	struct frame *f;
+
+	/* the client cannot be freed while it is in the index, and leaving it takes this lock */
+	pthread_mutex_lock(lock);
+	for (p = chatserver.names.buckets[h]; p != NULL; p = p -> name_next)
+		if (p -> state == CLIENT_JOINED && strcmp(p -> client_name, name) == 0)
+			break;
+	if (p != NULL) {
+		f = frame_new(p -> version, CMD_SERVER_WHISPER, -1, msg, len);
+		client_enqueue(p, f);
+		frame_put(f);
+	}
+	pthread_mutex_unlock(lock);
+	return p != NULL;
+}
+
+/*
+ * Count a new data stream to the v2 client with the name, if it is here and in a room and the token is
+ * the one of its session - *session gets a reference to the client, dropped with the stream
+ * Return value: 0 - success;
+ *               ERR_USER_NOT_FOUND - no such session;
+ *               ERR_STREAM_LIMIT - the session has DATA_STREAMS_MAX streams open already
+ */
+int name_index_session(const char *name, uint64_t token, struct chat_client **session)
+{
+	unsigned int h = str_hash(name) % NAME_HASH_SIZE;
+	pthread_mutex_t *lock = &chatserver.names.locks[h % NAME_LOCK_STRIPES];
+	struct chat_client *p;
+	int err = 0;
+
+	/* the streams open are counted under the lock, the ones closing only make room */
+	pthread_mutex_lock(lock);
+	for (p = chatserver.names.buckets[h]; p != NULL; p = p -> name_next)
+		if (p -> state == CLIENT_JOINED && p -> version == PROTO_V2 && strcmp(p -> client_name, name) == 0)
+			break;
+	if (p == NULL || token == 0 || p -> token != token) {
+		err = ERR_USER_NOT_FOUND;
+	} else if (atomic_load(&p -> nstreams) >= DATA_STREAMS_MAX) {
+		err = ERR_STREAM_LIMIT;
+	} else {
+		atomic_fetch_add(&p -> nstreams, 1);
+		atomic_fetch_add(&p -> refcnt, 1);
+		*session = p;
+	}
+	pthread_mutex_unlock(lock);
+	return err;
+}
+
+/*
+ * Disconnect the client with the name on behalf of the admin, its room is told on the control lane
+ * The client gets CMD_SERVER_CLOSE ahead of what is queued for it, if its socket takes it.
+ * Return value: 1 - kicked; 0 - no such client here
+ */
+int name_index_kick(const char *name)
+{
+	unsigned int h = str_hash(name) % NAME_HASH_SIZE;
+	pthread_mutex_t *lock = &chatserver.names.locks[h % NAME_LOCK_STRIPES];
+	struct chat_client *p;
+	struct frame *f;
+
+	pthread_mutex_lock(lock);
+	for (p = chatserver.names.buckets[h]; p != NULL; p = p -> name_next)
+		if (p -> state == CLIENT_JOINED && strcmp(p -> client_name, name) == 0)
+			break;
+	if (p != NULL) {
+		f = frame_new(p -> version, CMD_SERVER_CLOSE, -1, NULL, 0);
+		client_enqueue_urgent(p, f);
+		frame_put(f);
+
+		/* its event loop sees the hang up and removes it: the room is told then, the roster loses it */
+		pthread_mutex_lock(&p -> out_lock);
+		p -> dead = 1;
+		p -> kicked = 1;
+		shutdown(p -> socketfd, SHUT_RDWR);
+		pthread_mutex_unlock(&p -> out_lock);
+		printf("A client is kicked out [%s %s:%d]\n", p -> client_name, inet_ntoa(p -> address.sin_addr), p -> address.sin_port);
+	}
+	pthread_mutex_unlock(lock);
+	return p != NULL;
+}
+
+/*
+ * A peer server claims a name for a client of its own: grant it, unless a client here has it
+ * A client here which is still joining with the name itself loses to a peer with a lower node id.
+ * The granted name is leased to the peer until its claim is decided.
+ * Return value: 1 - granted; 0 - denied
+ */
+int name_index_grant(const char *name, uint64_t node, uint64_t claim)
+{
+	unsigned int h = str_hash(name) % NAME_HASH_SIZE;
+	pthread_mutex_t *lock = &chatserver.names.locks[h % NAME_LOCK_STRIPES];
+	struct chat_client *p;
+	struct name_lease *l;
+
+	pthread_mutex_lock(lock);
+	for (p = chatserver.names.buckets[h]; p != NULL; p = p -> name_next)
+		if (strcmp(p -> client_name, name) == 0)
+			break;
+	if (p != NULL && (p -> state == CLIENT_JOINED || chatserver.fed.node < node)) {
+		pthread_mutex_unlock(lock);
+		return 0;
+	}
+
+	l = (struct name_lease *)pool_calloc(sizeof(struct name_lease));
+	strncpy(l -> name, name, CLIENTNAME_LENGTH - 1);
+	l -> node = node;
+	l -> claim = claim;
+	l -> expires = now_ms() + chatserver.handshake_ms;
+	pthread_mutex_lock(&chatserver.fed.lock);
+	l -> next = chatserver.fed.leases;
+	chatserver.fed.leases = l;
+	pthread_mutex_unlock(&chatserver.fed.lock);
+	pthread_mutex_unlock(lock);
+	return 1;
+}
+
+
+/*
+ * Federation: the links to the peer servers, see chat_server.h
+ */
+
+/* cleanup handler - give the lock back if the thread is cancelled while holding it */
+static void release_mutex(void *lock)
+{
+	pthread_mutex_unlock((pthread_mutex_t *)lock);
+}
+
+/* queue frames on every peer link - fed.lock held */
+static void fed_send_all(struct frame **f, int n)
+{
+	int i;
+
+	for (i = 0; i < MAX_PEERS; i++)
+		if (chatserver.fed.peers[i] != NULL)
+			client_enqueue_batch(chatserver.fed.peers[i], f, n);
+}
+
+/*
+ * Queue messages on every peer link, each link writes them with one writev()
+ */
+void fed_relay(struct frame **f, int n)
+{
+	pthread_mutex_lock(&chatserver.fed.lock);
+	pthread_cleanup_push(release_mutex, &chatserver.fed.lock);
+	fed_send_all(f, n);
+	pthread_cleanup_pop(1);
+}
+
+/*
+ * A whisper of a client for a name which is not here: the peer server which has it delivers it
+ * The peers all answer, the sender hears of it only if none of them has the name.
+ * Return value: 1 - sent to the peers; 0 - there are none
+ */
+int fed_whisper(struct chat_client *sender, const char *name, const char *msg, size_t len)
+{
+	struct federation *fed = &chatserver.fed;
+	size_t name_len = strlen(name);
+	struct whisper_wait *w;
+	struct frame *f;
+	char *payload;
+	int i, n;
+
+	if (atomic_load_explicit(&fed -> npeers, memory_order_relaxed) == 0)
+		return 0;
+
+	w = (struct whisper_wait *)pool_calloc(sizeof(struct whisper_wait));
+	w -> sender = sender;
+	payload = (char *)pool_alloc(2 * VARINT_MAX + name_len + len);
+
+	pthread_mutex_lock(&fed -> lock);
+	for (i = 0; i < MAX_PEERS; i++)
+		if (fed -> peers[i] != NULL)
+			w -> waiting |= 1ULL << i;
+	if (w -> waiting == 0) {
+		pthread_mutex_unlock(&fed -> lock);
+		pool_free(payload);
+		pool_free(w);
+		return 0;
+	}
+	w -> id = ++fed -> next_whisper;
+	w -> next = fed -> whispers;
+	fed -> whispers = w;
+	atomic_fetch_add(&sender -> whispers, 1);
+
+	n = varint_put(payload, w -> id);
+	n += varint_put(payload + n, name_len);
+	memcpy(payload + n, name, name_len);
+	memcpy(payload + n + name_len, msg, len);
+	f = frame_new(PROTO_V2, CMD_PEER_WHISPER, -1, payload, n + name_len + len);
+	fed_send_all(&f, 1);
+	pthread_mutex_unlock(&fed -> lock);
+	pool_free(payload);
+	frame_put(f);
+	return 1;
+}
+
+/*
+ * A client departs while the peers have not answered all its whispers: it hears of none of them
+ */
+void fed_whisper_cancel(struct chat_client *clientInfo)
+{
+	struct whisper_wait *w, **pp = &chatserver.fed.whispers;
+
+	pthread_mutex_lock(&chatserver.fed.lock);
+	while ((w = *pp) != NULL) {
+		if (w -> sender == clientInfo) {
+			*pp = w -> next;
+			pool_free(w);
+		} else {
+			pp = &w -> next;
+		}
+	}
+	atomic_store(&clientInfo -> whispers, 0);
+	pthread_mutex_unlock(&chatserver.fed.lock);
+}
+
+/*
+ * A room is created here, the peer servers create it too
+ */
+void fed_room(const char *name)
+{
+	struct frame *f;
+
+	if (atomic_load(&chatserver.fed.npeers) == 0)
+		return;
+	f = frame_new(PROTO_V2, CMD_PEER_ROOM, -1, name, strlen(name));
+	fed_relay(&f, 1);
+	frame_put(f);
+}
+
+/* tell a new peer about a room of ours */
+static void announce_room(struct chat_room *room, void *arg)
+{
+	struct frame *f;
+
+	if (room == chatserver.lobby)
+		return;
+	f = frame_new(PROTO_V2, CMD_PEER_ROOM, -1, room -> name, strlen(room -> name));
+	client_enqueue((struct chat_client *)arg, f);
+	frame_put(f);
+}
+
+/* hand a decided claim over to the event loop of its client - fed.lock held, the claim is off the list */
+static void claim_decided(struct name_claim *c)
+{
+	struct event_loop *loop = c -> client -> loop;
+	uint64_t one = 1;
+
+	c -> next = loop -> claims_done;
+	loop -> claims_done = c;
+	while (write(loop -> wakefd, &one, sizeof(one)) == -1 && errno == EINTR)
+		;
+}
+
+/*
+ * A whisper is answered by all peers, or delivered: the sender is told if nobody had the name
+ * fed.lock held, the whisper is off the list - the sender departs only after it is counted out
+ */
+static void whisper_decided(struct whisper_wait *w, int delivered)
+{
+	struct chat_client *sender = w -> sender;
+	struct frame *f;
+
+	if (!delivered) {
+		f = frame_new(sender -> version, CMD_SERVER_FAIL, ERR_USER_NOT_FOUND, NULL, 0);
+		client_enqueue(sender, f);
+		frame_put(f);
+	}
+	atomic_fetch_sub(&sender -> whispers, 1);
+	pool_free(w);
+}
+
+/* the link in a slot is gone, it has no say in any claim, nor whisper, any more - fed.lock held */
+static void forget_slot(int slot)
+{
+	struct name_claim *c, **pp = &chatserver.fed.claims;
+	struct whisper_wait *w, **wp = &chatserver.fed.whispers;
+
+	while ((c = *pp) != NULL) {
+		c -> waiting &= ~(1ULL << slot);
+		if (c -> waiting == 0) {
+			*pp = c -> next;
+			claim_decided(c);
+		} else {
+			pp = &c -> next;
+		}
+	}
+	while ((w = *wp) != NULL) {
+		w -> waiting &= ~(1ULL << slot);
+		if (w -> waiting == 0) {
+			*wp = w -> next;
+			whisper_decided(w, 0);
+		} else {
+			wp = &w -> next;
+		}
+	}
+}
+
+/*
+ * A connection turned out to be a link to the peer server node: take it into a slot
+ * Two links between the same two servers (both opened one): the one opened by the server with
+ * the lower node id stays, both ends see the same and keep the same link. Of two links opened
+ * by the same server, the newer stays - the peer gave up on the older one.
+ * Return value:  0 - success, the connection is CLIENT_PEER now;
+ *               -1 - the other link stays, or all slots are taken;
+ */
+int fed_link(struct chat_client *clientInfo, uint64_t node)
+{
+	struct federation *fed = &chatserver.fed;
+	struct chat_client *old;
+	int slot;
+
+	pthread_mutex_lock(&fed -> lock);
+	if (clientInfo -> peer_addr >= 0)
+		fed -> addrs[clientInfo -> peer_addr].node = node;
+	for (slot = 0; slot < MAX_PEERS && (fed -> peers[slot] == NULL || fed -> peers[slot] -> node != node); slot++)
+		;
+	if (slot < MAX_PEERS) {
+		old = fed -> peers[slot];
+		if (old -> initiator < clientInfo -> initiator) {
+			pthread_mutex_unlock(&fed -> lock);
+			return -1;
+		}
+		/* its event loop sees the hang up and removes it, the slot is not its own any more */
+		old -> peer_slot = -1;
+		forget_slot(slot);
+		pthread_mutex_lock(&old -> out_lock);
+		old -> dead = 1;
+		shutdown(old -> socketfd, SHUT_RDWR);
+		pthread_mutex_unlock(&old -> out_lock);
+	} else {
+		for (slot = 0; slot < MAX_PEERS && fed -> peers[slot] != NULL; slot++)
+			;
+		if (slot == MAX_PEERS) {
+			pthread_mutex_unlock(&fed -> lock);
+			return -1;
+		}
+		atomic_fetch_add(&fed -> npeers, 1);
+	}
+	clientInfo -> node = node;
+	clientInfo -> peer_slot = slot;
+	clientInfo -> state = CLIENT_PEER;
+	fed -> peers[slot] = clientInfo;
+	pthread_mutex_unlock(&fed -> lock);
+
+	room_foreach(announce_room, clientInfo);
+	return 0;
+}
+
+/*
+ * A link to a peer server goes away: the claims waiting for it go on without it, and the
+ * names it claimed are free again
+ */
+void fed_unlink(struct chat_client *clientInfo)
+{
+	struct federation *fed = &chatserver.fed;
+	struct name_lease *l, **pp = &fed -> leases;
+
+	pthread_mutex_lock(&fed -> lock);
+	if (clientInfo -> peer_addr >= 0)
+		fed -> addrs[clientInfo -> peer_addr].busy = 0;	// to be opened again
+	if (clientInfo -> peer_slot >= 0) {
+		fed -> peers[clientInfo -> peer_slot] = NULL;
+		atomic_fetch_sub(&fed -> npeers, 1);
+		forget_slot(clientInfo -> peer_slot);
+		clientInfo -> peer_slot = -1;
+		while ((l = *pp) != NULL) {
+			if (l -> node == clientInfo -> node) {
+				*pp = l -> next;
+				pool_free(l);
+			} else {
+				pp = &l -> next;
+			}
+		}
+	}
+	pthread_mutex_unlock(&fed -> lock);
+}
+
+/* the claim is decided, the peers which granted it forget their lease */
+static void fed_release(uint64_t id)
+{
+	char payload[VARINT_MAX];
+	struct frame *f;
+
+	f = frame_new(PROTO_V2, CMD_PEER_RELEASE, -1, payload, varint_put(payload, id));
+	fed_relay(&f, 1);
+	frame_put(f);
+}
+
+/*
+ * Claim the name of a joining client, reserved here already, from all peer servers
+ * The client waits as CLIENT_CLAIMING, nothing more is read from it until fed_claims_done().
+ * Return value: 1 - the peers are asked;
+ *               0 - there are no peers, the client may be let in right away
+ */
+int fed_claim(struct chat_client *clientInfo, int command, const char *room_name, uint64_t last_seq)
+{
+	struct federation *fed = &chatserver.fed;
+	char payload[VARINT_MAX + CLIENTNAME_LENGTH];
+	struct epoll_event ev;
+	struct name_claim *c;
+	struct frame *f;
+	size_t len;
+	int i, n;
+
+	if (atomic_load(&fed -> npeers) == 0)
+		return 0;
+
+	c = (struct name_claim *)pool_calloc(sizeof(struct name_claim));
+	c -> client = clientInfo;
+	c -> command = command;
+	strcpy(c -> room, room_name);
+	c -> last_seq = last_seq;
+
+	pthread_mutex_lock(&fed -> lock);
+	for (i = 0; i < MAX_PEERS; i++)
+		if (fed -> peers[i] != NULL)
+			c -> waiting |= 1ULL << i;
+	if (c -> waiting == 0) {
+		pthread_mutex_unlock(&fed -> lock);
+		pool_free(c);
+		return 0;
+	}
+	c -> id = ++fed -> next_claim;
+	c -> next = fed -> claims;
+	fed -> claims = c;
+	clientInfo -> claim = c;
+	clientInfo -> state = CLIENT_CLAIMING;
+
+	n = varint_put(payload, c -> id);
+	len = strlen(clientInfo -> client_name);
+	memcpy(payload + n, clientInfo -> client_name, len);
+	f = frame_new(PROTO_V2, CMD_PEER_CLAIM, -1, payload, n + len);
+	fed_send_all(&f, 1);
+	pthread_mutex_unlock(&fed -> lock);
+	frame_put(f);
+
+	/* only a hang up is of interest meanwhile, the answers are handed to this loop */
+	ev.events = EPOLLRDHUP;
+	ev.data.ptr = clientInfo;
+	epoll_ctl(clientInfo -> loop -> epfd, EPOLL_CTL_MOD, clientInfo -> socketfd, &ev);
+	return 1;
+}
+
+/*
+ * A client departs while its name is claimed: the claim is withdrawn
+ */
+void fed_claim_cancel(struct chat_client *clientInfo)
+{
+	struct name_claim *c = clientInfo -> claim, **pp;
+
+	pthread_mutex_lock(&chatserver.fed.lock);
+	for (pp = &chatserver.fed.claims; *pp != NULL && *pp != c; pp = &(*pp) -> next)
+		;
+	if (*pp == NULL)
+		for (pp = &clientInfo -> loop -> claims_done; *pp != NULL && *pp != c; pp = &(*pp) -> next)
+			;
+	if (*pp != NULL)
+		*pp = c -> next;
+	pthread_mutex_unlock(&chatserver.fed.lock);
+
+	fed_release(c -> id);
+	clientInfo -> claim = NULL;
+	pool_free(c);
+}
+
+/*
+ * The claims of the clients of a loop which the peer servers decided: let the clients in, or turn them away
+ */
+void fed_claims_done(struct event_loop *loop)
+{
+	struct name_claim *c, *next;
+	struct chat_client *clientInfo;
+	struct epoll_event ev;
+
+	pthread_mutex_lock(&chatserver.fed.lock);
+	c = loop -> claims_done;
+	loop -> claims_done = NULL;
+	pthread_mutex_unlock(&chatserver.fed.lock);
+
+	for (; c != NULL; c = next) {
+		next = c -> next;
+		clientInfo = c -> client;
+		clientInfo -> claim = NULL;
+		fed_release(c -> id);
+		if (c -> denied) {
+			printf("A client's name is taken on a peer server [%s]\n", clientInfo -> client_name);
+			client_notify(clientInfo, CMD_SERVER_FAIL, ERR_JOIN_DUP_NAME);
+			client_depart(clientInfo);
+		} else {
+			ev.events = EPOLLIN | EPOLLRDHUP;
+			ev.data.ptr = clientInfo;
+			epoll_ctl(loop -> epfd, EPOLL_CTL_MOD, clientInfo -> socketfd, &ev);
+			/* what the client sent behind its join waited in the decoder */
+			if (client_admit(clientInfo, c -> command, c -> room, c -> last_seq) != 0 ||
+					client_dispatch(clientInfo) != 0)
+				client_depart(clientInfo);
+		}
+		pool_free(c);
+	}
+}
+
+/* a room named by a peer server, created if we do not have it */
+static struct chat_room *room_get(const char *payload, size_t len)
+{
+	char name[ROOMNAME_LENGTH];
+	struct chat_room *room;
+
+	len = (len < ROOMNAME_LENGTH) ? len : ROOMNAME_LENGTH - 1;
+	memcpy(name, payload, len);
+	name[len] = '\0';
+	if (len == 0)
+		return NULL;
+	if ((room = room_lookup(name)) == NULL && room_create(name, &room) != 0)
+		room = room_lookup(name);	// created meanwhile, or the limit is reached
+	return room;
+}
+
+/*
+ * Handle a message of a peer server, on the event loop of its link
+ * Return value:  0 - success;
+ *               -1 - the message is malformed, the link is to be dropped;
+ */
+int fed_peer_read(struct chat_client *clientInfo, struct chat_frame *mbuf)
+{
+	struct federation *fed = &chatserver.fed;
+	const char *p = mbuf -> payload, *end = mbuf -> payload + mbuf -> len;
+	char name[CLIENTNAME_LENGTH], payload[2 * VARINT_MAX];
+	struct name_claim *c, **pp;
+	struct name_lease *l, **lp;
+	struct whisper_wait *w, **wp;
+	struct chat_room *room;
+	struct frame *f;
+	uint64_t id, v;
+	size_t len;
+	int n;
+
+	if (mbuf -> command == CMD_PEER_RELAY || mbuf -> command == CMD_PEER_NOTICE) {
+		/* a message of a client of the peer, or a notice, for our clients of the room - not to be relayed again */
+		if ((n = varint_get(p, end - p, &v)) <= 0 || v > (uint64_t)(end - p - n))
+			return -1;
+		p += n;
+		if ((room = room_get(p, v)) == NULL)
+			return 0;
+		p += v;
+		f = frame_message(end - p);
+		memcpy(f -> data + PROTO_BROADCAST_HEADROOM, p, end - p);
+		f -> relayed = 1;
+		if (mbuf -> command == CMD_PEER_NOTICE) {
+			chatmsg_put_lane(&room -> chatmsgQ, LANE_PRESENCE, f);
+		} else if (chatmsg_put_nowait(&room -> chatmsgQ, f) != 0) {
+			/* the loop never waits for the broadcast thread: the link is not read until the relay goes */
+			clientInfo -> held_room = room;
+			client_hold(clientInfo, f, clientInfo -> loop -> now + FLOOD_RETRY_MS);
+		}
+	}
+	else if (mbuf -> command == CMD_PEER_WHISPER) {
+		/* for a client of ours, if it is here - never sent on, the sender's server is told either way */
+		if ((n = varint_get(p, end - p, &id)) <= 0)
+			return -1;
+		p += n;
+		if ((n = varint_get(p, end - p, &v)) <= 0 || v > (uint64_t)(end - p - n))
+			return -1;
+		p += n;
+		len = (v < CLIENTNAME_LENGTH) ? v : CLIENTNAME_LENGTH - 1;
+		memcpy(name, p, len);
+		name[len] = '\0';
+		p += v;
+		n = varint_put(payload, id);
+		n += varint_put(payload + n, name_index_deliver(name, p, end - p));
+		f = frame_new(PROTO_V2, CMD_PEER_WHISPER_REPLY, -1, payload, n);
+		client_enqueue(clientInfo, f);
+		frame_put(f);
+	}
+	else if (mbuf -> command == CMD_PEER_WHISPER_REPLY) {
+		if ((n = varint_get(p, end - p, &id)) <= 0 || varint_get(p + n, end - p - n, &v) <= 0)
+			return -1;
+		pthread_mutex_lock(&fed -> lock);
+		for (wp = &fed -> whispers; (w = *wp) != NULL && w -> id != id; wp = &w -> next)
+			;
+		/* the whisper may be decided already, or its sender gone */
+		if (w != NULL && clientInfo -> peer_slot >= 0) {
+			w -> waiting &= ~(1ULL << clientInfo -> peer_slot);
+			if (v != 0 || w -> waiting == 0) {
+				*wp = w -> next;
+				whisper_decided(w, v != 0);
+			}
+		}
+		pthread_mutex_unlock(&fed -> lock);
+	}
+	else if (mbuf -> command == CMD_PEER_ROOM) {
+		room_get(p, end - p);
+	}
+	else if (mbuf -> command == CMD_PEER_CLAIM) {
+		if ((n = varint_get(p, end - p, &id)) <= 0)
+			return -1;
+		p += n;
+		len = ((size_t)(end - p) < CLIENTNAME_LENGTH) ? (size_t)(end - p) : CLIENTNAME_LENGTH - 1;
+		memcpy(name, p, len);
+		name[len] = '\0';
+		n = varint_put(payload, id);
+		n += varint_put(payload + n, name_index_grant(name, clientInfo -> node, id));
+		f = frame_new(PROTO_V2, CMD_PEER_CLAIM_REPLY, -1, payload, n);
+		client_enqueue(clientInfo, f);
+		frame_put(f);
+	}
+	else if (mbuf -> command == CMD_PEER_CLAIM_REPLY) {
+		if ((n = varint_get(p, end - p, &id)) <= 0 || varint_get(p + n, end - p - n, &v) <= 0)
+			return -1;
+		pthread_mutex_lock(&fed -> lock);
+		for (pp = &fed -> claims; (c = *pp) != NULL && c -> id != id; pp = &c -> next)
+			;
+		/* the claim may be decided already, without this peer */
+		if (c != NULL && clientInfo -> peer_slot >= 0) {
+			c -> waiting &= ~(1ULL << clientInfo -> peer_slot);
+			if (v == 0)
+				c -> denied = 1;
+			if (c -> waiting == 0 || c -> denied) {
+				*pp = c -> next;
+				claim_decided(c);
+			}
+		}
+		pthread_mutex_unlock(&fed -> lock);
+	}
+	else if (mbuf -> command == CMD_SERVER_PING) {
+		/* the peer checks on the link, like we do */
+		f = frame_new(PROTO_V2, CMD_CLIENT_PONG, -1, NULL, 0);
+		client_enqueue(clientInfo, f);
+		frame_put(f);
+	}
+	else if (mbuf -> command == CMD_PEER_RELEASE) {
+		if (varint_get(p, end - p, &id) <= 0)
+			return -1;
+		pthread_mutex_lock(&fed -> lock);
+		for (lp = &fed -> leases; (l = *lp) != NULL; lp = &l -> next) {
+			if (l -> node == clientInfo -> node && l -> claim == id) {
+				*lp = l -> next;
+				pool_free(l);
+				break;
+			}
+		}
+		pthread_mutex_unlock(&fed -> lock);
+	}
+	return 0;
+}
+
+/*
+ * Open a link to a peer server given with -F, and send our CMD_PEER_HELLO
+ * The link is handed over to an event loop, which waits for the answer like for a join.
+ * Return value:  0 - success;
+ *               -1 - the peer cannot be reached;
+ */
+static int peer_connect(int i)
+{
+	struct peer_addr *a = &chatserver.fed.addrs[i];
+	struct addrinfo hints, *res;
+	char payload[VARINT_MAX], sbuf[PROTO_V2_HEADER_MAX + VARINT_MAX];
+	struct chat_client *c;
+	size_t len;
+	int fd, on = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(a -> host, a -> port, &hints, &res) != 0)
+		return -1;
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		freeaddrinfo(res);
+		return -1;
+	}
+	if (connect(fd, res -> ai_addr, res -> ai_addrlen) == -1) {
+		close(fd);
+		freeaddrinfo(res);
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	len = proto_encode(sbuf, PROTO_V2, CMD_PEER_HELLO, -1, payload, varint_put(payload, chatserver.fed.node));
+	if (send_all(fd, sbuf, len) == -1) {
+		close(fd);
+		freeaddrinfo(res);
+		return -1;
+	}
+	/* the socket is the loop's from here on, also if this fails */
+	c = client_new(fd, (struct sockaddr_in *)res -> ai_addr, 0, i);
+	freeaddrinfo(res);
+	return (c != NULL) ? 0 : -1;
+}
+
+/*
+ * Keep the links to the peer servers given with -F: open those which are down, every PEER_RETRY_MS
+ */
+void *peer_thread_fn(void *arg)
+{
+	struct federation *fed = &chatserver.fed;
+	int i, j, busy;
+
+	while (1) {
+		for (i = 0; i < fed -> naddrs; i++) {
+			/* a link the peer opened to us will do as well */
+			pthread_mutex_lock(&fed -> lock);
+			busy = fed -> addrs[i].busy;
+			for (j = 0; !busy && fed -> addrs[i].node != 0 && j < MAX_PEERS; j++)
+				busy = fed -> peers[j] != NULL && fed -> peers[j] -> node == fed -> addrs[i].node;
+			if (!busy)
+				fed -> addrs[i].busy = 1;
+			pthread_mutex_unlock(&fed -> lock);
+			if (busy)
+				continue;
+
+			if (peer_connect(i) != 0) {
+				pthread_mutex_lock(&fed -> lock);
+				fed -> addrs[i].busy = 0;
+				pthread_mutex_unlock(&fed -> lock);
+			}
+		}
+		usleep(PEER_RETRY_MS * 1000);
+	}
+	return NULL;
+}
+
+/*
+ * Find a room by name
+ * Return value: the room, NULL if there is none
+ */
+struct chat_room *room_lookup(const char *name)
+{
+	struct room_bucket *b = &chatserver.rooms.buckets[str_hash(name) % ROOM_HASH_SIZE];
+	struct chat_room *room;
+
+	pthread_mutex_lock(&b -> lock);
+	for (room = b -> head; room != NULL; room = room -> hnext)
+		if (strcmp(room -> name, name) == 0)
+			break;
+	pthread_mutex_unlock(&b -> lock);
+	return room;
+}
+
+/*
+ * Create a room and start its broadcast thread
+ * Return value: 0 - success, the room is returned in *room;
+ *               ERR_ROOM_EXISTS or ERR_ROOM_LIMIT
+ */
+int room_create(const char *name, struct chat_room **room)
+{
+	struct room_bucket *b = &chatserver.rooms.buckets[str_hash(name) % ROOM_HASH_SIZE];
+	struct chat_room *r;
+	pthread_attr_t attr;
+
+	pthread_mutex_lock(&b -> lock);
+	for (r = b -> head; r != NULL; r = r -> hnext) {
+		if (strcmp(r -> name, name) == 0) {
+			pthread_mutex_unlock(&b -> lock);
+			return ERR_ROOM_EXISTS;
+		}
+	}
+	if (atomic_fetch_add(&chatserver.rooms.count, 1) >= chatserver.max_rooms) {
+		atomic_fetch_sub(&chatserver.rooms.count, 1);
+		pthread_mutex_unlock(&b -> lock);
+		return ERR_ROOM_LIMIT;
+	}
+
+	r = (struct chat_room *)malloc(sizeof(struct chat_room));
+	memset(r, 0, sizeof(struct chat_room));
+	strncpy(r -> name, name, ROOMNAME_LENGTH - 1);
+	chatmsg_queue_init(&r -> chatmsgQ, chatserver.queue_msgs);
+	sem_init(&r -> clientQ.cq_lock, 0, 1);
+	r -> next_seq = 1;
+	if (chatserver.history_dir != NULL) {
+		if (history_open(&r -> history, chatserver.history_dir, r -> name) == 0) {
+			r -> has_history = 1;
+			r -> next_seq = r -> history.next_seq;	// the numbers go on where the last run stopped
+		} else {
+			perror("cannot open the history of the room");
+		}
+	}
+	if (chatserver.retain_msgs > 0) {
+		size_t n = 1;
+
+		while (n < chatserver.retain_msgs)
+			n <<= 1;
+		r -> retain = (struct frame **)calloc(n, sizeof(struct frame *));
+		r -> retain_mask = n - 1;
+	}
+
+	/* the broadcast thread needs little stack, keep the memory of many rooms small */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, BROADCAST_STACK_SIZE);
+	pthread_create(&r -> broadcast_thread, &attr, broadcast_thread_fn, (void *)r);
+	pthread_attr_destroy(&attr);
+
+	r -> hnext = b -> head;
+	b -> head = r;
+	pthread_mutex_unlock(&b -> lock);
+
+	if (r != chatserver.lobby && chatserver.lobby != NULL)
+		printf("A new room is created [%s]\n", r -> name);
+	*room = r;
+	return 0;
+}
+
+/*
+ * Call fn for every room
+ */
+void room_foreach(void (*fn)(struct chat_room *, void *), void *arg)
+{
+	struct room_bucket *b;
+	struct chat_room *room;
+	int i;
+
+	/* rooms are never removed, the list can be walked once the head is read */
+	for (i = 0; i < ROOM_HASH_SIZE; i++) {
+		b = &chatserver.rooms.buckets[i];
+		pthread_mutex_lock(&b -> lock);
+		room = b -> head;
+		pthread_mutex_unlock(&b -> lock);
+		for (; room != NULL; room = room -> hnext)
+			fn(room, arg);
+	}
+}
+
+/* queue one message of the history for a client - cq_lock held */
+static int replay_one(struct history_segment *seg, const struct history_rec *rec, void *arg)
+{
+	struct chat_client *clientInfo = arg;
+	struct frame *f;
+
+	if (clientInfo -> version == PROTO_V2)
+		f = frame_map(seg, rec);
+	else
+		f = frame_broadcast(clientInfo -> version, rec -> seq, rec -> frame + rec -> payload_off,
+				rec -> len - rec -> payload_off);
+	client_replay(clientInfo, f);
+	frame_put(f);
+	return 0;
+}
+
+/*
+ * Queue the messages after since for a resuming client - cq_lock held
+ * The frames retained in memory are used if they reach back far enough, the history
+ * otherwise. A gap nothing covers any more is told by a notice.
+ */
+static void replay_since(struct chat_room *room, struct chat_client *clientInfo, uint64_t since)
+{
+	uint64_t first = room -> next_seq, seq;
+	char content[CONTENT_LENGTH];
+	struct frame *f;
+
+	/* the oldest message still retained */
+	while (room -> retain != NULL && first > since + 1 && room -> next_seq - first <= room -> retain_mask &&
+			(f = room -> retain[(first - 1) & room -> retain_mask]) != NULL && f -> seq == first - 1)
+		first--;
+
+	if (first > since + 1 && room -> has_history &&
+			room -> history.oldest != NULL && room -> history.oldest -> first_seq < first) {
+		seq = (room -> history.oldest -> first_seq > since + 1) ? room -> history.oldest -> first_seq : since + 1;
+		if (seq > since + 1) {
+			snprintf(content, sizeof(content), "*** %llu messages missed ***", (unsigned long long)(seq - since - 1));
+			f = frame_broadcast(clientInfo -> version, 0, content, strlen(content));
+			client_enqueue(clientInfo, f);
+			frame_put(f);
+		}
+		history_replay(&room -> history, seq, replay_one, clientInfo);
+		return;
+	}
+
+	if (first > since + 1) {
+		snprintf(content, sizeof(content), "*** %llu messages missed ***", (unsigned long long)(first - since - 1));
+		f = frame_broadcast(clientInfo -> version, 0, content, strlen(content));
+		client_enqueue(clientInfo, f);
+		frame_put(f);
+	}
+	for (seq = first; seq < room -> next_seq; seq++)
+		client_replay(clientInfo, room -> retain[seq & room -> retain_mask]);
+}
+
+/* the change of the window pending for a name, or where it goes - cq_lock held */
+static struct presence_change **presence_find(struct chat_room *room, const char *name)
+{
+	struct presence_change **pp = &room -> pending[str_hash(name) % PRESENCE_HASH_SIZE];
+
+	while (*pp != NULL && strcmp((*pp) -> name, name) != 0)
+		pp = &(*pp) -> hnext;
+	return pp;
+}
+
+/*
+ * Note a join or a leave for the next roster update - cq_lock held
+ * The first change of a window sets the time of the update; a change undoing one still pending
+ * cancels it.
+ */
+static void presence_note(struct chat_room *room, const char *name, int left)
+{
+	struct presence_change **pp = presence_find(room, name), *c;
+
+	if ((c = *pp) != NULL) {
+		if (c -> left != left) {
+			*pp = c -> hnext;
+			c -> cancelled = 1;
+		}
+		return;
+	}
+	if (room -> nchanges == room -> changes_cap) {
+		room -> changes_cap = (room -> changes_cap > 0) ? room -> changes_cap * 2 : 16;
+		room -> changes = (struct presence_change **)realloc(room -> changes,
+				room -> changes_cap * sizeof(struct presence_change *));
+	}
+	c = (struct presence_change *)malloc(sizeof(struct presence_change));
+	strncpy(c -> name, name, CLIENTNAME_LENGTH - 1);
+	c -> name[CLIENTNAME_LENGTH - 1] = '\0';
+	c -> left = left;
+	c -> cancelled = 0;
+	c -> hnext = NULL;
+	*pp = c;
+	room -> changes[room -> nchanges++] = c;
+	if (room -> nchanges == 1)
+		chatmsg_wake_at(&room -> chatmsgQ, now_ns() + chatserver.presence_ms * 1000000LL);
+}
+
+/*
+ * Encode names of the roster into one v2 frame, as many as fit into max_payload but one at least:
+ * CMD_SERVER_ROSTER takes them from names[0], CMD_SERVER_PRESENCE from names[0] (joined), then
+ * from names[1] (left). pos[] is where the frame starts, and where the next one goes on.
+ */
+static struct frame *frame_roster(int command, const char **names[2], const int count[2], int pos[2])
+{
+	int nlists = (command == CMD_SERVER_ROSTER) ? 1 : 2;
+	size_t size = nlists * VARINT_MAX, len = 0, s;
+	int i, k, n[2] = {0, 0}, full = 0;
+	struct frame *f;
+	char *payload;
+
+	for (i = 0; i < nlists; i++)
+		for (; !full && pos[i] + n[i] < count[i]; n[i]++) {
+			s = VARINT_MAX + strlen(names[i][pos[i] + n[i]]);
+			if (size + s > chatserver.max_payload && size > (size_t)nlists * VARINT_MAX) {
+				full = 1;
+				break;
+			}
+			size += s;
+		}
+
+	payload = (char *)malloc(size);
+	for (i = 0; i < nlists; i++) {
+		len += varint_put(payload + len, n[i]);
+		for (k = pos[i]; k < pos[i] + n[i]; k++) {
+			s = strlen(names[i][k]);
+			len += varint_put(payload + len, s);
+			memcpy(payload + len, names[i][k], s);
+			len += s;
+		}
+		pos[i] += n[i];
+	}
+	f = frame_new(PROTO_V2, command, -1, payload, len);
+	f -> lane = LANE_PRESENCE;
+	free(payload);
+	return f;
+}
+
+/*
+ * A line of text about the joins or the leaves of a window: "alice, bob and 3 more just join the chat room, welcome!"
+ * out has room for CLIENTNAME_LENGTH + CONTENT_LENGTH bytes.
+ * Return value: the length of the text
+ */
+static size_t presence_text(char *out, const char **names, int n, int left)
+{
+	size_t len = 0, l;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		l = strlen(names[i]);
+		if (i > 0 && len + 2 + l > PRESENCE_TEXT_NAMES)
+			break;
+		if (i > 0) {
+			memcpy(out + len, ", ", 2);
+			len += 2;
+		}
+		memcpy(out + len, names[i], l);
+		len += l;
+	}
+	if (i < n)
+		len += sprintf(out + len, " and %d more", n - i);
+	if (n == 1)
+		len += sprintf(out + len, left ? " just leaves the chat room, goodbye!" : " just joins the chat room, welcome!");
+	else
+		len += sprintf(out + len, left ? " just leave the chat room, goodbye!" : " just join the chat room, welcome!");
+	return len;
+}
+
+/*
+ * Send the members of the room to a v2 client coming in - cq_lock held
+ * They are the members as of the last roster update, and the client itself: those joined since
+ * are left out, those left since are still in, the next update tells.
+ */
+static void roster_send(struct chat_room *room, struct chat_client *clientInfo)
+{
+	const char **names[2];
+	int count[2] = {0, 0}, pos[2] = {0, 0}, i;
+	struct presence_change *c;
+	struct chat_client *p;
+	struct frame *f;
+
+	names[0] = (const char **)malloc((room -> clientQ.count + room -> nchanges) * sizeof(const char *));
+	names[1] = NULL;
+	for (p = room -> clientQ.head; p != NULL; p = p -> next)
+		if (p == clientInfo || (c = *presence_find(room, p -> client_name)) == NULL || c -> left)
+			names[0][count[0]++] = p -> client_name;
+	for (i = 0; i < room -> nchanges; i++)
+		if (!room -> changes[i] -> cancelled && room -> changes[i] -> left)
+			names[0][count[0]++] = room -> changes[i] -> name;
+
+	/* what does not fit into the roster follows as joined */
+	f = frame_roster(CMD_SERVER_ROSTER, names, count, pos);
+	client_enqueue(clientInfo, f);
+	frame_put(f);
+	while (pos[0] < count[0]) {
+		f = frame_roster(CMD_SERVER_PRESENCE, names, count, pos);
+		client_enqueue(clientInfo, f);
+		frame_put(f);
+	}
+	free(names[0]);
+}
+
+/*
+ * Send the roster update of the window to the clients of the room - the broadcast thread, cq_lock held
+ * The v2 clients get the names, the v1 clients a line of text for the joins and one for the leaves;
+ * the same lines for the peer servers are returned in relay.
+ * Return value: the # of frames in relay, 2 at most
+ */
+static int presence_flush(struct chat_room *room, struct frame **relay)
+{
+	char text[CLIENTNAME_LENGTH + CONTENT_LENGTH];
+	const char **names[2];
+	int count[2] = {0, 0}, pos[2] = {0, 0}, nrelay = 0, i;
+	struct presence_change *c;
+	struct chat_client *p;
+	struct frame *f;
+	size_t len;
+
+	atomic_store(&room -> chatmsgQ.wake_at, 0);
+	if (room -> nchanges == 0)
+		return 0;
+	names[0] = (const char **)malloc(room -> nchanges * sizeof(const char *));
+	names[1] = (const char **)malloc(room -> nchanges * sizeof(const char *));
+	for (i = 0; i < room -> nchanges; i++) {
+		c = room -> changes[i];
+		if (!c -> cancelled)
+			names[c -> left][count[c -> left]++] = c -> name;
+	}
+
+	if (room -> clientQ.count > room -> clientQ.count_v1)
+		while (pos[0] < count[0] || pos[1] < count[1]) {
+			f = frame_roster(CMD_SERVER_PRESENCE, names, count, pos);
+			for (p = room -> clientQ.head; p != NULL; p = p -> next)
+				if (p -> version == PROTO_V2)
+					client_enqueue(p, f);
+			frame_put(f);
+		}
+	for (i = 0; i < 2; i++) {
+		if (count[i] == 0)
+			continue;
+		len = presence_text(text, names[i], count[i], i);
+		if (room -> clientQ.count_v1 > 0) {
+			f = frame_broadcast(PROTO_V1, 0, text, len);
+			f -> lane = LANE_PRESENCE;
+			for (p = room -> clientQ.head; p != NULL; p = p -> next)
+				if (p -> version == PROTO_V1)
+					client_enqueue(p, f);
+			frame_put(f);
+		}
+		if (atomic_load_explicit(&chatserver.fed.npeers, memory_order_relaxed) > 0)
+			relay[nrelay++] = frame_relay(CMD_PEER_NOTICE, room -> name, text, len);
+	}
+
+	for (i = 0; i < room -> nchanges; i++)
+		free(room -> changes[i]);
+	room -> nchanges = 0;
+	memset(room -> pending, 0, sizeof(room -> pending));
+	free(names[0]);
+	free(names[1]);
+	return nrelay;
+}
+
+/*
+ * Insert the client into the clientQ of a room, and note its join for the next roster update
+ * reply (if any) is queued for the client before any broadcast of the new room, followed by
+ * the roster (v2) and the messages it missed: since < 0 - none; 0 - the last messages of the
+ * room's history; > 0 - all after the message numbered since, for a resuming client.
+ * Return value: 0 - success;
+ *               ERR_JOIN_ROOM_FULL
+ */
+int room_add_client(struct chat_room *room, struct chat_client *clientInfo, struct frame *reply, long long since)
+{
+	int quiet;
+
+	/* a resumed session is back, nobody needs to hear about it */
+	pthread_mutex_lock(&clientInfo -> out_lock);
+	quiet = clientInfo -> quiet;
+	pthread_mutex_unlock(&clientInfo -> out_lock);
+
+	cq_lock(room);
+	if (room == chatserver.lobby && clientInfo -> lobby_slot) {
+		/* the place held since client_join() is taken now */
+		room -> clientQ.reserved --;
+		clientInfo -> lobby_slot = 0;
+	} else if (reply != NULL && room -> clientQ.count + room -> clientQ.reserved >= chatserver.room_capacity) {
+		sem_post(&room -> clientQ.cq_lock);
+		return ERR_JOIN_ROOM_FULL;
+	}
+	clientInfo -> next = NULL;
+	clientInfo -> prev = NULL;
+	if (room -> clientQ.tail != NULL){
+		room -> clientQ.tail -> next = clientInfo;
+		clientInfo -> prev = room -> clientQ.tail;
+		room -> clientQ.tail = clientInfo;}
+	else{
+		room -> clientQ.head = clientInfo;
+		room -> clientQ.tail = clientInfo;
+	}
+	room -> clientQ.count ++;
+	if (clientInfo -> version == PROTO_V1)
+		room -> clientQ.count_v1 ++;
+	if (clientInfo -> subs != NULL)
+		room -> subs_changed = 1;
+	clientInfo -> room = room;
+	if (!quiet)
+		presence_note(room, clientInfo -> client_name, 0);
+	if (reply != NULL)
+		client_enqueue(clientInfo, reply);
+	if (clientInfo -> version == PROTO_V2)
+		roster_send(room, clientInfo);
+	/* the broadcast thread numbers and stores every message under cq_lock: what is stored
+	 * now was sent to the others before, the new client gets everything after it live */
+	if (since > 0 && (uint64_t)since < room -> next_seq) {
+		replay_since(room, clientInfo, since);
+	} else if (since == 0 && room -> has_history && chatserver.history_replay > 0) {
+		uint64_t next = room -> history.next_seq;
+		history_replay(&room -> history, next > (uint64_t)chatserver.history_replay ? next - chatserver.history_replay : 1,
+				replay_one, clientInfo);
+	}
+	sem_post(&room -> clientQ.cq_lock);	// release lock
+
+	if (quiet) {
+		pthread_mutex_lock(&clientInfo -> out_lock);
+		clientInfo -> quiet = 0;
+		pthread_mutex_unlock(&clientInfo -> out_lock);
+	}
+	return 0;
+}
+
+/*
+ * Hold a place in the lobby for a joining client, see client_join()
+ * The name checks come first, and joins on several event loops run at once: the place is
+ * counted in the lobby's clientQ right away, so that they cannot overfill it between them.
+ * Return value: 0 - success;
+ *               ERR_JOIN_ROOM_FULL
+ */
+int lobby_reserve(struct chat_client *clientInfo)
+{
+	struct chat_room *lobby = chatserver.lobby;
+	int err = 0;
+
+	cq_lock(lobby);
+	if (lobby -> clientQ.count + lobby -> clientQ.reserved >= chatserver.room_capacity) {
+		err = ERR_JOIN_ROOM_FULL;
+	} else {
+		lobby -> clientQ.reserved ++;
+		clientInfo -> lobby_slot = 1;
+	}
+	sem_post(&lobby -> clientQ.cq_lock);
+	return err;
+}
+
+/*
+ * Give up the place a client holds in the lobby, if any: its join failed, or it went to another room
+ */
+void lobby_release(struct chat_client *clientInfo)
+{
+	struct chat_room *lobby = chatserver.lobby;
+
+	if (!clientInfo -> lobby_slot)
+		return;
+	cq_lock(lobby);
+	lobby -> clientQ.reserved --;
+	sem_post(&lobby -> clientQ.cq_lock);
+	clientInfo -> lobby_slot = 0;
+}
+
+/*
+ * Remove the client from the clientQ of a room, and note its leave for the next roster update
+ */
+void room_remove_client(struct chat_room *room, struct chat_client *clientInfo)
+{
+	/* a session taken over by a resuming client leaves without a word */
+	pthread_mutex_lock(&clientInfo -> out_lock);
+	int quiet = clientInfo -> quiet;
+	pthread_mutex_unlock(&clientInfo -> out_lock);
+
+	/* remove the client from clientQ, be sure to delete the correct one! */
+	cq_lock(room);
+	room -> clientQ.count --;
+	if (clientInfo -> version == PROTO_V1)
+		room -> clientQ.count_v1 --;
+	if (clientInfo -> subs != NULL)
+		room -> subs_changed = 1;
+	// pay attention to the special cases,such as deleting the head or tail of the list
+	if ((clientInfo -> prev != NULL)&&(clientInfo -> next != NULL)){
+		clientInfo -> next -> prev = clientInfo -> prev;
+		clientInfo -> prev -> next = clientInfo -> next;
+	}
+	else if ((clientInfo -> next == NULL)&&(clientInfo -> prev != NULL))
+		{clientInfo -> prev -> next = NULL;	room -> clientQ.tail = clientInfo -> prev;}
+	else if ((clientInfo -> prev == NULL)&&(clientInfo -> next != NULL))
+		{clientInfo -> next -> prev = NULL;	room -> clientQ.head = clientInfo -> next;}
+	else {room -> clientQ.head = NULL;	room -> clientQ.tail = NULL;}
+	clientInfo -> next = clientInfo -> prev = NULL;
+	if (!quiet)
+		presence_note(room, clientInfo -> client_name, 1);
+	sem_post(&room -> clientQ.cq_lock);//release lock
+}
+
+/*
+ * Compile the keywords of the subscribers of a room into one matcher - the broadcast thread, cq_lock held
+ */
+static void room_match_build(struct chat_room *room)
+{
+	struct match_pattern *p;
+	struct subscription *s;
+	struct chat_client *c;
+	int n = 0, nsubscribers = 0;
+
+	room -> subs_changed = 0;
+	for (c = room -> clientQ.head; c != NULL; c = c -> next)
+		if (c -> subs != NULL) {
+			c -> sub_slot = nsubscribers++;
+			n += c -> nsubs;
+		}
+
+	matcher_free(room -> matcher);
+	room -> matcher = NULL;
+	free(room -> sub_masks);
+	room -> sub_masks = (nsubscribers > 0) ? (uint64_t *)malloc(nsubscribers * sizeof(uint64_t)) : NULL;
+	room -> nsubscribers = nsubscribers;
+	if (n == 0 || (p = (struct match_pattern *)malloc(n * sizeof(struct match_pattern))) == NULL)
+		return;
+
+	n = 0;
+	for (c = room -> clientQ.head; c != NULL; c = c -> next)
+		for (s = c -> subs; s != NULL; s = s -> next) {
+			p[n].text = s -> text;
+			p[n].len = s -> len;
+			p[n].flags = s -> flags;
+			p[n].owner = c -> sub_slot;
+			n++;
+		}
+	room -> matcher = matcher_build(p, n);
+	free(p);
+}
+
+/* cleanup handler - give the lock back if the thread is cancelled while holding it */
+static void release_lock(void *lock)
+{
+	sem_post((sem_t *)lock);
+}
+
+void *broadcast_thread_fn(void *arg)
+{
+	struct chat_room *room = arg;
+
+	/* enable cancallation, the thread may only be cancelled at a cancellation point (deferred) */
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	stats_register("room %s", room -> name);
+	struct thread_stats *st = stats_self();
+
+    while (1) {
+        // Broadcast the messages in the bounded buffer to all clients of the room, a batch at a time
+        // Nothing here waits for a client: each message is queued on every client and
+        // written out by the client's event loop as fast as the client reads
+		
+		struct frame *msg[BATCH_MAX];	// the messages as the clients' event loops put them together
+		struct frame *relay[BATCH_MAX + 2];	// those of our own clients and the roster update, for the peer servers
+		int nrelay = 0;
+		struct frame *f[PROTO_V2 + 1][BATCH_MAX];
+		int need[PROTO_V2 + 1];
+		long long stamp[BATCH_MAX], until, wake;
+		size_t bytes;
+		uint64_t seq;
+		int i, n, v;
+
+		/* take the messages out, their slots are free for the producers right away */
+		if ((msg[0] = chatmsg_get(&room -> chatmsgQ, &stamp[0], 0)) == NULL) {
+			/* no message, but the roster update is due */
+			cq_lock(room);
+			pthread_cleanup_push(release_lock, &room -> clientQ.cq_lock);
+			nrelay = presence_flush(room, relay);
+			pthread_cleanup_pop(1);
+			if (nrelay > 0) {
+				fed_relay(relay, nrelay);
+				for (i = 0; i < nrelay; i++)
+					frame_put(relay[i]);
+			}
+			continue;
+		}
+		bytes = msg[0] -> len;
+		/* without a window, only what is already there joins the batch */
+		until = (chatserver.batch_us > 0) ? now_ns() + chatserver.batch_us * 1000LL : -1;
+		for (n = 1; n < BATCH_MAX && bytes < chatserver.batch_bytes; n++) {
+			if ((msg[n] = chatmsg_get(&room -> chatmsgQ, &stamp[n], until)) == NULL)
+				break;
+			bytes += msg[n] -> len;
+		}
+		stat_add(&st -> broadcasts, n);
+
+		/* each peer server gets what came from our clients once, and fans it out to its own */
+		if (atomic_load_explicit(&chatserver.fed.npeers, memory_order_relaxed) > 0)
+			for (i = 0; i < n; i++)
+				if (!msg[i] -> relayed)
+					relay[nrelay++] = frame_relay(msg[i] -> lane == LANE_CHAT ? CMD_PEER_RELAY : CMD_PEER_NOTICE,
+							room -> name, msg[i] -> buf, msg[i] -> len);
+
+		/* encode them once per protocol version, every recipient's queue references the same frames */
+		cq_lock(room);
+		pthread_cleanup_push(release_lock, &room -> clientQ.cq_lock);
+
+		/* the roster update is due meanwhile, it goes ahead of the batch */
+		wake = atomic_load(&room -> chatmsgQ.wake_at);
+		if (wake != 0 && now_ns() >= wake)
+			nrelay += presence_flush(room, relay + nrelay);
+
+		/* numbered under cq_lock: a client joining sees every message either replayed or live */
+		seq = room -> next_seq;
+		room -> next_seq += n;
+
+		/* the versions the clients of the room speak, the v2 one is kept for resuming clients too */
+		need[PROTO_V1] = room -> clientQ.count_v1 > 0;
+		need[PROTO_V2] = room -> has_history || room -> retain != NULL || room -> clientQ.count > room -> clientQ.count_v1;
+
+		/* one scan of every message for the keywords of all subscribers; without a matcher, they get everything */
+		if (room -> subs_changed)
+			room_match_build(room);
+		if (room -> sub_masks != NULL) {
+			memset(room -> sub_masks, (room -> matcher == NULL) ? 0xff : 0, room -> nsubscribers * sizeof(uint64_t));
+			for (i = 0; room -> matcher != NULL && i < n; i++)
+				matcher_scan(room -> matcher, msg[i] -> buf, msg[i] -> len, room -> sub_masks, 1ULL << i);
+		}
+
+		for (i = 0; i < n; i++) {
+			const char *text = msg[i] -> buf;
+			size_t len = msg[i] -> len;
+			int lane = msg[i] -> lane;
+
+			if (need[PROTO_V1]) {
+				f[PROTO_V1][i] = frame_broadcast(PROTO_V1, seq + i, text, len);
+				f[PROTO_V1][i] -> stamp = stamp[i];
+				f[PROTO_V1][i] -> lane = lane;
+			}
+			if (!need[PROTO_V2])
+				continue;
+
+			/* the v2 encoding goes to the history, and the v2 clients get it from there */
+			f[PROTO_V2][i] = NULL;
+			if (room -> has_history) {
+				struct history_segment *seg;
+				const struct history_rec *rec;
+
+				rec = history_append(&room -> history, seq + i, now_wall_ms(), text, len, &seg);
+				if (rec != NULL)
+					f[PROTO_V2][i] = frame_map(seg, rec);
+			}
+			if (f[PROTO_V2][i] == NULL) {
+				/* else the message becomes the v2 frame right where it is, the reference goes with it */
+				frame_seal(msg[i], seq + i);
+				f[PROTO_V2][i] = msg[i];
+				msg[i] = NULL;
+			}
+			f[PROTO_V2][i] -> stamp = stamp[i];
+			f[PROTO_V2][i] -> lane = lane;
+
+			/* the last messages stay around for clients coming back */
+			if (room -> retain != NULL) {
+				struct frame **slot = &room -> retain[(seq + i) & room -> retain_mask];
+
+				if (*slot != NULL)
+					frame_put(*slot);
+				*slot = f[PROTO_V2][i];
+				atomic_fetch_add_explicit(&f[PROTO_V2][i] -> refcnt, 1, memory_order_relaxed);
+			}
+		}
+
+		/* a large room shares the writes with the fan-out pool */
+		if (chatserver.fanout.nworkers > 0 && room -> clientQ.count > FANOUT_SHARD_SIZE) {
+			fanout_broadcast(room, f, n, room -> sub_masks);
+		} else {
+			struct chat_client *p = room -> clientQ.head;
+			while (p != NULL){
+				client_deliver(p, f[p -> version], n, room -> sub_masks);
+				p = p -> next;
+			}
+		}
+		pthread_cleanup_pop(1);
+		if (nrelay > 0) {
+			fed_relay(relay, nrelay);
+			for (i = 0; i < nrelay; i++)
+				frame_put(relay[i]);
+		}
+		for (i = 0; i < n; i++) {
+			if (msg[i] != NULL)
+				frame_put(msg[i]);
+			for (v = PROTO_V1; v <= PROTO_V2; v++)
+				if (need[v])
+					frame_put(f[v][i]);
+		}
+    }
+}
+
+
+static void stop_room(struct chat_room *room, void *arg)
+{
+	pthread_cancel(room -> broadcast_thread);
+	chatmsg_wakeup(&room -> chatmsgQ);
+	pthread_join(room -> broadcast_thread, NULL);
+}
+
+static void wakeup_room(struct chat_room *room, void *arg)
+{
+	chatmsg_wakeup(&room -> chatmsgQ);
+}
+
+static void close_room(struct chat_room *room, void *arg)
+{
+	cq_lock(room);
+	struct chat_client *p = room -> clientQ.head;
+	while (p != NULL){
+		/* CMD_SERVER_CLOSE goes ahead of what is still queued, give slow clients a moment to take it all */
+		struct frame *f = frame_new(p -> version, CMD_SERVER_CLOSE, -1, NULL, 0);
+		client_enqueue_urgent(p, f);
+		frame_put(f);
+		pthread_mutex_lock(&p -> out_lock);
+		if (p -> out_head != NULL) {
+			struct timeval tv = {0, 100000};
+			fcntl(p -> socketfd, F_SETFL, fcntl(p -> socketfd, F_GETFL, 0) & ~O_NONBLOCK);
+			setsockopt(p -> socketfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+			client_write(p);
+		}
+		pthread_mutex_unlock(&p -> out_lock);
+		close(p -> socketfd);	//close all new_fd
+		if (p -> next != NULL){
+			p = p -> next;
+			client_put(p -> prev);
+		}
+		else{client_put(p); break;}
+	}
+	sem_post(&room -> clientQ.cq_lock);	//release lock
+
+	/* free msgQ */
+	struct frame *msg;
+	while ((msg = chatmsg_try_next(&room -> chatmsgQ, NULL)) != NULL)
+		frame_put(msg);
+	free(room -> chatmsgQ.slots);
+
+	if (room -> retain != NULL) {
+		size_t i;
+
+		for (i = 0; i <= room -> retain_mask; i++)
+			if (room -> retain[i] != NULL)
+				frame_put(room -> retain[i]);
+		free(room -> retain);
+	}
+	if (room -> has_history)
+		history_close(&room -> history);
+
+	/* destroy mutex, semaphore */
+	sem_destroy(&room -> clientQ.cq_lock);	//release semaphore resources
+}
+
+/*
+ * Signal handler (when "Ctrl + C" is pressed)
+ */
+void shutdown_handler(int signum)
+{
+    // Implement server shutdown here
+    // 1. send CMD_SERVER_CLOSE message to all clients
+    // 2. terminates all threads: broadcast_thread, event loops
+    // 3. free/destroy all dynamically allocated resources: memory, mutex, semaphore, whatever.
+	
+	
+	printf("Kill by SIGKILL (kill -2)\n");
+	printf("Shutdown server .....\n");
+	/* terminate the broadcast threads and the event loops */
+	int i;
+	room_foreach(stop_room, NULL);
+	fanout_stop();
+	for (i = 0; i < chatserver.nloops; i++)
+		pthread_cancel(chatserver.loops[i].loop_thread);
+	room_foreach(wakeup_room, NULL);
+	for (i = 0; i < chatserver.nloops; i++) {
+		pthread_join(chatserver.loops[i].loop_thread, NULL);
+		close(chatserver.loops[i].epfd);
+	}
+	free(chatserver.loops);
+
+	/* send CMD_SERVER_CLOSE message to all clients & free all rooms */
+	room_foreach(close_room, NULL);
+	if (chatserver.admin_path != NULL)
+		unlink(chatserver.admin_path);
+	if (chatserver.local_path != NULL)
+		unlink(chatserver.local_path);
+	
 	printf("Done\n");
     exit(0);
 }
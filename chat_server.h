@@ -2,60 +2,543 @@
 #define _CHSERVER_H_
 
 #include <semaphore.h>
+#include <stdatomic.h>
+#include "chat_proto.h"
+#include "chat_hist.h"
+#include "chat_history.h"
+#include "chat_ring.h"
+#include "chat_timer.h"
+#include "chat_match.h"
+#include "chat_spool.h"
 
 /*
  * Chat server variables
  */
 #define DEFAULT_LISTEN_PORT 3500    // the default port number of server/client communication
-#define BACKLOG 10                  // the queue length of waiting connections
+#define BACKLOG 1024                // the queue length of waiting connections (capped by net.core.somaxconn)
+#define DEFAULT_HANDSHAKE_MS 5000   // a new connection must complete its JOIN within this time
+#define DEFAULT_HEARTBEAT_MS 30000  // a client silent this long is pinged, and dropped if still silent as long again
+
+#define LOOP_READ_BUDGET 16       // max. # of reads from one client before serving the next ready one
+#define CACHE_LINE 64             // data written by different threads is kept this far apart
+
+/*
+ * Data structure to store an event loop
+ * Each loop thread owns a share of the clients and waits for their messages with epoll
+ */
+struct event_loop {
+    int epfd;                   // the epoll instance watching the sockets of this loop's clients
+    pthread_t loop_thread;      // the thread running event_loop_fn
+
+    /* the deadlines of the loop's clients: handshake, heartbeat, idle - the acceptors arm those of new connections */
+    pthread_mutex_t timer_lock;
+    struct timer_wheel timers;
+    long long sleep_until;              // when the loop wakes up at the latest (ms, monotonic clock) - protected by timer_lock
+    long long now;                      // when epoll_wait() returned last
+
+    int wakefd;                         // eventfd in the epoll set (data.ptr NULL): a claim of a name is decided, or an earlier deadline
+    struct name_claim *claims_done;     // the decided claims of this loop's clients - protected by chatserver.fed.lock
+    struct zc_linger *lingering;        // sockets of departed clients waiting for zero-copy notifications - this loop only
+};
+
+/*
+ * The fan-out pool: worker threads sharing the writes of the broadcasts of large rooms
+ *
+ * The broadcast thread cuts the client list of its room into shards of FANOUT_SHARD_SIZE
+ * clients and deals them out to the workers' deques, shard i to worker i % nworkers, then
+ * helps out and waits until all shards are done. A worker runs the shards of its own deque
+ * first and steals from the others when it runs dry, so the shards of slow sockets do not
+ * hold up the batch. The next batch of the room only starts when the last one is out,
+ * which keeps the order of messages for every client.
+ */
+#define FANOUT_SHARD_SIZE 128       // # of clients of one shard
+#define FANOUT_QUEUE_SIZE 1024      // # of shards a deque holds
+
+struct fanout_job {
+    struct frame **frames[PROTO_V2 + 1];    // the batch, in every protocol version a client of the room speaks
+    int n;                                  // # of messages of the batch
+    const uint64_t *masks;                  // the messages each subscriber of the room gets, by sub_slot
+    atomic_int pending;                     // # of shards not done yet
+    atomic_int done;                        // futex word, 1 when the last shard is done
+};
+
+struct fanout_task {
+    struct chat_client *first;              // the shard: count clients from first on in the clientQ
+    int count;
+    struct fanout_job *job;
+};
+
+struct fanout_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;                   // protects the deque, the owner takes from the head, thieves from the tail
+    struct fanout_task tasks[FANOUT_QUEUE_SIZE];
+    int head, count;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct fanout_pool {
+    struct fanout_worker *workers;
+    int nworkers;
+    atomic_int work;                        // futex word, bumped when shards are dealt out
+    atomic_int stopping;
+};
+
+/*
+ * Data structure to store an acceptor
+ * With several acceptors, each has its own listening socket bound with SO_REUSEPORT,
+ * and the kernel spreads the new connections over them.
+ */
+struct acceptor {
+    int listenfd;
+    int local;                  // the Unix socket, for clients on the same host
+    pthread_t thread;           // the thread running acceptor_fn (the main thread runs the first acceptor)
+};
+
+/*
+ * One encoded message, ready for the wire
+ * A broadcast is encoded once and shared by the outbound queues of all recipients,
+ * it is freed when the last of them has written it.
+ * The bytes follow the frame, or they are a record of the room history which stays mapped
+ * as long as the frame holds a reference to its segment.
+ */
+struct frame {
+    atomic_int refcnt;          // # of outbound queues (and other owners) referencing the frame
+    int len;                    // # of bytes of the encoded message
+    long long stamp;            // broadcasts: when the message entered the room's buffer (ns, monotonic clock), else 0
+    int relayed;                // a chat message of frame_message() which came from a peer server, not to be relayed again
+    struct chat_client *sender; // a chat message in the buffer of a room: the local client which sent it, else NULL
+    int lane;                   // the lane of the room's buffer the message went by, a slow client loses chat only, see LANE_CHAT
+    struct frame *lane_next;    // waiting in a priority lane
+    uint64_t seq;               // broadcasts: the sequence number in the room, else 0
+    const char *buf;            // the encoded message: data, or a history record
+    struct history_segment *seg;    // the history segment buf points into, NULL if buf == data
+    char data[];
+};
+
+/*
+ * One message waiting in the outbound queue of a client
+ */
+struct out_msg {
+    struct out_msg *next;
+    struct frame *frame;        // the encoded message, shared with the other recipients
+    int off;                    // # of bytes already written to the socket
+    int skipped;                // SLOW_COALESCE notice only: # of messages it stands for
+    long long stamp;            // when the message was queued (ms, monotonic clock)
+    int replayed;               // sent again (history, resume), not counted in the fan-out latency
+    int urgent;                 // queued ahead of the others, never dropped by the slow consumer policy
+    int zc;                     // (part of it) went out with MSG_ZEROCOPY, in the send numbered zc_tag
+    uint32_t zc_tag;
+};
+
+/*
+ * Zero-copy sends: with -Z, a write of at least zc_threshold bytes uses MSG_ZEROCOPY, the
+ * kernel sends right from the frames instead of copying them. Each such send is numbered
+ * by the kernel, per socket from 0; when it is done with the pages of sends lo..hi, it queues
+ * a notification on the error queue of the socket (EPOLLERR). Until then the messages stay
+ * on the zc list of the client, and their frames stay allocated (and mapped).
+ * The kernel copies after all if the route does not allow zero-copy (loopback, for one);
+ * the client then goes back to ordinary sends for good.
+ * A client departing before all notifications are in leaves its socket and zc list to its
+ * event loop, which waits for the rest; after ZC_LINGER_MS it resets the connection, so the
+ * kernel drops what it still has to send, and waits for the notifications of that.
+ */
+#define ZEROCOPY_SUGGESTED  (10 * 1024)     // below this, pinning pages costs more than copying
+#define ZC_LINGER_MS        10000           // a departed client's socket waits this long before it is reset
+#define ZC_LINGER_POLL_MS   100             // how often the event loop looks at the error queues of those sockets
+
+struct zc_linger {
+    struct zc_linger *next;
+    int fd;                                 // write side shut down, the error queue still read
+    struct out_msg *zc_head, *zc_tail;      // the zc list of the departed client
+    long long deadline;                     // when the connection is reset (ms, monotonic clock)
+    int reset;
+};
+
+/*
+ * What to do with a client whose outbound queue lags behind by more than max_lag_bytes or max_lag_ms
+ */
+#define SLOW_DROP_OLDEST    0   // discard the oldest queued messages
+#define SLOW_COALESCE       1   // replace all queued messages by one "N messages skipped" notice
+#define SLOW_DISCONNECT     2   // disconnect the client
+#define DEFAULT_MAX_LAG_BYTES   (64 * 1024)
+#define DEFAULT_MAX_LAG_MS      5000
+
+/*
+ * Flood control of the chat messages a client sends: two token buckets, one for messages (-L)
+ * and one for bytes (-Y), each filling up at its rate up to its burst. A message needs a token of
+ * the one and its length of the other. Whatever the rates, a client also never has more messages
+ * in the buffer of its room than the buffer has free slots: with n clients sending as fast as they
+ * can, each keeps about 1/(n+1) of the buffer, and the others always find room.
+ * A message over the limits is held, and the client is not read until it may go - its socket
+ * fills up and slows the sender down. With FLOOD_REJECT, a message over the rates is thrown away
+ * and answered with ERR_RATE_LIMITED instead; the share of the buffer always holds.
+ */
+#define FLOOD_THROTTLE      0
+#define FLOOD_REJECT        1
+#define FLOOD_RETRY_MS      1   // a client over its share of the buffer tries again this soon
+
+struct rate_limit {
+    long rate;                  // per second, 0: no limit
+    long burst;                 // the size of the bucket
+};
+
+struct token_bucket {
+    long long tokens;           // in 1/1000
+    long long stamp;            // when it was filled up last (ms, monotonic clock)
+};
+
+/*
+ * The broadcast thread sends what piled up in the message buffer as one batch: every client
+ * gets all messages of a batch with one writev(). A batch waits at most batch_us for more
+ * messages after its first one, and ends at BATCH_MAX messages or batch_bytes.
+ */
+#define BATCH_MAX               64
+#define DEFAULT_BATCH_BYTES     (32 * 1024)
+#define DEFAULT_BATCH_US        0       // take what is there, never wait
+
+/*
+ * Keyword subscriptions: a client which subscribes to keywords gets only the broadcasts of its
+ * room with one of them in it, see chat_match.h; a keyword ending in '*' is a prefix. The
+ * broadcast thread compiles the keywords of all subscribers of the room into one matcher, again
+ * before the next batch whenever a subscriber comes, goes or changes its keywords, and scans
+ * every message of a batch once: subscriber i gets message j if bit j of masks[i] is set.
+ */
+#define MAX_SUBSCRIPTIONS       16      // # of keywords of one client
+#define SUB_KEYWORD_MAX         64      // the longest keyword
+
+struct subscription {
+    struct subscription *next;
+    int flags;                  // MATCH_PREFIX
+    size_t len;
+    char text[];
+};
+
+/*
+ * Roster: a v2 client entering a room gets its members with CMD_SERVER_ROSTER, and from then on
+ * CMD_SERVER_PRESENCE with the names which joined and left. The changes are gathered for
+ * presence_ms after the first one and go out together, in as few frames as they fit into: a storm
+ * of N joins costs every member a few frames, not N. A name which leaves and comes back within
+ * the window, or comes and leaves, is not reported at all. The v1 clients and the peer servers
+ * get a line of text for the joins and one for the leaves instead.
+ */
+#define DEFAULT_PRESENCE_MS     50
+#define PRESENCE_HASH_SIZE      256
+#define PRESENCE_TEXT_NAMES     (CONTENT_LENGTH / 2)    // the names a line of text lists, the others are counted
+
+struct presence_change {
+    struct presence_change *hnext;  // the same bucket of pending
+    int left;                       // 0: joined
+    int cancelled;                  // undone within the window
+    char name[CLIENTNAME_LENGTH];
+};
 
 /*
  * Data structure to store client information
  */
+#define CLIENT_HANDSHAKE    0   // connected, waiting for its CMD_CLIENT_JOIN
+#define CLIENT_JOINED       1   // in a room
+#define CLIENT_CLAIMING     2   // joining, the peer servers are asked for the name
+#define CLIENT_PEER         3   // not a client: the link to a peer server
+#define CLIENT_DATA         4   // not in a room: the data stream of a client, see chat_spool.h
+
 struct chat_client {
-    struct chat_client *next, *prev;
-    int socketfd;                           // the socket to communicate with client
+    struct chat_client *next, *prev;        // the clientQ of its room
+    struct chat_client *name_next;          // next client in the same bucket of the name index
+    int socketfd;                           // the socket to communicate with client (non-blocking)
     struct sockaddr_in address;	            // remote client address
     char client_name[CLIENTNAME_LENGTH];    // remote client username
-    pthread_t client_thread;                // the client thread to receive messages, and then put them in the bounded buffer
+    struct event_loop *loop;                // the event loop which receives messages from this client
+    struct chat_room *room;                 // the room the client is in - changed by its event loop only
+    int version;                            // the protocol version the client speaks, PROTO_V1 or PROTO_V2
+    struct frame_decoder decoder;           // reassembles the incoming messages
+    int state;                              // CLIENT_HANDSHAKE or CLIENT_JOINED
+    uint64_t token;                         // v2: the secret which lets the client resume this session
+    int quiet;                              // entering/leaving is not announced: the session is resumed by a new connection
+    int lobby_slot;                         // joining: holds a place in the lobby, see lobby_reserve() - its loop only
+    struct timer timer;                     // the handshake deadline, then the next heartbeat - on the wheel of its loop
+    long long last_rx;                      // when anything was received last (ms, monotonic clock)
+    long long last_active;                  // when the client sent anything besides CMD_CLIENT_PONG last, or a transfer moved on
+    long long ping_at;                      // when CMD_SERVER_PING was sent last, 0: never
+    struct name_claim *claim;               // CLIENT_CLAIMING only: the question to the peer servers
+    atomic_int whispers;                    // # of its whispers the peer servers have not answered yet
+    atomic_int refcnt;                      // its event loop, each of its messages in the buffer of a room and each of its data streams
+    atomic_int inflight;                    // # of its chat messages in the buffer of a room
+    struct frame *held;                     // a chat message over the flood limits, the client is not read until it goes
+    long long held_until;                   // when it is tried again (ms, monotonic clock)
+    struct chat_room *held_room;            // a peer link: the room of the held relay, its buffer was full
+    struct token_bucket msg_bucket, byte_bucket;
+    struct subscription *subs;              // its keywords, NULL: it gets every broadcast - protected by the cq_lock of its room
+    int nsubs;
+    int sub_slot;                           // its index into the masks of the room's matcher
+
+    pthread_mutex_t out_lock;               // mutex lock for accessing the outbound queue
+    struct out_msg *out_head, *out_tail;    // outbound queue, drained by the event loop whenever the socket is writable
+    size_t out_bytes;                       // # of bytes waiting in the outbound queue
+    int out_armed;                          // whether the event loop waits for EPOLLOUT on this client
+    int dead;                               // disconnected as a slow consumer, waiting for its event loop to remove it
+    int kicked;                             // disconnected by the admin, its room is told when it is removed
+    int zerocopy;                           // large writes use MSG_ZEROCOPY
+    int local;                              // connected through the Unix socket, may attach a ring
+    struct ring *ring;                      // attached: the outbound queue is written into the ring, not the socket
+    struct ring *ring_next;                 // attaching: the ring, until CMD_SERVER_RING_OK is all on the socket
+    struct frame *ring_ok;                  // attaching: CMD_SERVER_RING_OK, the descriptors of ring_next ride on its first byte
+    int ring_ok_off;                        // # of bytes of ring_ok written
+    uint32_t zc_next;                       // the kernel's number of the next zero-copy send
+
+    /* CLIENT_PEER, or a link opened by us (-F) before the answer to its CMD_PEER_HELLO */
+    uint64_t node;                          // the node id of the server at the other end
+    uint64_t initiator;                     // the node id of the server which opened the link
+    int peer_slot;                          // the index in chatserver.fed.peers, -1 if not linked
+    int peer_addr;                          // opened by us: the index in chatserver.fed.addrs, else -1
+    struct out_msg *zc_head, *zc_tail;      // written, but the kernel may still read their frames
+
+    atomic_int nstreams;                    // # of data streams of the session open
+    /* CLIENT_DATA: the bytes of files bypass the decoder and the outbound queue */
+    struct chat_client *session;            // the client it is a stream of, with a reference counting it in nstreams
+    struct frame *notice;                   // the chat message of an upload, waiting for the share of the session ...
+    struct chat_room *notice_room;          // ... in the buffer of the room the file was offered in
+    struct spool_file *upload;              // the file being received, the socket is spliced into it
+    int pipefd[2];                          // the pipe it goes through
+    char dl_head[PROTO_V2_HEADER_MAX + 2 * VARINT_MAX];     // the frame being sent, the header and the payload ...
+    int dl_head_len, dl_head_off;           // ... 0 if none: the next request is read once it is out
+    struct spool_file *download;            // ... and the bytes of the file which follow, NULL if none
+    off_t dl_off;
+    size_t dl_left;
+
+    /* slow consumer statistics - protected by out_lock */
+    unsigned long sent_msgs;                // # of messages completely written to the socket
+    unsigned long dropped_msgs;             // # of messages discarded because the client lagged behind
+    unsigned long lag_events;               // # of times the lag limit was exceeded
+    size_t out_peak;                        // the largest out_bytes ever seen
 };
 
 /*
  * Use double-linked list to store all clients
  */
 struct client_queue {
-#define MAX_ROOM_CLIENT	20      // max. # of clients allowed
+#define DEFAULT_ROOM_CLIENT	65536   // default max. # of clients allowed in a room
     volatile int count;
+    int count_v1;       // # of the clients speaking protocol v1
+    int reserved;       // # of places held for joins not in the list yet, see lobby_reserve()
     struct chat_client *head, *tail;
     sem_t cq_lock; // mutex lock for accessing the link list (you can use pthread_mutex if you like)
 };
 
 
 /*
- * Use bounded buffer to store chat messages, implemented as a circular array and manipulate in FIFO fashion
- * Multiple producers: all client_threads put messages to this buffer
+ * Use bounded buffer to store chat messages, implemented as a lock-free ring and manipulate in FIFO fashion
+ * Multiple producers: the event loops put messages to this buffer
  * Single consumer: the broadcast_thread fetches each message and then sends it to all clients
+ *
+ * Each slot carries a sequence number telling whose turn it is (Vyukov's bounded queue): a producer
+ * claims a slot by advancing tail with compare-and-swap, the consumer owns head alone. Nobody takes a
+ * lock; a futex is only used when the consumer finds the ring empty or a producer finds it full.
+ */
+#define DEFAULT_QUEUE_MSG 1024              // default size of the bounded buffer of the chat room
+
+/*
+ * Priority lanes: besides the chat messages in the ring, the buffer has two lanes of its own -
+ * control (kicks) and presence (the join and leave notices of the peer servers). They are lists
+ * under a lock, not bounded: a notice never waits for room behind a chat backlog. The consumer takes what is in the
+ * control lane first; presence and chat take turns by their weights, LANE_PRESENCE_WEIGHT
+ * presence notices to LANE_CHAT_WEIGHT chat messages, so a notice waits for at most
+ * LANE_CHAT_WEIGHT chat messages per notice ahead of it - never for the whole chat backlog.
  */
+#define LANE_CONTROL            0
+#define LANE_PRESENCE           1
+#define LANE_CHAT               2   // the ring
+#define LANE_PRESENCE_WEIGHT    1
+#define LANE_CHAT_WEIGHT        3
+
+struct msg_lane {
+    pthread_mutex_t lock;
+    struct frame *head, *tail;      // linked through lane_next
+    atomic_int count;               // # of messages in the lane, the consumer peeks without the lock
+};
+
+struct chatmsg_slot {
+    atomic_size_t seq;  // == position: free for the producer at this position, == position + 1: holds a message
+    struct frame *msg;  // a chat message of frame_message(), not sealed yet
+    long long stamp;    // when the message was put (ns, monotonic clock)
+};
+
 struct chatmsg_queue {
-#define MAX_QUEUE_MSG	20              // size of the bounded buffer of the chat room
-    char *slots[MAX_QUEUE_MSG];
+    struct chatmsg_slot *slots;
+    size_t mask;        // # of slots - 1, the # of slots is a power of 2
 
-    volatile int head;  // pointer to the first message - update by the consumer (boradcast thread)
-    volatile int tail;  // pointer to the next available message slot - update by the producers (client threads)
+    atomic_size_t head __attribute__((aligned(CACHE_LINE)));  // next message to take - update by the consumer (broadcast thread)
+    atomic_size_t tail __attribute__((aligned(CACHE_LINE)));  // next slot to fill - update by the producers (event loops)
     
-    sem_t buffer_empty; // indicate whether the buffer is empty: no message, consumer has to wait
-    sem_t buffer_full;  // indicate whether the buffer is full: no available slot, producers have to wait
-    sem_t mq_lock;      // mutex lock for accessing the bounded buffer (you can use pthread_mutex if you like)
+    atomic_int not_empty __attribute__((aligned(CACHE_LINE)));   // futex word, bumped to wake up the consumer
+    atomic_int consumer_waiting;                                // the consumer sleeps on not_empty
+    atomic_int not_full __attribute__((aligned(CACHE_LINE)));    // futex word, bumped to wake up waiting producers
+    atomic_int producers_waiting;                               // # of producers sleeping on not_full
+
+    struct msg_lane lanes[LANE_CHAT];   // control and presence
+    int turn;                           // where the consumer is in the round of presence and chat
+    atomic_llong wake_at;               // chatmsg_get() returns NULL by then (ns, monotonic clock), 0: never
 };
+/*
+ * Counters of one thread - only the thread itself writes them, the admin interface reads them at any time
+ * Every thread registers its block on first use, blocks are never freed.
+ */
+struct thread_stats {
+    struct thread_stats *next;
+    char name[ROOMNAME_LENGTH + 8];
+    atomic_ulong msgs_in, bytes_in;     // chat messages received from clients, and all bytes received
+    atomic_ulong msgs_out, bytes_out;   // messages completely written to clients, and the bytes written
+    atomic_ulong broadcasts;            // messages taken out of a room's buffer
+    atomic_ulong drops;                 // messages discarded by the slow consumer policy
+    atomic_ulong disconnects;           // clients disconnected by the slow consumer policy
+    atomic_ulong timeouts;              // connections dropped by a deadline: handshake, heartbeat or idle
+    atomic_ulong limited;               // chat messages held or thrown away by flood control
+    atomic_ulong cq_waits;              // # of times cq_lock was taken by somebody else
+    atomic_ulong cq_wait_ns;            // the time spent waiting for cq_lock
+    atomic_ulong zc_sends;              // sends with MSG_ZEROCOPY
+    atomic_ulong zc_copied;             // notifications that the kernel copied anyway
+    struct histogram latency;           // us from entering the room's buffer to the completed send, per recipient
+} __attribute__((aligned(CACHE_LINE)));
 
+struct metrics {
+    pthread_mutex_t lock;               // protects the list, not the counters
+    struct thread_stats *threads;
+    long long start;                    // when the server started (ms, monotonic clock)
+};
 
 /*
  * Data structure to store room information
+ * Every room has its own buffer, client list and broadcast thread, rooms never share a lock.
  */
 struct chat_room {
+    struct chat_room *hnext;        // next room in the same bucket of the registry
+    char name[ROOMNAME_LENGTH];
     struct chatmsg_queue chatmsgQ;  // the message buffer to queue up chat message for broadcast
     struct client_queue clientQ;	// the corresponding slave thread for each client
     pthread_t broadcast_thread;     // the broadcast thread for sending out messages to all clients
+    struct history history;         // the messages broadcast so far - protected by clientQ.cq_lock
+    int has_history;
+
+    /* the last messages, for clients resuming after a disconnect - protected by clientQ.cq_lock */
+    uint64_t next_seq;              // the sequence number of the next broadcast, from 1
+    struct frame **retain;          // the v2 frame of message seq is at retain[seq & retain_mask]
+    size_t retain_mask;
+
+    /* the keyword subscriptions of the clients in the room - protected by clientQ.cq_lock */
+    int subs_changed;               // the matcher is out of date
+    struct matcher *matcher;        // owned by the broadcast thread, NULL: no keywords
+    uint64_t *sub_masks;            // one per subscriber
+    int nsubscribers;
+
+    /* the joins and leaves of the window, see DEFAULT_PRESENCE_MS - protected by clientQ.cq_lock */
+    struct presence_change **changes;   // in order, the cancelled ones too
+    int nchanges, changes_cap;
+    struct presence_change *pending[PRESENCE_HASH_SIZE];    // those not cancelled, by name
+};
+
+/*
+ * All rooms of the server, hashed by name
+ * A bucket is locked only to look up or add a room; the rooms stay until the server shuts down.
+ */
+#define ROOM_HASH_SIZE 256
+#define DEFAULT_RETAIN_MSGS 1024
+#define DEFAULT_MAX_ROOMS 1024
+#define BROADCAST_STACK_SIZE (256 * 1024)
+
+struct room_bucket {
+    pthread_mutex_t lock;
+    struct chat_room *head;
+};
+
+struct room_registry {
+    struct room_bucket buckets[ROOM_HASH_SIZE];
+    atomic_int count;               // # of rooms
+};
+
+
+/*
+ * Index of the names of all clients of the server, for O(1) admission and lookups by name
+ * Buckets share NAME_LOCK_STRIPES locks, so joins with different names hardly ever meet.
+ */
+#define NAME_HASH_SIZE 16384
+#define NAME_LOCK_STRIPES 256
+
+struct name_index {
+    struct chat_client *buckets[NAME_HASH_SIZE];
+    pthread_mutex_t locks[NAME_LOCK_STRIPES];
+};
+
+
+/*
+ * Federation: several server processes share their rooms over peer links
+ *
+ * A server links with the peers given with -F, each of them links with the others: the servers
+ * form a full mesh. A link is an ordinary connection to the client port, which starts with
+ * CMD_PEER_HELLO instead of a join; both ends send one, with their node id. Should two servers
+ * open a link to each other, the one opened by the server with the lower node id stays.
+ *
+ * The broadcast thread of a room relays every message which did not come from a peer as one
+ * CMD_PEER_RELAY per link - the peer server numbers it and fans it out to its own clients, but
+ * never relays it further. Joins, departures and the rooms created travel the same way.
+ *
+ * A name is unique across all servers: a client's name is reserved in the local name index,
+ * and then claimed from every linked peer. The peers answer from their own name index; a peer
+ * which grants a name holds a lease on it until the claim is decided (CMD_PEER_RELEASE), so it
+ * will not admit a client of its own with the name meanwhile. Two servers claiming the same name
+ * at the same time both see the other's reservation, the one with the lower node id wins.
+ * A link going down counts as a grant for the claims it did not answer.
+ *
+ * A whisper for a name which is not here goes to every peer the same way, and each of them tells
+ * whether the name is one of its clients (CMD_PEER_WHISPER_REPLY). The sender gets ERR_USER_NOT_FOUND
+ * once all have answered no; a link going down counts as a no.
+ */
+#define MAX_PEERS 64                // # of peer links, each claim keeps a bit per link
+#define PEER_RETRY_MS 1000          // how often the links given with -F which are down are tried again
+#define PEER_MAX_QUEUE (64 << 20)   // a peer lagging behind by more bytes is disconnected, and linked again
+
+struct peer_addr {
+    char *host;
+    char *port;
+    uint64_t node;                  // the node id learned from its CMD_PEER_HELLO, 0 until then
+    int busy;                       // a link opened to it exists, linked or not yet
+};
+
+struct name_claim {
+    struct name_claim *next;
+    struct chat_client *client;
+    uint64_t id;
+    uint64_t waiting;               // bit i: the link in slot i has not answered yet
+    int denied;
+    int command;                    // the join of the client, to be finished by client_admit()
+    char room[ROOMNAME_LENGTH];
+    uint64_t last_seq;
+};
+
+struct whisper_wait {
+    struct whisper_wait *next;
+    struct chat_client *sender;     // counted in its whispers, it waits for this before it is freed
+    uint64_t id;
+    uint64_t waiting;               // bit i: the link in slot i has not answered yet
+};
+
+struct name_lease {
+    struct name_lease *next;
+    char name[CLIENTNAME_LENGTH];
+    uint64_t node;                  // the peer server claiming the name ...
+    uint64_t claim;                 // ... with this claim id
+    long long expires;              // ms, monotonic clock
+};
+
+struct federation {
+    uint64_t node;                  // our node id, random
+    pthread_mutex_t lock;           // protects everything below, and the claims_done lists of the loops
+    struct chat_client *peers[MAX_PEERS];   // the links to peer servers, NULL: a free slot
+    atomic_int npeers;              // # of links, the broadcast threads relay only if there are any
+    struct peer_addr *addrs;        // the peers given with -F
+    int naddrs;
+    struct name_claim *claims;      // the claims of our clients, not decided yet
+    struct name_lease *leases;      // the names granted to peers, not decided yet
+    struct whisper_wait *whispers;  // the whispers relayed to the peers, not answered yet
+    uint64_t next_claim;
+    uint64_t next_whisper;
 };
 
 
@@ -64,7 +547,41 @@ struct chat_room {
  */
 struct chat_server {
     struct sockaddr_in address;     // the server's internet address 
-    struct chat_room room;
+    struct room_registry rooms;     // all chat rooms
+    struct chat_room *lobby;        // DEFAULT_ROOM, where every client enters
+    struct name_index names;        // all clients by name
+    struct event_loop *loops;       // the event loops sharing all client sessions, one per core by default
+    int nloops;
+    atomic_uint next_loop;          // the loop which gets the next new client (round robin)
+    struct acceptor *acceptors;     // the threads accepting new connections
+    int nacceptors;                 // # of acceptors of the port, the one of the Unix socket follows them
+    char *local_path;               // the Unix socket for clients on the same host, NULL: none
+    int handshake_ms;               // how long a new connection may take to join
+    int heartbeat_ms;               // how long a client may be silent before it is pinged, 0: never
+    int idle_ms;                    // how long a client may stay in a room without sending anything, 0: forever
+    struct metrics metrics;         // the counters of all threads
+    char *admin_path;               // the Unix socket answering "stats" and "clients" queries, NULL: none
+    char *history_dir;              // where the rooms keep their history, NULL: no history
+    int history_replay;             // # of messages of the history a client gets when entering a room
+    size_t retain_msgs;             // # of messages every room keeps in memory for resuming clients
+    struct fanout_pool fanout;      // the workers writing the broadcasts of large rooms, none by default
+    size_t zc_threshold;            // writes of at least this many bytes use MSG_ZEROCOPY, 0: never
+    struct federation fed;          // the peer servers sharing the rooms
+    struct spool spool;             // the files shared in the rooms
+
+    struct rate_limit msg_limit;    // the chat messages one client may send
+    struct rate_limit byte_limit;   // the bytes of chat messages one client may send
+    int flood_policy;               // FLOOD_THROTTLE or FLOOD_REJECT
+    int slow_policy;                // SLOW_DROP_OLDEST, SLOW_COALESCE or SLOW_DISCONNECT
+    size_t max_lag_bytes;           // the outbound queue of a client may hold at most this many bytes ...
+    int max_lag_ms;                 // ... and its oldest message may wait at most this long
+    size_t queue_msgs;              // # of slots of the bounded buffer of the chat room
+    size_t batch_bytes;             // the broadcast thread sends at most this many bytes as one batch ...
+    int batch_us;                   // ... and waits at most this long for a batch to fill
+    int presence_ms;                // the joins and leaves of this long go out as one roster update
+    size_t max_payload;             // the longest v2 payload accepted from a client
+    int max_rooms;                  // the largest # of rooms
+    int room_capacity;              // the largest # of clients in one room
 };
 
 #endif
@@ -0,0 +1,336 @@
+#define _GNU_SOURCE
+#include "chat_spool.h"
+#include "chat_timer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
+
+/* a file nobody can open by name, it is gone with the last descriptor */
+static int spool_fd(const char *dir)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	if ((fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) != -1)
+		return fd;
+	/* no O_TMPFILE there: a named file, unlinked right away */
+	snprintf(path, sizeof(path), "%s/chat-spool-XXXXXX", dir);
+	if ((fd = mkostemp(path, O_CLOEXEC)) != -1)
+		unlink(path);
+	return fd;
+}
+
+/* close the files nobody uses any more, away from the event loops */
+static void *spool_reaper_fn(void *arg)
+{
+	struct spool *s = arg;
+	struct spool_file *f;
+
+	pthread_mutex_lock(&s -> lock);
+	while (1) {
+		while (s -> dead == NULL)
+			pthread_cond_wait(&s -> reap, &s -> lock);
+		f = s -> dead;
+		s -> dead = f -> hnext;
+		pthread_mutex_unlock(&s -> lock);
+		close(f -> fd);
+		free(f);
+		pthread_mutex_lock(&s -> lock);
+	}
+	return NULL;
+}
+
+void spool_init(struct spool *s, const char *dir, size_t file_max, size_t max_bytes)
+{
+	pthread_t reaper;
+
+	pthread_mutex_init(&s -> lock, NULL);
+	pthread_cond_init(&s -> reap, NULL);
+	s -> dead = NULL;
+	memset(s -> buckets, 0, sizeof(s -> buckets));
+	s -> count = 0;
+	s -> bytes = 0;
+	s -> dir = dir;
+	s -> file_max = file_max;
+	s -> max_bytes = max_bytes;
+	pthread_create(&reaper, NULL, spool_reaper_fn, s);
+	pthread_detach(reaper);
+}
+
+/* take a file out of the registry, if it is still there - lock held */
+static int spool_unlink(struct spool *s, struct spool_file *f)
+{
+	struct spool_file **pp;
+
+	for (pp = &s -> buckets[f -> id % SPOOL_HASH_SIZE]; *pp != NULL; pp = &(*pp) -> hnext) {
+		if (*pp == f) {
+			*pp = f -> hnext;
+			s -> count--;
+			s -> bytes -= f -> size;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* the file to make room: an offer never uploaded, else the oldest complete file - lock held */
+static struct spool_file *spool_victim(struct spool *s, long long now)
+{
+	struct spool_file *f, *oldest = NULL;
+	int i, state;
+
+	for (i = 0; i < SPOOL_HASH_SIZE; i++) {
+		for (f = s -> buckets[i]; f != NULL; f = f -> hnext) {
+			state = atomic_load(&f -> state);
+			if (state == FILE_OFFERED && now - f -> stamp >= FILE_OFFER_MS)
+				return f;
+			if (state == FILE_COMPLETE && (oldest == NULL || f -> stamp < oldest -> stamp))
+				oldest = f;
+		}
+	}
+	return oldest;
+}
+
+static struct spool_file *spool_find(struct spool *s, uint64_t id)
+{
+	struct spool_file *f;
+
+	for (f = s -> buckets[id % SPOOL_HASH_SIZE]; f != NULL; f = f -> hnext)
+		if (f -> id == id)
+			return f;
+	return NULL;
+}
+
+/*
+ * Make room for a file of size bytes which the client owner offers in the room
+ * Return value: the file with a reference for the caller, NULL if it is too large, the spool
+ *               is full of files in use, or the spool directory fails
+ */
+struct spool_file *spool_create(struct spool *s, const char *name, size_t len, size_t size, const char *owner, const char *room)
+{
+	struct spool_file *f, *victim;
+	long long now = now_ms();
+
+	if (size == 0 || size > s -> file_max || size > s -> max_bytes)
+		return NULL;
+	if ((f = (struct spool_file *)calloc(1, sizeof(struct spool_file))) == NULL)
+		return NULL;
+	if ((f -> fd = spool_fd(s -> dir)) == -1) {
+		perror("spool file");
+		free(f);
+		return NULL;
+	}
+	len = strnlen(name, (len < FILE_NAME_MAX) ? len : FILE_NAME_MAX - 1);
+	memcpy(f -> name, name, len);
+	/* the name goes out to the room, no control characters in it */
+	while (len-- > 0)
+		if ((unsigned char)f -> name[len] < 0x20 || f -> name[len] == 0x7f)
+			f -> name[len] = '_';
+	strncpy(f -> owner, owner, CLIENTNAME_LENGTH - 1);
+	strncpy(f -> room, room, ROOMNAME_LENGTH - 1);
+	f -> spool = s;
+	f -> size = size;
+	f -> stamp = now;
+	atomic_init(&f -> state, FILE_OFFERED);
+	atomic_init(&f -> refcnt, 2);
+
+	pthread_mutex_lock(&s -> lock);
+	while (s -> count >= SPOOL_MAX_FILES || s -> bytes + size > s -> max_bytes) {
+		if ((victim = spool_victim(s, now)) == NULL) {
+			pthread_mutex_unlock(&s -> lock);
+			close(f -> fd);
+			free(f);
+			return NULL;
+		}
+		spool_unlink(s, victim);
+		if (atomic_fetch_sub_explicit(&victim -> refcnt, 1, memory_order_acq_rel) == 1) {
+			victim -> hnext = s -> dead;
+			s -> dead = victim;
+			pthread_cond_signal(&s -> reap);
+		}
+	}
+	do {
+		if (getrandom(&f -> id, sizeof(f -> id), 0) != sizeof(f -> id))
+			f -> id = ((uint64_t)now << 20) ^ (uintptr_t)f ^ s -> count;
+	} while (f -> id == 0 || spool_find(s, f -> id) != NULL);
+	f -> hnext = s -> buckets[f -> id % SPOOL_HASH_SIZE];
+	s -> buckets[f -> id % SPOOL_HASH_SIZE] = f;
+	s -> count++;
+	s -> bytes += size;
+	pthread_mutex_unlock(&s -> lock);
+	return f;
+}
+
+/*
+ * Look up a complete file to send from
+ * Return value: the file with a reference for the caller, NULL if there is none
+ */
+struct spool_file *spool_get(struct spool *s, uint64_t id)
+{
+	struct spool_file *f;
+
+	pthread_mutex_lock(&s -> lock);
+	if ((f = spool_find(s, id)) != NULL && atomic_load(&f -> state) == FILE_COMPLETE)
+		atomic_fetch_add(&f -> refcnt, 1);
+	else
+		f = NULL;
+	pthread_mutex_unlock(&s -> lock);
+	return f;
+}
+
+/*
+ * Start the upload of an offered file, by its owner - once only
+ * Return value: the file with a reference for the caller, NULL if there is none to upload
+ */
+struct spool_file *spool_begin(struct spool *s, uint64_t id, const char *owner)
+{
+	struct spool_file *f;
+
+	pthread_mutex_lock(&s -> lock);
+	if ((f = spool_find(s, id)) != NULL && atomic_load(&f -> state) == FILE_OFFERED && strcmp(f -> owner, owner) == 0) {
+		atomic_store(&f -> state, FILE_UPLOADING);
+		atomic_fetch_add(&f -> refcnt, 1);
+	} else {
+		f = NULL;
+	}
+	pthread_mutex_unlock(&s -> lock);
+	return f;
+}
+
+/*
+ * The upload is complete, the file may be fetched from now on
+ */
+void spool_finish(struct spool *s, struct spool_file *f)
+{
+	pthread_mutex_lock(&s -> lock);
+	atomic_store(&f -> state, FILE_COMPLETE);
+	pthread_mutex_unlock(&s -> lock);
+}
+
+/*
+ * Drop a file from the spool, an upload cut short: the data streams still sending from it keep it
+ */
+void spool_remove(struct spool *s, struct spool_file *f)
+{
+	int linked;
+
+	pthread_mutex_lock(&s -> lock);
+	linked = spool_unlink(s, f);
+	pthread_mutex_unlock(&s -> lock);
+	if (linked)
+		spool_put(f);
+}
+
+/*
+ * Drop a reference to a file, the last one hands it to the reaper, which frees its bytes on disk
+ */
+void spool_put(struct spool_file *f)
+{
+	struct spool *s = f -> spool;
+
+	if (atomic_fetch_sub_explicit(&f -> refcnt, 1, memory_order_acq_rel) == 1) {
+		pthread_mutex_lock(&s -> lock);
+		f -> hnext = s -> dead;
+		s -> dead = f;
+		pthread_cond_signal(&s -> reap);
+		pthread_mutex_unlock(&s -> lock);
+	}
+}
+
+/*
+ * Append bytes of the upload which were received into user space already - the few which came
+ * along with CMD_CLIENT_FILE_PUT
+ * Return value:  0 - success;
+ *               -1 - error, see errno;
+ */
+int spool_write(struct spool_file *f, const char *p, size_t n)
+{
+	ssize_t k;
+
+	while (n > 0) {
+		if ((k = pwrite(f -> fd, p, n, f -> received)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		f -> received += k;
+		p += k;
+		n -= k;
+	}
+	return 0;
+}
+
+/* throw away what is left in the pipe, the file cannot take it */
+static void pipe_drain(int pipefd[2], size_t n)
+{
+	char buf[4096];
+	ssize_t k;
+
+	while (n > 0) {
+		k = read(pipefd[0], buf, (n < sizeof(buf)) ? n : sizeof(buf));
+		if (k == -1 && errno == EINTR)
+			continue;
+		if (k <= 0)
+			break;
+		n -= k;
+	}
+}
+
+/*
+ * Move at most max bytes of the upload from the socket into the file, through the pipe
+ * The pipe is empty before and after, whatever happens.
+ * Return value: >0 - the # of bytes moved;
+ *                0 - the socket is closed;
+ *               -1 - error, see errno - EAGAIN: nothing to read now, EIO: the file fails;
+ */
+ssize_t spool_recv(struct spool_file *f, int sockfd, int pipefd[2], size_t max)
+{
+	size_t want = f -> size - f -> received;
+	off_t off = f -> received;
+	ssize_t n, k, done = 0;
+
+	if (want > max)
+		want = max;
+	while (want > 0) {
+		n = splice(sockfd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n == 0)
+			break;
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (done > 0) ? done : -1;
+		}
+		/* the pipe holds what came, all of it goes on into the file */
+		while (n > 0) {
+			k = splice(pipefd[0], NULL, f -> fd, &off, n, SPLICE_F_MOVE);
+			if (k == -1 && errno == EINTR)
+				continue;
+			if (k <= 0) {
+				/* the bytes taken from the socket are lost, the upload cannot go on */
+				pipe_drain(pipefd, n);
+				errno = EIO;
+				return -1;
+			}
+			f -> received += k;
+			done += k;
+			want -= k;
+			n -= k;
+		}
+	}
+	return done;
+}
+
+/*
+ * Send n bytes of a complete file from *off, as many as the socket takes - straight from the page cache
+ * Return value: the # of bytes sent, *off moves on; -1 - error, see errno
+ */
+ssize_t spool_send(struct spool_file *f, int sockfd, off_t *off, size_t n)
+{
+	return sendfile(sockfd, f -> fd, off, n);
+}
@@ -0,0 +1,83 @@
+#ifndef _CHAT_SPOOL_H_
+#define _CHAT_SPOOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "chat_proto.h"
+
+/*
+ * The spool of the files shared in the rooms - use by the server
+ *
+ * A client offers a file on its chat connection (CMD_CLIENT_FILE_OFFER) and gets an id for it.
+ * The bytes take another way: a data stream, a second connection whose first frame is
+ * CMD_CLIENT_DATA_OPEN with the name and session token of the chat connection. The uploader
+ * sends CMD_CLIENT_FILE_PUT and the raw file after it; once it is complete, the room the file
+ * was offered in is told, and anyone fetches it piece by piece with CMD_CLIENT_FILE_GET.
+ *
+ * Each file is spooled into an unlinked file of its own in the spool directory (-s). An upload is
+ * spliced from the socket through a pipe into it, a download is sent from it with sendfile(): the
+ * bytes never pass through a buffer of the server, and the broadcast threads never see them.
+ * A data stream moves at most FILE_SLICE bytes per round of its event loop, in either direction,
+ * so a large transfer takes turns with the chat clients of the loop, and no faster than the
+ * other end takes them. When the spool is full, the oldest complete files make room.
+ * The room is told of a file by a chat message of its uploader, under the flood limits of any other.
+ * A session has at most DATA_STREAMS_MAX data streams, each is dropped once idle for DATA_IDLE_MS.
+ * Freeing the pages of a large file takes a while, the spool's own thread closes the files dropped.
+ */
+#define FILE_SLICE              (64 * 1024)         // the bytes of a transfer per round of the event loop
+#define DEFAULT_FILE_MAX        (64 << 20)          // the largest file, -X
+#define DEFAULT_SPOOL_BYTES     (1024LL << 20)      // all files together
+#define SPOOL_MAX_FILES         1024
+#define SPOOL_HASH_SIZE         256
+#define FILE_OFFER_MS           60000               // an offer not uploaded this long makes room for new ones
+#define DATA_IDLE_MS            30000               // a data stream which moves nothing this long is dropped
+#define DATA_STREAMS_MAX        8                   // the data streams of one session open at once
+#define FILE_NOTICE_NAME        64                  // the part of a file name the room is told
+
+#define FILE_OFFERED    0   // waiting for its CMD_CLIENT_FILE_PUT
+#define FILE_UPLOADING  1
+#define FILE_COMPLETE   2   // may be fetched
+
+struct spool_file {
+    struct spool_file *hnext;           // next file in the same bucket, or on the list of files to close
+    struct spool *spool;
+    uint64_t id;                        // random, not to be guessed
+    int fd;                             // the spool file, unlinked
+    size_t size;
+    size_t received;                    // # of bytes uploaded - update by the data stream uploading it only
+    atomic_int state;                   // FILE_OFFERED, FILE_UPLOADING or FILE_COMPLETE
+    atomic_int refcnt;                  // the spool, and each data stream using it
+    long long stamp;                    // when it was offered (ms, monotonic clock)
+    char owner[CLIENTNAME_LENGTH];      // the client which may upload it
+    char room[ROOMNAME_LENGTH];         // the room it was offered in
+    char name[FILE_NAME_MAX];
+};
+
+struct spool {
+    pthread_mutex_t lock;
+    struct spool_file *buckets[SPOOL_HASH_SIZE];
+    int count;
+    size_t bytes;                       // the sizes of all files together
+    const char *dir;
+    size_t file_max;                    // the largest file accepted
+    size_t max_bytes;
+    struct spool_file *dead;            // no more references, to be closed by the reaper
+    pthread_cond_t reap;
+};
+
+void spool_init(struct spool *s, const char *dir, size_t file_max, size_t max_bytes);
+struct spool_file *spool_create(struct spool *s, const char *name, size_t len, size_t size, const char *owner, const char *room);
+struct spool_file *spool_get(struct spool *s, uint64_t id);
+struct spool_file *spool_begin(struct spool *s, uint64_t id, const char *owner);
+void spool_finish(struct spool *s, struct spool_file *f);
+void spool_remove(struct spool *s, struct spool_file *f);
+void spool_put(struct spool_file *f);
+
+int spool_write(struct spool_file *f, const char *p, size_t n);
+ssize_t spool_recv(struct spool_file *f, int sockfd, int pipefd[2], size_t max);
+ssize_t spool_send(struct spool_file *f, int sockfd, off_t *off, size_t n);
+
+#endif
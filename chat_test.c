@@ -0,0 +1,348 @@
+#include "chat.h"
+#include "chat_proto.h"
+#include "chat_match.h"
+#include "chat_timer.h"
+#include "chat_ring.h"
+#include "chat_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Unit checks of the building blocks of the server, run by "make check"
+ * Each failed check is printed; the exit status tells whether any failed.
+ */
+static int checks, failures;
+
+#define CHECK(cond) do { \
+	checks++; \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/*
+ * Matcher: words, prefixes, case, patterns inside each other
+ */
+static void check_match(void)
+{
+	static const struct match_pattern p[] = {
+		{ "deploy", 6, MATCH_PREFIX, 0 },
+		{ "log", 3, 0, 1 },
+		{ "login", 5, 0, 2 },
+		{ "he", 2, 0, 3 },
+		{ "she", 3, 0, 4 },
+		{ "hers", 4, MATCH_PREFIX, 5 },
+		{ "LOG", 3, 0, 6 },
+	};
+	static const struct {
+		const char *text;
+		uint64_t hits;              // bit i: owner i matches
+	} t[] = {
+		{ "", 0 },
+		{ "nothing to see", 0 },
+		{ "Deployment done", 1 << 0 },
+		{ "deploy", 1 << 0 },
+		{ "redeploy", 0 },
+		{ "log in", 1 << 1 | 1 << 6 },
+		{ "LOGIN!", 1 << 2 },
+		{ "blog", 0 },
+		{ "logs", 0 },
+		{ "she said", 1 << 4 },
+		{ "he/she", 1 << 3 | 1 << 4 },
+		{ "herself", 1 << 5 },
+		{ "hers", 1 << 5 },
+		{ "hersheys", 1 << 5 },
+		{ "log_in", 0 },
+		{ "she-he-hers", 1 << 3 | 1 << 4 | 1 << 5 },
+		{ "h\xc3\xa9he", 0 },
+	};
+	struct matcher *m = matcher_build(p, sizeof(p) / sizeof(p[0]));
+	uint64_t masks[7], hits;
+	size_t i;
+	int k;
+
+	CHECK(m != NULL);
+	if (m == NULL)
+		return;
+	for (i = 0; i < sizeof(t) / sizeof(t[0]); i++) {
+		memset(masks, 0, sizeof(masks));
+		matcher_scan(m, t[i].text, strlen(t[i].text), masks, 1);
+		for (hits = 0, k = 0; k < 7; k++)
+			hits |= (masks[k] & 1) << k;
+		if (hits != t[i].hits)
+			printf("match \"%s\": %llx, expected %llx\n", t[i].text, (unsigned long long)hits, (unsigned long long)t[i].hits);
+		CHECK(hits == t[i].hits);
+	}
+
+	/* one bit per message of a batch */
+	memset(masks, 0, sizeof(masks));
+	matcher_scan(m, "deploy it", 9, masks, 1 << 0);
+	matcher_scan(m, "the log", 7, masks, 1 << 1);
+	matcher_scan(m, "log the deploy", 14, masks, 1 << 2);
+	CHECK(masks[0] == (1 << 0 | 1 << 2));
+	CHECK(masks[1] == (1 << 1 | 1 << 2) && masks[6] == masks[1]);
+	CHECK(masks[2] == 0 && masks[3] == 0);
+	matcher_free(m);
+}
+
+/*
+ * Varints: round trips, truncated and oversized input
+ */
+static void check_varint(void)
+{
+	static const uint64_t v[] = { 0, 1, 0x7f, 0x80, 0x3fff, 0x4000, 0xffffffffULL, 1ULL << 63, UINT64_MAX };
+	char buf[VARINT_MAX + 2];
+	uint64_t x;
+	size_t i;
+	int n;
+
+	for (i = 0; i < sizeof(v) / sizeof(v[0]); i++) {
+		n = varint_put(buf, v[i]);
+		CHECK(n >= 1 && n <= VARINT_MAX);
+		x = ~v[i];
+		CHECK(varint_get(buf, n, &x) == n && x == v[i]);
+		/* cut short anywhere: more bytes are needed */
+		CHECK(varint_get(buf, n - 1, &x) == 0);
+	}
+	CHECK(varint_get(buf, 0, &x) == 0);
+	CHECK(varint_get("\x80\x80", 2, &x) == 0);
+
+	/* no varint is longer than VARINT_MAX bytes */
+	memset(buf, 0x80, sizeof(buf));
+	CHECK(varint_get(buf, VARINT_MAX, &x) == -1);
+	CHECK(varint_get(buf, sizeof(buf), &x) == -1);
+	CHECK(varint_get(buf, VARINT_MAX - 1, &x) == 0);
+}
+
+/* feed bytes to a decoder, as recv() would */
+static void feed(struct frame_decoder *d, const char *p, size_t len)
+{
+	size_t room;
+	char *space;
+
+	while (len > 0) {
+		space = decoder_space(d, &room);
+		if (room > len)
+			room = len;
+		memcpy(space, p, room);
+		decoder_commit(d, room);
+		p += room;
+		len -= room;
+	}
+}
+
+/*
+ * Decoder: frames arriving byte by byte, and malformed ones
+ */
+static void check_decoder(void)
+{
+	struct frame_decoder d;
+	struct chat_frame f;
+	char buf[64], payload[16];
+	size_t len, i;
+
+	/* byte by byte: nothing until the last one */
+	decoder_init(&d, 0, 16);
+	len = proto_encode(buf, PROTO_V2, CMD_CLIENT_SEND, -1, "hello", 5);
+	for (i = 0; i < len - 1; i++) {
+		feed(&d, buf + i, 1);
+		CHECK(decoder_next(&d, &f) == 0);
+	}
+	feed(&d, buf + i, 1);
+	CHECK(decoder_next(&d, &f) == 1);
+	CHECK(f.version == PROTO_V2 && f.command == CMD_CLIENT_SEND && f.len == 5 && memcmp(f.payload, "hello", 5) == 0);
+	CHECK(decoder_next(&d, &f) == 0);
+
+	/* two frames in one read, the error code and the sequence number come out of the payload */
+	len = proto_encode(buf, PROTO_V2, CMD_SERVER_FAIL, ERR_JOIN_DUP_NAME, NULL, 0);
+	len += proto_encode_broadcast(buf + len, PROTO_V2, 300, "hi", 2);
+	feed(&d, buf, len);
+	CHECK(decoder_next(&d, &f) == 1 && f.command == CMD_SERVER_FAIL && f.private_data == ERR_JOIN_DUP_NAME);
+	CHECK(decoder_next(&d, &f) == 1 && f.command == CMD_SERVER_BROADCAST && f.seq == 300 &&
+			f.len == 2 && memcmp(f.payload, "hi", 2) == 0);
+	CHECK(decoder_next(&d, &f) == 0);
+
+	/* the length is cut short: wait */
+	feed(&d, "\xc2\x66\x80", 3);
+	CHECK(decoder_next(&d, &f) == 0);
+	decoder_free(&d);
+
+	/* a payload longer than allowed */
+	decoder_init(&d, 0, 16);
+	memset(payload, 'x', sizeof(payload));
+	len = proto_encode(buf, PROTO_V2, CMD_CLIENT_SEND, -1, payload, 16);
+	feed(&d, buf, len);
+	CHECK(decoder_next(&d, &f) == 1 && f.len == 16);
+	buf[0] = PROTO_V2_MAGIC;
+	buf[1] = CMD_CLIENT_SEND;
+	len = 2 + varint_put(buf + 2, 17);
+	feed(&d, buf, len);
+	CHECK(decoder_next(&d, &f) == -1);
+	decoder_free(&d);
+
+	/* a length longer than any varint */
+	decoder_init(&d, 0, 16);
+	memset(buf, 0x80, sizeof(buf));
+	buf[0] = PROTO_V2_MAGIC;
+	buf[1] = CMD_CLIENT_SEND;
+	feed(&d, buf, 2 + VARINT_MAX + 1);
+	CHECK(decoder_next(&d, &f) == -1);
+	decoder_free(&d);
+
+	/* a v2 stream goes on with something else */
+	decoder_init(&d, 0, 16);
+	len = proto_encode(buf, PROTO_V2, CMD_CLIENT_SEND, -1, "a", 1);
+	buf[len] = 0;
+	feed(&d, buf, len + 1);
+	CHECK(decoder_next(&d, &f) == 1);
+	CHECK(decoder_next(&d, &f) == -1);
+	decoder_free(&d);
+
+	/* an error code which is no varint */
+	decoder_init(&d, 0, 16);
+	feed(&d, "\xc2\x6a\x01\x80", 4);
+	CHECK(decoder_next(&d, &f) == -1);
+	decoder_free(&d);
+
+	/* a v1 frame is taken whole */
+	decoder_init(&d, 0, 16);
+	len = proto_encode(buf, PROTO_V1, CMD_CLIENT_JOIN, -1, "bob", 3);
+	feed(&d, buf, len - 1);
+	CHECK(decoder_next(&d, &f) == 0);
+	feed(&d, buf + len - 1, 1);
+	CHECK(decoder_next(&d, &f) == 1 && f.version == PROTO_V1 && f.command == CMD_CLIENT_JOIN &&
+			f.len == 3 && memcmp(f.payload, "bob", 3) == 0);
+	decoder_free(&d);
+}
+
+/*
+ * Timer wheel: deadlines on every level fire on time, never early
+ */
+static void check_timer(void)
+{
+	struct timer_wheel w;
+	struct timer t[5], *fired;
+	long long now = 1000;
+	int i;
+
+	wheel_init(&w, now);
+	CHECK(wheel_timeout(&w, now) == -1);
+	for (i = 0; i < 5; i++)
+		t[i].pprev = NULL;
+	timer_add(&w, &t[0], now + 3 * TIMER_TICK_MS);
+	timer_add(&w, &t[1], now + 5 * TIMER_TICK_MS);
+	timer_add(&w, &t[2], now + 100 * TIMER_TICK_MS);
+	timer_add(&w, &t[3], now + 5000 * TIMER_TICK_MS);
+	timer_add(&w, &t[4], now + 300000 * TIMER_TICK_MS);
+	CHECK(w.count == 5);
+	CHECK(wheel_timeout(&w, now) >= 0 && wheel_timeout(&w, now) <= 3 * TIMER_TICK_MS);
+
+	fired = wheel_advance(&w, now + 2 * TIMER_TICK_MS);
+	CHECK(fired == NULL);
+	now += 4 * TIMER_TICK_MS;
+	fired = wheel_advance(&w, now);
+	CHECK(fired == &t[0] && fired -> next == NULL);
+
+	/* advance a tick at a time up to each deadline: it fires right then */
+	for (i = 1; i < 4; i++) {
+		while ((fired = wheel_advance(&w, now += TIMER_TICK_MS)) == NULL)
+			;
+		CHECK(fired == &t[i] && fired -> next == NULL && now == t[i].expires);
+	}
+	timer_del(&w, &t[4]);
+	CHECK(w.count == 0 && t[4].pprev == NULL);
+	CHECK(wheel_timeout(&w, now) == -1);
+	CHECK(wheel_advance(&w, now + 400000 * TIMER_TICK_MS) == NULL);
+}
+
+/*
+ * Ring: what goes in comes out in one piece, across the end of the ring too
+ */
+static void check_ring(void)
+{
+	struct ring p, c;
+	struct iovec iov[2];
+	const char *q;
+	char *buf;
+	size_t n, size;
+
+	if (ring_create(&p, 0) == -1) {
+		perror("ring_create");
+		CHECK(0);
+		return;
+	}
+	CHECK(p.size == RING_MIN_SIZE);
+	CHECK(ring_map(&c, dup(p.memfd), dup(p.efd)) == 0);
+	size = c.size;
+	buf = (char *)malloc(size);
+	for (n = 0; n < size; n++)
+		buf[n] = n * 7;
+
+	CHECK(ring_peek(&c, &q) == 0);
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 100;
+	iov[1].iov_base = buf + 100;
+	iov[1].iov_len = size - 150;
+	CHECK(ring_writev(&p, iov, 2) == size - 50);
+	CHECK(ring_peek(&c, &q) == size - 50 && memcmp(q, buf, size - 50) == 0);
+	CHECK(ring_consume(&c, size - 50) == 0);
+
+	/* 100 bytes from 50 before the end: the second mapping shows them in a row */
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 100;
+	CHECK(ring_writev(&p, iov, 1) == 100);
+	CHECK(ring_peek(&c, &q) == 100 && memcmp(q, buf, 100) == 0);
+	CHECK(ring_consume(&c, 100) == 0);
+
+	/* full: the producer waits, the consumer is told to say when it has made room */
+	iov[0].iov_len = size;
+	CHECK(ring_writev(&p, iov, 1) == size);
+	CHECK(ring_writev(&p, iov, 1) == 0);
+	CHECK(ring_peek(&c, &q) == size && memcmp(q, buf, size) == 0);
+	CHECK(ring_consume(&c, 10) == 1);
+	CHECK(ring_writev(&p, iov, 1) == 10);
+
+	free(buf);
+	ring_close(&c);
+	ring_close(&p);
+}
+
+/*
+ * Pool: blocks of every class and beyond, zeroed when asked for
+ */
+static void check_pool(void)
+{
+	char *b[16];
+	size_t size;
+	int i;
+
+	for (i = 0, size = 1; i < 16; i++, size *= 2) {
+		b[i] = (char *)pool_alloc(size);
+		CHECK(b[i] != NULL);
+		memset(b[i], 0xa5, size);
+	}
+	for (i = 0; i < 16; i++)
+		pool_free(b[i]);
+	for (i = 0, size = 1; i < 16; i++, size *= 2) {
+		b[i] = (char *)pool_calloc(size);
+		CHECK(b[i] != NULL && b[i][0] == 0 && b[i][size - 1] == 0);
+	}
+	for (i = 0; i < 16; i++)
+		pool_free(b[i]);
+}
+
+int main(void)
+{
+	check_match();
+	check_varint();
+	check_decoder();
+	check_timer();
+	check_ring();
+	check_pool();
+
+	printf("%d checks, %d failed\n", checks, failures);
+	return failures != 0;
+}
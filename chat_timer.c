@@ -0,0 +1,148 @@
+#include "chat_timer.h"
+#include <string.h>
+#include <limits.h>
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_RANGE (1ULL << (TIMER_BITS * TIMER_LEVELS))
+
+/* the tick a deadline falls due on, rounded up: never early */
+static inline unsigned long long to_tick(long long ms)
+{
+	return (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+void wheel_init(struct timer_wheel *w, long long now)
+{
+	memset(w, 0, sizeof(struct timer_wheel));
+	w -> tick = now / TIMER_TICK_MS;
+}
+
+/* put a timer into the slot its deadline falls in, seen from the current tick */
+static void wheel_insert(struct timer_wheel *w, struct timer *t)
+{
+	unsigned long long expires = to_tick(t -> expires), delta;
+	struct timer **slot;
+	int level;
+
+	if (expires < w -> tick)
+		expires = w -> tick;	// overdue, the current tick runs it
+	delta = expires - w -> tick;
+	for (level = 0; level < TIMER_LEVELS - 1 && delta >= 1ULL << (TIMER_BITS * (level + 1)); level++)
+		;
+	if (delta >= TIMER_RANGE)
+		expires = w -> tick + TIMER_RANGE - 1;
+	slot = &w -> slots[level][(expires >> (TIMER_BITS * level)) & TIMER_MASK];
+
+	t -> next = *slot;
+	if (*slot != NULL)
+		(*slot) -> pprev = &t -> next;
+	*slot = t;
+	t -> pprev = slot;
+}
+
+static void wheel_unlink(struct timer *t)
+{
+	*t -> pprev = t -> next;
+	if (t -> next != NULL)
+		t -> next -> pprev = t -> pprev;
+	t -> pprev = NULL;
+}
+
+/*
+ * Arm a timer to fire at expires (ms), or move it there if it is armed already
+ */
+void timer_add(struct timer_wheel *w, struct timer *t, long long expires)
+{
+	if (t -> pprev != NULL)
+		wheel_unlink(t);
+	else
+		w -> count++;
+	t -> expires = expires;
+	wheel_insert(w, t);
+}
+
+/*
+ * Disarm a timer, nothing happens if it is not armed
+ */
+void timer_del(struct timer_wheel *w, struct timer *t)
+{
+	if (t -> pprev == NULL)
+		return;
+	wheel_unlink(t);
+	w -> count--;
+}
+
+/* empty a slot of an upper wheel into the lower ones, return the index of the slot */
+static int cascade(struct timer_wheel *w, int level)
+{
+	int idx = (w -> tick >> (TIMER_BITS * level)) & TIMER_MASK;
+	struct timer *t, *next;
+
+	t = w -> slots[level][idx];
+	w -> slots[level][idx] = NULL;
+	for (; t != NULL; t = next) {
+		next = t -> next;
+		wheel_insert(w, t);
+	}
+	return idx;
+}
+
+/*
+ * Run the clock up to now (ms)
+ * Return value: the timers which fell due, linked through next and no longer armed; the caller
+ *               may arm each of them again once it took the next one
+ */
+struct timer *wheel_advance(struct timer_wheel *w, long long now)
+{
+	unsigned long long target = now / TIMER_TICK_MS;
+	struct timer *expired = NULL, *t;
+	int idx, level;
+
+	/* nothing to run, the clock jumps */
+	if (w -> count == 0) {
+		if (w -> tick <= target)
+			w -> tick = target + 1;
+		return NULL;
+	}
+
+	for (; w -> tick <= target; w -> tick++) {
+		idx = w -> tick & TIMER_MASK;
+		/* the first wheel starts a turn: bring down the next slot of the one above, and so on up */
+		for (level = 1; idx == 0 && level < TIMER_LEVELS; level++)
+			idx = cascade(w, level);
+
+		idx = w -> tick & TIMER_MASK;
+		while ((t = w -> slots[0][idx]) != NULL) {
+			wheel_unlink(t);
+			/* one which waited at the end of the top wheel may need another round */
+			if (to_tick(t -> expires) > w -> tick) {
+				wheel_insert(w, t);
+				continue;
+			}
+			w -> count--;
+			t -> next = expired;
+			expired = t;
+		}
+	}
+	return expired;
+}
+
+/*
+ * How long the owner may sleep before it has to call wheel_advance() again
+ * Return value: ms, -1 if no timer is armed
+ */
+int wheel_timeout(struct timer_wheel *w, long long now)
+{
+	unsigned long long tick;
+	long long ms;
+
+	if (w -> count == 0)
+		return -1;
+	/* the next timer of the first wheel, or the start of its next turn when the wheel above comes down */
+	for (tick = w -> tick; (tick & TIMER_MASK) != 0 && w -> slots[0][tick & TIMER_MASK] == NULL; tick++)
+		;
+	ms = (long long)tick * TIMER_TICK_MS - now;
+	if (ms < 0)
+		return 0;
+	return (ms > INT_MAX) ? INT_MAX : (int)ms;
+}
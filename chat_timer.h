@@ -0,0 +1,49 @@
+#ifndef _CHAT_TIMER_H_
+#define _CHAT_TIMER_H_
+
+#include <time.h>
+
+/*
+ * Hierarchical timing wheel, for the deadlines of the sessions of one event loop
+ *
+ * TIMER_LEVELS wheels of TIMER_SLOTS slots each: a slot of the first wheel stands for one tick of
+ * TIMER_TICK_MS, a slot of the wheel above for a whole turn of the one below, and so on. A timer
+ * goes into the lowest wheel whose turn reaches its deadline. Whenever a wheel completes a turn,
+ * the next slot of the wheel above is emptied into the lower ones. Arming, removing and firing a
+ * timer take the same time however many timers there are; a timer fires at most one tick late,
+ * never early. A deadline beyond the turn of the top wheel waits at its end for another round.
+ *
+ * The wheel takes no lock, and needs no memory of its own besides the slots.
+ */
+#define TIMER_TICK_MS 1
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4                  // a turn of the top wheel: 2^24 ticks, 4.6 hours
+
+struct timer {
+    struct timer *next, **pprev;        // the slot of the wheel, pprev is NULL when the timer is not armed
+    long long expires;                  // ms, monotonic clock
+};
+
+struct timer_wheel {
+    struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+    unsigned long long tick;            // the next tick to run
+    int count;                          // # of timers armed
+};
+
+/* the clock of the deadlines */
+static inline long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void wheel_init(struct timer_wheel *w, long long now);
+void timer_add(struct timer_wheel *w, struct timer *t, long long expires);
+void timer_del(struct timer_wheel *w, struct timer *t);
+struct timer *wheel_advance(struct timer_wheel *w, long long now);
+int wheel_timeout(struct timer_wheel *w, long long now);
+
+#endif